@@ -36,6 +36,7 @@
     NSMutableDictionary *_dataProviders;
     BOOL _supportsNameBasedVirtualHosts;
     
+    NSCondition *_controlCondition;
     BOOL _shouldStart;
     BOOL _shouldStop;
     BOOL _shouldRestart;
@@ -22,9 +22,6 @@
 #import "TIMongoose.h"
 #import "NSString+TIMongooseAdditions.h"
 
-// For sleep() function - to avoid warning under iOS target compilation
-#include <unistd.h>
-
 #pragma mark Class Extensions (Private Methods)
 @interface TIMongooseOperation ()
 
@@ -37,6 +34,8 @@
 - (void)_startMongoose;
 - (void)_stopMongoose;
 - (void)_restartMongoose;
+- (void)_setControlFlag:(BOOL *)flag toValue:(BOOL)value;
+- (BOOL)_controlFlag:(BOOL *)flag;
 
 - (TIMongooseDataProvider *)_dataProviderForRequest:(TIMongooseRequest *)aRequest;
 - (TIMongooseDataProvider *)_defaultProvider;
@@ -52,7 +51,6 @@ NSString * const kTIMongooseDefaultHostDataProvider = @"kTIMongooseDefaultHostDa
 
 @synthesize delegate = _delegate, mongooseContext = _mongooseContext, ports = _ports, supportsNameBasedVirtualHosts = _supportsNameBasedVirtualHosts;
 @synthesize sslCertificatePath = _sslCertificatePath, mongooseServerIsRunning = _mongooseServerIsRunning;
-@synthesize shouldStart = _shouldStart, shouldStop = _shouldStop, shouldRestart = _shouldRestart;
 
 #pragma mark -
 #pragma mark Initialization and Deallocation
@@ -63,6 +61,7 @@ NSString * const kTIMongooseDefaultHostDataProvider = @"kTIMongooseDefaultHostDa
     
     _delegate = aDelegate;
     _dataProviders = [[NSMutableDictionary alloc] initWithCapacity:10];
+    _controlCondition = [[NSCondition alloc] init];
     
     return self;
 }
@@ -74,6 +73,7 @@ NSString * const kTIMongooseDefaultHostDataProvider = @"kTIMongooseDefaultHostDa
 - (void)dealloc {
     [_ports release]; _ports = nil;
     [_dataProviders release]; _dataProviders = nil;
+    [_controlCondition release]; _controlCondition = nil;
     
     [super dealloc];
 }
@@ -85,15 +85,22 @@ NSString * const kTIMongooseDefaultHostDataProvider = @"kTIMongooseDefaultHostDa
         NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
         
         while( YES ) {
-            if ( [self isCancelled] ) return;
+            // Sleep until a control flag is set, or the operation is cancelled
+            [_controlCondition lock];
+            while( !_shouldStop && !_shouldStart && !_shouldRestart && ![self isCancelled] )
+                [_controlCondition wait];
+            
+            BOOL shouldStop = _shouldStop, shouldStart = _shouldStart, shouldRestart = _shouldRestart;
+            _shouldStop = _shouldStart = _shouldRestart = NO;
+            [_controlCondition unlock];
             
-            if( [self shouldStop] ) { [self _stopMongoose]; [self setShouldStop:NO]; }
+            if ( [self isCancelled] ) break;
             
-            if( [self shouldStart] ) { [self _startMongoose]; [self setShouldStart:NO]; }
+            if( shouldStop ) [self _stopMongoose];
             
-            if( [self shouldRestart] ) { [self _restartMongoose]; [self setShouldRestart:NO]; }
+            if( shouldStart ) [self _startMongoose];
             
-            sleep(1);
+            if( shouldRestart ) [self _restartMongoose];
         }
         
         [pool release];
@@ -103,6 +110,41 @@ NSString * const kTIMongooseDefaultHostDataProvider = @"kTIMongooseDefaultHostDa
     }
 }
 
+- (void)cancel {
+    [super cancel];
+    
+    // Wake up -main so that it notices
+    [_controlCondition lock];
+    [_controlCondition signal];
+    [_controlCondition unlock];
+}
+
+#pragma mark -
+#pragma mark Control Flags
+- (void)_setControlFlag:(BOOL *)flag toValue:(BOOL)value
+{
+    [_controlCondition lock];
+    *flag = value;
+    [_controlCondition signal];
+    [_controlCondition unlock];
+}
+
+- (BOOL)_controlFlag:(BOOL *)flag
+{
+    [_controlCondition lock];
+    BOOL value = *flag;
+    [_controlCondition unlock];
+    
+    return value;
+}
+
+- (BOOL)shouldStart { return [self _controlFlag:&_shouldStart]; }
+- (void)setShouldStart:(BOOL)flag { [self _setControlFlag:&_shouldStart toValue:flag]; }
+- (BOOL)shouldStop { return [self _controlFlag:&_shouldStop]; }
+- (void)setShouldStop:(BOOL)flag { [self _setControlFlag:&_shouldStop toValue:flag]; }
+- (BOOL)shouldRestart { return [self _controlFlag:&_shouldRestart]; }
+- (void)setShouldRestart:(BOOL)flag { [self _setControlFlag:&_shouldRestart toValue:flag]; }
+
 #pragma mark -
 #pragma mark Callbacks
 static void http_request_callback(struct mg_connection *conn,
@@ -117,7 +159,7 @@ static void http_request_callback(struct mg_connection *conn,
     TIMongooseResponse *mongooseResponse = [[mongooseOperation _dataProviderForRequest:mongooseRequest] mongooseResponseForRequest:mongooseRequest];
     
     if( [[mongooseResponse headersForOutput] length] > 0 )
-       mg_printf(conn, [[mongooseResponse headersForOutput] UTF8String]);
+       mg_printf(conn, "%s", [[mongooseResponse headersForOutput] UTF8String]);
     
     if( [[mongooseResponse dataForOutput] length] > 0 ) {
         mg_write(conn, [[mongooseResponse dataForOutput] bytes], [[mongooseResponse dataForOutput] length]);
@@ -137,7 +179,7 @@ static void http_error_callback(struct mg_connection *conn,
     TIMongooseResponse *mongooseResponse = [[mongooseOperation _dataProviderForRequest:mongooseRequest] mongooseResponseForHttpErrorCode:request_info->status_code fromRequest:mongooseRequest];
     
     if( [[mongooseResponse headersForOutput] length] > 0 )
-        mg_printf(conn, [[mongooseResponse headersForOutput] UTF8String]);
+        mg_printf(conn, "%s", [[mongooseResponse headersForOutput] UTF8String]);
     
     if( [[mongooseResponse dataForOutput] length] > 0 )
         mg_write(conn, [[mongooseResponse dataForOutput] bytes], [[mongooseResponse dataForOutput] length]);
@@ -231,10 +273,9 @@ static void http_error_callback(struct mg_connection *conn,
 
 - (void)_restartMongoose
 {
+    // mg_stop() returns once the listening sockets are closed, so the
+    // ports can be bound again right away
     [self _stopMongoose];
-    
-    sleep(1);
-    
     [self _startMongoose];
     //NSLog(@"Mongoose Restarted");
 }
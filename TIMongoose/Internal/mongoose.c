@@ -27,6 +27,10 @@
 #define _CRT_SECURE_NO_WARNINGS	/* Disable deprecation warning in VS2005 */
 #endif /* _WIN32 */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define	_GNU_SOURCE		/* For accept4() */
+#endif /* __linux__ */
+
 #ifndef _WIN32_WCE /* Some ANSI #includes are not available on Windows CE */
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -101,6 +105,7 @@ typedef long off_t;
 #define INT64_FMT		"I64"
 
 #define	SHUT_WR			1
+#define	SHUT_RDWR		2
 #define	snprintf		_snprintf
 #define	vsnprintf		_vsnprintf
 #define	sleep(x)		Sleep((x) * 1000)
@@ -162,9 +167,12 @@ typedef struct DIR {
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <poll.h>
 #include <stdint.h>
 #include <inttypes.h>
 
@@ -189,6 +197,87 @@ typedef struct DIR {
 #define INT64_FMT		PRId64
 typedef int SOCKET;
 
+/*
+ * On Linux, connections are multiplexed by the epoll reactor. Define NO_EPOLL
+ * to fall back to the select() loop used on the other platforms.
+ */
+#if defined(__linux__) && !defined(NO_EPOLL)
+#define	USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif /* __linux__ && !NO_EPOLL */
+
+/*
+ * On Linux, idle worker threads sleep on a futex. Elsewhere, they use
+ * a mutex and a condition variable.
+ */
+#if defined(__linux__) && !defined(NO_FUTEX)
+#define	USE_FUTEX
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif /* __linux__ && !NO_FUTEX */
+
+/*
+ * On Linux, static files are sent with io_uring when the kernel allows it.
+ * Define NO_IO_URING to always use the read/send loop.
+ */
+#if defined(__linux__) && !defined(NO_IO_URING)
+#define	USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif /* __linux__ && !NO_IO_URING */
+
+/*
+ * With epoll, connections can run as coroutines, many per worker thread.
+ * Define NO_COROUTINES to compile this out.
+ */
+#if defined(USE_EPOLL) && !defined(NO_COROUTINES)
+#define	USE_COROUTINES
+#include <ucontext.h>
+#endif /* USE_EPOLL && !NO_COROUTINES */
+
+/*
+ * On Linux, acceptor and worker threads can be pinned to CPUs. Define
+ * NO_AFFINITY to compile this out.
+ */
+#if defined(__linux__) && !defined(NO_AFFINITY)
+#define	USE_AFFINITY
+#include <sched.h>
+#endif /* __linux__ && !NO_AFFINITY */
+
+/*
+ * Static files are sent from the page cache with sendfile() where it is
+ * available. Define NO_SENDFILE to always copy them through user space.
+ */
+#if (defined(__linux__) || defined(__APPLE__)) && !defined(NO_SENDFILE)
+#define	USE_SENDFILE
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif /* __linux__ */
+#endif /* (__linux__ || __APPLE__) && !NO_SENDFILE */
+
+/*
+ * On Linux, the files that request URIs resolve to are remembered, and
+ * forgotten when inotify reports a change in their directories. Define
+ * NO_INOTIFY to resolve every request.
+ */
+#if defined(__linux__) && !defined(NO_INOTIFY)
+#define	USE_INOTIFY
+#include <sys/inotify.h>
+#endif /* __linux__ && !NO_INOTIFY */
+
+/* Sub-second parts of the file times, where struct stat has them */
+#if defined(__APPLE__)
+#define	ST_MTIME_NSEC(st)	((st)->st_mtimespec.tv_nsec)
+#define	ST_CTIME_NSEC(st)	((st)->st_ctimespec.tv_nsec)
+#elif defined(__linux__)
+#define	ST_MTIME_NSEC(st)	((st)->st_mtim.tv_nsec)
+#define	ST_CTIME_NSEC(st)	((st)->st_ctim.tv_nsec)
+#else
+#define	ST_MTIME_NSEC(st)	0
+#define	ST_CTIME_NSEC(st)	0
+#endif /* __APPLE__ */
+
 #endif /* End of Windows and UNIX specific includes */
 
 #include "mongoose.h"
@@ -198,8 +287,22 @@ typedef int SOCKET;
 #define	CGI_ENVIRONMENT_SIZE	4096
 #define	MAX_CGI_ENVIR_VARS	64
 #define	MAX_REQUEST_SIZE	8192
+#define	OUTPUT_BUFFER_SIZE	2048
+#define	CACHE_SHARDS		16
+#define	CACHE_BUCKETS		256
 #define	MAX_LISTENING_SOCKETS	10
 #define	MAX_CALLBACKS		20
+#define	MAX_EPOLL_EVENTS	64
+#define	MAX_ACCEPTORS		64
+#define	MAX_WORKERS		1024
+#define	LOCAL_QUEUE_SIZE	16
+#define	URING_BUFS		4
+#define	URING_BUF_SIZE		65536
+#define	URING_REFUSED(res)	((res) == -EINVAL || \
+				    (res) == -EOPNOTSUPP)
+#define	SENDFILE_CHUNK_SIZE	(1024 * 1024)
+#define	COROUTINE_STACK_SIZE	(256 * 1024)
+#define	MAX_NUMA_NODES		16
 #define	ARRAY_SIZE(array)	(sizeof(array) / sizeof(array[0]))
 #define	DEBUG_MGS_PREFIX	"*** Mongoose debug *** "
 
@@ -223,6 +326,32 @@ enum {FALSE, TRUE};
 typedef int bool_t;
 typedef void * (*mg_thread_func_t)(void *);
 
+/*
+ * Atomic operations for the lock-free connection queue. Loads acquire,
+ * stores release, read-modify-write operations are full barriers.
+ */
+#if defined(_MSC_VER)
+#define	ATOMIC_LOAD(p)		(MemoryBarrier(), *(p))
+#define	ATOMIC_STORE(p, v)	(MemoryBarrier(), *(p) = (v))
+#define	ATOMIC_CAS(p, o, n)	(InterlockedCompareExchange((volatile LONG *) \
+				(p), (LONG) (n), (LONG) (o)) == (LONG) (o))
+#define	ATOMIC_ADD(p, v)	InterlockedExchangeAdd((volatile LONG *) (p), \
+				(LONG) (v))
+#define	MEMORY_BARRIER()	MemoryBarrier()
+#elif defined(__ATOMIC_ACQUIRE)
+#define	ATOMIC_LOAD(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define	ATOMIC_STORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define	ATOMIC_CAS(p, o, n)	__sync_bool_compare_and_swap((p), (o), (n))
+#define	ATOMIC_ADD(p, v)	__sync_fetch_and_add((p), (v))
+#define	MEMORY_BARRIER()	__sync_synchronize()
+#else
+#define	ATOMIC_LOAD(p)		(__sync_synchronize(), *(p))
+#define	ATOMIC_STORE(p, v)	(__sync_synchronize(), *(p) = (v))
+#define	ATOMIC_CAS(p, o, n)	__sync_bool_compare_and_swap((p), (o), (n))
+#define	ATOMIC_ADD(p, v)	__sync_fetch_and_add((p), (v))
+#define	MEMORY_BARRIER()	__sync_synchronize()
+#endif /* _MSC_VER */
+
 static const char *http_500_error = "Internal Server Error";
 
 
@@ -281,6 +410,7 @@ typedef struct ssl_ctx_st SSL_CTX;
 #define SSL_CTX_set_default_passwd_cb(x,y) \
 	(* (void (*)(SSL_CTX *, mg_spcb_t)) ssl_sw[13].ptr)((x),(y))
 #define SSL_CTX_free(x) (* (void (*)(SSL_CTX *)) ssl_sw[14].ptr)(x)
+#define SSL_pending(x) (* (int (*)(SSL *)) ssl_sw[15].ptr)(x)
 
 #define CRYPTO_num_locks() (* (int (*)(void)) crypto_sw[0].ptr)()
 #define CRYPTO_set_locking_callback(x)					\
@@ -311,6 +441,7 @@ static struct ssl_func	ssl_sw[] = {
 	{"SSL_CTX_use_certificate_file",NULL},
 	{"SSL_CTX_set_default_passwd_cb",NULL},
 	{"SSL_CTX_free",		NULL},
+	{"SSL_pending",			NULL},
 	{NULL,				NULL}
 };
 
@@ -361,6 +492,11 @@ struct mgstat {
 	bool_t		is_directory;	/* Directory marker		*/
 	int64_t		size;		/* File size			*/
 	time_t		mtime;		/* Modification time		*/
+	long		mtime_nsec;	/* Nanoseconds of it, or 0	*/
+	time_t		ctime;		/* Status change time, or 0	*/
+	long		ctime_nsec;
+	uint64_t	dev;		/* Device, 0 if unknown		*/
+	uint64_t	ino;		/* Inode, 0 if unknown		*/
 };
 
 struct mg_option {
@@ -379,8 +515,18 @@ enum mg_option_index {
 	OPT_CGI_INTERPRETER, OPT_CGI_ENV, OPT_SSI_EXTENSIONS, OPT_AUTH_DOMAIN,
 	OPT_AUTH_GPASSWD, OPT_AUTH_PUT, OPT_ACCESS_LOG, OPT_ERROR_LOG,
 	OPT_SSL_CERTIFICATE, OPT_ALIASES, OPT_ACL, OPT_UID, OPT_PROTECT,
-	OPT_SERVICE, OPT_HIDE, OPT_ADMIN_URI, OPT_MAX_THREADS, OPT_IDLE_TIME,
-	OPT_MIME_TYPES,
+	OPT_SERVICE, OPT_HIDE, OPT_ADMIN_URI, OPT_MAX_THREADS, OPT_MIN_THREADS,
+	OPT_IDLE_TIME,
+	OPT_MIME_TYPES, OPT_KEEP_ALIVE_TIMEOUT, OPT_KEEP_ALIVE_REQUESTS,
+	OPT_QUEUE_SIZE, OPT_ACCEPTOR_THREADS, OPT_IO_URING, OPT_COROUTINES,
+	OPT_HEADER_TIMEOUT, OPT_BODY_TIMEOUT, OPT_SEND_TIMEOUT, OPT_MIN_RATE,
+	OPT_SHED_QUEUE_DEPTH, OPT_SHED_QUEUE_WAIT, OPT_RETRY_AFTER,
+	OPT_ACCEPTOR_CPUS, OPT_WORKER_CPUS,
+	OPT_LISTEN_BACKLOG, OPT_DEFER_ACCEPT, OPT_FASTOPEN, OPT_RCVBUF,
+	OPT_SNDBUF, OPT_TCP_NODELAY, OPT_SENDFILE, OPT_OUTPUT_BUFFER,
+	OPT_CACHE_SIZE, OPT_CACHE_SMALL_FILE, OPT_RESOLVE_CACHE,
+	OPT_MISSING_CACHE, OPT_OPEN_FILE_CACHE, OPT_OPEN_FILE_VALID,
+	OPT_PRECOMPRESSED,
 	NUM_OPTIONS
 };
 
@@ -407,11 +553,308 @@ struct callback {
 	void		*user_data;	/* opaque user data		*/
 };
 
+/*
+ * Static file in the cache. Small files are kept in memory, right after
+ * the path. Bigger ones are mapped.
+ */
+struct cache_entry {
+	struct cache_entry *next;	/* Hash chain			*/
+	struct cache_entry *lru_prev;	/* Used more recently		*/
+	struct cache_entry *lru_next;	/* Used less recently		*/
+	unsigned int	hash;		/* Of the path			*/
+	const struct encoding *encoding;	/* Precompressed file	*/
+	int		refs;		/* Cache and senders hold them	*/
+	struct mgstat	st;		/* File version cached		*/
+	int64_t		size;
+	char		*data;		/* File contents		*/
+	bool_t		is_mapped;	/* data is mmap()-ed		*/
+	int		headers_len;
+	char		headers[256];	/* Rendered Etag etc.		*/
+	char		path[1];	/* Allocated with the entry	*/
+};
+
+/*
+ * The cache is split into shards, each with its own lock, LRU list and
+ * share of the byte budget. A shard may take more while the others leave
+ * room, and gives it back when they need their share.
+ */
+struct cache_shard {
+	pthread_mutex_t	mutex;
+	struct cache_entry *buckets[CACHE_BUCKETS];
+	struct cache_entry *lru_head;	/* Most recently used		*/
+	struct cache_entry *lru_tail;	/* Evicted first		*/
+	int64_t		used;		/* Bytes taken by entries	*/
+	int64_t		budget;		/* Bytes that may be taken	*/
+};
+
+#if !defined(_WIN32)
+/*
+ * Descriptor of a static file, kept open for the next senders. Entries
+ * are reference counted, like the cache entries above.
+ */
+struct open_file {
+	struct open_file *next;		/* Hash chain			*/
+	struct open_file *lru_prev;	/* Used more recently		*/
+	struct open_file *lru_next;	/* Used less recently		*/
+	unsigned int	hash;		/* Of the path			*/
+	int		refs;		/* Table and senders hold them	*/
+	int		fd;		/* Opened read only		*/
+	struct mgstat	st;		/* File version opened		*/
+	time_t		expires;	/* Opened again after that	*/
+	char		path[1];	/* Allocated with the entry	*/
+};
+
+/*
+ * Shard of open files. The LRU list is circular, and its head is a dummy
+ * entry in the shard.
+ */
+struct open_file_shard {
+	pthread_mutex_t	mutex;
+	struct open_file *buckets[CACHE_BUCKETS];
+	struct open_file lru;		/* Most recently used is next	*/
+	int		num_files;
+	int		max_files;
+};
+#endif /* !_WIN32 */
+
+#if defined(USE_INOTIFY)
+/*
+ * Request URI resolved to a regular file that needs no authorization,
+ * or to a file that does not exist.
+ */
+struct resolved {
+	struct resolved	*next;		/* Hash chain			*/
+	struct resolved	*lru_prev;	/* Used more recently		*/
+	struct resolved	*lru_next;	/* Used less recently		*/
+	struct resolved	*dir_prev;	/* Entries in the same directory */
+	struct resolved	*dir_next;
+	struct resolve_dir *dir;	/* Directory of path		*/
+	unsigned int	hash;		/* Of the URI			*/
+	bool_t		is_missing;	/* Not found, st is not set	*/
+	bool_t		is_index;	/* Index file of a directory	*/
+	struct mgstat	st;		/* Of the file			*/
+	char		*path;		/* File, after the URI		*/
+	char		uri[1];		/* Allocated with the entry	*/
+};
+
+/*
+ * Directory that entries of a shard are in, or that such a directory is
+ * in. The directories form a tree, so that a change in one finds what it
+ * affects without looking at the other entries. A directory goes away
+ * with the last entry under it.
+ */
+struct resolve_dir {
+	struct resolve_dir *next;	/* Hash chain			*/
+	struct resolve_dir *parent;	/* NULL at the top		*/
+	struct resolve_dir *children;	/* Subdirectories		*/
+	struct resolve_dir *sibling;	/* Next one of the parent	*/
+	struct resolved	*entries;	/* Files in the directory	*/
+	unsigned int	hash;		/* Of the path			*/
+	const char	*name;		/* Last component of path	*/
+	char		path[1];	/* Allocated with the entry	*/
+};
+
+/*
+ * Shard of resolved URIs. Files and missing files are kept on separate
+ * LRU lists, indexed by is_missing, so that requests for missing files
+ * cannot push the files out. The lists are circular, and their heads are
+ * dummy entries in the shard.
+ */
+struct resolve_shard {
+	pthread_mutex_t	mutex;
+	struct resolved	*buckets[CACHE_BUCKETS];
+	struct resolve_dir *dirs[CACHE_BUCKETS];	/* By path	*/
+	struct resolved	lru[2];		/* Most recently used is next	*/
+	int		num_entries[2];
+	int		max_entries[2];
+};
+
+/*
+ * Watched directory. Different paths to the same directory share
+ * the watch descriptor.
+ */
+struct watch {
+	struct watch	*next;		/* Hash chain			*/
+	int		wd;		/* inotify watch descriptor	*/
+	char		path[1];
+};
+#endif /* USE_INOTIFY */
+
+/*
+ * Bounded lock-free multi-producer multi-consumer queue of accepted
+ * connections, after Dmitry Vyukov's design. Each cell carries a sequence
+ * number telling producers and consumers whose turn it is to use the cell.
+ * When the queue is resized, the old ring is chained to the new one and is
+ * drained by the workers, until the pool manager frees it.
+ */
+struct ring_cell {
+	unsigned long		seq;	/* Turn of this cell		*/
+	struct mg_connection	*conn;	/* Queued connection		*/
+};
+
+struct ring {
+	struct ring	*next;		/* Previous, retired ring	*/
+	unsigned long	mask;		/* Number of cells - 1		*/
+	char		pad1[64];	/* Keep head and tail apart	*/
+	unsigned long	head;		/* Next cell to fill		*/
+	char		pad2[64];
+	unsigned long	tail;		/* Next cell to drain		*/
+	char		pad3[64];
+	struct ring_cell cells[1];
+};
+
+/*
+ * Place where threads wait for the queue to change. A waiter takes the
+ * current sequence number, checks the queue once more, and sleeps until
+ * the sequence changes. With futexes, the sequence word is the futex.
+ */
+struct park {
+	unsigned int	seq;		/* Bumped on every wakeup	*/
+	unsigned int	num_waiting;	/* Number of parked threads	*/
+#if !defined(USE_FUTEX)
+	pthread_mutex_t	mutex;
+	pthread_cond_t	cond;
+#endif /* !USE_FUTEX */
+};
+
+/*
+ * Hierarchical timer wheel, after Varghese and Lauck. Level 0 has a slot
+ * for each of the next 64 seconds, and every level above spans 64 times
+ * more than the one below. Timers are filed by the second they expire at,
+ * and move down a level when the wheel turns to their slot, so that
+ * setting, cancelling and expiring a timer take constant time. A wheel
+ * is used by one thread only.
+ */
+#define	WHEEL_BITS	6
+#define	WHEEL_SLOTS	(1 << WHEEL_BITS)
+#define	WHEEL_LEVELS	3
+#define	TIMER_OWNER(t, type, member)	\
+	((type *) ((char *) (t) - offsetof(type, member)))
+
+struct timer {
+	struct timer	*next;		/* Linkage in the slot		*/
+	struct timer	**pprev;	/* Link to us, NULL if unset	*/
+	time_t		expires;	/* Second it expires at		*/
+};
+
+struct wheel {
+	time_t		clk;		/* Second being expired		*/
+	int		num_timers;	/* Timers set			*/
+	struct timer	*slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+/*
+ * Worker thread slot. Every worker owns a small local queue, acceptors
+ * hand connections straight to it, and idle workers steal from the local
+ * queues of busy peers. Slots outlive their threads: they are reused by
+ * new workers and freed only by mg_fini(), so that thieves can look at
+ * any slot at any time without locking.
+ */
+#if defined(USE_IO_URING)
+/*
+ * io_uring instance of a worker slot, used to send static files. A file
+ * chunk is read into a registered buffer and sent by a pair of linked
+ * requests, and a batch of chunks goes to the kernel in one system call.
+ */
+struct uring {
+	int		fd;		/* io_uring descriptor		*/
+	bool_t		is_fixed;	/* Buffers are registered	*/
+	unsigned int	num_sqes;	/* Submission queue entries	*/
+	unsigned int	tail;		/* Local submission queue tail	*/
+	unsigned int	*sq_tail;	/* Submission ring, shared	*/
+	unsigned int	*sq_mask;
+	unsigned int	*sq_array;
+	unsigned int	*cq_head;	/* Completion ring, shared	*/
+	unsigned int	*cq_tail;
+	unsigned int	*cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void		*sq_ptr;	/* Mapped rings			*/
+	void		*cq_ptr;
+	size_t		sq_len;
+	size_t		cq_len;
+	char		*bufs;		/* URING_BUFS buffers		*/
+};
+#endif /* USE_IO_URING */
+
+#if defined(USE_COROUTINES)
+/*
+ * Connection running as a coroutine. When its socket would block, it
+ * switches back to the scheduler of the worker thread, which resumes it
+ * once epoll says the socket is ready.
+ */
+struct coroutine {
+	struct worker	*worker;	/* Worker running us		*/
+	struct mg_connection *conn;	/* Connection being served	*/
+	ucontext_t	context;	/* Saved registers and stack	*/
+	char		*stack;		/* Mapped stack			*/
+	bool_t		is_registered;	/* Socket is in worker's epoll	*/
+	bool_t		is_waiting;	/* Waits for the socket		*/
+	bool_t		is_ready;	/* Socket is ready, not timeout	*/
+	bool_t		is_done;	/* Connection is served		*/
+	bool_t		is_idle;	/* Waits for the next request	*/
+	struct timer	timer;		/* Gives up waiting then	*/
+	struct coroutine *next;		/* Linkage in worker's list	*/
+};
+#endif /* USE_COROUTINES */
+
+struct worker {
+	struct mg_context *ctx;		/* Context we belong to		*/
+	int		index;		/* Slot number			*/
+	int		is_active;	/* Owned by a running thread	*/
+	struct park	wakeup;		/* Owner waits here when idle	*/
+	struct ring	*queue;		/* Local connection queue	*/
+	pthread_mutex_t	sock_mutex;	/* Held to change or use sock	*/
+	SOCKET		sock;		/* Served in blocking mode	*/
+	time_t		deadline;	/* IO on sock ends, 0 - never	*/
+#if defined(USE_IO_URING)
+	struct uring	*uring;		/* Created on first use		*/
+#endif /* USE_IO_URING */
+#if defined(USE_COROUTINES)
+	bool_t		has_scheduler;	/* Descriptors below are open	*/
+	int		epoll_fd;	/* Sockets of the coroutines	*/
+	int		event_fd;	/* Wakes the scheduler up	*/
+	int		is_polling;	/* Scheduler is in epoll_wait()	*/
+	ucontext_t	scheduler;	/* Scheduler context		*/
+	struct coroutine *coroutines;	/* Running coroutines		*/
+	int		num_coroutines;
+	struct wheel	wheel;		/* Deadlines of the coroutines	*/
+#endif /* USE_COROUTINES */
+};
+
+#if defined(USE_EPOLL)
+/*
+ * Acceptor thread state. Each acceptor runs its own epoll reactor.
+ * Acceptor 0 is the master thread, it accepts on ctx->listeners. Others
+ * accept on their own SO_REUSEPORT copies of them, and the kernel spreads
+ * incoming connections across all acceptors.
+ */
+struct reactor {
+	struct mg_context *ctx;		/* Context we belong to		*/
+	int		index;		/* Acceptor number		*/
+	int		epoll_fd;	/* Reactor's epoll descriptor	*/
+	struct mg_connection *pending;	/* Connections owned by reactor	*/
+	int		generation;	/* Listeners generation seen	*/
+	struct socket	listeners[MAX_LISTENING_SOCKETS];
+	int		num_listeners;
+	struct wheel	wheel;		/* Deadlines of pending ones	*/
+	time_t		last_sweep;	/* Idle ones were checked then	*/
+};
+#endif /* USE_EPOLL */
+
 /*
  * Mongoose context
  */
 struct mg_context {
 	int		stop_flag;	/* Should we stop event loop	*/
+	pthread_cond_t	stop_cond;	/* mg_stop() waits for mg_fini() */
+	int		is_draining;	/* mg_drain() has been called	*/
+	int		num_connections;	/* Accepted, not freed	*/
+	struct park	drained;	/* mg_drain() waits here	*/
+#if !defined(_WIN32)
+	int		stop_fd[2];	/* Readable after mg_stop()	*/
+	int		drain_fd[2];	/* Readable after mg_drain()	*/
+#endif /* !_WIN32 */
 	SSL_CTX		*ssl_ctx;	/* SSL context			*/
 
 	FILE		*access_log;	/* Opened access log		*/
@@ -419,6 +862,13 @@ struct mg_context {
 
 	struct socket	listeners[MAX_LISTENING_SOCKETS];
 	int		num_listeners;
+	int		listeners_generation;	/* Bumped on every rebind */
+	int		listen_backlog;	/* listen() queue length	*/
+	int		defer_accept;	/* TCP_DEFER_ACCEPT, seconds	*/
+	int		fastopen;	/* TCP_FASTOPEN queue length	*/
+	int		rcvbuf;		/* SO_RCVBUF, 0 - default	*/
+	int		sndbuf;		/* SO_SNDBUF, 0 - default	*/
+	bool_t		nodelay;	/* Set TCP_NODELAY on accept	*/
 
 	struct callback	callbacks[MAX_CALLBACKS];
 	int		num_callbacks;
@@ -427,34 +877,149 @@ struct mg_context {
 	pthread_mutex_t	opt_mutex[NUM_OPTIONS];	/* Option protector	*/
 
 	int		max_threads;	/* Maximum number of threads	*/
+	int		min_threads;	/* Threads kept when idle	*/
 	int		num_threads;	/* Number of threads		*/
-	int		num_idle;	/* Number of idle threads	*/
-	pthread_mutex_t	thr_mutex;	/* Protects (max|num)_threads	*/
+	int		num_exiting;	/* Retired, but still running	*/
+	time_t		last_grow;	/* When the pool last grew	*/
+	bool_t		has_manager;	/* Pool manager is running	*/
+	pthread_mutex_t	thr_mutex;	/* Protects pool fields above	*/
 	pthread_cond_t	thr_cond;
+	struct park	pool_wanted;	/* Pool manager waits here	*/
 	pthread_mutex_t	bind_mutex;	/* Protects bind operations	*/
 
-	struct socket	queue[20];	/* Accepted sockets		*/
-	int		sq_head;	/* Head of the socket queue	*/
-	int		sq_tail;	/* Tail of the socket queue	*/
-	pthread_cond_t	empty_cond;	/* Socket queue empty condvar	*/
-	pthread_cond_t	full_cond;	/* Socket queue full condvar	*/
+	struct ring	*queue;		/* Overflow of local queues	*/
+	struct park	queue_full;	/* Producers wait for room here	*/
+	int		queue_phase;	/* Flipped to retire old rings	*/
+	int		queue_users[2];	/* Threads in each phase	*/
+	struct ring	*retired;	/* Unlinked, not yet freed	*/
+	int		retired_phase;	/* Phase they were unlinked in	*/
+	struct worker	*workers[MAX_WORKERS];	/* Worker slots		*/
+	int		num_workers;	/* Number of allocated slots	*/
+	int		num_idle;	/* Workers waiting for work	*/
+	int		shed_depth;	/* Overloaded at this depth	*/
+	int		shed_wait;	/* Or this wait in queue, msec	*/
+	int		queue_wait;	/* Last connection taken waited	*/
+	char		busy_reply[128];	/* Sent when overloaded	*/
+	int		busy_reply_len;
+	int		output_limit;	/* Response bytes held back	*/
+	struct cache_shard cache[CACHE_SHARDS];	/* Static files	*/
+	int64_t		cache_budget;	/* Bytes all shards may take	*/
+	bool_t		is_caching;	/* Cache budget is not 0	*/
+	int		cache_small_file;	/* Bigger ones mapped	*/
+#if !defined(_WIN32)
+	struct open_file_shard open_files[CACHE_SHARDS];
+	int		max_open_files;	/* Per shard, 0 - none kept	*/
+	int		open_file_valid;	/* Seconds to keep one	*/
+#endif /* !_WIN32 */
+	bool_t		has_watcher;	/* Watcher thread is running	*/
+#if defined(USE_INOTIFY)
+	int		inotify_fd;	/* Watches directories, or -1	*/
+	bool_t		is_resolving;	/* URIs are remembered		*/
+	int		max_resolved[2];	/* URIs per shard	*/
+	int		resolve_gen;	/* Bumped on every invalidation	*/
+	struct resolve_shard resolved[CACHE_SHARDS];	/* URIs	*/
+	pthread_mutex_t	watch_mutex;	/* Protects watches		*/
+	struct watch	*watches[CACHE_BUCKETS];
+#endif /* USE_INOTIFY */
+	unsigned int	next_worker;	/* Round-robin cursor		*/
+#if defined(USE_IO_URING)
+	bool_t		no_io_uring;	/* Kernel refused io_uring	*/
+#endif /* USE_IO_URING */
+#if defined(USE_AFFINITY)
+	cpu_set_t	all_cpus;	/* Where mg_start() could run	*/
+	cpu_set_t	acceptor_cpus;	/* One for each acceptor	*/
+	cpu_set_t	worker_cpus[MAX_NUMA_NODES];	/* Per node	*/
+	int		num_worker_nodes;
+#endif /* USE_AFFINITY */
+
+#if defined(USE_EPOLL)
+	int		num_acceptors;	/* Configured acceptor threads	*/
+	struct reactor	*acceptors[MAX_ACCEPTORS];	/* Running ones	*/
+	struct mg_connection *parked;	/* Idle persistent connections	*/
+	int		parked_fd;	/* eventfd, wakes master thread	*/
+#endif /* USE_EPOLL */
 
 	mg_spcb_t	ssl_password_callback;
 	mg_callback_t	log_callback;
 };
 
+/*
+ * Framing of the response, as seen by mg_write(). Handlers, including user
+ * callbacks, write raw HTTP responses. Outgoing headers are scanned to find
+ * out whether the body is delimited, so the connection can be reused after
+ * the handler returns.
+ */
+enum {RESP_STATUS_LINE, RESP_HEADERS, RESP_BODY};
+
+/*
+ * What is known about a request URI before it is looked at, see
+ * resolve_uri().
+ */
+enum {RESOLVE_UNKNOWN, RESOLVE_FILE, RESOLVE_MISSING};
+
+struct response {
+	int		state;		/* Which part is being sent	*/
+	int		status;		/* Status code sent		*/
+	int64_t		content_len;	/* Content-Length, or -1	*/
+	int64_t		body_len;	/* Body bytes sent so far	*/
+	bool_t		is_chunked;	/* Transfer-Encoding: chunked	*/
+	bool_t		no_body;	/* HEAD, 1xx, 204 or 304	*/
+	bool_t		conn_close;	/* Connection: close sent	*/
+	bool_t		conn_keep_alive;/* Connection: keep-alive sent	*/
+	int		hdr_end;	/* Held headers end in out here	*/
+	int		body_start;	/* And the held body starts	*/
+	int		chunk_len;	/* Body ending out, not framed	*/
+	int		line_len;	/* Bytes buffered in line	*/
+	char		line[128];	/* Header line being scanned	*/
+};
+
+/*
+ * IO of a connection that is being timed.
+ */
+enum {IO_NONE, IO_HEADERS, IO_BODY, IO_SEND};
+
 /*
  * Client connection.
+ * Connections are allocated by the master thread when accepted, and
+ * freed by the worker thread that served them. While the reactor is
+ * buffering the request headers, the connection sits on its pending list.
  */
 struct mg_connection {
 	struct mg_request_info	request_info;
 	struct mg_context *ctx;		/* Mongoose context we belong to*/
+	struct worker	*worker;	/* Worker serving us, if any	*/
 	SSL		*ssl;		/* SSL descriptor		*/
 	struct socket	client;		/* Connected client		*/
 	time_t		birth_time;	/* Time connection was accepted	*/
 	bool_t		free_post_data;	/* post_data was malloc-ed	*/
 	bool_t		embedded_auth;	/* Used for authorization	*/
 	int64_t		num_bytes_sent;	/* Total bytes sent to client	*/
+	bool_t		keep_alive;	/* Connection may be reused	*/
+	bool_t		chunked;	/* Chunk-encode response body	*/
+	bool_t		body_read;	/* Request body was read in	*/
+	int		num_requests;	/* Requests served so far	*/
+	struct response	resp;		/* Response being sent		*/
+	struct mg_connection *next;	/* Linkage in the pending list	*/
+	struct mg_connection *prev;
+	struct timer	timer;		/* Reactor drops it then	*/
+	int64_t		queued_at;	/* put_socket() time, msec	*/
+	int		io_phase;	/* IO being timed		*/
+	time_t		io_start;	/* When it began		*/
+	time_t		io_end;		/* Last call returned, or 0	*/
+	int64_t		io_bytes;	/* Bytes moved since it began	*/
+	int		io_timeout;	/* Seconds it may take		*/
+	int		io_min_rate;	/* Bytes that add a second	*/
+	time_t		io_deadline;	/* Current call ends, 0 - never	*/
+	int		nread;		/* Bytes buffered in buf	*/
+	char		buf[MAX_REQUEST_SIZE];	/* Request buffer	*/
+	bool_t		pipelined;	/* Next request is buffered too	*/
+	int		out_len;	/* Bytes buffered in out	*/
+	int		out_size;	/* Bytes allocated for out	*/
+	char		*out;		/* Batched responses		*/
+#if defined(USE_INOTIFY)
+	int		resolve_gen;	/* Invalidations before resolving */
+	size_t		resolve_base;	/* Path length the URI adds to	*/
+#endif /* USE_INOTIFY */
 };
 
 /*
@@ -811,6 +1376,34 @@ mg_set_log_callback(struct mg_context *ctx, mg_callback_t log_callback)
 		ctx->log_callback = log_callback;
 }
 
+/*
+ * Value for the Connection: header of the response being sent.
+ */
+static const char *
+suggest_connection_header(const struct mg_connection *conn)
+{
+	return (conn->keep_alive ? "keep-alive" : "close");
+}
+
+/*
+ * Return framing headers for a response whose length is not known in
+ * advance. HTTP/1.1 clients get a chunked body. For others, connection
+ * is closed after the response to mark the end of the body.
+ */
+static const char *
+unknown_length_headers(struct mg_connection *conn)
+{
+	if (conn->keep_alive &&
+	    !strcmp(conn->request_info.http_version, "1.1")) {
+		conn->chunked = TRUE;
+		return ("Transfer-Encoding: chunked\r\n"
+		    "Connection: keep-alive\r\n");
+	}
+
+	conn->keep_alive = FALSE;
+	return ("Connection: close\r\n");
+}
+
 /*
  * Send error message back to the client.
  */
@@ -849,8 +1442,9 @@ send_error(struct mg_connection *conn, int status, const char *reason,
 		    "HTTP/1.1 %d %s\r\n"
 		    "Content-Type: text/plain\r\n"
 		    "Content-Length: %d\r\n"
-		    "Connection: close\r\n"
-		    "\r\n%s", status, reason, len, buf);
+		    "Connection: %s\r\n"
+		    "\r\n%s", status, reason, len,
+		    suggest_connection_header(conn), buf);
 	}
 }
 
@@ -1102,6 +1696,9 @@ mg_stat(const char *path, struct mgstat *stp)
 		    info.ftLastWriteTime.dwHighDateTime);
 		stp->is_directory =
 		    info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY;
+		stp->mtime_nsec = stp->ctime_nsec = 0;
+		stp->ctime = 0;
+		stp->dev = stp->ino = 0;
 		ok = 0;  /* Success */
 	}
 
@@ -1335,8 +1932,30 @@ set_non_blocking_mode(struct mg_connection *conn, SOCKET sock)
 	return (ioctlsocket(sock, FIONBIO, &on));
 }
 
+static int
+set_blocking_mode(struct mg_connection *conn, SOCKET sock)
+{
+	unsigned long	off = 0;
+
+	conn = NULL; /* unused */
+	return (ioctlsocket(sock, FIONBIO, &off));
+}
+
 #else
 
+static void
+stat_to_mgstat(const struct stat *st, struct mgstat *stp)
+{
+	stp->size = st->st_size;
+	stp->mtime = st->st_mtime;
+	stp->mtime_nsec = (long) ST_MTIME_NSEC(st);
+	stp->ctime = st->st_ctime;
+	stp->ctime_nsec = (long) ST_CTIME_NSEC(st);
+	stp->is_directory = S_ISDIR(st->st_mode);
+	stp->dev = (uint64_t) st->st_dev;
+	stp->ino = (uint64_t) st->st_ino;
+}
+
 static int
 mg_stat(const char *path, struct mgstat *stp)
 {
@@ -1345,9 +1964,7 @@ mg_stat(const char *path, struct mgstat *stp)
 
 	if (stat(path, &st) == 0) {
 		ok = 0;
-		stp->size = st.st_size;
-		stp->mtime = st.st_mtime;
-		stp->is_directory = S_ISDIR(st.st_mode);
+		stat_to_mgstat(&st, stp);
 	} else {
 		ok = -1;
 	}
@@ -1448,6 +2065,22 @@ set_non_blocking_mode(struct mg_connection *conn, SOCKET sock)
 
 	return (ok);
 }
+
+static int
+set_blocking_mode(struct mg_connection *conn, SOCKET sock)
+{
+	int	flags, ok = -1;
+
+	if ((flags = fcntl(sock, F_GETFL, 0)) == -1) {
+		cry(conn, "%s: fcntl(F_GETFL): %d", __func__, ERRNO);
+	} else if (fcntl(sock, F_SETFL, flags & ~O_NONBLOCK) != 0) {
+		cry(conn, "%s: fcntl(F_SETFL): %d", __func__, ERRNO);
+	} else {
+		ok = 0;	/* Success */
+	}
+
+	return (ok);
+}
 #endif /* _WIN32 */
 
 static void
@@ -1465,3182 +2098,8203 @@ unlock_option(struct mg_context *ctx, int opt_index)
 }
 
 /*
- * Write data to the IO channel - opened file descriptor, socket or SSL
- * descriptor. Return number of bytes written.
+ * Return current time in milliseconds, for measuring short intervals.
  */
 static int64_t
-push(FILE *fp, SOCKET sock, SSL *ssl, const char *buf, int64_t len)
+get_msec(void)
 {
-	int64_t	sent;
-	int	n, k;
-
-	sent = 0;
-	while (sent < len) {
+#if defined(_WIN32)
+	return ((int64_t) GetTickCount64());
+#else
+	struct timeval	tv;
 
-		/* How many bytes we send in this iteration */
-		k = len - sent > INT_MAX ? INT_MAX : (int) (len - sent);
+	(void) gettimeofday(&tv, NULL);
+	return ((int64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000);
+#endif /* _WIN32 */
+}
 
-		if (ssl != NULL) {
-			n = SSL_write(ssl, buf + sent, k);
-		} else if (fp != NULL) {
-			n = fwrite(buf + sent, 1, k, fp);
-			if (ferror(fp))
-				n = -1;
-		} else {
-			n = send(sock, buf + sent, (size_t)k, 0);
-		}
+/*
+ * Allocate a ring with room for at least capacity connections.
+ */
+static struct ring *
+ring_new(int capacity)
+{
+	struct ring	*ring;
+	unsigned long	i, size;
 
-		if (n < 0)
-			break;
+	for (size = 1; size < (unsigned long) capacity; size <<= 1)
+		continue;
 
-		sent += n;
+	ring = (struct ring *) calloc(1,
+	    sizeof(*ring) + (size - 1) * sizeof(ring->cells[0]));
+	if (ring != NULL) {
+		ring->mask = size - 1;
+		for (i = 0; i < size; i++)
+			ring->cells[i].seq = i;
 	}
 
-	return (sent);
+	return (ring);
 }
 
 /*
- * Read from IO channel - opened file descriptor, socket, or SSL descriptor.
- * Return number of bytes read.
+ * Add connection to the ring. Return FALSE if the ring is full.
  */
-static int
-pull(FILE *fp, SOCKET sock, SSL *ssl, char *buf, int len)
+static bool_t
+ring_put(struct ring *ring, struct mg_connection *conn)
 {
-	int	nread;
+	struct ring_cell	*cell;
+	unsigned long		pos;
+	long			diff;
 
-	if (ssl != NULL) {
-		nread = SSL_read(ssl, buf, len);
-	} else if (fp != NULL) {
-		nread = fread(buf, 1, (size_t) len, fp);
-		if (ferror(fp))
-			nread = -1;
-	} else {
-		nread = recv(sock, buf, (size_t) len, 0);
+	for (pos = ATOMIC_LOAD(&ring->head);; pos = ATOMIC_LOAD(&ring->head)) {
+		cell = &ring->cells[pos & ring->mask];
+		diff = (long) (ATOMIC_LOAD(&cell->seq) - pos);
+		if (diff == 0 && ATOMIC_CAS(&ring->head, pos, pos + 1))
+			break;
+		else if (diff < 0)
+			return (FALSE);
 	}
 
-	return (nread);
-}
+	cell->conn = conn;
+	ATOMIC_STORE(&cell->seq, pos + 1);
 
-int
-mg_write(struct mg_connection *conn, const void *buf, int len)
-{
-	assert(len >= 0);
-	return ((int) push(NULL, conn->client.sock, conn->ssl,
-				(const char *) buf, (int64_t) len));
+	return (TRUE);
 }
 
-int
-mg_printf(struct mg_connection *conn, const char *fmt, ...)
+/*
+ * Take connection from the ring. Return NULL if the ring is empty.
+ */
+static struct mg_connection *
+ring_get(struct ring *ring)
 {
-	char	buf[MAX_REQUEST_SIZE];
-	int	len;
-	va_list	ap;
+	struct mg_connection	*conn;
+	struct ring_cell	*cell;
+	unsigned long		pos;
+	long			diff;
+
+	for (pos = ATOMIC_LOAD(&ring->tail);; pos = ATOMIC_LOAD(&ring->tail)) {
+		cell = &ring->cells[pos & ring->mask];
+		diff = (long) (ATOMIC_LOAD(&cell->seq) - (pos + 1));
+		if (diff == 0 && ATOMIC_CAS(&ring->tail, pos, pos + 1))
+			break;
+		else if (diff < 0)
+			return (NULL);
+	}
 
-	va_start(ap, fmt);
-	len = mg_vsnprintf(conn, buf, sizeof(buf), fmt, ap);
-	va_end(ap);
+	conn = cell->conn;
+	ATOMIC_STORE(&cell->seq, pos + ring->mask + 1);
 
-	return (mg_write(conn, buf, len));
+	return (conn);
 }
 
-/*
- * Return content length of the request, or -1 constant if
- * Content-Length header is not set.
- */
-static int64_t
-get_content_length(const struct mg_connection *conn)
+static void
+park_init(struct park *park)
 {
-	const char *cl = mg_get_header(conn, "Content-Length");
-	return (cl == NULL ? -1 : strtoll(cl, NULL, 10));
+	park->seq = park->num_waiting = 0;
+#if !defined(USE_FUTEX)
+	(void) pthread_mutex_init(&park->mutex, NULL);
+	(void) pthread_cond_init(&park->cond, NULL);
+#endif /* !USE_FUTEX */
+}
+
+static void
+park_destroy(struct park *park)
+{
+#if !defined(USE_FUTEX)
+	(void) pthread_mutex_destroy(&park->mutex);
+	(void) pthread_cond_destroy(&park->cond);
+#else
+	park = NULL; /* Unused */
+#endif /* !USE_FUTEX */
 }
 
 /*
- * URL-decode input buffer into destination buffer.
- * 0-terminate the destination buffer. Return the length of decoded data.
- * form-url-encoded data differs from URI encoding in a way that it
- * uses '+' as character for space, see RFC 1866 section 8.2.1
- * http://ftp.ics.uci.edu/pub/ietf/html/rfc1866.txt
+ * Announce that the calling thread is about to park. The caller must check
+ * the queue after this, and either park_wait() or park_cancel().
  */
-static size_t
-url_decode(const char *src, size_t src_len, char *dst, size_t dst_len,
-		bool_t is_form_url_encoded)
+static unsigned int
+park_prepare(struct park *park)
 {
-	size_t	i, j;
-	int	a, b;
-#define	HEXTOI(x)	(isdigit(x) ? x - '0' : x - 'W')
+	unsigned int	seq = ATOMIC_LOAD(&park->seq);
 
-	for (i = j = 0; i < src_len && j < dst_len - 1; i++, j++) {
-		if (src[i] == '%' &&
-		    isxdigit(* (unsigned char *) (src + i + 1)) &&
-		    isxdigit(* (unsigned char *) (src + i + 2))) {
-			a = tolower(* (unsigned char *) (src + i + 1));
-			b = tolower(* (unsigned char *) (src + i + 2));
-			dst[j] = ((HEXTOI(a) << 4) | HEXTOI(b)) & 0xff;
-			i += 2;
-		} else if (is_form_url_encoded && src[i] == '+') {
-			dst[j] = ' ';
-		} else {
-			dst[j] = src[i];
-		}
-	}
+	(void) ATOMIC_ADD(&park->num_waiting, 1);
 
-	dst[j] = '\0';	/* Null-terminate the destination */
+	return (seq);
+}
 
-	return (j);
+static void
+park_cancel(struct park *park)
+{
+	(void) ATOMIC_ADD(&park->num_waiting, -1);
 }
 
 /*
- * Search for a form variable in a given buffer.
- * Semantic is the same as for mg_get_var().
+ * Sleep until park_wake() is called, at most timeout seconds.
+ * Return FALSE if timed out.
  */
-static char *
-get_var(const char *name, const char *buf, size_t buf_len)
+static bool_t
+park_wait(struct park *park, unsigned int seq, int timeout)
 {
-	const char	*p, *e, *s;
-	char		*val;
-	size_t		var_len, len;
-
-	var_len = strlen(name);
-	e = buf + buf_len;
-	val = NULL;
-
-	/* buf is "var1=val1&var2=val2...". Find variable first */
-	for (p = buf; p + var_len < e; p++)
-		if ((p == buf || p[-1] == '&') && p[var_len] == '=' &&
-		    !mg_strncasecmp(name, p, var_len)) {
+	struct timespec	ts;
+	bool_t		woken = TRUE;
+
+#if defined(USE_FUTEX)
+	ts.tv_sec = timeout;
+	ts.tv_nsec = 0;
+	if (syscall(SYS_futex, &park->seq, FUTEX_WAIT_PRIVATE, seq,
+	    &ts, NULL, 0) != 0 && ERRNO == ETIMEDOUT)
+		woken = FALSE;
+#else
+	ts.tv_sec = time(NULL) + timeout;
+	ts.tv_nsec = 0;
+	(void) pthread_mutex_lock(&park->mutex);
+	while (woken && ATOMIC_LOAD(&park->seq) == seq)
+		if (pthread_cond_timedwait(&park->cond, &park->mutex, &ts) != 0)
+			woken = FALSE;
+	(void) pthread_mutex_unlock(&park->mutex);
+#endif /* USE_FUTEX */
 
-			/* Point p to variable value */
-			p += var_len + 1;
+	park_cancel(park);
 
-			/* Point s to the end of the value */
-			s = (const char *) memchr(p, '&', e - p);
-			if (s == NULL)
-				s = e;
+	return (woken);
+}
 
-			/* Try to allocate the buffer */
-			len = s - p;
-			if ((val = (char *) malloc(len + 1)) != NULL)
-				(void) url_decode(p, len, val, len + 1, TRUE);
-			break;
-		}
+/*
+ * Wake up one thread parked at the given place, if there is any.
+ */
+static void
+park_wake(struct park *park)
+{
+	/* Make the queue change visible before looking for waiters */
+	MEMORY_BARRIER();
+	if (ATOMIC_LOAD(&park->num_waiting) == 0)
+		return;
 
-	return (val);
+#if defined(USE_FUTEX)
+	(void) ATOMIC_ADD(&park->seq, 1);
+	(void) syscall(SYS_futex, &park->seq, FUTEX_WAKE_PRIVATE, 1,
+	    NULL, NULL, 0);
+#else
+	(void) pthread_mutex_lock(&park->mutex);
+	(void) ATOMIC_ADD(&park->seq, 1);
+	(void) pthread_cond_signal(&park->cond);
+	(void) pthread_mutex_unlock(&park->mutex);
+#endif /* USE_FUTEX */
 }
 
 /*
- * Free the pointer returned by mg_get_var(). This is needed for languages
- * like python, to have an ability to free allocated data without
- * loading C runtime library and calling free().
+ * Wake up all threads parked at the given place.
  */
-void
-mg_free(char *data)
+static void
+park_wake_all(struct park *park)
 {
-	free(data);
+	MEMORY_BARRIER();
+	if (ATOMIC_LOAD(&park->num_waiting) == 0)
+		return;
+
+#if defined(USE_FUTEX)
+	(void) ATOMIC_ADD(&park->seq, 1);
+	(void) syscall(SYS_futex, &park->seq, FUTEX_WAKE_PRIVATE, INT_MAX,
+	    NULL, NULL, 0);
+#else
+	(void) pthread_mutex_lock(&park->mutex);
+	(void) ATOMIC_ADD(&park->seq, 1);
+	(void) pthread_cond_broadcast(&park->cond);
+	(void) pthread_mutex_unlock(&park->mutex);
+#endif /* USE_FUTEX */
+}
+
+#if defined(USE_EPOLL)
+static void
+wheel_init(struct wheel *wheel, time_t now)
+{
+	(void) memset(wheel, 0, sizeof(*wheel));
+	wheel->clk = now;
 }
 
 /*
- * Return form data variable.
- * It can be specified in query string, or in the POST data.
- * Return NULL if the variable not found, or allocated 0-terminated value.
- * It is caller's responsibility to free the returned value.
+ * File the timer in the slot of the level that spans its expiry time,
+ * as seen from the current second.
  */
-char *
-mg_get_var(const struct mg_connection *conn, const char *name)
+static void
+wheel_insert(struct wheel *wheel, struct timer *t)
 {
-	const struct mg_request_info	*ri = &conn->request_info;
-	char				*v1, *v2;
+	struct timer	**slot;
+	time_t		expires = t->expires;
+	int		level;
 
-	v1 = v2 = NULL;
+	/* Overdue timers go to the current slot. Those too far away go to
+	 * the last slot of the top level, and are filed again from there */
+	if (expires < wheel->clk)
+		expires = wheel->clk;
+	else if (expires - wheel->clk >= (time_t) 1 << (WHEEL_BITS *
+	    WHEEL_LEVELS))
+		expires = wheel->clk +
+		    ((time_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
 
-	/* Look in both query_string and POST data */
-	if (ri->query_string != NULL)
-		v1 = get_var(name, ri->query_string, strlen(ri->query_string));
-	if (ri->post_data_len > 0)
-		v2 = get_var(name, ri->post_data, ri->post_data_len);
+	for (level = 0; level < WHEEL_LEVELS - 1 && expires - wheel->clk >=
+	    (time_t) 1 << (WHEEL_BITS * (level + 1)); level++)
+		continue;
 
-	/* If they both have queried variable, POST data wins */
-	if (v1 != NULL && v2 != NULL)
-		free(v1);
+	slot = &wheel->slots[level][(expires >> (WHEEL_BITS * level)) &
+	    (WHEEL_SLOTS - 1)];
+	if ((t->next = *slot) != NULL)
+		t->next->pprev = &t->next;
+	t->pprev = slot;
+	*slot = t;
+}
 
-	return (v2 == NULL ? v1 : v2);
+static void
+timer_cancel(struct wheel *wheel, struct timer *t)
+{
+	if (t->pprev != NULL) {
+		if ((*t->pprev = t->next) != NULL)
+			t->next->pprev = t->pprev;
+		t->pprev = NULL;
+		wheel->num_timers--;
+	}
+}
+
+static void
+timer_set(struct wheel *wheel, struct timer *t, time_t expires)
+{
+	timer_cancel(wheel, t);
+	t->expires = expires;
+	wheel_insert(wheel, t);
+	wheel->num_timers++;
 }
 
 /*
- * Transform URI to the file name.
+ * Turn the wheel up to the given second. Return a timer that has expired,
+ * unset, or NULL if there are no more. Whenever the wheel turns to a new
+ * slot of an upper level, timers in it are filed again, one level down.
  */
-static void
-convert_uri_to_file_name(struct mg_connection *conn, const char *uri,
-		char *buf, size_t buf_len)
+static struct timer *
+wheel_expire(struct wheel *wheel, time_t now)
 {
-	struct mg_context	*ctx = conn->ctx;
-	struct vec		uri_vec, path_vec;
-	const char		*list;
+	struct timer	*t, *next;
+	int		level;
 
-	lock_option(ctx, OPT_ROOT);
-	mg_snprintf(conn, buf, buf_len, "%s%s", ctx->options[OPT_ROOT], uri);
-	unlock_option(ctx, OPT_ROOT);
+	/* Nothing to expire on the way, jump */
+	if (wheel->num_timers == 0 && wheel->clk < now)
+		wheel->clk = now;
 
-	/* If requested URI has aliased prefix, use alternate root */
-	lock_option(ctx, OPT_ALIASES);
-	list = ctx->options[OPT_ALIASES];
+	for (;;) {
+		if ((t = wheel->slots[0][wheel->clk & (WHEEL_SLOTS - 1)]) !=
+		    NULL) {
+			timer_cancel(wheel, t);
+			return (t);
+		} else if (wheel->clk >= now) {
+			return (NULL);
+		}
 
-	while ((list = next_option(list, &uri_vec, &path_vec)) != NULL) {
-		if (memcmp(uri, uri_vec.ptr, uri_vec.len) == 0) {
-			(void) mg_snprintf(conn, buf, buf_len, "%.*s%s",
-			    path_vec.len, path_vec.ptr, uri + uri_vec.len);
-			break;
+		wheel->clk++;
+		for (level = 1; level < WHEEL_LEVELS && (wheel->clk &
+		    ((1 << (WHEEL_BITS * level)) - 1)) == 0; level++)
+			continue;
+		while (--level > 0) {
+			t = wheel->slots[level][(wheel->clk >>
+			    (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+			wheel->slots[level][(wheel->clk >>
+			    (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)] = NULL;
+			for (; t != NULL; t = next) {
+				next = t->next;
+				wheel_insert(wheel, t);
+			}
 		}
 	}
-	unlock_option(ctx, OPT_ALIASES);
+}
+#endif /* USE_EPOLL */
 
-#ifdef _WIN32
-	fix_directory_separators(buf);
-#endif /* _WIN32 */
+/*
+ * Threads enter the current phase before they load ctx->queue, and leave
+ * it when done with the rings. A ring unlinked by free_retired_rings() is
+ * freed after every thread of the phase it was unlinked in has left.
+ */
+static int
+enter_queue(struct mg_context *ctx)
+{
+	int	phase;
 
-	DEBUG_TRACE((DEBUG_MGS_PREFIX "%s: [%s] -> [%s]", __func__, uri, buf));
+	for (;;) {
+		phase = ATOMIC_LOAD(&ctx->queue_phase) & 1;
+		(void) ATOMIC_ADD(&ctx->queue_users[phase], 1);
+		if ((ATOMIC_LOAD(&ctx->queue_phase) & 1) == phase)
+			return (phase);
+		/* Flipped meanwhile, the manager may not wait for us */
+		(void) ATOMIC_ADD(&ctx->queue_users[phase], -1);
+	}
+}
+
+static void
+leave_queue(struct mg_context *ctx, int phase)
+{
+	(void) ATOMIC_ADD(&ctx->queue_users[phase], -1);
 }
 
 /*
- * Setup listening socket on given address, return socket.
- * Address format: [local_ip_address:]port_number
+ * Put a connection in the shared queue. Return FALSE if it is full.
  */
-static SOCKET
-mg_open_listening_port(struct mg_context *ctx, const char *str, struct usa *usa)
+static bool_t
+enqueue_connection(struct mg_context *ctx, struct mg_connection *conn)
 {
-	SOCKET		sock;
-	int		on = 1, a, b, c, d, port;
+	bool_t	ok;
+	int	phase;
 
-	/* MacOS needs that. If we do not zero it, bind() will fail. */
-	(void) memset(usa, 0, sizeof(*usa));
+	phase = enter_queue(ctx);
+	ok = ring_put(ATOMIC_LOAD(&ctx->queue), conn);
+	leave_queue(ctx, phase);
 
-	if (sscanf(str, "%d.%d.%d.%d:%d", &a, &b, &c, &d, &port) == 5) {
-		/* IP address to bind to is specified */
-		usa->u.sin.sin_addr.s_addr =
-		    htonl((a << 24) | (b << 16) | (c << 8) | d);
-	} else if (sscanf(str, "%d", &port) == 1) {
-		/* Only port number is specified. Bind to all addresses */
-		usa->u.sin.sin_addr.s_addr = htonl(INADDR_ANY);
-	} else {
-		return (INVALID_SOCKET);
-	}
+	return (ok);
+}
 
-	usa->len			= sizeof(usa->u.sin);
-	usa->u.sin.sin_family		= AF_INET;
-	usa->u.sin.sin_port		= htons((uint16_t) port);
+/*
+ * Take a connection from the queue, including rings retired by resizing.
+ */
+static struct mg_connection *
+dequeue_connection(struct mg_context *ctx)
+{
+	struct mg_connection	*conn = NULL;
+	struct ring		*ring;
+	int			phase;
 
-	if ((sock = socket(PF_INET, SOCK_STREAM, 6)) != INVALID_SOCKET &&
-	    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
-	    (char *) &on, sizeof(on)) == 0 &&
-	    bind(sock, &usa->u.sa, usa->len) == 0 &&
-	    listen(sock, 20) == 0) {
-		/* Success */
-		set_close_on_exec(sock);
-	} else {
-		/* Error */
-		cry(fc(ctx), "%s(%d): %s", __func__, port, strerror(ERRNO));
-		if (sock != INVALID_SOCKET)
-			(void) closesocket(sock);
-		sock = INVALID_SOCKET;
-	}
+	phase = enter_queue(ctx);
+	for (ring = ATOMIC_LOAD(&ctx->queue); ring != NULL && conn == NULL;
+	    ring = ATOMIC_LOAD(&ring->next))
+		conn = ring_get(ring);
+	leave_queue(ctx, phase);
 
-	return (sock);
+	return (conn);
 }
 
 /*
- * Check whether full request is buffered. Return:
- *   -1         if request is malformed
- *    0         if request is not yet fully buffered
- *   >0         actual request length, including last \r\n\r\n
+ * Approximate number of connections waiting in the ring.
  */
 static int
-get_request_len(const char *buf, size_t buflen)
+ring_depth(struct ring *ring)
 {
-	const char	*s, *e;
-	int		len = 0;
+	long	n;
 
-	for (s = buf, e = s + buflen - 1; len <= 0 && s < e; s++)
-		/* Control characters are not allowed but >=128 is. */
-		if (!isprint(* (unsigned char *) s) && *s != '\r' &&
-		    *s != '\n' && * (unsigned char *) s < 128)
-			len = -1;
-		else if (s[0] == '\n' && s[1] == '\n')
-			len = (int) (s - buf) + 2;
-		else if (s[0] == '\n' && &s[1] < e &&
-		    s[1] == '\r' && s[2] == '\n')
-			len = (int) (s - buf) + 3;
+	n = (long) (ATOMIC_LOAD(&ring->head) - ATOMIC_LOAD(&ring->tail));
 
-	return (len);
+	return (n < 0 ? 0 : (int) n);
 }
 
 /*
- * Convert month to the month number. Return -1 on error, or month number
+ * Approximate number of connections waiting for a worker, in the shared
+ * queue and in the local queues of all workers.
  */
 static int
-montoi(const char *s)
+queued_connections(struct mg_context *ctx)
 {
-	size_t	i;
+	struct ring	*ring;
+	int		i, n = 0, phase;
 
-	for (i = 0; i < sizeof(month_names) / sizeof(month_names[0]); i++)
-		if (!strcmp(s, month_names[i]))
-			return ((int) i);
+	phase = enter_queue(ctx);
+	for (ring = ATOMIC_LOAD(&ctx->queue); ring != NULL;
+	    ring = ATOMIC_LOAD(&ring->next))
+		n += ring_depth(ring);
+	leave_queue(ctx, phase);
+	for (i = 0; i < ATOMIC_LOAD(&ctx->num_workers); i++)
+		n += ring_depth(ctx->workers[i]->queue);
 
-	return (-1);
+	return (n);
 }
 
 /*
- * Parse date-time string, and return the corresponding time_t value
+ * Take a connection for the given worker: from its own queue first, then
+ * from the shared queue, and at last steal one from its peers.
  */
-static time_t
-date_to_epoch(const char *s)
+static struct mg_connection *
+take_connection(struct worker *w)
 {
-	time_t		current_time;
-	struct tm	tm, *tmp;
-	char		mon[32];
-	int		sec, min, hour, mday, month, year;
+	struct mg_context	*ctx = w->ctx;
+	struct mg_connection	*conn;
+	int			i, n;
+
+	if ((conn = ring_get(w->queue)) == NULL &&
+	    (conn = dequeue_connection(ctx)) == NULL) {
+		n = ATOMIC_LOAD(&ctx->num_workers);
+		for (i = 1; i < n && conn == NULL; i++)
+			conn = ring_get(
+			    ctx->workers[(w->index + i) % n]->queue);
+	}
 
-	(void) memset(&tm, 0, sizeof(tm));
-	sec = min = hour = mday = month = year = 0;
+	/* Acceptors shed load when connections wait too long */
+	if (conn != NULL && ATOMIC_LOAD(&ctx->shed_wait) > 0)
+		ATOMIC_STORE(&ctx->queue_wait,
+		    (int) (get_msec() - conn->queued_at));
 
-	if (((sscanf(s, "%d/%3s/%d %d:%d:%d",
-	    &mday, mon, &year, &hour, &min, &sec) == 6) ||
-	    (sscanf(s, "%d %3s %d %d:%d:%d",
-	    &mday, mon, &year, &hour, &min, &sec) == 6) ||
-	    (sscanf(s, "%*3s, %d %3s %d %d:%d:%d",
-	    &mday, mon, &year, &hour, &min, &sec) == 6) ||
-	    (sscanf(s, "%d-%3s-%d %d:%d:%d",
-	    &mday, mon, &year, &hour, &min, &sec) == 6)) &&
-	    (month = montoi(mon)) != -1) {
-		tm.tm_mday	= mday;
-		tm.tm_mon	= month;
-		tm.tm_year	= year;
-		tm.tm_hour	= hour;
-		tm.tm_min	= min;
-		tm.tm_sec	= sec;
-	}
+	return (conn);
+}
 
-	if (tm.tm_year > 1900)
-		tm.tm_year -= 1900;
-	else if (tm.tm_year < 70)
-		tm.tm_year += 100;
+/*
+ * Choose a worker for the new connection: an idle one if there is any,
+ * or the less loaded of the next two in round-robin order. Return NULL
+ * if the chosen worker has no room in its local queue.
+ */
+static struct worker *
+assign_connection(struct mg_context *ctx, struct mg_connection *conn)
+{
+	struct worker	*w, *best = NULL;
+	int		i, n, start, num_candidates;
 
-	/* Set Daylight Saving Time field */
-	current_time = time(NULL);
-	tmp = localtime(&current_time);
-	tm.tm_isdst = tmp->tm_isdst;
+	if ((n = ATOMIC_LOAD(&ctx->num_workers)) == 0)
+		return (NULL);
 
-	return (mktime(&tm));
+	start = (int) (ATOMIC_ADD(&ctx->next_worker, 1) % n);
+	num_candidates = ATOMIC_LOAD(&ctx->num_idle) > 0 ? n : 2;
+
+	for (i = 0; i < n && num_candidates > 0; i++) {
+		w = ctx->workers[(start + i) % n];
+		if (!ATOMIC_LOAD(&w->is_active))
+			continue;
+		num_candidates--;
+		if (ATOMIC_LOAD(&w->wakeup.num_waiting) > 0) {
+			best = w;
+			break;
+		} else if (best == NULL ||
+		    ring_depth(w->queue) < ring_depth(best->queue)) {
+			best = w;
+		}
+	}
+
+	return (best != NULL && ring_put(best->queue, conn) ? best : NULL);
 }
 
 /*
- * Protect against directory disclosure attack by removing '..',
- * excessive '/' and '\' characters
+ * Wake up some idle worker, so that it steals queued work.
  */
 static void
-remove_double_dots_and_double_slashes(char *s)
+wake_idle_worker(struct mg_context *ctx)
 {
-	char	*p = s;
+	struct worker	*w;
+	int		i, n, start;
 
-	while (*s != '\0') {
-		*p++ = *s++;
-		if (s[-1] == '/' || s[-1] == '\\') {
-			/* Skip all following slashes and backslashes */
-			while (*s == '/' || *s == '\\')
-				s++;
+	if ((n = ATOMIC_LOAD(&ctx->num_workers)) == 0)
+		return;
 
-			/* Skip all double-dots */
-			while (*s == '.' && s[1] == '.')
-				s += 2;
+	start = (int) (ATOMIC_LOAD(&ctx->next_worker) % n);
+	for (i = 0; i < n; i++) {
+		w = ctx->workers[(start + i) % n];
+		if (ATOMIC_LOAD(&w->wakeup.num_waiting) > 0) {
+			park_wake(&w->wakeup);
+			break;
 		}
 	}
-	*p = '\0';
 }
 
 /*
- * Built-in mime types
+ * Wake up all idle workers, so that they notice a change of the pool.
  */
-static const struct {
-	const char	*extension;
-	size_t		ext_len;
-	const char	*mime_type;
-	size_t		mime_type_len;
-} mime_types[] = {
-	{".html",	5,	"text/html",			9},
-	{".htm",	4,	"text/html",			9},
-	{".shtm",	5,	"text/html",			9},
-	{".shtml",	6,	"text/html",			9},
-	{".css",	4,	"text/css",			8},
-	{".js",		3,	"application/x-javascript",	24},
-	{".ico",	4,	"image/x-icon",			12},
-	{".gif",	4,	"image/gif",			9},
-	{".jpg",	4,	"image/jpeg",			10},
-	{".jpeg",	5,	"image/jpeg",			10},
-	{".png",	4,	"image/png",			9},
-	{".svg",	4,	"image/svg+xml",		13},
-	{".torrent",	8,	"application/x-bittorrent",	24},
-	{".wav",	4,	"audio/x-wav",			11},
-	{".mp3",	4,	"audio/x-mp3",			11},
-	{".mid",	4,	"audio/mid",			9},
-	{".m3u",	4,	"audio/x-mpegurl",		15},
-	{".ram",	4,	"audio/x-pn-realaudio",		20},
-	{".xml",	4,	"text/xml",			8},
-	{".xslt",	5,	"application/xml",		15},
-	{".ra",		3,	"audio/x-pn-realaudio",		20},
-	{".doc",	4,	"application/msword",		19},
-	{".exe",	4,	"application/octet-stream",	24},
-	{".zip",	4,	"application/x-zip-compressed",	28},
-	{".xls",	4,	"application/excel",		17},
-	{".tgz",	4,	"application/x-tar-gz",		20},
-	{".tar",	4,	"application/x-tar",		17},
-	{".gz",		3,	"application/x-gunzip",		20},
-	{".arj",	4,	"application/x-arj-compressed",	28},
-	{".rar",	4,	"application/x-arj-compressed",	28},
-	{".rtf",	4,	"application/rtf",		15},
-	{".pdf",	4,	"application/pdf",		15},
-	{".swf",	4,	"application/x-shockwave-flash",29},
-	{".mpg",	4,	"video/mpeg",			10},
-	{".mpeg",	5,	"video/mpeg",			10},
-	{".asf",	4,	"video/x-ms-asf",		14},
-	{".avi",	4,	"video/x-msvideo",		15},
-	{".bmp",	4,	"image/bmp",			9},
-	{NULL,		0,	NULL,				0}
-};
+static void
+wake_all_workers(struct mg_context *ctx)
+{
+	int	i;
+
+	for (i = 0; i < ATOMIC_LOAD(&ctx->num_workers); i++)
+		park_wake(&ctx->workers[i]->wakeup);
+}
 
 /*
- * Look at the "path" extension and figure what mime type it has.
- * Store mime type in the vector.
+ * Find a free worker slot for a new thread, allocating one if needed.
+ * Must be called with thr_mutex held.
  */
-static void
-get_mime_type(struct mg_context *ctx, const char *path, struct vec *vec)
+static struct worker *
+claim_worker(struct mg_context *ctx)
 {
-	struct vec	ext_vec, mime_vec;
-	const char	*list, *ext;
-	size_t		i, path_len;
+	struct worker	*w;
+	int		i;
 
-	path_len = strlen(path);
+	for (i = 0; i < ctx->num_workers; i++)
+		if (!ctx->workers[i]->is_active)
+			break;
 
-	/*
-	 * Scan user-defined mime types first, in case user wants to
-	 * override default mime types.
-	 */
-	lock_option(ctx, OPT_MIME_TYPES);
-	list = ctx->options[OPT_MIME_TYPES];
-	while ((list = next_option(list, &ext_vec, &mime_vec)) != NULL) {
-		/* ext now points to the path suffix */
-		ext = path + path_len - ext_vec.len;
-		if (mg_strncasecmp(ext, ext_vec.ptr, ext_vec.len) == 0) {
-			*vec = mime_vec;
-			unlock_option(ctx, OPT_MIME_TYPES);
-			return;
-		}
+	if (i < ctx->num_workers) {
+		w = ctx->workers[i];
+	} else if (i == MAX_WORKERS ||
+	    (w = (struct worker *) calloc(1, sizeof(*w))) == NULL) {
+		return (NULL);
+	} else if ((w->queue = ring_new(LOCAL_QUEUE_SIZE)) == NULL) {
+		free(w);
+		return (NULL);
+	} else {
+		w->ctx = ctx;
+		w->index = i;
+		w->sock = INVALID_SOCKET;
+		(void) pthread_mutex_init(&w->sock_mutex, NULL);
+		park_init(&w->wakeup);
+		ctx->workers[i] = w;
+		ATOMIC_STORE(&ctx->num_workers, i + 1);
 	}
-	unlock_option(ctx, OPT_MIME_TYPES);
 
-	/* Now scan built-in mime types */
-	for (i = 0; mime_types[i].extension != NULL; i++) {
-		ext = path + (path_len - mime_types[i].ext_len);
-		if (path_len > mime_types[i].ext_len &&
-		    mg_strcasecmp(ext, mime_types[i].extension) == 0) {
-			vec->ptr = mime_types[i].mime_type;
-			vec->len = mime_types[i].mime_type_len;
-			return;
-		}
-	}
+	ATOMIC_STORE(&w->is_active, TRUE);
 
-	/* Nothing found. Fall back to text/plain */
-	vec->ptr = "text/plain";
-	vec->len = 10;
+	return (w);
 }
 
-#ifndef HAVE_MD5
-typedef struct MD5Context {
-	uint32_t	buf[4];
-	uint32_t	bits[2];
-	unsigned char	in[64];
-} MD5_CTX;
-
-#if __BYTE_ORDER == 1234
-#define byteReverse(buf, len)	/* Nothing */
-#else
 /*
- * Note: this code is harmless on little-endian machines.
+ * Set the socket that the worker serves in blocking mode, so that it can
+ * be shut down to unblock the worker. The worker sets it to INVALID_SOCKET
+ * before the socket is closed or handed over, and the pool manager and
+ * mg_drain() use it only with sock_mutex held.
  */
 static void
-byteReverse(unsigned char *buf, unsigned longs)
+set_worker_socket(struct worker *w, SOCKET sock)
 {
-	uint32_t t;
-	do {
-		t = (uint32_t) ((unsigned) buf[3] << 8 | buf[2]) << 16 |
-			((unsigned) buf[1] << 8 | buf[0]);
-		*(uint32_t *) buf = t;
-		buf += 4;
-	} while (--longs);
+	(void) pthread_mutex_lock(&w->sock_mutex);
+	ATOMIC_STORE(&w->deadline, 0);
+	w->sock = sock;
+	(void) pthread_mutex_unlock(&w->sock_mutex);
 }
-#endif /* __BYTE_ORDER */
 
-/* The four core functions - F1 is optimized somewhat */
+#if defined(USE_AFFINITY)
+/*
+ * Parse a list of CPUs, like "0-3,8,10-11". An empty list is valid.
+ */
+static bool_t
+parse_cpu_list(const char *list, cpu_set_t *set)
+{
+	struct vec	vec;
+	char		buf[32];
+	int		lo, hi;
 
-/* #define F1(x, y, z) (x & y | ~x & z) */
-#define F1(x, y, z) (z ^ (x & (y ^ z)))
-#define F2(x, y, z) F1(z, x, y)
-#define F3(x, y, z) (x ^ y ^ z)
-#define F4(x, y, z) (y ^ (x | ~z))
+	CPU_ZERO(set);
+	while ((list = next_option(list, &vec, NULL)) != NULL) {
+		mg_strlcpy(buf, vec.ptr, vec.len + 1 < sizeof(buf) ?
+		    vec.len + 1 : sizeof(buf));
+		switch (sscanf(buf, "%d-%d", &lo, &hi)) {
+		case 1:
+			hi = lo;
+			break;
+		case 2:
+			break;
+		default:
+			return (FALSE);
+		}
+		if (lo < 0 || hi < lo || hi >= CPU_SETSIZE)
+			return (FALSE);
+		for (; lo <= hi; lo++)
+			CPU_SET(lo, set);
+	}
 
-/* This is the central step in the MD5 algorithm. */
-#define MD5STEP(f, w, x, y, z, data, s) \
-( w += f(x, y, z) + data,  w = w<<s | w>>(32-s),  w += x )
+	return (TRUE);
+}
 
 /*
- * Start MD5 accumulation.  Set bit count to 0 and buffer to mysterious
- * initialization constants.
+ * Split the CPUs by NUMA node, as the kernel reports them in sysfs.
+ * Without NUMA, all of them are on one node. Return number of nodes.
  */
-static void
-MD5Init(MD5_CTX *ctx)
+static int
+split_by_node(const cpu_set_t *set, cpu_set_t nodes[MAX_NUMA_NODES])
 {
-	ctx->buf[0] = 0x67452301;
-	ctx->buf[1] = 0xefcdab89;
-	ctx->buf[2] = 0x98badcfe;
-	ctx->buf[3] = 0x10325476;
+	cpu_set_t	cpus;
+	FILE		*fp;
+	char		path[64], buf[BUFSIZ];
+	int		i, n;
+	bool_t		ok;
+
+	for (i = n = 0; n < MAX_NUMA_NODES; i++) {
+		(void) snprintf(path, sizeof(path),
+		    "/sys/devices/system/node/node%d/cpulist", i);
+		if ((fp = fopen(path, "r")) == NULL)
+			break;
+		ok = fgets(buf, sizeof(buf), fp) != NULL &&
+		    parse_cpu_list(buf, &cpus);
+		(void) fclose(fp);
+		if (ok) {
+			CPU_AND(&nodes[n], &cpus, set);
+			if (CPU_COUNT(&nodes[n]) > 0)
+				n++;
+		}
+	}
 
-	ctx->bits[0] = 0;
-	ctx->bits[1] = 0;
+	if (i == 0) {
+		nodes[0] = *set;
+		n = 1;
+	}
+
+	return (n);
 }
 
 /*
- * The core of the MD5 algorithm, this alters an existing MD5 hash to
- * reflect the addition of 16 longwords of new data.  MD5Update blocks
- * the data and converts bytes into longwords for this routine.
+ * Parse the CPU list of an option. The CPUs must be available to the
+ * application.
  */
-static void
-MD5Transform(uint32_t buf[4], uint32_t const in[16])
+static bool_t
+parse_cpus_option(struct mg_context *ctx, const char *str, cpu_set_t *set)
 {
-	register uint32_t a, b, c, d;
-
-	a = buf[0];
-	b = buf[1];
-	c = buf[2];
-	d = buf[3];
+	cpu_set_t	allowed;
 
-	MD5STEP(F1, a, b, c, d, in[0] + 0xd76aa478, 7);
-	MD5STEP(F1, d, a, b, c, in[1] + 0xe8c7b756, 12);
-	MD5STEP(F1, c, d, a, b, in[2] + 0x242070db, 17);
-	MD5STEP(F1, b, c, d, a, in[3] + 0xc1bdceee, 22);
-	MD5STEP(F1, a, b, c, d, in[4] + 0xf57c0faf, 7);
-	MD5STEP(F1, d, a, b, c, in[5] + 0x4787c62a, 12);
-	MD5STEP(F1, c, d, a, b, in[6] + 0xa8304613, 17);
-	MD5STEP(F1, b, c, d, a, in[7] + 0xfd469501, 22);
-	MD5STEP(F1, a, b, c, d, in[8] + 0x698098d8, 7);
-	MD5STEP(F1, d, a, b, c, in[9] + 0x8b44f7af, 12);
-	MD5STEP(F1, c, d, a, b, in[10] + 0xffff5bb1, 17);
-	MD5STEP(F1, b, c, d, a, in[11] + 0x895cd7be, 22);
-	MD5STEP(F1, a, b, c, d, in[12] + 0x6b901122, 7);
-	MD5STEP(F1, d, a, b, c, in[13] + 0xfd987193, 12);
-	MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17);
-	MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22);
+	if (!parse_cpu_list(str, set)) {
+		cry(fc(ctx), "Invalid CPU list: %s", str);
+		return (FALSE);
+	}
 
-	MD5STEP(F2, a, b, c, d, in[1] + 0xf61e2562, 5);
-	MD5STEP(F2, d, a, b, c, in[6] + 0xc040b340, 9);
-	MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14);
-	MD5STEP(F2, b, c, d, a, in[0] + 0xe9b6c7aa, 20);
-	MD5STEP(F2, a, b, c, d, in[5] + 0xd62f105d, 5);
-	MD5STEP(F2, d, a, b, c, in[10] + 0x02441453, 9);
-	MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14);
-	MD5STEP(F2, b, c, d, a, in[4] + 0xe7d3fbc8, 20);
-	MD5STEP(F2, a, b, c, d, in[9] + 0x21e1cde6, 5);
-	MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6, 9);
-	MD5STEP(F2, c, d, a, b, in[3] + 0xf4d50d87, 14);
-	MD5STEP(F2, b, c, d, a, in[8] + 0x455a14ed, 20);
-	MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905, 5);
-	MD5STEP(F2, d, a, b, c, in[2] + 0xfcefa3f8, 9);
-	MD5STEP(F2, c, d, a, b, in[7] + 0x676f02d9, 14);
-	MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20);
+	CPU_AND(&allowed, set, &ctx->all_cpus);
+	if (!CPU_EQUAL(&allowed, set)) {
+		cry(fc(ctx), "CPUs not available: %s", str);
+		return (FALSE);
+	}
 
-	MD5STEP(F3, a, b, c, d, in[5] + 0xfffa3942, 4);
-	MD5STEP(F3, d, a, b, c, in[8] + 0x8771f681, 11);
-	MD5STEP(F3, c, d, a, b, in[11] + 0x6d9d6122, 16);
-	MD5STEP(F3, b, c, d, a, in[14] + 0xfde5380c, 23);
-	MD5STEP(F3, a, b, c, d, in[1] + 0xa4beea44, 4);
-	MD5STEP(F3, d, a, b, c, in[4] + 0x4bdecfa9, 11);
-	MD5STEP(F3, c, d, a, b, in[7] + 0xf6bb4b60, 16);
-	MD5STEP(F3, b, c, d, a, in[10] + 0xbebfbc70, 23);
-	MD5STEP(F3, a, b, c, d, in[13] + 0x289b7ec6, 4);
-	MD5STEP(F3, d, a, b, c, in[0] + 0xeaa127fa, 11);
-	MD5STEP(F3, c, d, a, b, in[3] + 0xd4ef3085, 16);
-	MD5STEP(F3, b, c, d, a, in[6] + 0x04881d05, 23);
-	MD5STEP(F3, a, b, c, d, in[9] + 0xd9d4d039, 4);
-	MD5STEP(F3, d, a, b, c, in[12] + 0xe6db99e5, 11);
-	MD5STEP(F3, c, d, a, b, in[15] + 0x1fa27cf8, 16);
-	MD5STEP(F3, b, c, d, a, in[2] + 0xc4ac5665, 23);
+	return (TRUE);
+}
 
-	MD5STEP(F4, a, b, c, d, in[0] + 0xf4292244, 6);
-	MD5STEP(F4, d, a, b, c, in[7] + 0x432aff97, 10);
-	MD5STEP(F4, c, d, a, b, in[14] + 0xab9423a7, 15);
-	MD5STEP(F4, b, c, d, a, in[5] + 0xfc93a039, 21);
-	MD5STEP(F4, a, b, c, d, in[12] + 0x655b59c3, 6);
-	MD5STEP(F4, d, a, b, c, in[3] + 0x8f0ccc92, 10);
-	MD5STEP(F4, c, d, a, b, in[10] + 0xffeff47d, 15);
-	MD5STEP(F4, b, c, d, a, in[1] + 0x85845dd1, 21);
-	MD5STEP(F4, a, b, c, d, in[8] + 0x6fa87e4f, 6);
-	MD5STEP(F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10);
-	MD5STEP(F4, c, d, a, b, in[6] + 0xa3014314, 15);
-	MD5STEP(F4, b, c, d, a, in[13] + 0x4e0811a1, 21);
-	MD5STEP(F4, a, b, c, d, in[4] + 0xf7537e82, 6);
-	MD5STEP(F4, d, a, b, c, in[11] + 0xbd3af235, 10);
-	MD5STEP(F4, c, d, a, b, in[2] + 0x2ad7d2bb, 15);
-	MD5STEP(F4, b, c, d, a, in[9] + 0xeb86d391, 21);
+static void
+set_affinity(struct mg_context *ctx, const cpu_set_t *set)
+{
+	int	retval;
 
-	buf[0] += a;
-	buf[1] += b;
-	buf[2] += c;
-	buf[3] += d;
+	if (CPU_COUNT(set) > 0 && (retval = pthread_setaffinity_np(
+	    pthread_self(), sizeof(*set), set)) != 0)
+		cry(fc(ctx), "%s: %s", __func__, strerror(retval));
 }
 
 /*
- * Update context to reflect the concatenation of another buffer full
- * of bytes.
+ * Threads pin themselves as soon as they start, before they allocate
+ * anything: memory is taken from the NUMA node of the thread that touches
+ * it first. Threads inherit the CPUs of their creator, so unpinned ones
+ * are set free explicitly.
  */
 static void
-MD5Update(MD5_CTX *ctx, unsigned char const *buf, unsigned len)
+pin_acceptor(struct mg_context *ctx, int index)
 {
-	uint32_t t;
-
-	/* Update bitcount */
+	cpu_set_t	set;
+	int		cpu, n;
 
-	t = ctx->bits[0];
-	if ((ctx->bits[0] = t + ((uint32_t) len << 3)) < t)
-		ctx->bits[1]++;		/* Carry from low to high */
-	ctx->bits[1] += len >> 29;
+	lock_option(ctx, OPT_ACCEPTOR_CPUS);
+	if ((n = CPU_COUNT(&ctx->acceptor_cpus)) == 0) {
+		set_affinity(ctx, &ctx->all_cpus);
+	} else {
+		/* Acceptors take the CPUs of the set in turn */
+		for (n = index % n, cpu = 0;
+		    !CPU_ISSET(cpu, &ctx->acceptor_cpus) || n-- > 0; cpu++)
+			continue;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		set_affinity(ctx, &set);
+	}
+	unlock_option(ctx, OPT_ACCEPTOR_CPUS);
+}
 
-	t = (t >> 3) & 0x3f;	/* Bytes already in shsInfo->data */
+/*
+ * Workers may run on any CPU of the node their slot is bound to. Slot
+ * buffers, like the io_uring ones, outlive threads: a slot is bound to
+ * a node, rather than a thread.
+ */
+static void
+pin_worker(struct worker *w)
+{
+	struct mg_context	*ctx = w->ctx;
 
-	/* Handle any leading odd-sized chunks */
+	lock_option(ctx, OPT_WORKER_CPUS);
+	if (ctx->num_worker_nodes == 0)
+		set_affinity(ctx, &ctx->all_cpus);
+	else
+		set_affinity(ctx, &ctx->worker_cpus[w->index %
+		    ctx->num_worker_nodes]);
+	unlock_option(ctx, OPT_WORKER_CPUS);
+}
+#else
+#define	pin_acceptor(ctx, index)
+#define	pin_worker(w)
+#endif /* USE_AFFINITY */
 
-	if (t) {
-		unsigned char *p = (unsigned char *) ctx->in + t;
+#if defined(USE_COROUTINES)
+/* Coroutine running on the calling thread, if any */
+static __thread struct coroutine *current_coroutine;
 
-		t = 64 - t;
-		if (len < t) {
-			memcpy(p, buf, len);
-			return;
-		}
-		memcpy(p, buf, t);
-		byteReverse(ctx->in, 16);
-		MD5Transform(ctx->buf, (uint32_t *) ctx->in);
-		buf += t;
-		len -= t;
-	}
-	/* Process data in 64-byte chunks */
+/*
+ * Switch to the scheduler until the socket is ready for the given epoll
+ * events, or the deadline passes (0 - no deadline). Return FALSE on
+ * timeout, or if the server is stopping.
+ */
+static bool_t
+coroutine_wait(SOCKET sock, int events, time_t deadline)
+{
+	struct coroutine	*co = current_coroutine;
+	struct epoll_event	ev;
 
-	while (len >= 64) {
-		memcpy(ctx->in, buf, 64);
-		byteReverse(ctx->in, 16);
-		MD5Transform(ctx->buf, (uint32_t *) ctx->in);
-		buf += 64;
-		len -= 64;
-	}
+	ev.events = events | EPOLLONESHOT;
+	ev.data.ptr = co;
+	if (epoll_ctl(co->worker->epoll_fd, co->is_registered ?
+	    EPOLL_CTL_MOD : EPOLL_CTL_ADD, sock, &ev) != 0)
+		return (FALSE);
 
-	/* Handle any remaining bytes of data. */
+	co->is_registered = TRUE;
+	co->is_waiting = TRUE;
+	if (deadline != 0)
+		timer_set(&co->worker->wheel, &co->timer, deadline);
+	(void) swapcontext(&co->context, &co->worker->scheduler);
 
-	memcpy(ctx->in, buf, len);
+	return (co->is_ready);
 }
 
 /*
- * Final wrapup - pad to 64-byte boundary with the bit pattern
- * 1 0* (64-bit count of bits processed, MSB-first)
+ * Socket IO failed with errno. If it would block and we are running in
+ * a coroutine, wait for the socket until the IO deadline of the
+ * connection, and return TRUE to retry.
  */
-static void
-MD5Final(unsigned char digest[16], MD5_CTX *ctx)
+static bool_t
+should_retry_io(SOCKET sock, int events)
 {
-	unsigned count;
-	unsigned char *p;
+	return ((ERRNO == EAGAIN || ERRNO == EWOULDBLOCK) &&
+	    current_coroutine != NULL &&
+	    current_coroutine->conn->client.sock == sock &&
+	    coroutine_wait(sock, events,
+	    current_coroutine->conn->io_deadline));
+}
+#else
+#define	should_retry_io(sock, events)	FALSE
+#endif /* USE_COROUTINES */
 
-	/* Compute number of bytes mod 64 */
-	count = (ctx->bits[0] >> 3) & 0x3F;
+#if !defined(MSG_MORE)
+#define	MSG_MORE	0	/* Linux only, elsewhere data is not held */
+#endif /* !MSG_MORE */
 
-	/* Set the first char of padding to 0x80.  This is safe since there is
-	   always at least one byte free */
-	p = ctx->in + count;
-	*p++ = 0x80;
+/*
+ * Write data to the IO channel - opened file descriptor, socket or SSL
+ * descriptor. Flags are passed to send(). Return number of bytes written.
+ */
+static int64_t
+push(FILE *fp, SOCKET sock, SSL *ssl, const char *buf, int64_t len,
+		int flags)
+{
+	int64_t	sent;
+	int	n, k;
 
-	/* Bytes of padding needed to make 64 bytes */
-	count = 64 - 1 - count;
+	sent = 0;
+	while (sent < len) {
 
-	/* Pad out to 56 mod 64 */
-	if (count < 8) {
-		/* Two lots of padding:  Pad the first block to 64 bytes */
-		memset(p, 0, count);
-		byteReverse(ctx->in, 16);
-		MD5Transform(ctx->buf, (uint32_t *) ctx->in);
+		/* How many bytes we send in this iteration */
+		k = len - sent > INT_MAX ? INT_MAX : (int) (len - sent);
 
-		/* Now fill the next block with 56 bytes */
-		memset(ctx->in, 0, 56);
-	} else {
-		/* Pad block to 56 bytes */
-		memset(p, 0, count - 8);
+		if (ssl != NULL) {
+			n = SSL_write(ssl, buf + sent, k);
+		} else if (fp != NULL) {
+			n = fwrite(buf + sent, 1, k, fp);
+			if (ferror(fp))
+				n = -1;
+		} else {
+			n = send(sock, buf + sent, (size_t)k, flags);
+			if (n < 0 && should_retry_io(sock, EPOLLOUT))
+				continue;
+		}
+
+		if (n < 0)
+			break;
+
+		sent += n;
 	}
-	byteReverse(ctx->in, 14);
 
-	/* Append length in bits and transform */
-	((uint32_t *) ctx->in)[14] = ctx->bits[0];
-	((uint32_t *) ctx->in)[15] = ctx->bits[1];
+	return (sent);
+}
 
-	MD5Transform(ctx->buf, (uint32_t *) ctx->in);
-	byteReverse((unsigned char *) ctx->buf, 4);
-	memcpy(digest, ctx->buf, 16);
-	memset((char *) ctx, 0, sizeof(ctx));	/* In case it's sensitive */
+/*
+ * Read from IO channel - opened file descriptor, socket, or SSL descriptor.
+ * Return number of bytes read.
+ */
+static int
+pull(FILE *fp, SOCKET sock, SSL *ssl, char *buf, int len)
+{
+	int	nread;
+
+	if (ssl != NULL) {
+		nread = SSL_read(ssl, buf, len);
+	} else if (fp != NULL) {
+		nread = fread(buf, 1, (size_t) len, fp);
+		if (ferror(fp))
+			nread = -1;
+	} else {
+		do {
+			nread = recv(sock, buf, (size_t) len, 0);
+		} while (nread < 0 && should_retry_io(sock, EPOLLIN));
+	}
+
+	return (nread);
 }
-#endif /* !HAVE_MD5 */
 
 /*
- * Stringify binary data. Output buffer must be twice as big as input,
- * because each byte takes 2 bytes in string representation
+ * Time an IO call with the client. Reading request headers, reading
+ * request body and sending the response are timed separately. A call may
+ * take the timeout of its phase. Besides, the whole phase may take the
+ * timeout plus a second for every min_rate bytes moved, so that a slow
+ * client keeping up the rate gets through, and a trickling one does not.
+ * Only the time spent in the IO calls counts. Workers that block past the
+ * deadline have their socket shut down by the pool manager, coroutines
+ * stop waiting for the socket.
  */
 static void
-bin2str(char *to, const unsigned char *p, size_t len)
+time_io(struct mg_connection *conn, int phase)
 {
-	static const char *hex = "0123456789abcdef";
+	struct mg_context	*ctx = conn->ctx;
+	time_t			by_rate, now = time(NULL);
+
+	if (conn->io_phase != phase) {
+		conn->io_phase = phase;
+		conn->io_start = now;
+		conn->io_bytes = 0;
+		conn->io_timeout = atoi(ctx->options[phase == IO_HEADERS ?
+		    OPT_HEADER_TIMEOUT : phase == IO_BODY ?
+		    OPT_BODY_TIMEOUT : OPT_SEND_TIMEOUT]);
+		conn->io_min_rate = atoi(ctx->options[OPT_MIN_RATE]);
+	} else if (conn->io_end != 0) {
+		/* Time spent in between, in the handler, does not count */
+		conn->io_start += now - conn->io_end;
+	}
+	conn->io_end = 0;
 
-	for (; len--; p++) {
-		*to++ = hex[p[0] >> 4];
-		*to++ = hex[p[0] & 0x0f];
+	if (conn->io_timeout <= 0) {
+		conn->io_deadline = 0;
+	} else {
+		conn->io_deadline = now + conn->io_timeout;
+		if (conn->io_min_rate > 0) {
+			by_rate = conn->io_start + conn->io_timeout +
+			    conn->io_bytes / conn->io_min_rate;
+			if (by_rate < conn->io_deadline)
+				conn->io_deadline = by_rate;
+		}
 	}
-	*to = '\0';
+
+	if (conn->worker != NULL
+#if defined(USE_COROUTINES)
+	    && current_coroutine == NULL	/* Waits with the deadline */
+#endif /* USE_COROUTINES */
+	    )
+		ATOMIC_STORE(&conn->worker->deadline, conn->io_deadline);
 }
 
 /*
- * Return stringified MD5 hash for list of vectors.
- * buf must point to 33-bytes long buffer
+ * The IO call timed by time_io() has returned, having moved n bytes.
  */
 static void
-mg_md5(char *buf, ...)
+done_io(struct mg_connection *conn, int64_t n)
 {
-	unsigned char	hash[16];
-	const char	*p;
-	va_list		ap;
-	MD5_CTX		ctx;
+	conn->io_end = time(NULL);
+	conn->io_deadline = 0;
+	if (n > 0)
+		conn->io_bytes += n;
 
-	MD5Init(&ctx);
+	if (conn->worker != NULL
+#if defined(USE_COROUTINES)
+	    && current_coroutine == NULL
+#endif /* USE_COROUTINES */
+	    )
+		ATOMIC_STORE(&conn->worker->deadline, 0);
+}
 
-	va_start(ap, buf);
-	while ((p = va_arg(ap, const char *)) != NULL)
-		MD5Update(&ctx, (unsigned char *) p, (int) strlen(p));
-	va_end(ap);
+/*
+ * Send two buffers to the client, in one system call if possible.
+ * Return number of bytes sent.
+ */
+static int64_t
+push2(struct mg_connection *conn, const char *buf1, int len1,
+		const char *buf2, int64_t len2)
+{
+#if !defined(_WIN32)
+	struct iovec	iov[2];
+	int64_t		sent;
+	ssize_t		n;
+
+	if (conn->ssl == NULL && len2 <= INT_MAX) {
+		iov[0].iov_base = (void *) buf1;
+		iov[0].iov_len = len1;
+		iov[1].iov_base = (void *) buf2;
+		iov[1].iov_len = (size_t) len2;
+
+		for (sent = 0; iov[0].iov_len + iov[1].iov_len > 0; sent += n) {
+			if ((n = writev(conn->client.sock, iov, 2)) <= 0) {
+				if (n < 0 && (ERRNO == EINTR || should_retry_io(
+				    conn->client.sock, EPOLLOUT))) {
+					n = 0;
+					continue;
+				}
+				break;
+			} else if ((size_t) n < iov[0].iov_len) {
+				iov[0].iov_base = (char *) iov[0].iov_base + n;
+				iov[0].iov_len -= n;
+			} else {
+				iov[1].iov_base = (char *) iov[1].iov_base +
+				    (n - iov[0].iov_len);
+				iov[1].iov_len -= n - iov[0].iov_len;
+				iov[0].iov_len = 0;
+			}
+		}
 
-	MD5Final(hash, &ctx);
-	bin2str(buf, hash, sizeof(hash));
+		return (sent);
+	}
+#endif /* !_WIN32 */
+
+	if (push(NULL, conn->client.sock, conn->ssl, buf1, len1, 0) != len1)
+		return (0);
+	return (len1 + push(NULL, conn->client.sock, conn->ssl, buf2, len2, 0));
 }
 
 /*
- * Check the user's password, return 1 if OK
+ * Make room for len more bytes in the output buffer. It starts small
+ * and grows as needed, so that idle connections cost little memory.
  */
 static bool_t
-check_password(const char *method, const char *ha1, const char *uri,
-		const char *nonce, const char *nc, const char *cnonce,
-		const char *qop, const char *response)
+reserve_output(struct mg_connection *conn, int len)
 {
-	char	ha2[32 + 1], expected_response[32 + 1];
+	char	*p;
+	int	size = conn->out_size > 0 ? conn->out_size : OUTPUT_BUFFER_SIZE;
 
-	/* XXX  Due to a bug in MSIE, we do not compare the URI	 */
-	/* Also, we do not check for authentication timeout */
-	if (/*strcmp(dig->uri, c->ouri) != 0 || */
-	    strlen(response) != 32 /*||
-	    now - strtoul(dig->nonce, NULL, 10) > 3600 */)
+	while (size - conn->out_len < len)
+		size *= 2;
+
+	if (size != conn->out_size) {
+		if ((p = (char *) realloc(conn->out, size)) == NULL)
+			return (FALSE);
+		conn->out = p;
+		conn->out_size = size;
+	}
+
+	return (TRUE);
+}
+
+/*
+ * Output is about to be sent. If headers of the current response
+ * have begun, they are no longer held back and cannot be changed.
+ */
+static void
+release_output(struct mg_connection *conn)
+{
+	if (conn->resp.state != RESP_STATUS_LINE || conn->resp.line_len > 0)
+		conn->resp.hdr_end = -1;
+}
+
+/*
+ * Chunked body data collects at the end of the output buffer unframed,
+ * so that many small writes make one chunk. Frame it before anything
+ * else is added to the buffer or the buffer is sent.
+ */
+static bool_t
+frame_output(struct mg_connection *conn)
+{
+	struct response	*resp = &conn->resp;
+	char		size[32];
+	int		n, start;
+
+	if (resp->chunk_len == 0)
+		return (TRUE);
+
+	n = mg_snprintf(conn, size, sizeof(size), "%x\r\n", resp->chunk_len);
+	if (!reserve_output(conn, n + 2))
 		return (FALSE);
 
-	mg_md5(ha2, method, ":", uri, NULL);
-	mg_md5(expected_response, ha1, ":", nonce, ":", nc,
-	    ":", cnonce, ":", qop, ":", ha2, NULL);
+	start = conn->out_len - resp->chunk_len;
+	(void) memmove(conn->out + start + n, conn->out + start,
+	    resp->chunk_len);
+	(void) memcpy(conn->out + start, size, n);
+	(void) memcpy(conn->out + conn->out_len + n, "\r\n", 2);
+	conn->out_len += n + 2;
+	resp->chunk_len = 0;
 
-	return (!mg_strcasecmp(response, expected_response));
+	return (TRUE);
 }
 
 /*
- * Use the global passwords file, if specified by auth_gpass option,
- * or search for .htpasswd in the requested directory.
+ * Send data to the client. Output is collected in conn->out, up to the
+ * "output_buffer" limit, and sent at the end of the batch of requests,
+ * or when the limit is reached. Headers and body leave together, with as
+ * few system calls as possible. Return number of bytes accepted.
  */
-static FILE *
-open_auth_file(struct mg_connection *conn, const char *path)
+static int64_t
+write_to_client(struct mg_connection *conn, const char *buf, int64_t len)
 {
-	struct mg_context	*ctx = conn->ctx;
-	char 			name[FILENAME_MAX];
-	const char		*p, *e;
-	struct mgstat		st;
-	FILE			*fp;
+	int64_t	sent;
+	int	out_len;
 
-	if (ctx->options[OPT_AUTH_GPASSWD] != NULL) {
-		/* Use global passwords file */
-		fp =  mg_fopen(ctx->options[OPT_AUTH_GPASSWD], "r");
-		if (fp == NULL)
-			cry(fc(ctx), "fopen(%s): %s",
-			    ctx->options[OPT_AUTH_GPASSWD], strerror(ERRNO));
-	} else if (!mg_stat(path, &st) && st.is_directory) {
-		(void) mg_snprintf(conn, name, sizeof(name), "%s%c%s",
-		    path, DIRSEP, PASSWORDS_FILE_NAME);
-		fp = mg_fopen(name, "r");
-	} else {
-		/*
-		 * Try to find .htpasswd in requested directory.
-		 * Given the path, create the path to .htpasswd file
-		 * in the same directory. Find the right-most
-		 * directory separator character first. That would be the
-		 * directory name. If directory separator character is not
-		 * found, 'e' will point to 'p'.
-		 */
-		for (p = path, e = p + strlen(p) - 1; e > p; e--)
-			if (IS_DIRSEP_CHAR(*e))
-				break;
+	if (!frame_output(conn))
+		return (0);
+	out_len = conn->out_len;
 
-		/*
-		 * Make up the path by concatenating directory name and
-		 * .htpasswd file name.
-		 */
-		(void) mg_snprintf(conn, name, sizeof(name), "%.*s%c%s",
-		    (int) (e - p), p, DIRSEP, PASSWORDS_FILE_NAME);
-		fp = mg_fopen(name, "r");
+	if (out_len + len <= ATOMIC_LOAD(&conn->ctx->output_limit) &&
+	    reserve_output(conn, (int) len)) {
+		(void) memcpy(conn->out + out_len, buf, (size_t) len);
+		conn->out_len += (int) len;
+		return (len);
 	}
 
-	return (fp);
+	release_output(conn);
+	time_io(conn, IO_SEND);
+	if (out_len == 0) {
+		sent = push(NULL, conn->client.sock, conn->ssl, buf, len, 0);
+		done_io(conn, sent);
+		return (sent);
+	}
+
+	/* Send what's batched along with the new data */
+	conn->out_len = 0;
+	sent = push2(conn, conn->out, out_len, buf, len);
+	done_io(conn, sent);
+
+	return (sent == out_len + len ? len : 0);
 }
 
 /*
- * Parsed Authorization: header
+ * Insert data into the output buffer at the given offset.
  */
-struct ah {
-	char	*user, *uri, *cnonce, *response, *qop, *nc, *nonce;
-};
+static bool_t
+insert_output(struct mg_connection *conn, int offset, const char *buf,
+		int len)
+{
+	if (!reserve_output(conn, len))
+		return (FALSE);
+
+	(void) memmove(conn->out + offset + len, conn->out + offset,
+	    conn->out_len - offset);
+	(void) memcpy(conn->out + offset, buf, len);
+	conn->out_len += len;
+
+	return (TRUE);
+}
 
+/*
+ * Add a header line to the response whose headers are still held back.
+ */
 static bool_t
-parse_auth_header(struct mg_connection *conn, char *buf, size_t buf_size,
-		struct ah *ah)
+insert_header(struct mg_connection *conn, const char *hdr, int len)
 {
-	char		*name, *value, *s;
-	const char	*auth_header;
+	struct response	*resp = &conn->resp;
 
-	if ((auth_header = mg_get_header(conn, "Authorization")) == NULL ||
-	    mg_strncasecmp(auth_header, "Digest ", 7) != 0)
+	if (resp->hdr_end <= 0 || !insert_output(conn, resp->hdr_end, hdr, len))
 		return (FALSE);
 
-	/* Make modifiable copy of the auth header */
-	(void) mg_strlcpy(buf, auth_header + 7, buf_size);
+	resp->hdr_end += len;
+	resp->body_start += len;
 
-	s = buf;
-	(void) memset(ah, 0, sizeof(*ah));
+	return (TRUE);
+}
 
-	/* Gobble initial spaces */
-	while (isspace(* (unsigned char *) s))
-		s++;
+/*
+ * Send responses batched in conn->out. If more data follows right away,
+ * e.g. the body sent with sendfile(), let the kernel merge them into
+ * full segments. Return FALSE on error.
+ */
+static bool_t
+flush_output(struct mg_connection *conn, bool_t more)
+{
+	int64_t	sent;
+	int	len;
 
-	/* Parse authorization header */
-	for (;;) {
-		name = skip(&s, "=");
-		value = skip(&s, ", ");
+	if (!frame_output(conn))
+		return (FALSE);
+	if ((len = conn->out_len) == 0)
+		return (TRUE);
 
-		if (*value == '"') {
-			value++;
-			value[strlen(value) - 1] = '\0';
-		} else if (*value == '\0') {
-			break;
-		}
+	release_output(conn);
+	conn->out_len = 0;
+	time_io(conn, IO_SEND);
+	sent = push(NULL, conn->client.sock, conn->ssl, conn->out, len,
+	    more ? MSG_MORE : 0);
+	done_io(conn, sent);
 
-		if (!strcmp(name, "username")) {
-			ah->user = value;
-		} else if (!strcmp(name, "cnonce")) {
-			ah->cnonce = value;
-		} else if (!strcmp(name, "response")) {
-			ah->response = value;
-		} else if (!strcmp(name, "uri")) {
-			ah->uri = value;
-		} else if (!strcmp(name, "qop")) {
-			ah->qop = value;
-		} else if (!strcmp(name, "nc")) {
-			ah->nc = value;
-		} else if (!strcmp(name, "nonce")) {
-			ah->nonce = value;
+	return (sent == len);
+}
+
+/*
+ * Look at one complete line of the response headers being sent.
+ */
+static void
+parse_response_line(struct mg_connection *conn)
+{
+	struct response	*resp = &conn->resp;
+	char		*name = resp->line, *value;
+
+	if (resp->state == RESP_STATUS_LINE) {
+		if (sscanf(name, "HTTP/%*d.%*d %d", &resp->status) != 1)
+			resp->status = 0;
+		resp->state = RESP_HEADERS;
+	} else if (name[0] == '\0') {
+		if (resp->status >= 100 && resp->status < 200) {
+			/* Interim response, the final one follows */
+			resp->state = RESP_STATUS_LINE;
+		} else {
+			resp->state = RESP_BODY;
+			resp->no_body = resp->status == 204 ||
+			    resp->status == 304 ||
+			    !strcmp(conn->request_info.request_method, "HEAD");
+		}
+	} else if ((value = strchr(name, ':')) != NULL) {
+		*value++ = '\0';
+		while (*value == ' ' || *value == '\t')
+			value++;
+		if (!mg_strcasecmp(name, "Content-Length")) {
+			resp->content_len = strtoll(value, NULL, 10);
+		} else if (!mg_strcasecmp(name, "Transfer-Encoding")) {
+			resp->is_chunked = !mg_strcasecmp(value, "chunked");
+		} else if (!mg_strcasecmp(name, "Connection")) {
+			resp->conn_close = !mg_strcasecmp(value, "close");
+			resp->conn_keep_alive =
+			    !mg_strcasecmp(value, "keep-alive");
 		}
 	}
-
-	/* CGI needs it as REMOTE_USER */
-	if (ah->user != NULL)
-		conn->request_info.remote_user = mg_strdup(ah->user);
-
-	return (TRUE);
 }
 
 /*
- * Authorize against the opened passwords file. Return 1 if authorized.
+ * Scan outgoing data while response headers are being sent.
+ * Return the number of bytes in buf that belong to the headers.
  */
-static bool_t
-authorize(struct mg_connection *conn, FILE *fp)
+static int
+scan_response(struct mg_connection *conn, const char *buf, int len)
 {
-	struct ah	ah;
-	char		line[256], f_user[256], domain[256], ha1[256],
-			buf[MAX_REQUEST_SIZE];
-
-	if (!parse_auth_header(conn, buf, sizeof(buf), &ah))
-		return (FALSE);
-
-	/* Loop over passwords file */
-	while (fgets(line, sizeof(line), fp) != NULL) {
-
-		if (sscanf(line, "%[^:]:%[^:]:%s", f_user, domain, ha1) != 3)
-			continue;
+	struct response	*resp = &conn->resp;
+	int		i;
 
-		if (!strcmp(ah.user, f_user) &&
-		    !strcmp(domain, conn->ctx->options[OPT_AUTH_DOMAIN]))
-			return (check_password(
-			    conn->request_info.request_method, ha1,
-			    ah.uri, ah.nonce, ah.nc, ah.cnonce,
-			    ah.qop, ah.response));
+	for (i = 0; i < len && resp->state != RESP_BODY; i++) {
+		if (buf[i] == '\n') {
+			if (resp->line_len > 0 &&
+			    resp->line[resp->line_len - 1] == '\r')
+				resp->line_len--;
+			resp->line[resp->line_len] = '\0';
+			parse_response_line(conn);
+			resp->line_len = 0;
+		} else if (resp->line_len < (int) sizeof(resp->line) - 1) {
+			resp->line[resp->line_len++] = buf[i];
+		}
 	}
 
-	return (FALSE);
+	return (i);
 }
 
 /*
- * Return TRUE if request is authorised, FALSE otherwise.
+ * Return TRUE if the response is held back whole, and its length is not
+ * known to the client yet.
  */
 static bool_t
-check_authorization(struct mg_connection *conn, const char *path)
+is_unframed(const struct mg_connection *conn)
 {
-	FILE		*fp;
-	char		fname[FILENAME_MAX];
-	struct vec	uri_vec, filename_vec;
-	const char	*list;
-	bool_t		authorized;
+	const struct response	*resp = &conn->resp;
 
-	fp = NULL;
-	authorized = TRUE;
+	return (resp->hdr_end > 0 && resp->state == RESP_BODY &&
+	    !resp->no_body && resp->content_len < 0 && !resp->is_chunked &&
+	    !conn->chunked);
+}
 
-	lock_option(conn->ctx, OPT_PROTECT);
-	list = conn->ctx->options[OPT_PROTECT];
-	while ((list = next_option(list, &uri_vec, &filename_vec)) != NULL) {
-		if (!memcmp(conn->request_info.uri, uri_vec.ptr, uri_vec.len)) {
-			(void) mg_snprintf(conn, fname, sizeof(fname), "%.*s",
-			    filename_vec.len, filename_vec.ptr);
-			if ((fp = mg_fopen(fname, "r")) == NULL)
-				cry(conn, "%s: cannot open %s: %s",
-				    __func__, fname, strerror(errno));
-			break;
-		}
-	}
-	unlock_option(conn->ctx, OPT_PROTECT);
+/*
+ * The body of a response without Content-Length has outgrown the output
+ * buffer. HTTP/1.1 clients get the rest chunk-encoded, so that the
+ * connection can stay open. The held body becomes the first chunk.
+ */
+static void
+start_chunked_body(struct mg_connection *conn)
+{
+	static const char	hdr[] = "Transfer-Encoding: chunked\r\n";
+	struct response		*resp = &conn->resp;
+	char			size[32];
+	int			n, held = conn->out_len - resp->body_start;
 
-	if (fp == NULL)
-		fp = open_auth_file(conn, path);
+	if (!is_unframed(conn) || !conn->keep_alive || resp->conn_close ||
+	    strcmp(conn->request_info.http_version, "1.1") != 0 ||
+	    !reserve_output(conn, (int) sizeof(hdr) + sizeof(size) + 2) ||
+	    !insert_header(conn, hdr, sizeof(hdr) - 1))
+		return;
 
-	if (fp != NULL) {
-		authorized = authorize(conn, fp);
-		(void) fclose(fp);
+	if (held > 0) {
+		n = mg_snprintf(conn, size, sizeof(size), "%x\r\n", held);
+		(void) insert_output(conn, resp->body_start, size, n);
+		(void) insert_output(conn, conn->out_len, "\r\n", 2);
 	}
 
-	return (authorized);
+	resp->is_chunked = conn->chunked = TRUE;
 }
 
+/*
+ * The handler is done, and the whole response is still held back. Tell
+ * the client its length, so that the connection can be kept alive.
+ */
 static void
-send_authorization_request(struct mg_connection *conn)
+add_content_length(struct mg_connection *conn)
 {
-	conn->request_info.status_code = 401;
-	(void) mg_printf(conn,
-	    "HTTP/1.1 401 Unauthorized\r\n"
-	    "WWW-Authenticate: Digest qop=\"auth\", "
-	    "realm=\"%s\", nonce=\"%lu\"\r\n\r\n",
-	    conn->ctx->options[OPT_AUTH_DOMAIN], (unsigned long) time(NULL));
+	struct response	*resp = &conn->resp;
+	char		hdr[64];
+	int		n;
+
+	if (!is_unframed(conn))
+		return;
+
+	n = mg_snprintf(conn, hdr, sizeof(hdr),
+	    "Content-Length: %" INT64_FMT "\r\n", resp->body_len);
+	if (insert_header(conn, hdr, n))
+		resp->content_len = resp->body_len;
+
+	/* HTTP/1.0 clients need to be told, too */
+	if (conn->keep_alive && !resp->conn_close && !resp->conn_keep_alive &&
+	    strcmp(conn->request_info.http_version, "1.1") != 0 &&
+	    insert_header(conn, "Connection: keep-alive\r\n", 24))
+		resp->conn_keep_alive = TRUE;
 }
 
-static bool_t
-is_authorized_for_put(struct mg_connection *conn)
+/*
+ * Send response body data, chunk-encoded if the connection is in the
+ * chunked mode. Return number of body bytes sent.
+ */
+static int
+write_body(struct mg_connection *conn, const char *buf, int len)
 {
-	FILE	*fp;
-	int	ret = FALSE;
+	char	size[32];
+	int	n;
 
-	if ((fp = mg_fopen(conn->ctx->options[OPT_AUTH_PUT], "r")) != NULL) {
-		set_close_on_exec(fileno(fp));
-		ret = authorize(conn, fp);
-		(void) fclose(fp);
+	/* Responses to HEAD, 204 and 304 MUST NOT have a body */
+	if (conn->resp.no_body)
+		return (len);
+
+	if (!conn->chunked && conn->out_len + len >
+	    ATOMIC_LOAD(&conn->ctx->output_limit))
+		start_chunked_body(conn);
+
+	conn->resp.body_len += len;
+	if (!conn->chunked)
+		return ((int) write_to_client(conn, buf, (int64_t) len));
+
+	/* Buffered, it joins the chunk framed when the buffer is sent */
+	if (conn->out_len + len <= ATOMIC_LOAD(&conn->ctx->output_limit) &&
+	    reserve_output(conn, len)) {
+		(void) memcpy(conn->out + conn->out_len, buf, len);
+		conn->out_len += len;
+		conn->resp.chunk_len += len;
+		return (len);
 	}
 
-	return (ret);
+	n = mg_snprintf(conn, size, sizeof(size), "%x\r\n", len);
+	if (write_to_client(conn, size, n) != n ||
+	    write_to_client(conn, buf, len) != len ||
+	    write_to_client(conn, "\r\n", 2) != 2)
+		return (0);
+
+	return (len);
 }
 
 int
-mg_modify_passwords_file(struct mg_context *ctx, const char *fname,
-		const char *user, const char *pass)
+mg_write(struct mg_connection *conn, const void *buf, int len)
 {
-	int		found;
-	char		line[512], u[512], d[512], ha1[33], tmp[FILENAME_MAX];
-	const char	*domain;
-	FILE		*fp, *fp2;
-
-	found = 0;
-	fp = fp2 = NULL;
-	domain = ctx->options[OPT_AUTH_DOMAIN];
-
-	/* Regard empty password as no password - remove user record. */
-	if (pass[0] == '\0')
-		pass = NULL;
+	const char	*data = (const char *) buf;
+	int		headers_len, sent;
 
-	(void) snprintf(tmp, sizeof(tmp), "%s.tmp", fname);
+	assert(len >= 0);
+	headers_len = scan_response(conn, data, len);
+	sent = headers_len == 0 ? 0 :
+	    (int) write_to_client(conn, data, (int64_t) headers_len);
+
+	/* If all headers are held back, remember where they end */
+	if (headers_len > 0 && conn->resp.state == RESP_BODY &&
+	    conn->resp.hdr_end == 0 && conn->out_len > 0) {
+		conn->resp.body_start = conn->out_len;
+		conn->resp.hdr_end = conn->out_len - (conn->out_len > 1 &&
+		    conn->out[conn->out_len - 2] == '\r' ? 2 : 1);
+	}
 
-	/* Create the file if does not exist */
-	if ((fp = mg_fopen(fname, "a+")) != NULL)
-		(void) fclose(fp);
+	if (sent == headers_len && len > headers_len)
+		sent += write_body(conn, data + headers_len, len - headers_len);
 
-	/* Open the given file and temporary file */
-	if ((fp = mg_fopen(fname, "r")) == NULL) {
-		cry(fc(ctx), "Cannot open %s: %s", fname, strerror(errno));
-		return (0);
-	} else if ((fp2 = mg_fopen(tmp, "w+")) == NULL) {
-		cry(fc(ctx), "Cannot open %s: %s", tmp, strerror(errno));
-		return (0);
-	}
+	/* Client is out of sync with us, do not reuse the connection */
+	if (sent != len)
+		conn->keep_alive = FALSE;
 
-	/* Copy the stuff to temporary file */
-	while (fgets(line, sizeof(line), fp) != NULL) {
+	return (sent);
+}
 
-		if (sscanf(line, "%[^:]:%[^:]:%*s", u, d) != 2)
-			continue;
+/*
+ * Output that does not fit in the stack buffer is formatted again into
+ * a heap one, so that nothing is truncated.
+ */
+int
+mg_printf(struct mg_connection *conn, const char *fmt, ...)
+{
+	char	buf[MAX_REQUEST_SIZE], *p = buf;
+	int	len;
+	va_list	ap, aq;
 
-		if (!strcmp(u, user) && !strcmp(d, domain)) {
-			found++;
-			if (pass != NULL) {
-				mg_md5(ha1, user, ":", domain, ":", pass, NULL);
-				fprintf(fp2, "%s:%s:%s\n", user, domain, ha1);
-			}
-		} else {
-			(void) fprintf(fp2, "%s", line);
-		}
-	}
+	va_start(ap, fmt);
+	va_copy(aq, ap);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	if (len >= (int) sizeof(buf) &&
+	    (p = (char *) malloc(len + 1)) != NULL)
+		len = vsnprintf(p, len + 1, fmt, aq);
+	va_end(aq);
+	va_end(ap);
 
-	/* If new user, just add it */
-	if (!found && pass != NULL) {
-		mg_md5(ha1, user, ":", domain, ":", pass, NULL);
-		(void) fprintf(fp2, "%s:%s:%s\n", user, domain, ha1);
+	if (len < 0) {
+		cry(conn, "%s: vsnprintf error", __func__);
+		len = 0;
+	} else if (p == NULL) {
+		cry(conn, "%s: cannot allocate %d bytes", __func__, len + 1);
+		p = buf;
+		len = sizeof(buf) - 1;
 	}
 
-	/* Close files */
-	(void) fclose(fp);
-	(void) fclose(fp2);
-
-	/* Put the temp file in place of real file */
-	(void) mg_remove(fname);
-	(void) mg_rename(tmp, fname);
+	len = mg_write(conn, p, len);
+	if (p != buf)
+		free(p);
 
-	return (0);
+	return (len);
 }
 
-struct de {
-	struct mg_connection	*conn;
-	char			*file_name;
-	struct mgstat		st;
-};
-
-static void
-url_encode(const char *src, char *dst, size_t dst_len)
+/*
+ * Return content length of the request, or -1 constant if
+ * Content-Length header is not set.
+ */
+static int64_t
+get_content_length(const struct mg_connection *conn)
 {
-	const char	*dont_escape = "._-$,;~()";
-	const char	*hex = "0123456789abcdef";
-	const char	*end = dst + dst_len - 1;
-	
-	for (; *src != '\0' && dst < end; src++, dst++) {
-		if (isalnum(*(unsigned char *) src) ||
-		    strchr(dont_escape, * (unsigned char *) src) != NULL) {
-			*dst = *src;
-		} else if (dst + 2 < end) {
-			dst[0] = '%';
-			dst[1] = hex[(* (unsigned char *) src) >> 4];
-			dst[2] = hex[(* (unsigned char *) src) & 0xf];
-			dst += 2;
-		}
-	}
-
-	*dst = '\0';
+	const char *cl = mg_get_header(conn, "Content-Length");
+	return (cl == NULL ? -1 : strtoll(cl, NULL, 10));
 }
 
 /*
- * This function is called from send_directory() and prints out
- * single directory entry.
+ * URL-decode input buffer into destination buffer.
+ * 0-terminate the destination buffer. Return the length of decoded data.
+ * form-url-encoded data differs from URI encoding in a way that it
+ * uses '+' as character for space, see RFC 1866 section 8.2.1
+ * http://ftp.ics.uci.edu/pub/ietf/html/rfc1866.txt
  */
-static void
-print_dir_entry(struct de *de)
+static size_t
+url_decode(const char *src, size_t src_len, char *dst, size_t dst_len,
+		bool_t is_form_url_encoded)
 {
-	char		size[64], mod[64], href[FILENAME_MAX];
+	size_t	i, j;
+	int	a, b;
+#define	HEXTOI(x)	(isdigit(x) ? x - '0' : x - 'W')
 
-	if (de->st.is_directory) {
-		(void) mg_snprintf(de->conn,
-		    size, sizeof(size), "%s", "[DIRECTORY]");
-	} else {
-		/*
-		 * We use (signed) cast below because MSVC 6 compiler cannot
-		 * convert unsigned __int64 to double. Sigh.
-		 */
-		if (de->st.size < 1024)
-			(void) mg_snprintf(de->conn, size, sizeof(size),
-			    "%lu", (unsigned long) de->st.size);
-		else if (de->st.size < 1024 * 1024)
-			(void) mg_snprintf(de->conn, size, sizeof(size),
-			    "%.1fk", (double) de->st.size / 1024.0);
-		else if (de->st.size < 1024 * 1024 * 1024)
-			(void) mg_snprintf(de->conn, size, sizeof(size),
-			    "%.1fM", (double) de->st.size / 1048576);
-		else
-			(void) mg_snprintf(de->conn, size, sizeof(size),
-			  "%.1fG", (double) de->st.size / 1073741824);
+	for (i = j = 0; i < src_len && j < dst_len - 1; i++, j++) {
+		if (src[i] == '%' &&
+		    isxdigit(* (unsigned char *) (src + i + 1)) &&
+		    isxdigit(* (unsigned char *) (src + i + 2))) {
+			a = tolower(* (unsigned char *) (src + i + 1));
+			b = tolower(* (unsigned char *) (src + i + 2));
+			dst[j] = ((HEXTOI(a) << 4) | HEXTOI(b)) & 0xff;
+			i += 2;
+		} else if (is_form_url_encoded && src[i] == '+') {
+			dst[j] = ' ';
+		} else {
+			dst[j] = src[i];
+		}
 	}
-	(void) strftime(mod, sizeof(mod), "%d-%b-%Y %H:%M",
-		localtime(&de->st.mtime));
 
-	url_encode(de->file_name, href, sizeof(href));
+	dst[j] = '\0';	/* Null-terminate the destination */
 
-	de->conn->num_bytes_sent += mg_printf(de->conn,
-	    "<tr><td><a href=\"%s%s%s\">%s%s</a></td>"
-	    "<td>&nbsp;%s</td><td>&nbsp;&nbsp;%s</td></tr>\n",
-	    de->conn->request_info.uri, href, de->st.is_directory ? "/" : "",
-	    de->file_name, de->st.is_directory ? "/" : "", mod, size);
+	return (j);
 }
 
 /*
- * This function is called from send_directory() and used for
- * sorting direcotory entries by size, or name, or modification time.
+ * Search for a form variable in a given buffer.
+ * Semantic is the same as for mg_get_var().
  */
-static int
-compare_dir_entries(const void *p1, const void *p2)
+static char *
+get_var(const char *name, const char *buf, size_t buf_len)
 {
-	const struct de	*a = (struct de *) p1, *b = (struct de *) p2;
-	const char	*query_string = a->conn->request_info.query_string;
-	int		cmp_result = 0;
+	const char	*p, *e, *s;
+	char		*val;
+	size_t		var_len, len;
 
-	if (query_string == NULL)
-		query_string = "na";
+	var_len = strlen(name);
+	e = buf + buf_len;
+	val = NULL;
 
-	if (a->st.is_directory && !b->st.is_directory) {
-		return (-1);  /* Always put directories on top */
-	} else if (!a->st.is_directory && b->st.is_directory) {
-		return (1);   /* Always put directories on top */
-	} else if (*query_string == 'n') {
-		cmp_result = strcmp(a->file_name, b->file_name);
-	} else if (*query_string == 's') {
-		cmp_result = a->st.size == b->st.size ? 0 :
-			a->st.size > b->st.size ? 1 : -1;
-	} else if (*query_string == 'd') {
-		cmp_result = a->st.mtime == b->st.mtime ? 0 :
-			a->st.mtime > b->st.mtime ? 1 : -1;
-	}
+	/* buf is "var1=val1&var2=val2...". Find variable first */
+	for (p = buf; p + var_len < e; p++)
+		if ((p == buf || p[-1] == '&') && p[var_len] == '=' &&
+		    !mg_strncasecmp(name, p, var_len)) {
 
-	return (query_string[1] == 'd' ? -cmp_result : cmp_result);
+			/* Point p to variable value */
+			p += var_len + 1;
+
+			/* Point s to the end of the value */
+			s = (const char *) memchr(p, '&', e - p);
+			if (s == NULL)
+				s = e;
+
+			/* Try to allocate the buffer */
+			len = s - p;
+			if ((val = (char *) malloc(len + 1)) != NULL)
+				(void) url_decode(p, len, val, len + 1, TRUE);
+			break;
+		}
+
+	return (val);
 }
 
 /*
- * Send directory contents.
+ * Free the pointer returned by mg_get_var(). This is needed for languages
+ * like python, to have an ability to free allocated data without
+ * loading C runtime library and calling free().
  */
-static void
-send_directory(struct mg_connection *conn, const char *dir)
+void
+mg_free(char *data)
 {
-	struct dirent	*dp;
-	DIR		*dirp;
-	struct de	*entries = NULL;
-	char		path[FILENAME_MAX];
-	int		i, sort_direction, num_entries = 0, arr_size = 128;
-
-	if ((dirp = opendir(dir)) == NULL) {
-		send_error(conn, 500, "Cannot open directory",
-		    "Error: opendir(%s): %s", path, strerror(ERRNO));
-		return;
-	}
+	free(data);
+}
 
-	(void) mg_printf(conn, "%s",
-	    "HTTP/1.1 200 OK\r\n"
-	    "Connection: close\r\n"
-	    "Content-Type: text/html; charset=utf-8\r\n\r\n");
+/*
+ * Return form data variable.
+ * It can be specified in query string, or in the POST data.
+ * Return NULL if the variable not found, or allocated 0-terminated value.
+ * It is caller's responsibility to free the returned value.
+ */
+char *
+mg_get_var(const struct mg_connection *conn, const char *name)
+{
+	const struct mg_request_info	*ri = &conn->request_info;
+	char				*v1, *v2;
 
-	sort_direction = conn->request_info.query_string != NULL &&
-	    conn->request_info.query_string[1] == 'd' ? 'a' : 'd';
+	v1 = v2 = NULL;
 
-	while ((dp = readdir(dirp)) != NULL) {
+	/* Look in both query_string and POST data */
+	if (ri->query_string != NULL)
+		v1 = get_var(name, ri->query_string, strlen(ri->query_string));
+	if (ri->post_data_len > 0)
+		v2 = get_var(name, ri->post_data, ri->post_data_len);
 
-		/* Do not show current dir and passwords file */
-		if (!strcmp(dp->d_name, ".") ||
-		    !strcmp(dp->d_name, "..") ||
-		    !strcmp(dp->d_name, PASSWORDS_FILE_NAME))
-			continue;
+	/* If they both have queried variable, POST data wins */
+	if (v1 != NULL && v2 != NULL)
+		free(v1);
 
-		if (entries == NULL || num_entries >= arr_size) {
-			arr_size *= 2;
-			entries = (struct de *) realloc(entries,
-			    arr_size * sizeof(entries[0]));
-		}
+	return (v2 == NULL ? v1 : v2);
+}
 
-		if (entries == NULL) {
-			send_error(conn, 500, "Cannot open directory",
-			    "%s", "Error: cannot allocate memory");
-			return;
-		}
+/*
+ * Transform URI to the file name.
+ */
+static void
+convert_uri_to_file_name(struct mg_connection *conn, const char *uri,
+		char *buf, size_t buf_len)
+{
+	struct mg_context	*ctx = conn->ctx;
+	struct vec		uri_vec, path_vec;
+	const char		*list;
 
-		(void) mg_snprintf(conn, path, sizeof(path), "%s%c%s",
-		    dir, DIRSEP, dp->d_name);
+	lock_option(ctx, OPT_ROOT);
+	mg_snprintf(conn, buf, buf_len, "%s%s", ctx->options[OPT_ROOT], uri);
+	unlock_option(ctx, OPT_ROOT);
 
-		/*
-		 * If we don't memset stat structure to zero, mtime will have
-		 * garbage and strftime() will segfault later on in
-		 * print_dir_entry(). memset is required only if mg_stat()
-		 * fails. For more details, see
-		 * http://code.google.com/p/mongoose/issues/detail?id=79
-		 */
-		if (mg_stat(path, &entries[num_entries].st) != 0)
-			(void) memset(&entries[num_entries].st, 0,
-			    sizeof(entries[num_entries].st));
+	/* If requested URI has aliased prefix, use alternate root */
+	lock_option(ctx, OPT_ALIASES);
+	list = ctx->options[OPT_ALIASES];
 
-		entries[num_entries].conn = conn;
-		entries[num_entries].file_name = mg_strdup(dp->d_name);
-		num_entries++;
+	while ((list = next_option(list, &uri_vec, &path_vec)) != NULL) {
+		if (memcmp(uri, uri_vec.ptr, uri_vec.len) == 0) {
+			(void) mg_snprintf(conn, buf, buf_len, "%.*s%s",
+			    path_vec.len, path_vec.ptr, uri + uri_vec.len);
+			break;
+		}
 	}
-	(void) closedir(dirp);
-
-	conn->num_bytes_sent += mg_printf(conn,
-	    "<html><head><title>Index of %s</title>"
-	    "<style>th {text-align: left;}</style></head>"
-	    "<body><h1>Index of %s</h1><pre><table cellpadding=\"0\">"
-	    "<tr><th><a href=\"?n%c\">Name</a></th>"
-	    "<th><a href=\"?d%c\">Modified</a></th>"
-	    "<th><a href=\"?s%c\">Size</a></th></tr>"
-	    "<tr><td colspan=\"3\"><hr></td></tr>",
-	    conn->request_info.uri, conn->request_info.uri,
-	    sort_direction, sort_direction, sort_direction);
+	unlock_option(ctx, OPT_ALIASES);
 
-	/* Print first entry - link to a parent directory */
-	conn->num_bytes_sent += mg_printf(conn,
-	    "<tr><td><a href=\"%s%s\">%s</a></td>"
-	    "<td>&nbsp;%s</td><td>&nbsp;&nbsp;%s</td></tr>\n",
-	    conn->request_info.uri, "..", "Parent directory", "-", "-");
+#ifdef _WIN32
+	fix_directory_separators(buf);
+#endif /* _WIN32 */
 
-	/* Sort and print directory entries */
-	qsort(entries, num_entries, sizeof(entries[0]), compare_dir_entries);
-	for (i = 0; i < num_entries; i++) {
-		print_dir_entry(&entries[i]);
-		free(entries[i].file_name);
-	}
-	free(entries);
+	DEBUG_TRACE((DEBUG_MGS_PREFIX "%s: [%s] -> [%s]", __func__, uri, buf));
+}
 
-	conn->num_bytes_sent += mg_printf(conn, "%s", "</table></body></html>");
-	conn->request_info.status_code = 200;
+static void
+set_listener_option(struct mg_context *ctx, SOCKET sock,
+		int level, int name, const char *desc, int value)
+{
+	if (setsockopt(sock, level, name, (char *) &value, sizeof(value)) != 0)
+		cry(fc(ctx), "%s: %s: %s", __func__, desc, strerror(ERRNO));
 }
 
 /*
- * Send len bytes from the opened file to the client.
+ * Apply the listener options to a bound socket and (re)start listening.
+ * Calling listen() again on a listening socket changes its backlog.
+ * Accepted sockets inherit the buffer sizes, so that window scaling is
+ * negotiated for them. Zero leaves the buffer sizes as they were.
  */
-static void
-send_opened_file_stream(struct mg_connection *conn, FILE *fp, int64_t len)
+static bool_t
+tune_listening_socket(struct mg_context *ctx, SOCKET sock)
 {
-	char	buf[BUFSIZ];
-	int	to_read, num_read, num_written;
-
-	while (len > 0) {
-		/* Calculate how much to read from the file in the buffer */
-		to_read = sizeof(buf);
-		if ((int64_t) to_read > len)
-			to_read = (int) len;
-
-		/* Read from file, exit the loop on error */
-		if ((num_read = fread(buf, 1, to_read, fp)) == 0)
-			break;
-
-		/* Send read bytes to the client, exit the loop on error */
-		if ((num_written = mg_write(conn, buf, num_read)) != num_read)
-			break;
+	int	n;
 
-		/* Both read and were successful, adjust counters */
-		conn->num_bytes_sent += num_written;
-		len -= num_written;
-	}
+	if ((n = ATOMIC_LOAD(&ctx->rcvbuf)) > 0)
+		set_listener_option(ctx, sock, SOL_SOCKET, SO_RCVBUF,
+		    "SO_RCVBUF", n);
+	if ((n = ATOMIC_LOAD(&ctx->sndbuf)) > 0)
+		set_listener_option(ctx, sock, SOL_SOCKET, SO_SNDBUF,
+		    "SO_SNDBUF", n);
+#if defined(TCP_DEFER_ACCEPT)
+	/* Do not wake up the acceptor until the request starts arriving */
+	set_listener_option(ctx, sock, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+	    "TCP_DEFER_ACCEPT", ATOMIC_LOAD(&ctx->defer_accept));
+#endif /* TCP_DEFER_ACCEPT */
+#if defined(TCP_FASTOPEN)
+	if ((n = ATOMIC_LOAD(&ctx->fastopen)) > 0)
+		set_listener_option(ctx, sock, IPPROTO_TCP, TCP_FASTOPEN,
+		    "TCP_FASTOPEN", n);
+#endif /* TCP_FASTOPEN */
+
+	return (listen(sock, ATOMIC_LOAD(&ctx->listen_backlog)) == 0);
 }
 
 /*
- * Send regular file contents.
+ * Create a socket listening on the given address. The socket of
+ * ctx->listeners is bound exclusively, so that a port someone else
+ * listens on is an error. If shared is not INVALID_SOCKET, the new socket
+ * is an acceptor thread's SO_REUSEPORT copy of that listening socket.
  */
-static void
-send_file(struct mg_connection *conn, const char *path, struct mgstat *stp)
+static SOCKET
+open_listening_socket(struct mg_context *ctx, const struct usa *usa,
+		SOCKET shared)
 {
-	char		date[64], lm[64], etag[64], range[64];
-	const char	*fmt = "%a, %d %b %Y %H:%M:%S %Z", *msg = "OK", *hdr;
-	time_t		curtime = time(NULL);
-	int64_t		cl, r1, r2;
-	struct vec	mime_vec;
-	FILE		*fp;
-	int		n;
+	SOCKET		sock;
+	int		on = 1;
 
-	get_mime_type(conn->ctx, path, &mime_vec);
-	cl = stp->size;
-	conn->request_info.status_code = 200;
-	range[0] = '\0';
-
-	if ((fp = mg_fopen(path, "rb")) == NULL) {
-		send_error(conn, 500, http_500_error,
-		    "fopen(%s): %s", path, strerror(ERRNO));
-		return;
+#if defined(USE_EPOLL) && defined(SO_REUSEPORT)
+	/*
+	 * Linux lets a socket join the port only if the ones bound to it
+	 * are SO_REUSEPORT, too. The listening socket is made so only now,
+	 * after it has got the port to itself.
+	 */
+	if (shared != INVALID_SOCKET && setsockopt(shared, SOL_SOCKET,
+	    SO_REUSEPORT, (char *) &on, sizeof(on)) != 0) {
+		cry(fc(ctx), "%s: SO_REUSEPORT: %s",
+		    __func__, strerror(ERRNO));
+		return (INVALID_SOCKET);
 	}
-	set_close_on_exec(fileno(fp));
+#endif /* USE_EPOLL && SO_REUSEPORT */
 
-	/* If Range: header specified, act accordingly */
-	r1 = r2 = 0;
-	hdr = mg_get_header(conn, "Range");
-	if (hdr != NULL && (n = sscanf(hdr,
-	    "bytes=%" INT64_FMT "-%" INT64_FMT, &r1, &r2)) > 0) {
-		conn->request_info.status_code = 206;
-		(void) fseeko(fp, (off_t) r1, SEEK_SET);
-		cl = n == 2 ? r2 - r1 + 1: cl - r1;
-		(void) mg_snprintf(conn, range, sizeof(range),
-		    "Content-Range: bytes "
-		    "%" INT64_FMT "-%"
-		    INT64_FMT "/%" INT64_FMT "\r\n",
-		    r1, r1 + cl - 1, stp->size);
-		msg = "Partial Content";
+	if ((sock = socket(PF_INET, SOCK_STREAM, 6)) != INVALID_SOCKET &&
+	    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
+	    (char *) &on, sizeof(on)) == 0 &&
+#if defined(USE_EPOLL) && defined(SO_REUSEPORT)
+	    (shared == INVALID_SOCKET || setsockopt(sock, SOL_SOCKET,
+	    SO_REUSEPORT, (char *) &on, sizeof(on)) == 0) &&
+#endif /* USE_EPOLL && SO_REUSEPORT */
+	    bind(sock, &usa->u.sa, usa->len) == 0 &&
+	    tune_listening_socket(ctx, sock)) {
+		/* Success */
+		set_close_on_exec(sock);
+	} else {
+		/* Error */
+		cry(fc(ctx), "%s(%d): %s", __func__,
+		    ntohs(usa->u.sin.sin_port), strerror(ERRNO));
+		if (sock != INVALID_SOCKET)
+			(void) closesocket(sock);
+		sock = INVALID_SOCKET;
 	}
 
-	/* Prepare Etag, Date, Last-Modified headers */
-	(void) strftime(date, sizeof(date), fmt, localtime(&curtime));
-	(void) strftime(lm, sizeof(lm), fmt, localtime(&stp->mtime));
-	(void) mg_snprintf(conn, etag, sizeof(etag), "%lx.%lx",
-	    (unsigned long) stp->mtime, (unsigned long) stp->size);
-
-	(void) mg_printf(conn,
-	    "HTTP/1.1 %d %s\r\n"
-	    "Date: %s\r\n"
-	    "Last-Modified: %s\r\n"
-	    "Etag: \"%s\"\r\n"
-	    "Content-Type: %.*s\r\n"
-	    "Content-Length: %" INT64_FMT "\r\n"
-	    "Connection: close\r\n"
-	    "Accept-Ranges: bytes\r\n"
-	    "%s\r\n",
-	    conn->request_info.status_code, msg, date, lm, etag,
-	    mime_vec.len, mime_vec.ptr, cl, range);
-
-	if (strcmp(conn->request_info.request_method, "HEAD") != 0)
-		send_opened_file_stream(conn, fp, cl);
-	(void) fclose(fp);
+	return (sock);
 }
 
 /*
- * Parse HTTP headers from the given buffer, advance buffer to the point
- * where parsing stopped.
+ * Parse listening address. Format: [local_ip_address:]port_number
  */
-static void
-parse_http_headers(char **buf, struct mg_request_info *ri)
+static bool_t
+parse_listening_address(const char *str, struct usa *usa)
 {
-	int	i;
+	int		a, b, c, d, port;
 
-	for (i = 0; i < (int) ARRAY_SIZE(ri->http_headers); i++) {
-		ri->http_headers[i].name = skip(buf, ": ");
-		ri->http_headers[i].value = skip(buf, "\r\n");
-		if (ri->http_headers[i].name[0] == '\0')
-			break;
-		ri->num_headers = i + 1;
+	/* MacOS needs that. If we do not zero it, bind() will fail. */
+	(void) memset(usa, 0, sizeof(*usa));
+
+	if (sscanf(str, "%d.%d.%d.%d:%d", &a, &b, &c, &d, &port) == 5) {
+		/* IP address to bind to is specified */
+		usa->u.sin.sin_addr.s_addr =
+		    htonl((a << 24) | (b << 16) | (c << 8) | d);
+	} else if (sscanf(str, "%d", &port) == 1) {
+		/* Only port number is specified. Bind to all addresses */
+		usa->u.sin.sin_addr.s_addr = htonl(INADDR_ANY);
+	} else {
+		return (FALSE);
 	}
+
+	usa->len			= sizeof(usa->u.sin);
+	usa->u.sin.sin_family		= AF_INET;
+	usa->u.sin.sin_port		= htons((uint16_t) port);
+
+	return (TRUE);
 }
 
+/*
+ * Return TRUE if both listeners are bound to the same address, and
+ * speak the same protocol.
+ */
 static bool_t
-is_valid_http_method(const char *method)
+is_same_listener(const struct socket *a, const struct socket *b)
 {
-	return (!strcmp(method, "GET") ||
-	    !strcmp(method, "POST") ||
-	    !strcmp(method, "HEAD") ||
-	    !strcmp(method, "PUT") ||
-	    !strcmp(method, "DELETE"));
+	return (a->is_ssl == b->is_ssl &&
+	    a->lsa.u.sin.sin_addr.s_addr == b->lsa.u.sin.sin_addr.s_addr &&
+	    a->lsa.u.sin.sin_port == b->lsa.u.sin.sin_port);
 }
 
 /*
- * Parse HTTP request, fill in mg_request_info structure.
+ * Check whether full request is buffered. Return:
+ *   -1         if request is malformed
+ *    0         if request is not yet fully buffered
+ *   >0         actual request length, including last \r\n\r\n
  */
-static bool_t
-parse_http_request(char *buf, struct mg_request_info *ri, const struct usa *usa)
+static int
+get_request_len(const char *buf, size_t buflen)
 {
-	int	success_code = FALSE;
-
-	ri->request_method = skip(&buf, " ");
-	ri->uri = skip(&buf, " ");
-	ri->http_version = skip(&buf, "\r\n");
+	const char	*s, *e;
+	int		len = 0;
 
-	if (is_valid_http_method(ri->request_method) &&
-	    ri->uri[0] == '/' &&
-	    strncmp(ri->http_version, "HTTP/", 5) == 0) {
-		ri->http_version += 5;   /* Skip "HTTP/" */
-		parse_http_headers(&buf, ri);
-		ri->remote_port = ntohs(usa->u.sin.sin_port);
-		(void) memcpy(&ri->remote_ip, &usa->u.sin.sin_addr.s_addr, 4);
-		ri->remote_ip = ntohl(ri->remote_ip);
-		success_code = TRUE;
-	}
+	for (s = buf, e = s + buflen - 1; len <= 0 && s < e; s++)
+		/* Control characters are not allowed but >=128 is. */
+		if (!isprint(* (unsigned char *) s) && *s != '\r' &&
+		    *s != '\n' && * (unsigned char *) s < 128)
+			len = -1;
+		else if (s[0] == '\n' && s[1] == '\n')
+			len = (int) (s - buf) + 2;
+		else if (s[0] == '\n' && &s[1] < e &&
+		    s[1] == '\r' && s[2] == '\n')
+			len = (int) (s - buf) + 3;
 
-	return (success_code);
+	return (len);
 }
 
 /*
- * Keep reading the input (either opened file descriptor fd, or socket sock,
- * or SSL descriptor ssl) into buffer buf, until \r\n\r\n appears in the
- * buffer (which marks the end of HTTP request). Buffer buf may already
- * have some data. The length of the data is stored in nread.
- * Upon every read operation, increase nread by the number of bytes read.
+ * Convert month to the month number. Return -1 on error, or month number
  */
 static int
-read_request(FILE *fp, SOCKET sock, SSL *ssl, char *buf, int bufsiz, int *nread)
+montoi(const char *s)
 {
-	int	n, request_len;
+	size_t	i;
 
-	request_len = 0;
-	while (*nread < bufsiz && request_len == 0) {
-		n = pull(fp, sock, ssl, buf + *nread, bufsiz - *nread);
-		if (n <= 0) {
-			break;
-		} else {
-			*nread += n;
-			request_len = get_request_len(buf, (size_t) *nread);
-		}
-	}
+	for (i = 0; i < sizeof(month_names) / sizeof(month_names[0]); i++)
+		if (!strcmp(s, month_names[i]))
+			return ((int) i);
 
-	return (request_len);
+	return (-1);
 }
 
 /*
- * For given directory path, substitute it to valid index file.
- * Return 0 if index file has been found, -1 if not found.
- * If the file is found, it's stats is returned in stp.
+ * Parse date-time string, and return the corresponding time_t value
  */
-static bool_t
-substitute_index_file(struct mg_connection *conn,
-		char *path, size_t path_len, struct mgstat *stp)
+static time_t
+date_to_epoch(const char *s)
 {
-	const char	*list;
-	struct mgstat	st;
-	struct vec	filename_vec;
-	size_t		n;
-	bool_t		found;
-
-	n = strlen(path);
-
-	/*
-	 * The 'path' given to us points to the directory. Remove all trailing
-	 * directory separator characters from the end of the path, and
-	 * then append single directory separator character.
-	 */
-	while (n > 0 && IS_DIRSEP_CHAR(path[n - 1]))
-		n--;
-	path[n] = DIRSEP;
-
-	/*
-	 * Traverse index files list. For each entry, append it to the given
-	 * path and see if the file exists. If it exists, break the loop
-	 */
-	lock_option(conn->ctx, OPT_INDEX_FILES);
-	list = conn->ctx->options[OPT_INDEX_FILES];
-	found = FALSE;
-
-	while ((list = next_option(list, &filename_vec, NULL)) != NULL) {
-
-		/* Ignore too long entries that may overflow path buffer */
-		if (filename_vec.len > path_len - n)
-			continue;
+	time_t		current_time;
+	struct tm	tm, *tmp;
+	char		mon[32];
+	int		sec, min, hour, mday, month, year;
 
-		/* Prepare full path to the index file  */
-		(void) mg_strlcpy(path + n + 1,
-		    filename_vec.ptr, filename_vec.len + 1);
+	(void) memset(&tm, 0, sizeof(tm));
+	sec = min = hour = mday = month = year = 0;
 
-		/* Does it exist ? */
-		if (mg_stat(path, &st) == 0) {
-			/* Yes it does, break the loop */
-			*stp = st;
-			found = TRUE;
-			break;
-		}
+	if (((sscanf(s, "%d/%3s/%d %d:%d:%d",
+	    &mday, mon, &year, &hour, &min, &sec) == 6) ||
+	    (sscanf(s, "%d %3s %d %d:%d:%d",
+	    &mday, mon, &year, &hour, &min, &sec) == 6) ||
+	    (sscanf(s, "%*3s, %d %3s %d %d:%d:%d",
+	    &mday, mon, &year, &hour, &min, &sec) == 6) ||
+	    (sscanf(s, "%d-%3s-%d %d:%d:%d",
+	    &mday, mon, &year, &hour, &min, &sec) == 6)) &&
+	    (month = montoi(mon)) != -1) {
+		tm.tm_mday	= mday;
+		tm.tm_mon	= month;
+		tm.tm_year	= year;
+		tm.tm_hour	= hour;
+		tm.tm_min	= min;
+		tm.tm_sec	= sec;
 	}
-	unlock_option(conn->ctx, OPT_INDEX_FILES);
 
-	/* If no index file exists, restore directory path */
-	if (found == FALSE)
-		path[n] = '\0';
+	if (tm.tm_year > 1900)
+		tm.tm_year -= 1900;
+	else if (tm.tm_year < 70)
+		tm.tm_year += 100;
 
-	return (found);
+	/* Set Daylight Saving Time field */
+	current_time = time(NULL);
+	tmp = localtime(&current_time);
+	tm.tm_isdst = tmp->tm_isdst;
+
+	return (mktime(&tm));
 }
 
+/*
+ * Protect against directory disclosure attack by removing '..',
+ * excessive '/' and '\' characters
+ */
 static void
-remove_callback(struct mg_context *ctx,
-		const char *uri_regex, int status_code, bool_t is_auth)
+remove_double_dots_and_double_slashes(char *s)
 {
-	struct callback	*cb;
-	int		i;
+	char	*p = s;
 
-	for (i = 0; i < ctx->num_callbacks; i++) {
-		cb = ctx->callbacks + i;
-		if ((uri_regex != NULL && cb->uri_regex != NULL &&
-		    ((is_auth && cb->is_auth) || (!is_auth && !cb->is_auth)) &&
-		    !strcmp(uri_regex, cb->uri_regex)) || (uri_regex == NULL &&
-		     (cb->status_code == 0 ||
-		      cb->status_code == status_code))) {
-			(void) memmove(cb, cb + 1,
-			    (char *) (ctx->callbacks + ctx->num_callbacks) -
-			    (char *) (cb + 1));
-			break;
+	while (*s != '\0') {
+		*p++ = *s++;
+		if (s[-1] == '/' || s[-1] == '\\') {
+			/* Skip all following slashes and backslashes */
+			while (*s == '/' || *s == '\\')
+				s++;
+
+			/* Skip all double-dots */
+			while (*s == '.' && s[1] == '.')
+				s += 2;
 		}
 	}
+	*p = '\0';
 }
 
-static void
-add_callback(struct mg_context *ctx, const char *uri_regex, int status_code,
-		mg_callback_t func, bool_t is_auth, void *user_data)
+/*
+ * Built-in mime types
+ */
+static const struct {
+	const char	*extension;
+	size_t		ext_len;
+	const char	*mime_type;
+	size_t		mime_type_len;
+} mime_types[] = {
+	{".html",	5,	"text/html",			9},
+	{".htm",	4,	"text/html",			9},
+	{".shtm",	5,	"text/html",			9},
+	{".shtml",	6,	"text/html",			9},
+	{".css",	4,	"text/css",			8},
+	{".js",		3,	"application/x-javascript",	24},
+	{".ico",	4,	"image/x-icon",			12},
+	{".gif",	4,	"image/gif",			9},
+	{".jpg",	4,	"image/jpeg",			10},
+	{".jpeg",	5,	"image/jpeg",			10},
+	{".png",	4,	"image/png",			9},
+	{".svg",	4,	"image/svg+xml",		13},
+	{".torrent",	8,	"application/x-bittorrent",	24},
+	{".wav",	4,	"audio/x-wav",			11},
+	{".mp3",	4,	"audio/x-mp3",			11},
+	{".mid",	4,	"audio/mid",			9},
+	{".m3u",	4,	"audio/x-mpegurl",		15},
+	{".ram",	4,	"audio/x-pn-realaudio",		20},
+	{".xml",	4,	"text/xml",			8},
+	{".xslt",	5,	"application/xml",		15},
+	{".ra",		3,	"audio/x-pn-realaudio",		20},
+	{".doc",	4,	"application/msword",		19},
+	{".exe",	4,	"application/octet-stream",	24},
+	{".zip",	4,	"application/x-zip-compressed",	28},
+	{".xls",	4,	"application/excel",		17},
+	{".tgz",	4,	"application/x-tar-gz",		20},
+	{".tar",	4,	"application/x-tar",		17},
+	{".gz",		3,	"application/x-gunzip",		20},
+	{".arj",	4,	"application/x-arj-compressed",	28},
+	{".rar",	4,	"application/x-arj-compressed",	28},
+	{".rtf",	4,	"application/rtf",		15},
+	{".pdf",	4,	"application/pdf",		15},
+	{".swf",	4,	"application/x-shockwave-flash",29},
+	{".mpg",	4,	"video/mpeg",			10},
+	{".mpeg",	5,	"video/mpeg",			10},
+	{".asf",	4,	"video/x-ms-asf",		14},
+	{".avi",	4,	"video/x-msvideo",		15},
+	{".bmp",	4,	"image/bmp",			9},
+	{NULL,		0,	NULL,				0}
+};
+
+/*
+ * Content codings of precompressed files, in order of preference
+ */
+static const struct encoding {
+	const char	*name;		/* Content-Encoding value	*/
+	const char	*ext;		/* Appended to the file name	*/
+} encodings[] = {
+	{"br",		".br"},
+	{"gzip",	".gz"},
+	{NULL,		NULL}
+};
+
+/*
+ * Look at the "path" extension and figure what mime type it has.
+ * Store mime type in the vector.
+ */
+static void
+get_mime_type(struct mg_context *ctx, const char *path, struct vec *vec)
+{
+	struct vec	ext_vec, mime_vec;
+	const char	*list, *ext;
+	size_t		i, path_len;
+
+	path_len = strlen(path);
+
+	/*
+	 * Scan user-defined mime types first, in case user wants to
+	 * override default mime types.
+	 */
+	lock_option(ctx, OPT_MIME_TYPES);
+	list = ctx->options[OPT_MIME_TYPES];
+	while ((list = next_option(list, &ext_vec, &mime_vec)) != NULL) {
+		/* ext now points to the path suffix */
+		ext = path + path_len - ext_vec.len;
+		if (mg_strncasecmp(ext, ext_vec.ptr, ext_vec.len) == 0) {
+			*vec = mime_vec;
+			unlock_option(ctx, OPT_MIME_TYPES);
+			return;
+		}
+	}
+	unlock_option(ctx, OPT_MIME_TYPES);
+
+	/* Now scan built-in mime types */
+	for (i = 0; mime_types[i].extension != NULL; i++) {
+		ext = path + (path_len - mime_types[i].ext_len);
+		if (path_len > mime_types[i].ext_len &&
+		    mg_strcasecmp(ext, mime_types[i].extension) == 0) {
+			vec->ptr = mime_types[i].mime_type;
+			vec->len = mime_types[i].mime_type_len;
+			return;
+		}
+	}
+
+	/* Nothing found. Fall back to text/plain */
+	vec->ptr = "text/plain";
+	vec->len = 10;
+}
+
+#ifndef HAVE_MD5
+typedef struct MD5Context {
+	uint32_t	buf[4];
+	uint32_t	bits[2];
+	unsigned char	in[64];
+} MD5_CTX;
+
+#if __BYTE_ORDER == 1234
+#define byteReverse(buf, len)	/* Nothing */
+#else
+/*
+ * Note: this code is harmless on little-endian machines.
+ */
+static void
+byteReverse(unsigned char *buf, unsigned longs)
+{
+	uint32_t t;
+	do {
+		t = (uint32_t) ((unsigned) buf[3] << 8 | buf[2]) << 16 |
+			((unsigned) buf[1] << 8 | buf[0]);
+		*(uint32_t *) buf = t;
+		buf += 4;
+	} while (--longs);
+}
+#endif /* __BYTE_ORDER */
+
+/* The four core functions - F1 is optimized somewhat */
+
+/* #define F1(x, y, z) (x & y | ~x & z) */
+#define F1(x, y, z) (z ^ (x & (y ^ z)))
+#define F2(x, y, z) F1(z, x, y)
+#define F3(x, y, z) (x ^ y ^ z)
+#define F4(x, y, z) (y ^ (x | ~z))
+
+/* This is the central step in the MD5 algorithm. */
+#define MD5STEP(f, w, x, y, z, data, s) \
+( w += f(x, y, z) + data,  w = w<<s | w>>(32-s),  w += x )
+
+/*
+ * Start MD5 accumulation.  Set bit count to 0 and buffer to mysterious
+ * initialization constants.
+ */
+static void
+MD5Init(MD5_CTX *ctx)
+{
+	ctx->buf[0] = 0x67452301;
+	ctx->buf[1] = 0xefcdab89;
+	ctx->buf[2] = 0x98badcfe;
+	ctx->buf[3] = 0x10325476;
+
+	ctx->bits[0] = 0;
+	ctx->bits[1] = 0;
+}
+
+/*
+ * The core of the MD5 algorithm, this alters an existing MD5 hash to
+ * reflect the addition of 16 longwords of new data.  MD5Update blocks
+ * the data and converts bytes into longwords for this routine.
+ */
+static void
+MD5Transform(uint32_t buf[4], uint32_t const in[16])
+{
+	register uint32_t a, b, c, d;
+
+	a = buf[0];
+	b = buf[1];
+	c = buf[2];
+	d = buf[3];
+
+	MD5STEP(F1, a, b, c, d, in[0] + 0xd76aa478, 7);
+	MD5STEP(F1, d, a, b, c, in[1] + 0xe8c7b756, 12);
+	MD5STEP(F1, c, d, a, b, in[2] + 0x242070db, 17);
+	MD5STEP(F1, b, c, d, a, in[3] + 0xc1bdceee, 22);
+	MD5STEP(F1, a, b, c, d, in[4] + 0xf57c0faf, 7);
+	MD5STEP(F1, d, a, b, c, in[5] + 0x4787c62a, 12);
+	MD5STEP(F1, c, d, a, b, in[6] + 0xa8304613, 17);
+	MD5STEP(F1, b, c, d, a, in[7] + 0xfd469501, 22);
+	MD5STEP(F1, a, b, c, d, in[8] + 0x698098d8, 7);
+	MD5STEP(F1, d, a, b, c, in[9] + 0x8b44f7af, 12);
+	MD5STEP(F1, c, d, a, b, in[10] + 0xffff5bb1, 17);
+	MD5STEP(F1, b, c, d, a, in[11] + 0x895cd7be, 22);
+	MD5STEP(F1, a, b, c, d, in[12] + 0x6b901122, 7);
+	MD5STEP(F1, d, a, b, c, in[13] + 0xfd987193, 12);
+	MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17);
+	MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22);
+
+	MD5STEP(F2, a, b, c, d, in[1] + 0xf61e2562, 5);
+	MD5STEP(F2, d, a, b, c, in[6] + 0xc040b340, 9);
+	MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14);
+	MD5STEP(F2, b, c, d, a, in[0] + 0xe9b6c7aa, 20);
+	MD5STEP(F2, a, b, c, d, in[5] + 0xd62f105d, 5);
+	MD5STEP(F2, d, a, b, c, in[10] + 0x02441453, 9);
+	MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14);
+	MD5STEP(F2, b, c, d, a, in[4] + 0xe7d3fbc8, 20);
+	MD5STEP(F2, a, b, c, d, in[9] + 0x21e1cde6, 5);
+	MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6, 9);
+	MD5STEP(F2, c, d, a, b, in[3] + 0xf4d50d87, 14);
+	MD5STEP(F2, b, c, d, a, in[8] + 0x455a14ed, 20);
+	MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905, 5);
+	MD5STEP(F2, d, a, b, c, in[2] + 0xfcefa3f8, 9);
+	MD5STEP(F2, c, d, a, b, in[7] + 0x676f02d9, 14);
+	MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20);
+
+	MD5STEP(F3, a, b, c, d, in[5] + 0xfffa3942, 4);
+	MD5STEP(F3, d, a, b, c, in[8] + 0x8771f681, 11);
+	MD5STEP(F3, c, d, a, b, in[11] + 0x6d9d6122, 16);
+	MD5STEP(F3, b, c, d, a, in[14] + 0xfde5380c, 23);
+	MD5STEP(F3, a, b, c, d, in[1] + 0xa4beea44, 4);
+	MD5STEP(F3, d, a, b, c, in[4] + 0x4bdecfa9, 11);
+	MD5STEP(F3, c, d, a, b, in[7] + 0xf6bb4b60, 16);
+	MD5STEP(F3, b, c, d, a, in[10] + 0xbebfbc70, 23);
+	MD5STEP(F3, a, b, c, d, in[13] + 0x289b7ec6, 4);
+	MD5STEP(F3, d, a, b, c, in[0] + 0xeaa127fa, 11);
+	MD5STEP(F3, c, d, a, b, in[3] + 0xd4ef3085, 16);
+	MD5STEP(F3, b, c, d, a, in[6] + 0x04881d05, 23);
+	MD5STEP(F3, a, b, c, d, in[9] + 0xd9d4d039, 4);
+	MD5STEP(F3, d, a, b, c, in[12] + 0xe6db99e5, 11);
+	MD5STEP(F3, c, d, a, b, in[15] + 0x1fa27cf8, 16);
+	MD5STEP(F3, b, c, d, a, in[2] + 0xc4ac5665, 23);
+
+	MD5STEP(F4, a, b, c, d, in[0] + 0xf4292244, 6);
+	MD5STEP(F4, d, a, b, c, in[7] + 0x432aff97, 10);
+	MD5STEP(F4, c, d, a, b, in[14] + 0xab9423a7, 15);
+	MD5STEP(F4, b, c, d, a, in[5] + 0xfc93a039, 21);
+	MD5STEP(F4, a, b, c, d, in[12] + 0x655b59c3, 6);
+	MD5STEP(F4, d, a, b, c, in[3] + 0x8f0ccc92, 10);
+	MD5STEP(F4, c, d, a, b, in[10] + 0xffeff47d, 15);
+	MD5STEP(F4, b, c, d, a, in[1] + 0x85845dd1, 21);
+	MD5STEP(F4, a, b, c, d, in[8] + 0x6fa87e4f, 6);
+	MD5STEP(F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10);
+	MD5STEP(F4, c, d, a, b, in[6] + 0xa3014314, 15);
+	MD5STEP(F4, b, c, d, a, in[13] + 0x4e0811a1, 21);
+	MD5STEP(F4, a, b, c, d, in[4] + 0xf7537e82, 6);
+	MD5STEP(F4, d, a, b, c, in[11] + 0xbd3af235, 10);
+	MD5STEP(F4, c, d, a, b, in[2] + 0x2ad7d2bb, 15);
+	MD5STEP(F4, b, c, d, a, in[9] + 0xeb86d391, 21);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+
+/*
+ * Update context to reflect the concatenation of another buffer full
+ * of bytes.
+ */
+static void
+MD5Update(MD5_CTX *ctx, unsigned char const *buf, unsigned len)
+{
+	uint32_t t;
+
+	/* Update bitcount */
+
+	t = ctx->bits[0];
+	if ((ctx->bits[0] = t + ((uint32_t) len << 3)) < t)
+		ctx->bits[1]++;		/* Carry from low to high */
+	ctx->bits[1] += len >> 29;
+
+	t = (t >> 3) & 0x3f;	/* Bytes already in shsInfo->data */
+
+	/* Handle any leading odd-sized chunks */
+
+	if (t) {
+		unsigned char *p = (unsigned char *) ctx->in + t;
+
+		t = 64 - t;
+		if (len < t) {
+			memcpy(p, buf, len);
+			return;
+		}
+		memcpy(p, buf, t);
+		byteReverse(ctx->in, 16);
+		MD5Transform(ctx->buf, (uint32_t *) ctx->in);
+		buf += t;
+		len -= t;
+	}
+	/* Process data in 64-byte chunks */
+
+	while (len >= 64) {
+		memcpy(ctx->in, buf, 64);
+		byteReverse(ctx->in, 16);
+		MD5Transform(ctx->buf, (uint32_t *) ctx->in);
+		buf += 64;
+		len -= 64;
+	}
+
+	/* Handle any remaining bytes of data. */
+
+	memcpy(ctx->in, buf, len);
+}
+
+/*
+ * Final wrapup - pad to 64-byte boundary with the bit pattern
+ * 1 0* (64-bit count of bits processed, MSB-first)
+ */
+static void
+MD5Final(unsigned char digest[16], MD5_CTX *ctx)
+{
+	unsigned count;
+	unsigned char *p;
+
+	/* Compute number of bytes mod 64 */
+	count = (ctx->bits[0] >> 3) & 0x3F;
+
+	/* Set the first char of padding to 0x80.  This is safe since there is
+	   always at least one byte free */
+	p = ctx->in + count;
+	*p++ = 0x80;
+
+	/* Bytes of padding needed to make 64 bytes */
+	count = 64 - 1 - count;
+
+	/* Pad out to 56 mod 64 */
+	if (count < 8) {
+		/* Two lots of padding:  Pad the first block to 64 bytes */
+		memset(p, 0, count);
+		byteReverse(ctx->in, 16);
+		MD5Transform(ctx->buf, (uint32_t *) ctx->in);
+
+		/* Now fill the next block with 56 bytes */
+		memset(ctx->in, 0, 56);
+	} else {
+		/* Pad block to 56 bytes */
+		memset(p, 0, count - 8);
+	}
+	byteReverse(ctx->in, 14);
+
+	/* Append length in bits and transform */
+	((uint32_t *) ctx->in)[14] = ctx->bits[0];
+	((uint32_t *) ctx->in)[15] = ctx->bits[1];
+
+	MD5Transform(ctx->buf, (uint32_t *) ctx->in);
+	byteReverse((unsigned char *) ctx->buf, 4);
+	memcpy(digest, ctx->buf, 16);
+	memset((char *) ctx, 0, sizeof(ctx));	/* In case it's sensitive */
+}
+#endif /* !HAVE_MD5 */
+
+/*
+ * Stringify binary data. Output buffer must be twice as big as input,
+ * because each byte takes 2 bytes in string representation
+ */
+static void
+bin2str(char *to, const unsigned char *p, size_t len)
+{
+	static const char *hex = "0123456789abcdef";
+
+	for (; len--; p++) {
+		*to++ = hex[p[0] >> 4];
+		*to++ = hex[p[0] & 0x0f];
+	}
+	*to = '\0';
+}
+
+/*
+ * Return stringified MD5 hash for list of vectors.
+ * buf must point to 33-bytes long buffer
+ */
+static void
+mg_md5(char *buf, ...)
+{
+	unsigned char	hash[16];
+	const char	*p;
+	va_list		ap;
+	MD5_CTX		ctx;
+
+	MD5Init(&ctx);
+
+	va_start(ap, buf);
+	while ((p = va_arg(ap, const char *)) != NULL)
+		MD5Update(&ctx, (unsigned char *) p, (int) strlen(p));
+	va_end(ap);
+
+	MD5Final(hash, &ctx);
+	bin2str(buf, hash, sizeof(hash));
+}
+
+/*
+ * Check the user's password, return 1 if OK
+ */
+static bool_t
+check_password(const char *method, const char *ha1, const char *uri,
+		const char *nonce, const char *nc, const char *cnonce,
+		const char *qop, const char *response)
+{
+	char	ha2[32 + 1], expected_response[32 + 1];
+
+	/* XXX  Due to a bug in MSIE, we do not compare the URI	 */
+	/* Also, we do not check for authentication timeout */
+	if (/*strcmp(dig->uri, c->ouri) != 0 || */
+	    strlen(response) != 32 /*||
+	    now - strtoul(dig->nonce, NULL, 10) > 3600 */)
+		return (FALSE);
+
+	mg_md5(ha2, method, ":", uri, NULL);
+	mg_md5(expected_response, ha1, ":", nonce, ":", nc,
+	    ":", cnonce, ":", qop, ":", ha2, NULL);
+
+	return (!mg_strcasecmp(response, expected_response));
+}
+
+/*
+ * Use the global passwords file, if specified by auth_gpass option,
+ * or search for .htpasswd in the requested directory.
+ */
+static FILE *
+open_auth_file(struct mg_connection *conn, const char *path)
+{
+	struct mg_context	*ctx = conn->ctx;
+	char 			name[FILENAME_MAX];
+	const char		*p, *e;
+	struct mgstat		st;
+	FILE			*fp;
+
+	if (ctx->options[OPT_AUTH_GPASSWD] != NULL) {
+		/* Use global passwords file */
+		fp =  mg_fopen(ctx->options[OPT_AUTH_GPASSWD], "r");
+		if (fp == NULL)
+			cry(fc(ctx), "fopen(%s): %s",
+			    ctx->options[OPT_AUTH_GPASSWD], strerror(ERRNO));
+	} else if (!mg_stat(path, &st) && st.is_directory) {
+		(void) mg_snprintf(conn, name, sizeof(name), "%s%c%s",
+		    path, DIRSEP, PASSWORDS_FILE_NAME);
+		fp = mg_fopen(name, "r");
+	} else {
+		/*
+		 * Try to find .htpasswd in requested directory.
+		 * Given the path, create the path to .htpasswd file
+		 * in the same directory. Find the right-most
+		 * directory separator character first. That would be the
+		 * directory name. If directory separator character is not
+		 * found, 'e' will point to 'p'.
+		 */
+		for (p = path, e = p + strlen(p) - 1; e > p; e--)
+			if (IS_DIRSEP_CHAR(*e))
+				break;
+
+		/*
+		 * Make up the path by concatenating directory name and
+		 * .htpasswd file name.
+		 */
+		(void) mg_snprintf(conn, name, sizeof(name), "%.*s%c%s",
+		    (int) (e - p), p, DIRSEP, PASSWORDS_FILE_NAME);
+		fp = mg_fopen(name, "r");
+	}
+
+	return (fp);
+}
+
+/*
+ * Parsed Authorization: header
+ */
+struct ah {
+	char	*user, *uri, *cnonce, *response, *qop, *nc, *nonce;
+};
+
+static bool_t
+parse_auth_header(struct mg_connection *conn, char *buf, size_t buf_size,
+		struct ah *ah)
+{
+	char		*name, *value, *s;
+	const char	*auth_header;
+
+	if ((auth_header = mg_get_header(conn, "Authorization")) == NULL ||
+	    mg_strncasecmp(auth_header, "Digest ", 7) != 0)
+		return (FALSE);
+
+	/* Make modifiable copy of the auth header */
+	(void) mg_strlcpy(buf, auth_header + 7, buf_size);
+
+	s = buf;
+	(void) memset(ah, 0, sizeof(*ah));
+
+	/* Gobble initial spaces */
+	while (isspace(* (unsigned char *) s))
+		s++;
+
+	/* Parse authorization header */
+	for (;;) {
+		name = skip(&s, "=");
+		value = skip(&s, ", ");
+
+		if (*value == '"') {
+			value++;
+			value[strlen(value) - 1] = '\0';
+		} else if (*value == '\0') {
+			break;
+		}
+
+		if (!strcmp(name, "username")) {
+			ah->user = value;
+		} else if (!strcmp(name, "cnonce")) {
+			ah->cnonce = value;
+		} else if (!strcmp(name, "response")) {
+			ah->response = value;
+		} else if (!strcmp(name, "uri")) {
+			ah->uri = value;
+		} else if (!strcmp(name, "qop")) {
+			ah->qop = value;
+		} else if (!strcmp(name, "nc")) {
+			ah->nc = value;
+		} else if (!strcmp(name, "nonce")) {
+			ah->nonce = value;
+		}
+	}
+
+	/* CGI needs it as REMOTE_USER */
+	if (ah->user != NULL)
+		conn->request_info.remote_user = mg_strdup(ah->user);
+
+	return (TRUE);
+}
+
+/*
+ * Authorize against the opened passwords file. Return 1 if authorized.
+ */
+static bool_t
+authorize(struct mg_connection *conn, FILE *fp)
+{
+	struct ah	ah;
+	char		line[256], f_user[256], domain[256], ha1[256],
+			buf[MAX_REQUEST_SIZE];
+
+	if (!parse_auth_header(conn, buf, sizeof(buf), &ah))
+		return (FALSE);
+
+	/* Loop over passwords file */
+	while (fgets(line, sizeof(line), fp) != NULL) {
+
+		if (sscanf(line, "%[^:]:%[^:]:%s", f_user, domain, ha1) != 3)
+			continue;
+
+		if (!strcmp(ah.user, f_user) &&
+		    !strcmp(domain, conn->ctx->options[OPT_AUTH_DOMAIN]))
+			return (check_password(
+			    conn->request_info.request_method, ha1,
+			    ah.uri, ah.nonce, ah.nc, ah.cnonce,
+			    ah.qop, ah.response));
+	}
+
+	return (FALSE);
+}
+
+/*
+ * Return TRUE if request is authorised, FALSE otherwise.
+ */
+static bool_t
+check_authorization(struct mg_connection *conn, const char *path,
+		bool_t *is_protected)
+{
+	FILE		*fp;
+	char		fname[FILENAME_MAX];
+	struct vec	uri_vec, filename_vec;
+	const char	*list;
+	bool_t		authorized;
+
+	fp = NULL;
+	authorized = TRUE;
+
+	lock_option(conn->ctx, OPT_PROTECT);
+	list = conn->ctx->options[OPT_PROTECT];
+	while ((list = next_option(list, &uri_vec, &filename_vec)) != NULL) {
+		if (!memcmp(conn->request_info.uri, uri_vec.ptr, uri_vec.len)) {
+			(void) mg_snprintf(conn, fname, sizeof(fname), "%.*s",
+			    filename_vec.len, filename_vec.ptr);
+			if ((fp = mg_fopen(fname, "r")) == NULL)
+				cry(conn, "%s: cannot open %s: %s",
+				    __func__, fname, strerror(errno));
+			break;
+		}
+	}
+	unlock_option(conn->ctx, OPT_PROTECT);
+
+	if (fp == NULL)
+		fp = open_auth_file(conn, path);
+
+	if ((*is_protected = fp != NULL) == TRUE) {
+		authorized = authorize(conn, fp);
+		(void) fclose(fp);
+	}
+
+	return (authorized);
+}
+
+static void
+send_authorization_request(struct mg_connection *conn)
+{
+	conn->request_info.status_code = 401;
+	(void) mg_printf(conn,
+	    "HTTP/1.1 401 Unauthorized\r\n"
+	    "Content-Length: 0\r\n"
+	    "Connection: %s\r\n"
+	    "WWW-Authenticate: Digest qop=\"auth\", "
+	    "realm=\"%s\", nonce=\"%lu\"\r\n\r\n",
+	    suggest_connection_header(conn),
+	    conn->ctx->options[OPT_AUTH_DOMAIN], (unsigned long) time(NULL));
+}
+
+static bool_t
+is_authorized_for_put(struct mg_connection *conn)
+{
+	FILE	*fp;
+	int	ret = FALSE;
+
+	if ((fp = mg_fopen(conn->ctx->options[OPT_AUTH_PUT], "r")) != NULL) {
+		set_close_on_exec(fileno(fp));
+		ret = authorize(conn, fp);
+		(void) fclose(fp);
+	}
+
+	return (ret);
+}
+
+int
+mg_modify_passwords_file(struct mg_context *ctx, const char *fname,
+		const char *user, const char *pass)
+{
+	int		found;
+	char		line[512], u[512], d[512], ha1[33], tmp[FILENAME_MAX];
+	const char	*domain;
+	FILE		*fp, *fp2;
+
+	found = 0;
+	fp = fp2 = NULL;
+	domain = ctx->options[OPT_AUTH_DOMAIN];
+
+	/* Regard empty password as no password - remove user record. */
+	if (pass[0] == '\0')
+		pass = NULL;
+
+	(void) snprintf(tmp, sizeof(tmp), "%s.tmp", fname);
+
+	/* Create the file if does not exist */
+	if ((fp = mg_fopen(fname, "a+")) != NULL)
+		(void) fclose(fp);
+
+	/* Open the given file and temporary file */
+	if ((fp = mg_fopen(fname, "r")) == NULL) {
+		cry(fc(ctx), "Cannot open %s: %s", fname, strerror(errno));
+		return (0);
+	} else if ((fp2 = mg_fopen(tmp, "w+")) == NULL) {
+		cry(fc(ctx), "Cannot open %s: %s", tmp, strerror(errno));
+		return (0);
+	}
+
+	/* Copy the stuff to temporary file */
+	while (fgets(line, sizeof(line), fp) != NULL) {
+
+		if (sscanf(line, "%[^:]:%[^:]:%*s", u, d) != 2)
+			continue;
+
+		if (!strcmp(u, user) && !strcmp(d, domain)) {
+			found++;
+			if (pass != NULL) {
+				mg_md5(ha1, user, ":", domain, ":", pass, NULL);
+				fprintf(fp2, "%s:%s:%s\n", user, domain, ha1);
+			}
+		} else {
+			(void) fprintf(fp2, "%s", line);
+		}
+	}
+
+	/* If new user, just add it */
+	if (!found && pass != NULL) {
+		mg_md5(ha1, user, ":", domain, ":", pass, NULL);
+		(void) fprintf(fp2, "%s:%s:%s\n", user, domain, ha1);
+	}
+
+	/* Close files */
+	(void) fclose(fp);
+	(void) fclose(fp2);
+
+	/* Put the temp file in place of real file */
+	(void) mg_remove(fname);
+	(void) mg_rename(tmp, fname);
+
+	return (0);
+}
+
+struct de {
+	struct mg_connection	*conn;
+	char			*file_name;
+	struct mgstat		st;
+};
+
+static void
+url_encode(const char *src, char *dst, size_t dst_len)
+{
+	const char	*dont_escape = "._-$,;~()";
+	const char	*hex = "0123456789abcdef";
+	const char	*end = dst + dst_len - 1;
+	
+	for (; *src != '\0' && dst < end; src++, dst++) {
+		if (isalnum(*(unsigned char *) src) ||
+		    strchr(dont_escape, * (unsigned char *) src) != NULL) {
+			*dst = *src;
+		} else if (dst + 2 < end) {
+			dst[0] = '%';
+			dst[1] = hex[(* (unsigned char *) src) >> 4];
+			dst[2] = hex[(* (unsigned char *) src) & 0xf];
+			dst += 2;
+		}
+	}
+
+	*dst = '\0';
+}
+
+/*
+ * This function is called from send_directory() and prints out
+ * single directory entry.
+ */
+static void
+print_dir_entry(struct de *de)
+{
+	char		size[64], mod[64], href[FILENAME_MAX];
+
+	if (de->st.is_directory) {
+		(void) mg_snprintf(de->conn,
+		    size, sizeof(size), "%s", "[DIRECTORY]");
+	} else {
+		/*
+		 * We use (signed) cast below because MSVC 6 compiler cannot
+		 * convert unsigned __int64 to double. Sigh.
+		 */
+		if (de->st.size < 1024)
+			(void) mg_snprintf(de->conn, size, sizeof(size),
+			    "%lu", (unsigned long) de->st.size);
+		else if (de->st.size < 1024 * 1024)
+			(void) mg_snprintf(de->conn, size, sizeof(size),
+			    "%.1fk", (double) de->st.size / 1024.0);
+		else if (de->st.size < 1024 * 1024 * 1024)
+			(void) mg_snprintf(de->conn, size, sizeof(size),
+			    "%.1fM", (double) de->st.size / 1048576);
+		else
+			(void) mg_snprintf(de->conn, size, sizeof(size),
+			  "%.1fG", (double) de->st.size / 1073741824);
+	}
+	(void) strftime(mod, sizeof(mod), "%d-%b-%Y %H:%M",
+		localtime(&de->st.mtime));
+
+	url_encode(de->file_name, href, sizeof(href));
+
+	de->conn->num_bytes_sent += mg_printf(de->conn,
+	    "<tr><td><a href=\"%s%s%s\">%s%s</a></td>"
+	    "<td>&nbsp;%s</td><td>&nbsp;&nbsp;%s</td></tr>\n",
+	    de->conn->request_info.uri, href, de->st.is_directory ? "/" : "",
+	    de->file_name, de->st.is_directory ? "/" : "", mod, size);
+}
+
+/*
+ * This function is called from send_directory() and used for
+ * sorting direcotory entries by size, or name, or modification time.
+ */
+static int
+compare_dir_entries(const void *p1, const void *p2)
+{
+	const struct de	*a = (struct de *) p1, *b = (struct de *) p2;
+	const char	*query_string = a->conn->request_info.query_string;
+	int		cmp_result = 0;
+
+	if (query_string == NULL)
+		query_string = "na";
+
+	if (a->st.is_directory && !b->st.is_directory) {
+		return (-1);  /* Always put directories on top */
+	} else if (!a->st.is_directory && b->st.is_directory) {
+		return (1);   /* Always put directories on top */
+	} else if (*query_string == 'n') {
+		cmp_result = strcmp(a->file_name, b->file_name);
+	} else if (*query_string == 's') {
+		cmp_result = a->st.size == b->st.size ? 0 :
+			a->st.size > b->st.size ? 1 : -1;
+	} else if (*query_string == 'd') {
+		cmp_result = a->st.mtime == b->st.mtime ? 0 :
+			a->st.mtime > b->st.mtime ? 1 : -1;
+	}
+
+	return (query_string[1] == 'd' ? -cmp_result : cmp_result);
+}
+
+/*
+ * Send directory contents.
+ */
+static void
+send_directory(struct mg_connection *conn, const char *dir)
+{
+	struct dirent	*dp;
+	DIR		*dirp;
+	struct de	*entries = NULL;
+	char		path[FILENAME_MAX];
+	int		i, sort_direction, num_entries = 0, arr_size = 128;
+
+	if ((dirp = opendir(dir)) == NULL) {
+		send_error(conn, 500, "Cannot open directory",
+		    "Error: opendir(%s): %s", path, strerror(ERRNO));
+		return;
+	}
+
+	(void) mg_printf(conn,
+	    "HTTP/1.1 200 OK\r\n"
+	    "%s"
+	    "Content-Type: text/html; charset=utf-8\r\n\r\n",
+	    unknown_length_headers(conn));
+
+	sort_direction = conn->request_info.query_string != NULL &&
+	    conn->request_info.query_string[1] == 'd' ? 'a' : 'd';
+
+	while ((dp = readdir(dirp)) != NULL) {
+
+		/* Do not show current dir and passwords file */
+		if (!strcmp(dp->d_name, ".") ||
+		    !strcmp(dp->d_name, "..") ||
+		    !strcmp(dp->d_name, PASSWORDS_FILE_NAME))
+			continue;
+
+		if (entries == NULL || num_entries >= arr_size) {
+			arr_size *= 2;
+			entries = (struct de *) realloc(entries,
+			    arr_size * sizeof(entries[0]));
+		}
+
+		if (entries == NULL) {
+			send_error(conn, 500, "Cannot open directory",
+			    "%s", "Error: cannot allocate memory");
+			return;
+		}
+
+		(void) mg_snprintf(conn, path, sizeof(path), "%s%c%s",
+		    dir, DIRSEP, dp->d_name);
+
+		/*
+		 * If we don't memset stat structure to zero, mtime will have
+		 * garbage and strftime() will segfault later on in
+		 * print_dir_entry(). memset is required only if mg_stat()
+		 * fails. For more details, see
+		 * http://code.google.com/p/mongoose/issues/detail?id=79
+		 */
+		if (mg_stat(path, &entries[num_entries].st) != 0)
+			(void) memset(&entries[num_entries].st, 0,
+			    sizeof(entries[num_entries].st));
+
+		entries[num_entries].conn = conn;
+		entries[num_entries].file_name = mg_strdup(dp->d_name);
+		num_entries++;
+	}
+	(void) closedir(dirp);
+
+	conn->num_bytes_sent += mg_printf(conn,
+	    "<html><head><title>Index of %s</title>"
+	    "<style>th {text-align: left;}</style></head>"
+	    "<body><h1>Index of %s</h1><pre><table cellpadding=\"0\">"
+	    "<tr><th><a href=\"?n%c\">Name</a></th>"
+	    "<th><a href=\"?d%c\">Modified</a></th>"
+	    "<th><a href=\"?s%c\">Size</a></th></tr>"
+	    "<tr><td colspan=\"3\"><hr></td></tr>",
+	    conn->request_info.uri, conn->request_info.uri,
+	    sort_direction, sort_direction, sort_direction);
+
+	/* Print first entry - link to a parent directory */
+	conn->num_bytes_sent += mg_printf(conn,
+	    "<tr><td><a href=\"%s%s\">%s</a></td>"
+	    "<td>&nbsp;%s</td><td>&nbsp;&nbsp;%s</td></tr>\n",
+	    conn->request_info.uri, "..", "Parent directory", "-", "-");
+
+	/* Sort and print directory entries */
+	qsort(entries, num_entries, sizeof(entries[0]), compare_dir_entries);
+	for (i = 0; i < num_entries; i++) {
+		print_dir_entry(&entries[i]);
+		free(entries[i].file_name);
+	}
+	free(entries);
+
+	conn->num_bytes_sent += mg_printf(conn, "%s", "</table></body></html>");
+	conn->request_info.status_code = 200;
+}
+
+/*
+ * Send len bytes from the opened file to the client.
+ */
+#if defined(USE_IO_URING)
+static void
+uring_free(struct uring *u)
+{
+	if (u->sqes != NULL)
+		(void) munmap(u->sqes, u->num_sqes * sizeof(u->sqes[0]));
+	if (u->cq_ptr != NULL && u->cq_ptr != u->sq_ptr)
+		(void) munmap(u->cq_ptr, u->cq_len);
+	if (u->sq_ptr != NULL)
+		(void) munmap(u->sq_ptr, u->sq_len);
+	(void) close(u->fd);
+	if (u->bufs != NULL)
+		free(u->bufs);
+	free(u);
+}
+
+static void *
+uring_map(int fd, size_t len, off_t offset)
+{
+	void	*p;
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, offset);
+
+	return (p == MAP_FAILED ? NULL : p);
+}
+
+/*
+ * Check that the kernel knows the opcodes uring_queue_chunk() submits.
+ * io_uring_setup() alone succeeds on kernels that would fail them later.
+ */
+static bool_t
+uring_has_ops(const struct uring *u)
+{
+	struct io_uring_probe	*probe;
+	int			read_op = u->is_fixed ?
+				    IORING_OP_READ_FIXED : IORING_OP_READ;
+	bool_t			ok;
+
+	probe = (struct io_uring_probe *) calloc(1,
+	    sizeof(*probe) + 256 * sizeof(probe->ops[0]));
+	if (probe == NULL)
+		return (FALSE);
+
+#define	HAS_OP(p, op)	((op) <= (p)->last_op && \
+			    ((p)->ops[(op)].flags & IO_URING_OP_SUPPORTED))
+	ok = syscall(__NR_io_uring_register, u->fd,
+	    IORING_REGISTER_PROBE, probe, 256) == 0 &&
+	    HAS_OP(probe, read_op) && HAS_OP(probe, IORING_OP_SEND);
+#undef HAS_OP
+
+	free(probe);
+
+	return (ok);
+}
+
+/*
+ * Set up io_uring and register the buffers. Return NULL if the kernel
+ * does not support io_uring, or does not allow to use it.
+ */
+static struct uring *
+uring_new(void)
+{
+	struct io_uring_params	p;
+	struct iovec		iov[URING_BUFS];
+	struct uring		*u;
+	char			*sq, *cq;
+	int			i;
+
+	if ((u = (struct uring *) calloc(1, sizeof(*u))) == NULL)
+		return (NULL);
+
+	(void) memset(&p, 0, sizeof(p));
+	if ((u->fd = (int) syscall(__NR_io_uring_setup,
+	    2 * URING_BUFS, &p)) < 0) {
+		free(u);
+		return (NULL);
+	}
+
+	u->num_sqes = p.sq_entries;
+	u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(u->cqes[0]);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_len > u->sq_len)
+			u->sq_len = u->cq_len;
+		u->sq_ptr = u->cq_ptr = uring_map(u->fd, u->sq_len,
+		    IORING_OFF_SQ_RING);
+	} else {
+		u->sq_ptr = uring_map(u->fd, u->sq_len, IORING_OFF_SQ_RING);
+		u->cq_ptr = uring_map(u->fd, u->cq_len, IORING_OFF_CQ_RING);
+	}
+	u->sqes = (struct io_uring_sqe *) uring_map(u->fd,
+	    u->num_sqes * sizeof(u->sqes[0]), IORING_OFF_SQES);
+	u->bufs = (char *) malloc(URING_BUFS * URING_BUF_SIZE);
+
+	if (u->sq_ptr == NULL || u->cq_ptr == NULL || u->sqes == NULL ||
+	    u->bufs == NULL) {
+		uring_free(u);
+		return (NULL);
+	}
+
+	sq = (char *) u->sq_ptr;
+	cq = (char *) u->cq_ptr;
+	u->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+	u->sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned int *) (sq + p.sq_off.array);
+	u->cq_head = (unsigned int *) (cq + p.cq_off.head);
+	u->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+	u->cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	u->tail = *u->sq_tail;
+
+	/* Registered buffers save page pinning on every read. Not fatal */
+	for (i = 0; i < URING_BUFS; i++) {
+		iov[i].iov_base = u->bufs + i * URING_BUF_SIZE;
+		iov[i].iov_len = URING_BUF_SIZE;
+	}
+	u->is_fixed = syscall(__NR_io_uring_register, u->fd,
+	    IORING_REGISTER_BUFFERS, iov, URING_BUFS) == 0;
+
+	if (!uring_has_ops(u)) {
+		uring_free(u);
+		errno = EOPNOTSUPP;
+		return (NULL);
+	}
+
+	return (u);
+}
+
+static struct io_uring_sqe *
+uring_next_sqe(struct uring *u)
+{
+	struct io_uring_sqe	*sqe;
+	unsigned int		idx = u->tail & *u->sq_mask;
+
+	sqe = &u->sqes[idx];
+	(void) memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[idx] = idx;
+	u->tail++;
+
+	return (sqe);
+}
+
+/*
+ * Queue reading of a file chunk into the given buffer, and sending it to
+ * the socket. All requests of a batch are linked, so that they are done
+ * in order, and a failure cancels the rest of the batch.
+ */
+static void
+uring_queue_chunk(struct uring *u, int fd, SOCKET sock, int buf_index,
+		int64_t offset, int len, bool_t is_last)
+{
+	struct io_uring_sqe	*sqe;
+	char			*buf = u->bufs + buf_index * URING_BUF_SIZE;
+
+	sqe = uring_next_sqe(u);
+	sqe->opcode = u->is_fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->fd = fd;
+	sqe->off = (uint64_t) offset;
+	sqe->addr = (uint64_t) (uintptr_t) buf;
+	sqe->len = (unsigned int) len;
+	sqe->buf_index = (uint16_t) buf_index;
+	sqe->user_data = 2 * buf_index;
+
+	sqe = uring_next_sqe(u);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->flags = is_last ? 0 : IOSQE_IO_LINK;
+	sqe->fd = sock;
+	sqe->addr = (uint64_t) (uintptr_t) buf;
+	sqe->len = (unsigned int) len;
+	sqe->msg_flags = MSG_WAITALL;
+	sqe->user_data = 2 * buf_index + 1;
+}
+
+/*
+ * Submit n queued requests and wait until all of them complete. Store
+ * their results in res. Return FALSE on io_uring failure.
+ */
+static bool_t
+uring_run(struct uring *u, unsigned int n, int *res)
+{
+	struct io_uring_cqe	*cqe;
+	unsigned int		head, submitted = 0, done = 0;
+	int			ret;
+
+	ATOMIC_STORE(u->sq_tail, u->tail);
+
+	while (done < n) {
+		ret = (int) syscall(__NR_io_uring_enter, u->fd, n - submitted,
+		    1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0 && ERRNO != EINTR)
+			return (FALSE);
+		else if (ret > 0)
+			submitted += ret;
+
+		for (head = *u->cq_head; head != ATOMIC_LOAD(u->cq_tail);
+		    head++, done++) {
+			cqe = &u->cqes[head & *u->cq_mask];
+			if (cqe->user_data < n)
+				res[cqe->user_data] = cqe->res;
+		}
+		ATOMIC_STORE(u->cq_head, head);
+	}
+
+	return (TRUE);
+}
+
+/*
+ * Send file contents with io_uring. Return FALSE if io_uring cannot be
+ * used for this response, or for the rest of it, so that the caller does
+ * it the regular way. *offsetp and *lenp then tell what is left to send.
+ */
+static bool_t
+uring_send_file(struct mg_connection *conn, int fd, int64_t *offsetp,
+		int64_t *lenp)
+{
+	struct mg_context	*ctx = conn->ctx;
+	struct worker		*w = conn->worker;
+	int			res[2 * URING_BUFS], lens[URING_BUFS];
+	int64_t			offset = *offsetp, len = *lenp;
+	int64_t			queued, sent;
+	int			i, n;
+	bool_t			ok, refused = FALSE;
+
+	/* Body must go to the socket as is, and headers must be done */
+	if (w == NULL || conn->ssl != NULL || conn->chunked ||
+	    conn->resp.no_body || conn->resp.state != RESP_BODY ||
+#if defined(USE_COROUTINES)
+	    current_coroutine != NULL ||	/* Would block the thread */
+#endif /* USE_COROUTINES */
+	    ATOMIC_LOAD(&ctx->no_io_uring) ||
+	    !is_true(ctx->options[OPT_IO_URING]))
+		return (FALSE);
+
+	if (w->uring == NULL && (w->uring = uring_new()) == NULL) {
+		DEBUG_TRACE((DEBUG_MGS_PREFIX "%s: io_uring: %s",
+		    __func__, strerror(ERRNO)));
+		ATOMIC_STORE(&ctx->no_io_uring, TRUE);
+		return (FALSE);
+	}
+
+	/* Headers may still sit in the output buffer */
+	if (!flush_output(conn, len > 0)) {
+		conn->keep_alive = FALSE;
+		return (TRUE);
+	}
+
+	for (ok = TRUE; ok && len > 0; len -= sent, offset += sent) {
+		for (n = 0, queued = 0; n < URING_BUFS && queued < len; n++) {
+			lens[n] = len - queued > URING_BUF_SIZE ?
+			    URING_BUF_SIZE : (int) (len - queued);
+			uring_queue_chunk(w->uring, fd,
+			    conn->client.sock, n, offset + queued, lens[n],
+			    n == URING_BUFS - 1 || queued + lens[n] == len);
+			queued += lens[n];
+		}
+
+		time_io(conn, IO_SEND);
+		if (!uring_run(w->uring, 2 * n, res)) {
+			done_io(conn, 0);
+			/* Leave the instance alone, the kernel may use it */
+			cry(conn, "%s: io_uring_enter: %s",
+			    __func__, strerror(ERRNO));
+			ATOMIC_STORE(&ctx->no_io_uring, TRUE);
+			conn->keep_alive = FALSE;
+			break;
+		}
+
+		for (i = 0, sent = 0; i < n && ok; i++) {
+			if (res[2 * i + 1] > 0)
+				sent += res[2 * i + 1];
+			ok = res[2 * i] == lens[i] && res[2 * i + 1] == lens[i];
+			refused = !ok && (URING_REFUSED(res[2 * i]) ||
+			    URING_REFUSED(res[2 * i + 1]));
+		}
+		done_io(conn, sent);
+		conn->num_bytes_sent += sent;
+		conn->resp.body_len += sent;
+	}
+
+	if (refused) {
+		/* The chunks before the refused one are out, hand the rest */
+		DEBUG_TRACE((DEBUG_MGS_PREFIX "%s: io_uring: opcode refused",
+		    __func__));
+		ATOMIC_STORE(&ctx->no_io_uring, TRUE);
+		*offsetp = offset;
+		*lenp = len;
+		return (FALSE);
+	}
+
+	if (!ok)
+		conn->keep_alive = FALSE;
+
+	return (TRUE);
+}
+#endif /* USE_IO_URING */
+
+#if defined(USE_SENDFILE)
+/*
+ * Send up to len bytes of the file, starting at offset, to the socket.
+ * Return number of bytes sent, or -1 on error.
+ */
+static int64_t
+sendfile_chunk(SOCKET sock, int fd, int64_t offset, int64_t len)
+{
+#if defined(__linux__)
+	off_t	off = (off_t) offset;
+
+	return ((int64_t) sendfile(sock, fd, &off, (size_t) len));
+#else
+	off_t	n = (off_t) len;
+
+	/* Interrupted calls may have sent something, too */
+	if (sendfile(fd, sock, (off_t) offset, &n, NULL, 0) != 0 && n == 0)
+		return (-1);
+
+	return ((int64_t) n);
+#endif /* __linux__ */
+}
+
+/*
+ * Send file contents with sendfile(), without copying them to user space.
+ * The file position is left alone. Return FALSE if sendfile() cannot be
+ * used for this file or connection, so that the caller copies the data.
+ */
+static bool_t
+sendfile_send_file(struct mg_connection *conn, int fd, int64_t offset,
+		int64_t len)
+{
+	SOCKET	sock = conn->client.sock;
+	int64_t	n, sent = 0;
+
+	/* Body must go to the socket as is, and headers must be done */
+	if (conn->ssl != NULL || conn->chunked || conn->resp.no_body ||
+	    conn->resp.state != RESP_BODY ||
+	    !is_true(conn->ctx->options[OPT_SENDFILE]))
+		return (FALSE);
+
+	/* Headers may still sit in the output buffer */
+	if (!flush_output(conn, len > 0)) {
+		conn->keep_alive = FALSE;
+		return (TRUE);
+	}
+
+	/*
+	 * Each chunk is timed on its own, so that send_timeout and
+	 * min_rate apply to it rather than to the whole file.
+	 */
+	while (len > 0) {
+		time_io(conn, IO_SEND);
+		n = sendfile_chunk(sock, fd, offset,
+		    len > SENDFILE_CHUNK_SIZE ? SENDFILE_CHUNK_SIZE : len);
+		done_io(conn, n > 0 ? n : 0);
+
+		if (n < 0 && should_retry_io(sock, EPOLLOUT)) {
+			continue;
+		} else if (n < 0 && sent == 0 && (ERRNO == EINVAL ||
+		    ERRNO == ENOSYS || ERRNO == ENOTSUP)) {
+			/* Not supported for this file, e.g. a pipe */
+			return (FALSE);
+		} else if (n < 0) {
+			conn->keep_alive = FALSE;
+			break;
+		} else if (n == 0) {
+			/* End of file */
+			break;
+		}
+
+		conn->num_bytes_sent += n;
+		conn->resp.body_len += n;
+		sent += n;
+		offset += n;
+		len -= n;
+	}
+
+	return (TRUE);
+}
+#endif /* USE_SENDFILE */
+
+static void
+send_opened_file_stream(struct mg_connection *conn, FILE *fp, int64_t len)
+{
+	char	buf[BUFSIZ];
+	int	to_read, num_read, num_written;
+#if defined(USE_SENDFILE) || defined(USE_IO_URING)
+	int64_t	offset = ftello(fp);	/* Pipes have none */
+#endif /* USE_SENDFILE || USE_IO_URING */
+
+#if defined(USE_SENDFILE)
+	if (offset >= 0 && sendfile_send_file(conn, fileno(fp), offset, len))
+		return;
+#endif /* USE_SENDFILE */
+
+#if defined(USE_IO_URING)
+	if (offset >= 0) {
+		if (uring_send_file(conn, fileno(fp), &offset, &len))
+			return;
+		/* Some of it may be sent already */
+		(void) fseeko(fp, offset, SEEK_SET);
+	}
+#endif /* USE_IO_URING */
+
+	while (len > 0) {
+		/* Calculate how much to read from the file in the buffer */
+		to_read = sizeof(buf);
+		if ((int64_t) to_read > len)
+			to_read = (int) len;
+
+		/* Read from file, exit the loop on error */
+		if ((num_read = fread(buf, 1, to_read, fp)) == 0)
+			break;
+
+		/* Send read bytes to the client, exit the loop on error */
+		if ((num_written = mg_write(conn, buf, num_read)) != num_read)
+			break;
+
+		/* Both read and were successful, adjust counters */
+		conn->num_bytes_sent += num_written;
+		len -= num_written;
+	}
+}
+
+/*
+ * Look at the Range: header. If it asks for a part of the file that
+ * exists, set 206 status, prepare Content-Range header, and return the
+ * offset and length of that part. Otherwise, the whole file is sent.
+ */
+static int64_t
+get_range(struct mg_connection *conn, int64_t size, int64_t *offset,
+		char *range, size_t range_len)
+{
+	const char	*hdr = mg_get_header(conn, "Range");
+	int64_t		r1 = 0, r2 = size - 1;
+	int		n;
+
+	conn->request_info.status_code = 200;
+	range[0] = '\0';
+	*offset = 0;
+
+	if (hdr == NULL || (n = sscanf(hdr,
+	    "bytes=%" INT64_FMT "-%" INT64_FMT, &r1, &r2)) < 1)
+		return (size);
+
+	/* "bytes=-N" asks for the last N bytes */
+	if (n == 1 && r1 < 0)
+		r1 = size + r1 < 0 ? 0 : size + r1;
+	if (n == 1 || r2 >= size)
+		r2 = size - 1;
+	if (r1 < 0 || r1 >= size || r2 < r1)
+		return (size);
+
+	conn->request_info.status_code = 206;
+	(void) mg_snprintf(conn, range, range_len,
+	    "Content-Range: bytes "
+	    "%" INT64_FMT "-%"
+	    INT64_FMT "/%" INT64_FMT "\r\n",
+	    r1, r2, size);
+	*offset = r1;
+
+	return (r2 - r1 + 1);
+}
+
+/*
+ * Return TRUE if both stats are of the same version of the same file.
+ */
+static bool_t
+same_file(const struct mgstat *a, const struct mgstat *b)
+{
+	return (a->size == b->size && a->mtime == b->mtime &&
+	    a->mtime_nsec == b->mtime_nsec && a->ctime == b->ctime &&
+	    a->ctime_nsec == b->ctime_nsec &&
+	    a->dev == b->dev && a->ino == b->ino);
+}
+
+/*
+ * Static file cache. An entry is good while the file keeps the same
+ * inode, size, modification and status change times, which
+ * analyze_request() has just looked up. Where inotify watches the
+ * directory, closing the file after a write also evicts it, since
+ * a rewrite within the same clock tick leaves the times as they were.
+ * Entries are reference counted, so that an entry that is evicted
+ * while being sent stays alive until the sender is done with it.
+ * Mapped files must be replaced with rename(), not rewritten in place:
+ * a sender touching a page past the new end of file would get SIGBUS.
+ */
+static unsigned int
+cache_hash(const char *path)
+{
+	unsigned int	h = 2166136261U;
+
+	/* FNV-1a */
+	while (*path != '\0')
+		h = (h ^ (unsigned char) *path++) * 16777619U;
+
+	return (h);
+}
+
+static struct cache_shard *
+cache_shard(struct mg_context *ctx, unsigned int hash)
+{
+	return (&ctx->cache[(hash / CACHE_BUCKETS) % CACHE_SHARDS]);
+}
+
+static void
+cache_unref(struct cache_entry *e)
+{
+	if (ATOMIC_ADD(&e->refs, -1) != 1)
+		return;
+#if !defined(_WIN32)
+	if (e->is_mapped)
+		(void) munmap(e->data, (size_t) e->size);
+#endif /* !_WIN32 */
+	free(e);
+}
+
+static void
+lru_remove(struct cache_shard *shard, struct cache_entry *e)
+{
+	if (e->lru_prev != NULL)
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		shard->lru_head = e->lru_next;
+	if (e->lru_next != NULL)
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		shard->lru_tail = e->lru_prev;
+}
+
+static void
+lru_push(struct cache_shard *shard, struct cache_entry *e)
+{
+	e->lru_prev = NULL;
+	e->lru_next = shard->lru_head;
+	if (shard->lru_head != NULL)
+		shard->lru_head->lru_prev = e;
+	else
+		shard->lru_tail = e;
+	shard->lru_head = e;
+}
+
+/*
+ * Remove the entry from the shard, and drop the reference the cache has.
+ * Called with the shard locked.
+ */
+static void
+cache_unlink(struct cache_shard *shard, struct cache_entry *e)
+{
+	struct cache_entry	**pp;
+
+	for (pp = &shard->buckets[e->hash % CACHE_BUCKETS]; *pp != e;
+	    pp = &(*pp)->next)
+		;
+	*pp = e->next;
+	lru_remove(shard, e);
+	ATOMIC_STORE(&shard->used, shard->used - e->size);
+	cache_unref(e);
+}
+
+/*
+ * Evict least recently used entries until there is room for more bytes.
+ */
+static void
+cache_trim(struct cache_shard *shard, int64_t room)
+{
+	while (shard->lru_tail != NULL && shard->used + room > shard->budget)
+		cache_unlink(shard, shard->lru_tail);
+}
+
+/*
+ * Bytes taken by all shards. The other shards are read without locking.
+ */
+static int64_t
+cache_used(struct mg_context *ctx)
+{
+	int64_t	n = 0;
+	int	i;
+
+	for (i = 0; i < CACHE_SHARDS; i++)
+		n += ATOMIC_LOAD(&ctx->cache[i].used);
+
+	return (n);
+}
+
+/*
+ * Evict from the shards taking more than their share, until the cache
+ * fits the budget again. Called with no shard locked.
+ */
+static void
+cache_repay(struct mg_context *ctx)
+{
+	struct cache_shard	*shard;
+	int64_t			budget = ATOMIC_LOAD(&ctx->cache_budget);
+	int			i;
+
+	for (i = 0; i < CACHE_SHARDS && cache_used(ctx) > budget; i++) {
+		shard = ctx->cache + i;
+		(void) pthread_mutex_lock(&shard->mutex);
+		while (shard->lru_tail != NULL &&
+		    shard->used > shard->budget && cache_used(ctx) > budget)
+			cache_unlink(shard, shard->lru_tail);
+		(void) pthread_mutex_unlock(&shard->mutex);
+	}
+}
+
+static struct cache_entry *
+cache_find(struct cache_shard *shard, unsigned int hash, const char *path,
+		const struct encoding *enc)
+{
+	struct cache_entry	*e;
+
+	for (e = shard->buckets[hash % CACHE_BUCKETS]; e != NULL; e = e->next)
+		if (e->hash == hash && e->encoding == enc &&
+		    !strcmp(e->path, path))
+			break;
+
+	return (e);
+}
+
+/*
+ * Return a referenced entry for the current version of the file,
+ * or NULL if it is not cached.
+ */
+static struct cache_entry *
+cache_lookup(struct mg_context *ctx, const char *path,
+		const struct encoding *enc, const struct mgstat *stp)
+{
+	unsigned int		hash = cache_hash(path);
+	struct cache_shard	*shard = cache_shard(ctx, hash);
+	struct cache_entry	*e;
+
+	(void) pthread_mutex_lock(&shard->mutex);
+	if ((e = cache_find(shard, hash, path, enc)) == NULL) {
+		/* Not cached */
+	} else if (!same_file(&e->st, stp)) {
+		/* File has changed */
+		cache_unlink(shard, e);
+		e = NULL;
+	} else {
+		lru_remove(shard, e);
+		lru_push(shard, e);
+		(void) ATOMIC_ADD(&e->refs, 1);
+	}
+	(void) pthread_mutex_unlock(&shard->mutex);
+
+	return (e);
+}
+
+/*
+ * Add a new entry, replacing an older version of the file, if any.
+ * Past its share, a shard evicts its own entries only when the whole
+ * cache is full, so that any file up to the budget can be cached.
+ */
+static void
+cache_insert(struct mg_context *ctx, struct cache_entry *e)
+{
+	struct cache_shard	*shard = cache_shard(ctx, e->hash);
+	struct cache_entry	*old;
+	int64_t			budget = ATOMIC_LOAD(&ctx->cache_budget);
+	bool_t			is_over = FALSE;
+
+	(void) pthread_mutex_lock(&shard->mutex);
+	if ((old = cache_find(shard, e->hash, e->path, e->encoding)) != NULL)
+		cache_unlink(shard, old);
+	while (shard->lru_tail != NULL &&
+	    shard->used + e->size > shard->budget &&
+	    cache_used(ctx) + e->size > budget)
+		cache_unlink(shard, shard->lru_tail);
+
+	if (shard->used + e->size <= shard->budget ||
+	    cache_used(ctx) + e->size <= budget) {
+		e->next = shard->buckets[e->hash % CACHE_BUCKETS];
+		shard->buckets[e->hash % CACHE_BUCKETS] = e;
+		lru_push(shard, e);
+		ATOMIC_STORE(&shard->used, shard->used + e->size);
+		(void) ATOMIC_ADD(&e->refs, 1);
+		is_over = cache_used(ctx) > budget;
+	}
+	(void) pthread_mutex_unlock(&shard->mutex);
+
+	/* Its share was lent out, take it back from the borrowers */
+	if (is_over)
+		cache_repay(ctx);
+}
+
+#if defined(USE_INOTIFY)
+/*
+ * Drop all cached files, keeping the budget.
+ */
+static void
+cache_flush(struct mg_context *ctx)
+{
+	struct cache_shard	*shard;
+	int			i;
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		shard = ctx->cache + i;
+		(void) pthread_mutex_lock(&shard->mutex);
+		cache_trim(shard, shard->budget + 1);
+		(void) pthread_mutex_unlock(&shard->mutex);
+	}
+}
+
+/*
+ * Drop all cached versions of the file, e.g. because it is written to.
+ */
+static void
+cache_evict(struct mg_context *ctx, const char *path)
+{
+	unsigned int		hash = cache_hash(path);
+	struct cache_shard	*shard = cache_shard(ctx, hash);
+	struct cache_entry	*e, *next;
+
+	(void) pthread_mutex_lock(&shard->mutex);
+	for (e = shard->buckets[hash % CACHE_BUCKETS]; e != NULL; e = next) {
+		next = e->next;
+		if (e->hash == hash && !strcmp(e->path, path))
+			cache_unlink(shard, e);
+	}
+	(void) pthread_mutex_unlock(&shard->mutex);
+}
+#endif /* USE_INOTIFY */
+
+static void
+cache_clear(struct mg_context *ctx, int64_t budget)
+{
+	struct cache_shard	*shard;
+	int			i;
+
+	ATOMIC_STORE(&ctx->cache_budget, budget);
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		shard = ctx->cache + i;
+		(void) pthread_mutex_lock(&shard->mutex);
+		shard->budget = budget / CACHE_SHARDS;
+		cache_trim(shard, 0);
+		(void) pthread_mutex_unlock(&shard->mutex);
+	}
+}
+
+/*
+ * Render the headers describing the file: Last-Modified, Etag,
+ * Content-Type and, if the file is precompressed, Content-Encoding.
+ * The type is the one of the uncompressed file, and the Etag differs
+ * from its Etag. Return the length of the headers.
+ */
+static int
+file_headers(struct mg_connection *conn, char *buf, size_t buf_len,
+		const char *path, const struct encoding *enc,
+		const struct mgstat *stp)
+{
+	const char	*fmt = "%a, %d %b %Y %H:%M:%S %Z";
+	char		lm[64], name[FILENAME_MAX];
+	struct vec	mime_vec;
+
+	if (enc != NULL) {
+		(void) mg_snprintf(conn, name, sizeof(name), "%.*s",
+		    (int) (strlen(path) - strlen(enc->ext)), path);
+		path = name;
+	}
+	get_mime_type(conn->ctx, path, &mime_vec);
+	(void) strftime(lm, sizeof(lm), fmt, localtime(&stp->mtime));
+
+	return (mg_snprintf(conn, buf, buf_len,
+	    "Last-Modified: %s\r\n"
+	    "Etag: \"%lx.%lx%s%s\"\r\n"
+	    "Content-Type: %.*s\r\n"
+	    "%s%s%s",
+	    lm, (unsigned long) stp->mtime, (unsigned long) stp->size,
+	    enc == NULL ? "" : "-", enc == NULL ? "" : enc->name,
+	    mime_vec.len, mime_vec.ptr,
+	    enc == NULL ? "" : "Content-Encoding: ",
+	    enc == NULL ? "" : enc->name, enc == NULL ? "" : "\r\n"));
+}
+
+/*
+ * Read or map the file, render its headers, and put it in the cache.
+ * Return a referenced entry, or NULL on error.
+ */
+static struct cache_entry *
+cache_load(struct mg_connection *conn, const char *path,
+		const struct encoding *enc, const struct mgstat *stp,
+		bool_t is_mapped)
+{
+	struct cache_entry	*e;
+	size_t			path_len = strlen(path) + 1;
+	FILE			*fp;
+	bool_t			ok = FALSE;
+
+	if ((e = (struct cache_entry *) calloc(1, sizeof(*e) + path_len +
+	    (is_mapped ? 0 : (size_t) stp->size))) == NULL)
+		return (NULL);
+
+	if ((fp = mg_fopen(path, "rb")) == NULL) {
+		free(e);
+		return (NULL);
+	}
+
+	(void) memcpy(e->path, path, path_len);
+	e->hash = cache_hash(path);
+	e->encoding = enc;
+	e->refs = 1;
+	e->st = *stp;
+	e->size = stp->size;
+
+	if (!is_mapped) {
+		/* File must not have changed since it was stat()-ed */
+		e->data = e->path + path_len;
+		ok = fread(e->data, 1, (size_t) e->size, fp) ==
+		    (size_t) e->size && fgetc(fp) == EOF;
+#if !defined(_WIN32)
+	} else if ((e->data = (char *) mmap(NULL, (size_t) e->size,
+	    PROT_READ, MAP_SHARED, fileno(fp), 0)) != MAP_FAILED) {
+		e->is_mapped = ok = TRUE;
+#endif /* !_WIN32 */
+	}
+	(void) fclose(fp);
+
+	if (!ok) {
+		free(e);
+		return (NULL);
+	}
+
+	e->headers_len = file_headers(conn, e->headers, sizeof(e->headers),
+	    path, enc, stp);
+
+#if defined(USE_INOTIFY)
+	/* Its eviction may have been missed if it changed since stat() */
+	if (conn->resolve_gen != ATOMIC_LOAD(&conn->ctx->resolve_gen))
+		return (e);
+#endif /* USE_INOTIFY */
+	cache_insert(conn->ctx, e);
+
+	return (e);
+}
+
+/*
+ * Return a referenced cache entry for the file, loading it if needed,
+ * or NULL if the file is not to be cached. Plain connections send big
+ * files with sendfile(), which is cheaper than writing from a mapping.
+ */
+static struct cache_entry *
+get_cached_file(struct mg_connection *conn, const char *path,
+		const struct encoding *enc, const struct mgstat *stp)
+{
+	struct mg_context	*ctx = conn->ctx;
+	struct cache_entry	*e;
+	bool_t			is_mapped;
+
+	if (!ATOMIC_LOAD(&ctx->is_caching) ||
+	    stp->size > ATOMIC_LOAD(&ctx->cache_budget))
+		return (NULL);
+
+	is_mapped = stp->size > ATOMIC_LOAD(&ctx->cache_small_file);
+#if defined(_WIN32)
+	if (is_mapped)
+		return (NULL);
+#elif defined(USE_SENDFILE)
+	if (is_mapped && conn->ssl == NULL &&
+	    is_true(ctx->options[OPT_SENDFILE]))
+		return (NULL);
+#endif /* _WIN32 */
+
+	if ((e = cache_lookup(ctx, path, enc, stp)) == NULL)
+		e = cache_load(conn, path, enc, stp, is_mapped);
+
+	return (e);
+}
+
+/*
+ * Send file contents from the cache.
+ */
+static void
+send_cached_file(struct mg_connection *conn, struct cache_entry *e,
+		bool_t vary)
+{
+	char		date[64], range[64];
+	const char	*fmt = "%a, %d %b %Y %H:%M:%S %Z";
+	time_t		curtime = time(NULL);
+	int64_t		cl, offset;
+	int		n, len;
+
+	cl = get_range(conn, e->size, &offset, range, sizeof(range));
+	(void) strftime(date, sizeof(date), fmt, localtime(&curtime));
+
+	(void) mg_printf(conn,
+	    "HTTP/1.1 %d %s\r\n"
+	    "Date: %s\r\n"
+	    "%.*s"
+	    "%s"
+	    "Content-Length: %" INT64_FMT "\r\n"
+	    "Connection: %s\r\n"
+	    "Accept-Ranges: bytes\r\n"
+	    "%s\r\n",
+	    conn->request_info.status_code,
+	    conn->request_info.status_code == 206 ? "Partial Content" : "OK",
+	    date, e->headers_len, e->headers,
+	    vary ? "Vary: Accept-Encoding\r\n" : "", cl,
+	    suggest_connection_header(conn), range);
+
+	if (strcmp(conn->request_info.request_method, "HEAD") == 0)
+		return;
+
+	for (; cl > 0; cl -= n, offset += n) {
+		len = cl > INT_MAX ? INT_MAX : (int) cl;
+		if ((n = mg_write(conn, e->data + offset, len)) <= 0)
+			break;
+		conn->num_bytes_sent += n;
+	}
+}
+
+#if !defined(_WIN32)
+/*
+ * Open file cache. Senders of a file share its descriptor, and read it
+ * with pread() or sendfile() at their own offsets. A descriptor is used
+ * while the file keeps the modification time and size it was opened
+ * with, and for open_file_valid seconds at most. Then the file is opened
+ * again, in case it has been replaced under the same name, which on
+ * a network file system may go unnoticed otherwise.
+ */
+static struct open_file_shard *
+open_file_shard(struct mg_context *ctx, unsigned int hash)
+{
+	return (&ctx->open_files[(hash / CACHE_BUCKETS) % CACHE_SHARDS]);
+}
+
+static void
+open_file_unref(struct open_file *f)
+{
+	if (ATOMIC_ADD(&f->refs, -1) != 1)
+		return;
+	(void) close(f->fd);
+	free(f);
+}
+
+/*
+ * Remove the entry from the shard, and drop the reference the table has.
+ * Called with the shard locked.
+ */
+static void
+open_file_unlink(struct open_file_shard *shard, struct open_file *f)
+{
+	struct open_file	**pp;
+
+	for (pp = &shard->buckets[f->hash % CACHE_BUCKETS]; *pp != f;
+	    pp = &(*pp)->next)
+		;
+	*pp = f->next;
+	f->lru_prev->lru_next = f->lru_next;
+	f->lru_next->lru_prev = f->lru_prev;
+	shard->num_files--;
+	open_file_unref(f);
+}
+
+static void
+open_file_push(struct open_file_shard *shard, struct open_file *f)
+{
+	f->lru_prev = &shard->lru;
+	f->lru_next = shard->lru.lru_next;
+	f->lru_next->lru_prev = f;
+	shard->lru.lru_next = f;
+}
+
+static struct open_file *
+open_file_find(struct open_file_shard *shard, unsigned int hash,
+		const char *path)
+{
+	struct open_file	*f;
+
+	for (f = shard->buckets[hash % CACHE_BUCKETS]; f != NULL; f = f->next)
+		if (f->hash == hash && !strcmp(f->path, path))
+			break;
+
+	return (f);
+}
+
+/*
+ * Close the descriptors nobody is sending from, and keep max_open_files
+ * per shard from now on.
+ */
+static void
+open_file_flush(struct mg_context *ctx)
+{
+	struct open_file_shard	*shard;
+	int			i;
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		shard = ctx->open_files + i;
+		(void) pthread_mutex_lock(&shard->mutex);
+		shard->max_files = ATOMIC_LOAD(&ctx->max_open_files);
+		while (shard->num_files > 0)
+			open_file_unlink(shard, shard->lru.lru_next);
+		(void) pthread_mutex_unlock(&shard->mutex);
+	}
+}
+
+/*
+ * Return a referenced open file for the current version of the file, or
+ * NULL if it is not to be kept open, or cannot be opened.
+ */
+static struct open_file *
+get_open_file(struct mg_connection *conn, const char *path,
+		const struct mgstat *stp)
+{
+	struct mg_context	*ctx = conn->ctx;
+	unsigned int		hash = cache_hash(path);
+	struct open_file_shard	*shard = open_file_shard(ctx, hash);
+	struct open_file	*f, *old;
+	time_t			now = time(NULL);
+	struct stat		st;
+	struct mgstat		opened;
+	int			fd;
+
+	if (!ATOMIC_LOAD(&ctx->max_open_files))
+		return (NULL);
+
+	(void) pthread_mutex_lock(&shard->mutex);
+	if ((f = open_file_find(shard, hash, path)) == NULL) {
+		/* Not open */
+	} else if (!same_file(&f->st, stp) || now >= f->expires) {
+		open_file_unlink(shard, f);
+		f = NULL;
+	} else {
+		f->lru_prev->lru_next = f->lru_next;
+		f->lru_next->lru_prev = f->lru_prev;
+		open_file_push(shard, f);
+		(void) ATOMIC_ADD(&f->refs, 1);
+	}
+	(void) pthread_mutex_unlock(&shard->mutex);
+
+	if (f != NULL)
+		return (f);
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return (NULL);
+	set_close_on_exec(fd);
+
+	if ((f = (struct open_file *) calloc(1, sizeof(*f) +
+	    strlen(path))) == NULL) {
+		(void) close(fd);
+		return (NULL);
+	}
+	(void) strcpy(f->path, path);
+	f->hash = hash;
+	f->refs = 1;
+	f->fd = fd;
+	f->st = *stp;
+	f->expires = now + ATOMIC_LOAD(&ctx->open_file_valid);
+
+	/*
+	 * Keep it only if it is the file that was stat()-ed, and it has not
+	 * changed since. A file replaced by rename() has another inode.
+	 */
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+		return (f);
+	stat_to_mgstat(&st, &opened);
+	if (!same_file(&opened, stp))
+		return (f);
+
+	(void) pthread_mutex_lock(&shard->mutex);
+	if (shard->max_files > 0) {
+		if ((old = open_file_find(shard, hash, path)) != NULL)
+			open_file_unlink(shard, old);
+		while (shard->num_files >= shard->max_files)
+			open_file_unlink(shard, shard->lru.lru_prev);
+
+		f->next = shard->buckets[hash % CACHE_BUCKETS];
+		shard->buckets[hash % CACHE_BUCKETS] = f;
+		open_file_push(shard, f);
+		shard->num_files++;
+		(void) ATOMIC_ADD(&f->refs, 1);
+	}
+	(void) pthread_mutex_unlock(&shard->mutex);
+
+	return (f);
+}
+
+/*
+ * Send len bytes of the open file, starting at the offset. The file
+ * position is not used, it is shared with other senders.
+ */
+static void
+send_open_file(struct mg_connection *conn, struct open_file *f,
+		int64_t offset, int64_t len)
+{
+	char	buf[BUFSIZ];
+	ssize_t	n;
+
+#if defined(USE_SENDFILE)
+	if (sendfile_send_file(conn, f->fd, offset, len))
+		return;
+#endif /* USE_SENDFILE */
+
+#if defined(USE_IO_URING)
+	if (uring_send_file(conn, f->fd, &offset, &len))
+		return;
+#endif /* USE_IO_URING */
+
+	while (len > 0 && (n = pread(f->fd, buf, len > (int64_t) sizeof(buf) ?
+	    sizeof(buf) : (size_t) len, (off_t) offset)) > 0) {
+		if (mg_write(conn, buf, (int) n) != (int) n)
+			break;
+		conn->num_bytes_sent += n;
+		offset += n;
+		len -= n;
+	}
+}
+#else
+#define	get_open_file(conn, path, stp)		NULL
+#define	send_open_file(conn, f, offset, len)	(void) 0
+#define	open_file_unref(f)			(void) 0
+#endif /* !_WIN32 */
+
+/*
+ * Send regular file contents.
+ */
+static void
+send_file(struct mg_connection *conn, const char *path, struct mgstat *stp,
+		const struct encoding *enc, bool_t vary)
+{
+	char		date[64], headers[256], range[64];
+	const char	*fmt = "%a, %d %b %Y %H:%M:%S %Z";
+	time_t		curtime = time(NULL);
+	int64_t		cl, offset;
+	struct cache_entry *e;
+	struct open_file *f;
+	FILE		*fp = NULL;
+	int		headers_len;
+
+	if ((e = get_cached_file(conn, path, enc, stp)) != NULL) {
+		send_cached_file(conn, e, vary);
+		cache_unref(e);
+		return;
+	}
+
+	if ((f = get_open_file(conn, path, stp)) == NULL &&
+	    (fp = mg_fopen(path, "rb")) == NULL) {
+		send_error(conn, 500, http_500_error,
+		    "fopen(%s): %s", path, strerror(ERRNO));
+		return;
+	}
+	if (fp != NULL)
+		set_close_on_exec(fileno(fp));
+
+	/* If Range: header specified, act accordingly */
+	cl = get_range(conn, stp->size, &offset, range, sizeof(range));
+	if (fp != NULL && offset > 0)
+		(void) fseeko(fp, (off_t) offset, SEEK_SET);
+
+	/* Prepare Etag, Date, Last-Modified headers */
+	(void) strftime(date, sizeof(date), fmt, localtime(&curtime));
+	headers_len = file_headers(conn, headers, sizeof(headers),
+	    path, enc, stp);
+
+	(void) mg_printf(conn,
+	    "HTTP/1.1 %d %s\r\n"
+	    "Date: %s\r\n"
+	    "%.*s"
+	    "%s"
+	    "Content-Length: %" INT64_FMT "\r\n"
+	    "Connection: %s\r\n"
+	    "Accept-Ranges: bytes\r\n"
+	    "%s\r\n",
+	    conn->request_info.status_code,
+	    conn->request_info.status_code == 206 ? "Partial Content" : "OK",
+	    date, headers_len, headers,
+	    vary ? "Vary: Accept-Encoding\r\n" : "", cl,
+	    suggest_connection_header(conn), range);
+
+	if (strcmp(conn->request_info.request_method, "HEAD") == 0) {
+		/* No body */
+	} else if (f != NULL) {
+		send_open_file(conn, f, offset, cl);
+	} else {
+		send_opened_file_stream(conn, fp, cl);
+	}
+
+	if (f != NULL)
+		open_file_unref(f);
+	else
+		(void) fclose(fp);
+}
+
+/*
+ * Parse HTTP headers from the given buffer, advance buffer to the point
+ * where parsing stopped.
+ */
+static void
+parse_http_headers(char **buf, struct mg_request_info *ri)
+{
+	int	i;
+
+	for (i = 0; i < (int) ARRAY_SIZE(ri->http_headers); i++) {
+		ri->http_headers[i].name = skip(buf, ": ");
+		ri->http_headers[i].value = skip(buf, "\r\n");
+		if (ri->http_headers[i].name[0] == '\0')
+			break;
+		ri->num_headers = i + 1;
+	}
+}
+
+static bool_t
+is_valid_http_method(const char *method)
+{
+	return (!strcmp(method, "GET") ||
+	    !strcmp(method, "POST") ||
+	    !strcmp(method, "HEAD") ||
+	    !strcmp(method, "PUT") ||
+	    !strcmp(method, "DELETE"));
+}
+
+/*
+ * Parse HTTP request, fill in mg_request_info structure.
+ */
+static bool_t
+parse_http_request(char *buf, struct mg_request_info *ri, const struct usa *usa)
+{
+	int	success_code = FALSE;
+
+	ri->request_method = skip(&buf, " ");
+	ri->uri = skip(&buf, " ");
+	ri->http_version = skip(&buf, "\r\n");
+
+	if (is_valid_http_method(ri->request_method) &&
+	    ri->uri[0] == '/' &&
+	    strncmp(ri->http_version, "HTTP/", 5) == 0) {
+		ri->http_version += 5;   /* Skip "HTTP/" */
+		parse_http_headers(&buf, ri);
+		ri->remote_port = ntohs(usa->u.sin.sin_port);
+		(void) memcpy(&ri->remote_ip, &usa->u.sin.sin_addr.s_addr, 4);
+		ri->remote_ip = ntohl(ri->remote_ip);
+		success_code = TRUE;
+	}
+
+	return (success_code);
+}
+
+/*
+ * Keep reading the input (either opened file descriptor fp, or the client
+ * of connection conn) into buffer buf, until \r\n\r\n appears in the
+ * buffer (which marks the end of HTTP request). Buffer buf may already
+ * have some data. The length of the data is stored in nread.
+ * Upon every read operation, increase nread by the number of bytes read.
+ */
+static int
+read_request(struct mg_connection *conn, FILE *fp,
+		char *buf, int bufsiz, int *nread)
+{
+	int	n, request_len;
+
+	request_len = 0;
+	while (*nread < bufsiz && request_len == 0) {
+		if (fp != NULL) {
+			n = pull(fp, INVALID_SOCKET, NULL,
+			    buf + *nread, bufsiz - *nread);
+		} else {
+			time_io(conn, IO_HEADERS);
+			n = pull(NULL, conn->client.sock, conn->ssl,
+			    buf + *nread, bufsiz - *nread);
+			done_io(conn, n);
+		}
+		if (n <= 0) {
+			break;
+		} else {
+			*nread += n;
+			request_len = get_request_len(buf, (size_t) *nread);
+		}
+	}
+
+	return (request_len);
+}
+
+/*
+ * For given directory path, substitute it to valid index file.
+ * Return 0 if index file has been found, -1 if not found.
+ * If the file is found, it's stats is returned in stp.
+ */
+static bool_t
+substitute_index_file(struct mg_connection *conn,
+		char *path, size_t path_len, struct mgstat *stp)
+{
+	const char	*list;
+	struct mgstat	st;
+	struct vec	filename_vec;
+	size_t		n;
+	bool_t		found;
+
+	n = strlen(path);
+
+	/*
+	 * The 'path' given to us points to the directory. Remove all trailing
+	 * directory separator characters from the end of the path, and
+	 * then append single directory separator character.
+	 */
+	while (n > 0 && IS_DIRSEP_CHAR(path[n - 1]))
+		n--;
+	path[n] = DIRSEP;
+
+	/*
+	 * Traverse index files list. For each entry, append it to the given
+	 * path and see if the file exists. If it exists, break the loop
+	 */
+	lock_option(conn->ctx, OPT_INDEX_FILES);
+	list = conn->ctx->options[OPT_INDEX_FILES];
+	found = FALSE;
+
+	while ((list = next_option(list, &filename_vec, NULL)) != NULL) {
+
+		/* Ignore too long entries that may overflow path buffer */
+		if (filename_vec.len > path_len - n)
+			continue;
+
+		/* Prepare full path to the index file  */
+		(void) mg_strlcpy(path + n + 1,
+		    filename_vec.ptr, filename_vec.len + 1);
+
+		/* Does it exist ? */
+		if (mg_stat(path, &st) == 0) {
+			/* Yes it does, break the loop */
+			*stp = st;
+			found = TRUE;
+			break;
+		}
+	}
+	unlock_option(conn->ctx, OPT_INDEX_FILES);
+
+	/* If no index file exists, restore directory path */
+	if (found == FALSE)
+		path[n] = '\0';
+
+	return (found);
+}
+
+static void
+remove_callback(struct mg_context *ctx,
+		const char *uri_regex, int status_code, bool_t is_auth)
+{
+	struct callback	*cb;
+	int		i;
+
+	for (i = 0; i < ctx->num_callbacks; i++) {
+		cb = ctx->callbacks + i;
+		if ((uri_regex != NULL && cb->uri_regex != NULL &&
+		    ((is_auth && cb->is_auth) || (!is_auth && !cb->is_auth)) &&
+		    !strcmp(uri_regex, cb->uri_regex)) || (uri_regex == NULL &&
+		     (cb->status_code == 0 ||
+		      cb->status_code == status_code))) {
+			(void) memmove(cb, cb + 1,
+			    (char *) (ctx->callbacks + ctx->num_callbacks) -
+			    (char *) (cb + 1));
+			break;
+		}
+	}
+}
+
+static void
+add_callback(struct mg_context *ctx, const char *uri_regex, int status_code,
+		mg_callback_t func, bool_t is_auth, void *user_data)
+{
+	struct callback	*cb;
+
+	pthread_mutex_lock(&ctx->bind_mutex);
+	if (func == NULL) {
+		remove_callback(ctx, uri_regex, status_code, is_auth);
+	} else if (ctx->num_callbacks >= (int) ARRAY_SIZE(ctx->callbacks) - 1) {
+		cry(fc(ctx), "Too many callbacks! Increase MAX_CALLBACKS.");
+	} else {
+		cb = &ctx->callbacks[ctx->num_callbacks];
+		cb->uri_regex = uri_regex ? mg_strdup(uri_regex) : NULL;
+		cb->func = func;
+		cb->is_auth = is_auth;
+		cb->status_code = status_code;
+		cb->user_data = user_data;
+		ctx->num_callbacks++;
+		DEBUG_TRACE((DEBUG_MGS_PREFIX "%s: uri %s code %d",
+		    __func__, uri_regex ? uri_regex : "NULL", status_code));
+	}
+	pthread_mutex_unlock(&ctx->bind_mutex);
+}
+
+void
+mg_set_uri_callback(struct mg_context *ctx, const char *uri_regex,
+		mg_callback_t func, void *user_data)
+{
+	assert(uri_regex != NULL);
+	add_callback(ctx, uri_regex, -1, func, FALSE, user_data);
+}
+
+void
+mg_set_error_callback(struct mg_context *ctx, int error_code,
+		mg_callback_t func, void *user_data)
+{
+	assert(error_code >= 0 && error_code < 1000);
+	add_callback(ctx, NULL, error_code, func, FALSE, user_data);
+}
+
+void
+mg_set_auth_callback(struct mg_context *ctx, const char *uri_regex,
+		mg_callback_t func, void *user_data)
+{
+	assert(uri_regex != NULL);
+	add_callback(ctx, uri_regex, -1, func, TRUE, user_data);
+}
+
+/*
+ * Return True if we should reply 304 Not Modified.
+ */
+static bool_t
+is_not_modified(const struct mg_connection *conn, const struct mgstat *stp)
+{
+	const char *ims = mg_get_header(conn, "If-Modified-Since");
+	return (ims != NULL && stp->mtime < date_to_epoch(ims));
+}
+
+static bool_t
+append_chunk(struct mg_request_info *ri, FILE *fp, const char *buf, int len)
+{
+	bool_t	ret_code = TRUE;
+
+	if (fp == NULL) {
+		/* TODO: check for NULL here */
+		ri->post_data = (char *) realloc(ri->post_data,
+		    ri->post_data_len + len);
+		(void) memcpy(ri->post_data + ri->post_data_len, buf, len);
+		ri->post_data_len += len;
+	} else if (push(fp, INVALID_SOCKET,
+	    NULL, buf, (int64_t) len, 0) != (int64_t) len) {
+		ret_code = FALSE;
+	}
+
+	return (ret_code);
+}
+
+static bool_t
+handle_request_body(struct mg_connection *conn, FILE *fp)
+{
+	struct mg_request_info	*ri = &conn->request_info;
+	const char	*expect, *tmp;
+	int64_t		content_len;
+	char		buf[BUFSIZ];
+	int		to_read, nread, already_read;
+	bool_t		success_code = FALSE;
+
+	content_len = get_content_length(conn);
+	expect = mg_get_header(conn, "Expect");
+
+	if (content_len == -1) {
+		send_error(conn, 411, "Length Required", "");
+	} else if (expect != NULL && mg_strcasecmp(expect, "100-continue")) {
+		send_error(conn, 417, "Expectation Failed", "");
+	} else {
+		if (expect != NULL)
+			(void) mg_printf(conn, "HTTP/1.1 100 Continue\r\n\r\n");
+
+		already_read = ri->post_data_len;
+		assert(already_read >= 0);
+
+		if (content_len <= (int64_t) already_read) {
+			ri->post_data_len = (int) content_len;
+			/*
+			 * If fp is NULL, this is embedded mode, and we do not
+			 * have to do anything: POST data is already there,
+			 * no need to allocate a buffer and copy it in.
+			 * If fp != NULL, we need to write the data.
+			 */
+			success_code = fp == NULL || (push(fp, INVALID_SOCKET,
+			    NULL, ri->post_data, content_len, 0) ==
+			    content_len) ?
+			    TRUE : FALSE;
+		} else {
+
+			if (fp == NULL) {
+				conn->free_post_data = TRUE;
+				tmp = ri->post_data;
+				/* +1 in case if already_read == 0 */
+				ri->post_data = (char*)malloc(already_read + 1);
+				(void) memcpy(ri->post_data, tmp, already_read);
+			} else {
+				(void) push(fp, INVALID_SOCKET, NULL,
+				    ri->post_data, (int64_t) already_read, 0);
+			}
+
+			content_len -= already_read;
+
+			/* Client may wait for our responses before sending */
+			if (!flush_output(conn, FALSE))
+				content_len = -1;
+
+			while (content_len > 0) {
+				to_read = sizeof(buf);
+				if ((int64_t) to_read > content_len)
+					to_read = (int) content_len;
+				time_io(conn, IO_BODY);
+				nread = pull(NULL, conn->client.sock,
+				    conn->ssl, buf, to_read);
+				done_io(conn, nread);
+				if (nread <= 0)
+					break;
+				if (!append_chunk(ri, fp, buf, nread))
+					break;
+				content_len -= nread;
+			}
+			success_code = content_len == 0 ? TRUE : FALSE;
+			conn->body_read = success_code;
+		}
+
+		/* Each error code path in this function must send an error */
+		if (success_code != TRUE)
+			send_error(conn, 577, http_500_error,
+			    "%s", "Error handling body data");
+	}
+
+	return (success_code);
+}
+
+#if !defined(NO_CGI)
+
+/*
+ * This structure helps to create an environment for the spawned CGI program.
+ * Environment is an array of "VARIABLE=VALUE\0" ASCIIZ strings,
+ * last element must be NULL.
+ * However, on Windows there is a requirement that all these VARIABLE=VALUE\0
+ * strings must reside in a contiguous buffer. The end of the buffer is
+ * marked by two '\0' characters.
+ * We satisfy both worlds: we create an envp array (which is vars), all
+ * entries are actually pointers inside buf.
+ */
+struct cgi_env_block {
+	struct mg_connection *conn;
+	char	buf[CGI_ENVIRONMENT_SIZE];	/* Environment buffer	*/
+	int	len;				/* Space taken		*/
+	char	*vars[MAX_CGI_ENVIR_VARS];	/* char **envp		*/
+	int	nvars;				/* Number of variables	*/
+};
+
+/*
+ * Append VARIABLE=VALUE\0 string to the buffer, and add a respective
+ * pointer into the vars array.
+ */
+static char *
+addenv(struct cgi_env_block *block, const char *fmt, ...)
+{
+	int	n, space;
+	char	*added;
+	va_list	ap;
+
+	/* Calculate how much space is left in the buffer */
+	space = sizeof(block->buf) - block->len - 2;
+	assert(space >= 0);
+
+	/* Make a pointer to the free space int the buffer */
+	added = block->buf + block->len;
+
+	/* Copy VARIABLE=VALUE\0 string into the free space */
+	va_start(ap, fmt);
+	n = mg_vsnprintf(block->conn, added, (size_t) space, fmt, ap);
+	va_end(ap);
+
+	/* Make sure we do not overflow buffer and the envp array */
+	if (n > 0 && n < space &&
+	    block->nvars < (int) ARRAY_SIZE(block->vars) - 2) {
+		/* Append a pointer to the added string into the envp array */
+		block->vars[block->nvars++] = block->buf + block->len;
+		/* Bump up used length counter. Include \0 terminator */
+		block->len += n + 1;
+	}
+
+	return (added);
+}
+
+static void
+prepare_cgi_environment(struct mg_connection *conn, const char *prog,
+		struct cgi_env_block *blk)
+{
+	const char	*s, *script_filename, *root, *slash;
+	struct vec	var_vec;
+	char		*p;
+	int		i;
+
+	blk->len = blk->nvars = 0;
+	blk->conn = conn;
+
+	/* SCRIPT_FILENAME */
+	script_filename = prog;
+	if ((s = strrchr(prog, '/')) != NULL)
+		script_filename = s + 1;
+
+	lock_option(conn->ctx, OPT_ROOT);
+	root = conn->ctx->options[OPT_ROOT];
+	addenv(blk, "SERVER_NAME=%s", conn->ctx->options[OPT_AUTH_DOMAIN]);
+	unlock_option(conn->ctx, OPT_ROOT);
+
+	/* Prepare the environment block */
+	addenv(blk, "%s", "GATEWAY_INTERFACE=CGI/1.1");
+	addenv(blk, "%s", "SERVER_PROTOCOL=HTTP/1.1");
+	addenv(blk, "%s", "REDIRECT_STATUS=200");	/* PHP */
+	addenv(blk, "SERVER_PORT=%d", ntohs(conn->client.lsa.u.sin.sin_port));
+	addenv(blk, "SERVER_ROOT=%s", root);
+	addenv(blk, "DOCUMENT_ROOT=%s", root);
+	addenv(blk, "REQUEST_METHOD=%s", conn->request_info.request_method);
+	addenv(blk, "REMOTE_ADDR=%s",
+	    inet_ntoa(conn->client.rsa.u.sin.sin_addr));
+	addenv(blk, "REMOTE_PORT=%d", conn->request_info.remote_port);
+	addenv(blk, "REQUEST_URI=%s", conn->request_info.uri);
+
+	slash = strrchr(conn->request_info.uri, '/');
+	addenv(blk, "SCRIPT_NAME=%.*s%s",
+	    (slash - conn->request_info.uri) + 1, conn->request_info.uri,
+	    script_filename);
+
+	addenv(blk, "SCRIPT_FILENAME=%s", script_filename);	/* PHP */
+	addenv(blk, "PATH_TRANSLATED=%s", prog);
+	addenv(blk, "HTTPS=%s", conn->ssl == NULL ? "off" : "on");
+
+	if ((s = mg_get_header(conn, "Content-Type")) != NULL)
+		addenv(blk, "CONTENT_TYPE=%s", s);
+
+	if (conn->request_info.query_string != NULL)
+		addenv(blk, "QUERY_STRING=%s", conn->request_info.query_string);
+
+	if ((s = mg_get_header(conn, "Content-Length")) != NULL)
+		addenv(blk, "CONTENT_LENGTH=%s", s);
+
+	if ((s = getenv("PATH")) != NULL)
+		addenv(blk, "PATH=%s", s);
+
+#if defined(_WIN32)
+	if ((s = getenv("COMSPEC")) != NULL)
+		addenv(blk, "COMSPEC=%s", s);
+	if ((s = getenv("SYSTEMROOT")) != NULL)
+		addenv(blk, "SYSTEMROOT=%s", s);
+#else
+	if ((s = getenv("LD_LIBRARY_PATH")) != NULL)
+		addenv(blk, "LD_LIBRARY_PATH=%s", s);
+#endif /* _WIN32 */
+
+	if ((s = getenv("PERLLIB")) != NULL)
+		addenv(blk, "PERLLIB=%s", s);
+
+	if (conn->request_info.remote_user != NULL) {
+		addenv(blk, "REMOTE_USER=%s", conn->request_info.remote_user);
+		addenv(blk, "%s", "AUTH_TYPE=Digest");
+	}
+
+	/* Add all headers as HTTP_* variables */
+	for (i = 0; i < conn->request_info.num_headers; i++) {
+		p = addenv(blk, "HTTP_%s=%s",
+		    conn->request_info.http_headers[i].name,
+		    conn->request_info.http_headers[i].value);
+
+		/* Convert variable name into uppercase, and change - to _ */
+		for (; *p != '=' && *p != '\0'; p++) {
+			if (*p == '-')
+				*p = '_';
+			*p = (char) toupper(* (unsigned char *) p);
+		}
+	}
+
+	/* Add user-specified variables */
+	lock_option(conn->ctx, OPT_CGI_ENV);
+	s = conn->ctx->options[OPT_CGI_ENV];
+	while ((s = next_option(s, &var_vec, NULL)) != NULL)
+		addenv(blk, "%.*s", var_vec.len, var_vec.ptr);
+	unlock_option(conn->ctx, OPT_CGI_ENV);
+
+	blk->vars[blk->nvars++] = NULL;
+	blk->buf[blk->len++] = '\0';
+
+	assert(blk->nvars < (int) ARRAY_SIZE(blk->vars));
+	assert(blk->len > 0);
+	assert(blk->len < (int) sizeof(blk->buf));
+}
+
+static void
+send_cgi(struct mg_connection *conn, const char *prog)
+{
+	int			headers_len, data_len, i;
+	const char		*status;
+	char			buf[MAX_REQUEST_SIZE], *pbuf;
+	struct mg_request_info	ri;
+	struct cgi_env_block	blk;
+	char			dir[FILENAME_MAX], *p;
+	int			fd_stdin[2], fd_stdout[2];
+	FILE			*in, *out;
+	pid_t			pid;
+
+	prepare_cgi_environment(conn, prog, &blk);
+
+	/* CGI must be executed in its own directory */
+	(void) mg_snprintf(conn, dir, sizeof(dir), "%s", prog);
+	if ((p = strrchr(dir, DIRSEP)) != NULL)
+		*p++ = '\0';
+
+	pid = (pid_t) -1;
+	fd_stdin[0] = fd_stdin[1] = fd_stdout[0] = fd_stdout[1] = -1;
+	in = out = NULL;
+
+	if (pipe(fd_stdin) != 0 || pipe(fd_stdout) != 0) {
+		send_error(conn, 500, http_500_error,
+		    "Cannot create CGI pipe: %s", strerror(ERRNO));
+		goto done;
+	} else if ((pid = spawn_process(conn, p, blk.buf, blk.vars,
+	    fd_stdin[0], fd_stdout[1], dir)) == (pid_t) -1) {
+		goto done;
+	} else if ((in = fdopen(fd_stdin[1], "wb")) == NULL ||
+	    (out = fdopen(fd_stdout[0], "rb")) == NULL) {
+		send_error(conn, 500, http_500_error,
+		    "fopen: %s", strerror(ERRNO));
+		goto done;
+	}
+
+	setbuf(in, NULL);
+	setbuf(out, NULL);
+
+	/*
+	 * spawn_process() must close those!
+	 * If we don't mark them as closed, close() attempt before
+	 * return from this function throws an exception on Windows.
+	 * Windows does not like when closed descriptor is closed again.
+	 */
+	fd_stdin[0] = fd_stdout[1] = -1;
+
+	/* Send POST data to the CGI process if needed */
+	if (!strcmp(conn->request_info.request_method, "POST") &&
+	    !handle_request_body(conn, in)) {
+		goto done;
+	}
+
+	/*
+	 * Now read CGI reply into a buffer. We need to set correct
+	 * status code, thus we need to see all HTTP headers first.
+	 * Do not send anything back to client, until we buffer in all
+	 * HTTP headers.
+	 */
+	data_len = 0;
+	headers_len = read_request(conn, out, buf, sizeof(buf), &data_len);
+	if (headers_len <= 0) {
+		send_error(conn, 500, http_500_error,
+		    "CGI program sent malformed HTTP headers: [%.*s]",
+		    data_len, buf);
+		goto done;
+	}
+	pbuf = buf;
+	buf[headers_len - 1] = '\0';
+	(void) memset(&ri, 0, sizeof(ri));
+	parse_http_headers(&pbuf, &ri);
+
+	/* Make up and send the status line */
+	status = get_header(&ri, "Status");
+	conn->request_info.status_code = status == NULL ? 200 : atoi(status);
+	(void) mg_printf(conn, "HTTP/1.1 %d OK\r\n",
+	    conn->request_info.status_code);
+
+	/* Send headers. Connection: is ours to decide, not the script's */
+	for (i = 0; i < ri.num_headers; i++)
+		if (mg_strcasecmp(ri.http_headers[i].name, "Connection"))
+			(void) mg_printf(conn, "%s: %s\r\n",
+			    ri.http_headers[i].name,
+			    ri.http_headers[i].value);
+	if (get_header(&ri, "Content-Length") == NULL &&
+	    get_header(&ri, "Transfer-Encoding") == NULL)
+		(void) mg_printf(conn, "%s", unknown_length_headers(conn));
+	else
+		(void) mg_printf(conn, "Connection: %s\r\n",
+		    suggest_connection_header(conn));
+	(void) mg_write(conn, "\r\n", 2);
+
+	/* Send chunk of data that may be read after the headers */
+	conn->num_bytes_sent += mg_write(conn,
+	    buf + headers_len, data_len - headers_len);
+
+	/* Read the rest of CGI output and send to the client */
+	send_opened_file_stream(conn, out, INT64_MAX);
+
+done:
+	if (pid != (pid_t) -1)
+		kill(pid, SIGTERM);
+	if (fd_stdin[0] != -1)
+		(void) close(fd_stdin[0]);
+	if (fd_stdout[1] != -1)
+		(void) close(fd_stdout[1]);
+
+	if (in != NULL)
+		(void) fclose(in);
+	else if (fd_stdin[1] != -1)
+		(void) close(fd_stdin[1]);
+
+	if (out != NULL)
+		(void) fclose(out);
+	else if (fd_stdout[0] != -1)
+		(void) close(fd_stdout[0]);
+}
+#endif /* !NO_CGI */
+
+/*
+ * For a given PUT path, create all intermediate subdirectories
+ * for given path. Return 0 if the path itself is a directory,
+ * or -1 on error, 1 if OK.
+ */
+static int
+put_dir(const char *path)
+{
+	char		buf[FILENAME_MAX];
+	const char	*s, *p;
+	struct mgstat	st;
+	size_t		len;
+
+	for (s = p = path + 2; (p = strchr(s, '/')) != NULL; s = ++p) {
+		len = p - path;
+		assert(len < sizeof(buf));
+		(void) memcpy(buf, path, len);
+		buf[len] = '\0';
+
+		/* Try to create intermediate directory */
+		if (mg_stat(buf, &st) == -1 && mg_mkdir(buf, 0755) != 0)
+			return (-1);
+
+		/* Is path itself a directory ? */
+		if (p[1] == '\0')
+			return (0);
+	}
+
+	return (1);
+}
+
+static void
+put_file(struct mg_connection *conn, const char *path)
+{
+	struct mgstat	st;
+	FILE		*fp;
+	int		rc;
+
+	conn->request_info.status_code = mg_stat(path, &st) == 0 ? 200 : 201;
+
+	if (mg_get_header(conn, "Range")) {
+		send_error(conn, 501, "Not Implemented",
+		    "%s", "Range support for PUT requests is not implemented");
+	} else if ((rc = put_dir(path)) == 0) {
+		(void) mg_printf(conn, "HTTP/1.1 %d OK\r\n"
+		    "Content-Length: 0\r\nConnection: %s\r\n\r\n",
+		    conn->request_info.status_code,
+		    suggest_connection_header(conn));
+	} else if (rc == -1) {
+		send_error(conn, 500, http_500_error,
+		    "put_dir(%s): %s", path, strerror(ERRNO));
+	} else if ((fp = mg_fopen(path, "wb+")) == NULL) {
+		send_error(conn, 500, http_500_error,
+		    "fopen(%s): %s", path, strerror(ERRNO));
+	} else {
+		set_close_on_exec(fileno(fp));
+		if (handle_request_body(conn, fp))
+			(void) mg_printf(conn, "HTTP/1.1 %d OK\r\n"
+			    "Content-Length: 0\r\nConnection: %s\r\n\r\n",
+			    conn->request_info.status_code,
+			    suggest_connection_header(conn));
+		(void) fclose(fp);
+	}
+}
+
+#if !defined(NO_SSI)
+static void send_ssi_file(struct mg_connection *, const char *, FILE *, int);
+
+static void
+do_ssi_include(struct mg_connection *conn, const char *ssi, char *tag,
+		int include_level)
+{
+	char	file_name[BUFSIZ], path[FILENAME_MAX], *p;
+	FILE	*fp;
+
+	/*
+	 * sscanf() is safe here, since send_ssi_file() also uses buffer
+	 * of size BUFSIZ to get the tag. So strlen(tag) is always < BUFSIZ.
+	 */
+	if (sscanf(tag, " virtual=\"%[^\"]\"", file_name) == 1) {
+		/* File name is relative to the webserver root */
+		lock_option(conn->ctx, OPT_ROOT);
+		(void) mg_snprintf(conn, path, sizeof(path), "%s%c%s",
+		    conn->ctx->options[OPT_ROOT], DIRSEP, file_name);
+		unlock_option(conn->ctx, OPT_ROOT);
+	} else if (sscanf(tag, " file=\"%[^\"]\"", file_name) == 1) {
+		/*
+		 * File name is relative to the webserver working directory
+		 * or it is absolute system path
+		 */
+		(void) mg_snprintf(conn, path, sizeof(path), "%s", file_name);
+	} else if (sscanf(tag, " \"%[^\"]\"", file_name) == 1) {
+		/* File name is relative to the currect document */
+		(void) mg_snprintf(conn, path, sizeof(path), "%s", ssi);
+		if ((p = strrchr(path, DIRSEP)) != NULL)
+			p[1] = '\0';
+		(void) mg_snprintf(conn, path + strlen(path),
+		    sizeof(path) - strlen(path), "%s", file_name);
+	} else {
+		cry(conn, "Bad SSI #include: [%s]", tag);
+		return;
+	}
+
+	if ((fp = mg_fopen(path, "rb")) == NULL) {
+		cry(conn, "Cannot open SSI #include: [%s]: fopen(%s): %s",
+		    tag, path, strerror(ERRNO));
+	} else {
+		set_close_on_exec(fileno(fp));
+		if (match_extension(path,
+		    conn->ctx->options[OPT_SSI_EXTENSIONS])) {
+			send_ssi_file(conn, path, fp, include_level + 1);
+		} else {
+			send_opened_file_stream(conn, fp, INT64_MAX);
+		}
+		(void) fclose(fp);
+	}
+}
+
+static void
+do_ssi_exec(struct mg_connection *conn, char *tag)
+{
+	char	cmd[BUFSIZ];
+	FILE	*fp;
+
+	if (sscanf(tag, " \"%[^\"]\"", cmd) != 1) {
+		cry(conn, "Bad SSI #exec: [%s]", tag);
+	} else if ((fp = popen(cmd, "r")) == NULL) {
+		cry(conn, "Cannot SSI #exec: [%s]: %s", cmd, strerror(ERRNO));
+	} else {
+		send_opened_file_stream(conn, fp, INT64_MAX);
+		(void) pclose(fp);
+	}
+}
+
+static void
+send_ssi_file(struct mg_connection *conn, const char *path, FILE *fp,
+		int include_level)
+{
+	char	buf[BUFSIZ];
+	int	ch, len, in_ssi_tag;
+
+	if (include_level > 10) {
+		cry(conn, "SSI #include level is too deep (%s)", path);
+		return;
+	}
+
+	in_ssi_tag = FALSE;
+	len = 0;
+
+	while ((ch = fgetc(fp)) != EOF) {
+		if (in_ssi_tag && ch == '>') {
+			in_ssi_tag = FALSE;
+			buf[len++] = ch & 0xff;
+			buf[len] = '\0';
+			assert(len <= (int) sizeof(buf));
+			if (len < 6 || memcmp(buf, "<!--#", 5) != 0) {
+				/* Not an SSI tag, pass it */
+				(void) mg_write(conn, buf, len);
+			} else {
+				if (!memcmp(buf + 5, "include", 7)) {
+					do_ssi_include(conn, path, buf + 12,
+					    include_level);
+				} else if (!memcmp(buf + 5, "exec", 4)) {
+					do_ssi_exec(conn, buf + 9);
+				} else {
+					cry(conn, "%s: unknown SSI "
+					    "command: \"%s\"", path, buf);
+				}
+			}
+			len = 0;
+		} else if (in_ssi_tag) {
+			if (len == 5 && memcmp(buf, "<!--#", 5) != 0) {
+				/* Not an SSI tag */
+				in_ssi_tag = FALSE;
+			} else if (len == (int) sizeof(buf) - 2) {
+				cry(conn, "%s: SSI tag is too large", path);
+				len = 0;
+			}
+			buf[len++] = ch & 0xff;
+		} else if (ch == '<') {
+			in_ssi_tag = TRUE;
+			if (len > 0)
+				(void) mg_write(conn, buf, len);
+			len = 0;
+			buf[len++] = ch & 0xff;
+		} else {
+			buf[len++] = ch & 0xff;
+			if (len == (int) sizeof(buf)) {
+				(void) mg_write(conn, buf, len);
+				len = 0;
+			}
+		}
+	}
+
+	/* Send the rest of buffered data */
+	if (len > 0)
+		(void) mg_write(conn, buf, len);
+
+}
+
+static void
+send_ssi(struct mg_connection *conn, const char *path)
+{
+	FILE	*fp;
+
+	if ((fp = mg_fopen(path, "rb")) == NULL) {
+		send_error(conn, 500, http_500_error,
+		    "fopen(%s): %s", path, strerror(ERRNO));
+	} else {
+		set_close_on_exec(fileno(fp));
+		(void) mg_printf(conn, "HTTP/1.1 200 OK\r\n"
+		    "Content-Type: text/html\r\n%s\r\n",
+		    unknown_length_headers(conn));
+		send_ssi_file(conn, path, fp, 0);
+		(void) fclose(fp);
+	}
+}
+#endif /* !NO_SSI */
+
+void
+mg_authorize(struct mg_connection *conn)
+{
+	conn->embedded_auth = TRUE;
+}
+
+static bool_t
+check_embedded_authorization(struct mg_connection *conn)
+{
+	const struct callback	*cb;
+	bool_t			authorized;
+
+	authorized = TRUE;
+	cb = find_callback(conn->ctx, TRUE, conn->request_info.uri, -1);
+
+	if (cb != NULL) {
+		cb->func(conn, &conn->request_info, cb->user_data);
+		authorized = conn->embedded_auth;
+	}
+
+	return (authorized);
+}
+
+#if defined(USE_INOTIFY)
+/*
+ * Resolution cache. GET and HEAD requests for regular files that need no
+ * authorization remember the file and its stat, so that the next request
+ * for the URI makes no system calls to find it. URIs that have no file
+ * are remembered too, and repeated 404s cost a hash lookup. Every
+ * directory from the root down to the file, or to the first missing name,
+ * is watched with inotify, and the watcher thread forgets what a change
+ * may affect. Option changes forget everything.
+ */
+#define	WATCH_EVENTS	(IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+			IN_DELETE_SELF | IN_MOVE_SELF | IN_MOVED_FROM | \
+			IN_MOVED_TO | IN_DONT_FOLLOW | IN_ONLYDIR)
+
+static struct resolve_shard *
+resolve_shard(struct mg_context *ctx, unsigned int hash)
+{
+	return (&ctx->resolved[(hash / CACHE_BUCKETS) % CACHE_SHARDS]);
+}
+
+static void
+resolve_push(struct resolve_shard *shard, struct resolved *e)
+{
+	struct resolved	*head = &shard->lru[e->is_missing];
+
+	e->lru_prev = head;
+	e->lru_next = head->lru_next;
+	e->lru_next->lru_prev = e;
+	head->lru_next = e;
+}
+
+/*
+ * Length of the directory part of the first len bytes of the path,
+ * without the separators that end it. 0 if there is none.
+ */
+static size_t
+resolve_dir_len(const char *path, size_t len)
+{
+	while (len > 0 && !IS_DIRSEP_CHAR(path[len - 1]))
+		len--;
+	while (len > 0 && IS_DIRSEP_CHAR(path[len - 1]))
+		len--;
+
+	return (len);
+}
+
+static struct resolve_dir *
+resolve_find_dir(struct resolve_shard *shard, const char *path, size_t len)
+{
+	struct resolve_dir	*d;
+	unsigned int		h = 2166136261U;
+	size_t			i;
+
+	/* FNV-1a, as cache_hash() */
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char) path[i]) * 16777619U;
+
+	for (d = shard->dirs[h % CACHE_BUCKETS]; d != NULL; d = d->next)
+		if (d->hash == h && !strncmp(d->path, path, len) &&
+		    d->path[len] == '\0')
+			break;
+
+	return (d);
+}
+
+/*
+ * Free the directory, and then its parents, while nothing is under them.
+ */
+static void
+resolve_put_dir(struct resolve_shard *shard, struct resolve_dir *d)
+{
+	struct resolve_dir	*parent, **pp;
+
+	for (; d != NULL && d->entries == NULL && d->children == NULL;
+	    d = parent) {
+		for (pp = &shard->dirs[d->hash % CACHE_BUCKETS]; *pp != d;
+		    pp = &(*pp)->next)
+			;
+		*pp = d->next;
+		if ((parent = d->parent) != NULL) {
+			for (pp = &parent->children; *pp != d;
+			    pp = &(*pp)->sibling)
+				;
+			*pp = d->sibling;
+		}
+		free(d);
+	}
+}
+
+/*
+ * Return the directory made of the first len bytes of the path, adding
+ * it and its parents if needed, or NULL if they cannot be allocated.
+ * What is added goes away unless an entry is put in it.
+ */
+static struct resolve_dir *
+resolve_get_dir(struct resolve_shard *shard, const char *path, size_t len)
+{
+	struct resolve_dir	*d, *parent = NULL;
+	size_t			parent_len, i;
+
+	if ((d = resolve_find_dir(shard, path, len)) != NULL)
+		return (d);
+
+	if ((parent_len = resolve_dir_len(path, len)) > 0 &&
+	    (parent = resolve_get_dir(shard, path, parent_len)) == NULL)
+		return (NULL);
+
+	if ((d = (struct resolve_dir *) calloc(1, sizeof(*d) + len)) == NULL) {
+		resolve_put_dir(shard, parent);
+		return (NULL);
+	}
+
+	(void) memcpy(d->path, path, len);
+	d->path[len] = '\0';
+	for (i = parent_len; IS_DIRSEP_CHAR(d->path[i]); i++)
+		;
+	d->name = d->path + i;
+	d->hash = 2166136261U;
+	for (i = 0; i < len; i++)
+		d->hash = (d->hash ^ (unsigned char) path[i]) * 16777619U;
+	d->next = shard->dirs[d->hash % CACHE_BUCKETS];
+	shard->dirs[d->hash % CACHE_BUCKETS] = d;
+	if ((d->parent = parent) != NULL) {
+		d->sibling = parent->children;
+		parent->children = d;
+	}
+
+	return (d);
+}
+
+/*
+ * Remove the entry from the shard and free it, and its directory if it
+ * was the last one under it. Called with the shard locked.
+ */
+static void
+resolve_unlink(struct resolve_shard *shard, struct resolved *e)
+{
+	struct resolved	**pp;
+
+	for (pp = &shard->buckets[e->hash % CACHE_BUCKETS]; *pp != e;
+	    pp = &(*pp)->next)
+		;
+	*pp = e->next;
+	e->lru_prev->lru_next = e->lru_next;
+	e->lru_next->lru_prev = e->lru_prev;
+	if (e->dir_prev != NULL)
+		e->dir_prev->dir_next = e->dir_next;
+	else
+		e->dir->entries = e->dir_next;
+	if (e->dir_next != NULL)
+		e->dir_next->dir_prev = e->dir_prev;
+	resolve_put_dir(shard, e->dir);
+	shard->num_entries[e->is_missing]--;
+	free(e);
+}
+
+/*
+ * Remove everything under the directory, which goes away with the last
+ * entry. Every directory has an entry under it.
+ */
+static void
+resolve_unlink_dir(struct resolve_shard *shard, struct resolve_dir *d)
+{
+	struct resolve_dir	*sub;
+	struct resolved		*e;
+	bool_t			is_last;
+
+	do {
+		/* Unlinking the only entry under d frees d too */
+		is_last = TRUE;
+		for (sub = d; sub->entries == NULL; sub = sub->children)
+			is_last = is_last && sub->children->sibling == NULL;
+		e = sub->entries;
+		is_last = is_last && sub->children == NULL &&
+		    e->dir_next == NULL;
+		resolve_unlink(shard, e);
+	} while (!is_last);
+}
+
+static void
+resolve_trim(struct resolve_shard *shard, bool_t is_missing, int room)
+{
+	while (shard->num_entries[is_missing] > 0 &&
+	    shard->num_entries[is_missing] + room >
+	    shard->max_entries[is_missing])
+		resolve_unlink(shard, shard->lru[is_missing].lru_prev);
+}
+
+/*
+ * Forget everything, and apply the configured number of entries.
+ */
+static void
+resolve_flush(struct mg_context *ctx)
+{
+	struct resolve_shard	*shard;
+	int			i, j;
+
+	(void) ATOMIC_ADD(&ctx->resolve_gen, 1);
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		shard = ctx->resolved + i;
+		(void) pthread_mutex_lock(&shard->mutex);
+		for (j = 0; j < 2; j++) {
+			shard->max_entries[j] =
+			    ATOMIC_LOAD(&ctx->max_resolved[j]);
+			while (shard->num_entries[j] > 0)
+				resolve_unlink(shard, shard->lru[j].lru_next);
+		}
+		(void) pthread_mutex_unlock(&shard->mutex);
+	}
+}
+
+/*
+ * Forget the files that a change in the directory may affect. When
+ * the directory itself has gone, that is everything under it. Otherwise,
+ * it is what lies under the name the event is about, and everything in
+ * the directory if that was a passwords file. Index files are looked up
+ * again whenever a name appears in the directory or goes away. Missing
+ * files are under the name of the first missing directory, if any.
+ * Only the entries under the directory are looked at.
+ */
+static void
+resolve_invalidate(struct mg_context *ctx, const char *dir,
+		const struct inotify_event *ev)
+{
+	struct resolve_shard	*shard;
+	struct resolve_dir	*d, *sub;
+	struct resolved		*e, *next;
+	size_t			len = strlen(dir);
+	const char		*name;
+	bool_t			is_gone, is_renamed, is_auth, is_last;
+	int			i;
+
+	is_gone = (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED |
+	    IN_UNMOUNT)) != 0;
+	is_renamed = (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+	    IN_MOVED_TO)) != 0;
+	is_auth = ev->len > 0 && !strcmp(ev->name, PASSWORDS_FILE_NAME);
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		shard = ctx->resolved + i;
+		(void) pthread_mutex_lock(&shard->mutex);
+		if ((d = resolve_find_dir(shard, dir, len)) == NULL) {
+			/* Nothing under it in this shard */
+		} else if (is_gone) {
+			resolve_unlink_dir(shard, d);
+		} else {
+			/* With a subdirectory, d outlives its entries */
+			for (sub = d->children; sub != NULL &&
+			    (ev->len == 0 || strcmp(sub->name, ev->name) != 0);
+			    sub = sub->sibling)
+				;
+			for (e = d->entries; e != NULL; e = next) {
+				next = e->dir_next;
+				for (name = e->path + len;
+				    IS_DIRSEP_CHAR(*name); name++)
+					;
+				if (!is_auth && !(e->is_index && is_renamed) &&
+				    (ev->len == 0 || strcmp(name, ev->name)))
+					continue;
+				is_last = d->children == NULL &&
+				    e == d->entries && next == NULL;
+				resolve_unlink(shard, e);
+				if (is_last)
+					break;
+			}
+			if (sub != NULL)
+				resolve_unlink_dir(shard, sub);
+		}
+		(void) pthread_mutex_unlock(&shard->mutex);
+	}
+}
+
+/*
+ * Make sure the directory is watched, and return FALSE if it cannot be.
+ * A new watch bumps the generation, as the directory might have changed
+ * before it was set. Symbolic links are not followed, a change to their
+ * targets would go unnoticed.
+ */
+static bool_t
+watch_dir(struct mg_context *ctx, const char *dir)
+{
+	unsigned int	hash = cache_hash(dir);
+	struct watch	*w;
+	struct stat	st;
+	bool_t		ok;
+
+	(void) pthread_mutex_lock(&ctx->watch_mutex);
+	for (w = ctx->watches[hash % CACHE_BUCKETS]; w != NULL; w = w->next)
+		if (!strcmp(w->path, dir))
+			break;
+
+	if ((ok = w != NULL) == FALSE && lstat(dir, &st) == 0 &&
+	    S_ISDIR(st.st_mode) &&
+	    (w = (struct watch *) malloc(sizeof(*w) + strlen(dir))) != NULL) {
+		if ((w->wd = inotify_add_watch(ctx->inotify_fd, dir,
+		    WATCH_EVENTS)) == -1) {
+			free(w);
+		} else {
+			(void) strcpy(w->path, dir);
+			w->next = ctx->watches[hash % CACHE_BUCKETS];
+			ctx->watches[hash % CACHE_BUCKETS] = w;
+			(void) ATOMIC_ADD(&ctx->resolve_gen, 1);
+			ok = TRUE;
+		}
+	}
+	(void) pthread_mutex_unlock(&ctx->watch_mutex);
+
+	return (ok);
+}
+
+/*
+ * Watch every directory from the one the URI was appended to down to
+ * the file. Return FALSE if some of them cannot be watched. For a missing
+ * file, the walk stops at the first name that is not a directory.
+ */
+static bool_t
+watch_path(struct mg_context *ctx, const char *path, size_t base,
+		bool_t is_missing)
+{
+	char		dir[FILENAME_MAX];
+	struct stat	st;
+	size_t		i;
+	bool_t		ok = TRUE;
+
+	for (i = base; i > 0 && !IS_DIRSEP_CHAR(path[i]); i--)
+		;
+	for (; path[i] != '\0'; i++) {
+		if (i == 0 || i >= sizeof(dir) || !IS_DIRSEP_CHAR(path[i]) ||
+		    IS_DIRSEP_CHAR(path[i - 1]))
+			continue;
+		(void) memcpy(dir, path, i);
+		dir[i] = '\0';
+		if (watch_dir(ctx, dir))
+			continue;
+		else if (is_missing && (lstat(dir, &st) != 0 ||
+		    (!S_ISDIR(st.st_mode) && !S_ISLNK(st.st_mode))))
+			break;
+		ok = FALSE;
+	}
+
+	return (ok);
+}
+
+/*
+ * Look up what the URI resolves to. If it is not known, convert the URI
+ * to the file name, and remember how it was done for resolve_insert().
+ */
+static int
+resolve_uri(struct mg_connection *conn, const char *uri,
+		char *path, size_t path_len, struct mgstat *stp)
+{
+	struct mg_context	*ctx = conn->ctx;
+	const char		*method = conn->request_info.request_method;
+	unsigned int		hash = cache_hash(uri);
+	struct resolve_shard	*shard = resolve_shard(ctx, hash);
+	struct resolved		*e;
+	size_t			len;
+	int			kind = RESOLVE_UNKNOWN;
+
+	/* Also tells the static file cache what it may have missed */
+	conn->resolve_gen = ATOMIC_LOAD(&ctx->resolve_gen);
+
+	if (ATOMIC_LOAD(&ctx->is_resolving) &&
+	    (!strcmp(method, "GET") || !strcmp(method, "HEAD"))) {
+		(void) pthread_mutex_lock(&shard->mutex);
+		for (e = shard->buckets[hash % CACHE_BUCKETS]; e != NULL;
+		    e = e->next)
+			if (e->hash == hash && !strcmp(e->uri, uri))
+				break;
+		if (e != NULL && strlen(e->path) < path_len) {
+			e->lru_prev->lru_next = e->lru_next;
+			e->lru_next->lru_prev = e->lru_prev;
+			resolve_push(shard, e);
+			(void) strcpy(path, e->path);
+			*stp = e->st;
+			kind = e->is_missing ? RESOLVE_MISSING : RESOLVE_FILE;
+		}
+		(void) pthread_mutex_unlock(&shard->mutex);
+	}
+
+	if (kind == RESOLVE_UNKNOWN) {
+		convert_uri_to_file_name(conn, uri, path, path_len);
+		len = strlen(uri);
+		conn->resolve_base = strlen(path) > len ? strlen(path) - len : 0;
+	}
+
+	return (kind);
+}
+
+/*
+ * Remember the file that the URI has been resolved to, or that it does
+ * not exist if stp is NULL. Nothing is remembered if something has been
+ * invalidated since resolve_uri() was called, since the file may be
+ * affected. Dangling symbolic links are not remembered as missing.
+ */
+static void
+resolve_insert(struct mg_connection *conn, const char *uri,
+		const char *path, const struct mgstat *stp)
+{
+	struct mg_context	*ctx = conn->ctx;
+	const char		*method = conn->request_info.request_method;
+	size_t			uri_len = strlen(uri) + 1, dir_len;
+	struct resolve_shard	*shard;
+	struct resolved		*e, **pp;
+	struct stat		st;
+	bool_t			is_missing = stp == NULL;
+
+	if (!ATOMIC_LOAD(&ctx->is_resolving) ||
+	    (strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0) ||
+	    !watch_path(ctx, path, conn->resolve_base, is_missing) ||
+	    (lstat(path, &st) == 0) == is_missing ||
+	    (!is_missing && !S_ISREG(st.st_mode)) ||
+	    (e = (struct resolved *) calloc(1, sizeof(*e) + uri_len +
+	    strlen(path))) == NULL)
+		return;
+
+	(void) memcpy(e->uri, uri, uri_len);
+	e->path = e->uri + uri_len;
+	(void) strcpy(e->path, path);
+	e->hash = cache_hash(uri);
+	e->is_missing = is_missing;
+	if (!is_missing) {
+		e->is_index = uri[uri_len - 2] == '/';
+		e->st = *stp;
+	}
+
+	shard = resolve_shard(ctx, e->hash);
+	(void) pthread_mutex_lock(&shard->mutex);
+	if (conn->resolve_gen != ATOMIC_LOAD(&ctx->resolve_gen) ||
+	    shard->max_entries[is_missing] == 0) {
+		free(e);
+		e = NULL;
+	} else {
+		for (pp = &shard->buckets[e->hash % CACHE_BUCKETS];
+		    *pp != NULL; pp = &(*pp)->next)
+			if ((*pp)->hash == e->hash && !strcmp((*pp)->uri, uri))
+				break;
+		if (*pp != NULL)
+			resolve_unlink(shard, *pp);
+		resolve_trim(shard, is_missing, 1);
+
+		/* Files with no directory could not be watched anyway */
+		if ((dir_len = resolve_dir_len(path, strlen(path))) == 0 ||
+		    (e->dir = resolve_get_dir(shard, path, dir_len)) == NULL) {
+			free(e);
+		} else {
+			e->dir_next = e->dir->entries;
+			if (e->dir_next != NULL)
+				e->dir_next->dir_prev = e;
+			e->dir->entries = e;
+			e->next = shard->buckets[e->hash % CACHE_BUCKETS];
+			shard->buckets[e->hash % CACHE_BUCKETS] = e;
+			resolve_push(shard, e);
+			shard->num_entries[is_missing]++;
+		}
+	}
+	(void) pthread_mutex_unlock(&shard->mutex);
+}
+
+/*
+ * Invalidate what the event may affect. The generation is bumped first,
+ * so that a worker either sees the bump before it inserts, or inserts
+ * before the shard is scanned.
+ */
+static void
+handle_watch_event(struct mg_context *ctx, const struct inotify_event *ev)
+{
+	struct watch	*w, **pp;
+	char		path[FILENAME_MAX];
+	bool_t		is_gone, is_written;
+	int		i;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		resolve_flush(ctx);
+		cache_flush(ctx);
+		return;
+	}
+	is_written = ev->len > 0 &&
+	    (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) != 0;
+
+	is_gone = (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED |
+	    IN_UNMOUNT)) != 0;
+	(void) ATOMIC_ADD(&ctx->resolve_gen, 1);
+
+	(void) pthread_mutex_lock(&ctx->watch_mutex);
+	for (i = 0; i < CACHE_BUCKETS; i++) {
+		for (pp = &ctx->watches[i]; (w = *pp) != NULL; ) {
+			if (w->wd != ev->wd) {
+				pp = &w->next;
+				continue;
+			}
+			resolve_invalidate(ctx, w->path, ev);
+			if (is_written && mg_snprintf(fc(ctx), path,
+			    sizeof(path), "%s%c%s", w->path, DIRSEP,
+			    ev->name) < (int) sizeof(path) - 1)
+				cache_evict(ctx, path);
+			if (is_gone) {
+				*pp = w->next;
+				free(w);
+			} else {
+				pp = &w->next;
+			}
+		}
+	}
+	(void) pthread_mutex_unlock(&ctx->watch_mutex);
+
+	/* Watches go by path, and a moved directory has left it */
+	if (is_gone && !(ev->mask & IN_IGNORED))
+		(void) inotify_rm_watch(ctx->inotify_fd, ev->wd);
+}
+
+/*
+ * Watcher thread reads inotify events until mg_stop() is called.
+ */
+static void
+watcher_thread(struct mg_context *ctx)
+{
+	union {
+		struct inotify_event	ev;
+		char			buf[4096];
+	} u;
+	const struct inotify_event	*ev;
+	struct pollfd	pfd[2];
+	ssize_t		n;
+	char		*p;
+
+	pfd[0].fd = ctx->inotify_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = ctx->stop_fd[0];
+	pfd[1].events = POLLIN;
+
+	while (ATOMIC_LOAD(&ctx->stop_flag) == 0) {
+		if (poll(pfd, 2, 1000) <= 0 || pfd[0].revents == 0 ||
+		    (n = read(ctx->inotify_fd, u.buf, sizeof(u.buf))) <= 0)
+			continue;
+		for (p = u.buf; p < u.buf + n; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *) p;
+			handle_watch_event(ctx, ev);
+		}
+	}
+
+	(void) pthread_mutex_lock(&ctx->thr_mutex);
+	ctx->has_watcher = FALSE;
+	(void) pthread_cond_signal(&ctx->thr_cond);
+	(void) pthread_mutex_unlock(&ctx->thr_mutex);
+}
+#else
+#define	resolve_uri(conn, uri, path, path_len, stp)	\
+	(convert_uri_to_file_name(conn, uri, path, path_len), RESOLVE_UNKNOWN)
+#define	resolve_insert(conn, uri, path, stp)	(void) 0
+#define	resolve_flush(ctx)			(void) 0
+#endif /* USE_INOTIFY */
+
+/*
+ * Return TRUE if the Accept-Encoding header value accepts the coding.
+ * A coding listed by name takes precedence over "*", and q=0 refuses.
+ */
+static bool_t
+accepts_encoding(const char *header, const char *coding)
+{
+	size_t		len = strlen(coding);
+	const char	*p, *end;
+	struct vec	vec;
+	int		named = -1, any = -1, accepted;
+
+	while ((header = next_option(header, &vec, NULL)) != NULL) {
+		end = vec.ptr + vec.len;
+		while (vec.ptr < end && isspace(* (unsigned char *) vec.ptr))
+			vec.ptr++;
+
+		/* Parameters follow ';', only q= is looked at */
+		accepted = TRUE;
+		for (p = vec.ptr; p < end && *p != ';'; p++)
+			;
+		vec.len = p - vec.ptr;
+		while (p < end) {
+			for (p++; p < end && isspace(* (unsigned char *) p); p++)
+				;
+			if (end - p > 1 && tolower(* (unsigned char *) p) == 'q'
+			    && p[1] == '=')
+				accepted = strtod(p + 2, NULL) > 0;
+			while (p < end && *p != ';')
+				p++;
+		}
+
+		while (vec.len > 0 &&
+		    isspace(((unsigned char *) vec.ptr)[vec.len - 1]))
+			vec.len--;
+		if (vec.len == len && !mg_strncasecmp(vec.ptr, coding, len))
+			named = accepted;
+		else if (vec.len == 1 && vec.ptr[0] == '*')
+			any = accepted;
+	}
+
+	return (named != -1 ? named == TRUE : any == TRUE);
+}
+
+/*
+ * Return TRUE if the URI falls under one of the "protect" prefixes.
+ */
+static bool_t
+is_protected_uri(struct mg_context *ctx, const char *uri)
+{
+	struct vec	uri_vec, filename_vec;
+	const char	*list;
+	bool_t		is_protected = FALSE;
+
+	lock_option(ctx, OPT_PROTECT);
+	list = ctx->options[OPT_PROTECT];
+	while ((list = next_option(list, &uri_vec, &filename_vec)) != NULL)
+		if (!memcmp(uri, uri_vec.ptr, uri_vec.len)) {
+			is_protected = TRUE;
+			break;
+		}
+	unlock_option(ctx, OPT_PROTECT);
+
+	return (is_protected);
+}
+
+/*
+ * If precompressed files are enabled, look for file.br and file.gz next
+ * to the file in path, in order of preference. The first one that the
+ * client accepts replaces path and *stp, and its encoding is returned.
+ * *has_variants tells if any of them exists, in which case the response
+ * depends on Accept-Encoding. Whether they exist is remembered like for
+ * any other URI. Files under access control are left alone.
+ */
+static const struct encoding *
+find_precompressed(struct mg_connection *conn, const char *uri,
+		char *path, size_t path_len, struct mgstat *stp,
+		bool_t *has_variants)
+{
+	const struct encoding	*enc, *found = NULL;
+	const char		*header, *name;
+	char			sib_uri[FILENAME_MAX], sib_path[FILENAME_MAX];
+	struct mgstat		st;
+	int			resolved;
+#if defined(USE_INOTIFY)
+	int			gen = conn->resolve_gen;
+#endif /* USE_INOTIFY */
+
+	*has_variants = FALSE;
+	if (!is_true(conn->ctx->options[OPT_PRECOMPRESSED]))
+		return (NULL);
+	header = mg_get_header(conn, "Accept-Encoding");
+
+	/* For a directory, the URI of the index file is used */
+	if ((name = strrchr(path, DIRSEP)) == NULL)
+		name = path;
+	else
+		name++;
+
+	for (enc = encodings; enc->name != NULL; enc++) {
+		(void) mg_snprintf(conn, sib_uri, sizeof(sib_uri), "%s%s%s",
+		    uri, uri[strlen(uri) - 1] == '/' ? name : "", enc->ext);
+		if (is_protected_uri(conn->ctx, sib_uri))
+			continue;
+
+		resolved = resolve_uri(conn, sib_uri, sib_path,
+		    sizeof(sib_path), &st);
+		if (resolved == RESOLVE_UNKNOWN) {
+			if (mg_stat(sib_path, &st) != 0) {
+				resolve_insert(conn, sib_uri, sib_path, NULL);
+				resolved = RESOLVE_MISSING;
+			} else {
+				resolve_insert(conn, sib_uri, sib_path, &st);
+			}
+		}
+		if (resolved == RESOLVE_MISSING || st.is_directory)
+			continue;
+
+		*has_variants = TRUE;
+		if (found == NULL && header != NULL &&
+		    accepts_encoding(header, enc->name) &&
+		    strlen(sib_path) < path_len) {
+			(void) strcpy(path, sib_path);
+			*stp = st;
+			found = enc;
+		}
+	}
+
+#if defined(USE_INOTIFY)
+	/* The file to send has been looked up after that */
+	conn->resolve_gen = gen;
+#endif /* USE_INOTIFY */
+
+	return (found);
+}
+
+/*
+ * This is the heart of the Mongoose's logic.
+ * This function is called when the request is read, parsed and validated,
+ * and Mongoose must decide what action to take: serve a file, or
+ * a directory, or call embedded function, etcetera.
+ */
+static void
+analyze_request(struct mg_connection *conn)
+{
+	struct mg_request_info *ri = &conn->request_info;
+	char			path[FILENAME_MAX], *uri = ri->uri;
+	struct mgstat		st;
+	const struct callback	*cb;
+	const struct encoding	*enc = NULL;
+	bool_t			is_protected, vary = FALSE;
+	int			resolved;
+
+	if ((conn->request_info.query_string = strchr(uri, '?')) != NULL)
+		* conn->request_info.query_string++ = '\0';
+
+	(void) url_decode(uri, (int) strlen(uri), uri, strlen(uri) + 1, FALSE);
+	remove_double_dots_and_double_slashes(uri);
+	resolved = resolve_uri(conn, uri, path, sizeof(path), &st);
+	/* Only files without access control are remembered */
+	is_protected = resolved == RESOLVE_UNKNOWN;
+
+	if (resolved == RESOLVE_UNKNOWN &&
+	    !check_authorization(conn, path, &is_protected)) {
+		send_authorization_request(conn);
+	} else if (check_embedded_authorization(conn) == FALSE) {
+		/*
+		 * Embedded code failed authorization. Do nothing here, since
+		 * an embedded code must handle this itself by either
+		 * showing proper error message, or redirecting to some
+		 * sort of login page, or something else.
+		 */
+	} else if ((cb = find_callback(conn->ctx, FALSE, uri, -1)) != NULL) {
+		if ((strcmp(ri->request_method, "POST") != 0 &&
+		    strcmp(ri->request_method, "PUT") != 0) ||
+		    handle_request_body(conn, NULL))
+			cb->func(conn, &conn->request_info, cb->user_data);
+	} else if (strstr(path, PASSWORDS_FILE_NAME)) {
+		/* Do not allow to view passwords files */
+		send_error(conn, 403, "Forbidden", "Access Forbidden");
+	} else if ((!strcmp(ri->request_method, "PUT") ||
+	    !strcmp(ri->request_method, "DELETE")) &&
+	    (conn->ctx->options[OPT_AUTH_PUT] == NULL ||
+	     !is_authorized_for_put(conn))) {
+		send_authorization_request(conn);
+	} else if (!strcmp(ri->request_method, "PUT")) {
+		put_file(conn, path);
+	} else if (!strcmp(ri->request_method, "DELETE")) {
+		if (mg_remove(path) == 0)
+			send_error(conn, 200, "OK", "");
+		else
+			send_error(conn, 500, http_500_error,
+			    "remove(%s): %s", path, strerror(ERRNO));
+	} else if (resolved == RESOLVE_MISSING ||
+	    (resolved == RESOLVE_UNKNOWN && mg_stat(path, &st) != 0)) {
+		if (resolved == RESOLVE_UNKNOWN && !is_protected)
+			resolve_insert(conn, uri, path, NULL);
+		send_error(conn, 404, "Not Found", "%s", "File not found");
+	} else if (st.is_directory && uri[strlen(uri) - 1] != '/') {
+		(void) mg_printf(conn,
+		    "HTTP/1.1 301 Moved Permanently\r\n"
+		    "Content-Length: 0\r\n"
+		    "Connection: %s\r\n"
+		    "Location: %s/\r\n\r\n",
+		    suggest_connection_header(conn), uri);
+	} else if (st.is_directory &&
+	    substitute_index_file(conn, path, sizeof(path), &st) == FALSE) {
+		if (is_true(conn->ctx->options[OPT_DIR_LIST])) {
+			send_directory(conn, path);
+		} else {
+			send_error(conn, 403, "Directory Listing Denied",
+			    "Directory listing denied");
+		}
+#if !defined(NO_CGI)
+	} else if (match_extension(path,
+	    conn->ctx->options[OPT_CGI_EXTENSIONS])) {
+		if (strcmp(ri->request_method, "POST") &&
+		    strcmp(ri->request_method, "GET")) {
+			send_error(conn, 501, "Not Implemented",
+			    "Method %s is not implemented", ri->request_method);
+		} else {
+			send_cgi(conn, path);
+		}
+#endif /* NO_CGI */
+#if !defined(NO_SSI)
+	} else if (match_extension(path,
+	    conn->ctx->options[OPT_SSI_EXTENSIONS])) {
+		send_ssi(conn, path);
+#endif /* NO_SSI */
+	} else {
+		if (resolved == RESOLVE_UNKNOWN && !is_protected)
+			resolve_insert(conn, uri, path, &st);
+		if (!is_protected)
+			enc = find_precompressed(conn, uri, path, sizeof(path),
+			    &st, &vary);
+		if (is_not_modified(conn, &st))
+			send_error(conn, 304, "Not Modified", "");
+		else
+			send_file(conn, path, &st, enc, vary);
+	}
+}
+
+static void
+close_all_listening_sockets(struct mg_context *ctx)
+{
+	int	i;
+
+	for (i = 0; i < ctx->num_listeners; i++)
+		(void) closesocket(ctx->listeners[i].sock);
+	ctx->num_listeners = 0;
+}
+
+static void close_listener(struct mg_context *, const struct socket *);
+
+/*
+ * Rebind to the new list of ports. Sockets of the ports that stay are
+ * kept, so their listen queues are not lost. All new sockets are opened
+ * before the old ones are closed. If some port cannot be bound, the old
+ * sockets are left as they were. New ports are bound exclusively, see
+ * open_listening_socket(), so a port that another process listens on
+ * fails the rebind rather than being shared with it.
+ */
+static bool_t
+set_ports_option(struct mg_context *ctx, const char *list)
+{
+	struct socket	listeners[MAX_LISTENING_SOCKETS], *listener;
+	bool_t		is_kept[MAX_LISTENING_SOCKETS];
+	bool_t		is_new[MAX_LISTENING_SOCKETS];
+	struct vec	vec;
+	int		i, n = 0;
+	bool_t		ok = TRUE;
+
+	(void) memset(is_kept, 0, sizeof(is_kept));
+
+	while (ok && (list = next_option(list, &vec, NULL)) != NULL) {
+
+		listener = listeners + n;
+		listener->is_ssl = vec.ptr[vec.len - 1] == 's' ? TRUE : FALSE;
+
+		if (n >= (int) (ARRAY_SIZE(listeners) - 1)) {
+			cry(fc(ctx), "%s", "Too many listeninig sockets");
+			ok = FALSE;
+		} else if (!parse_listening_address(vec.ptr, &listener->lsa)) {
+			cry(fc(ctx), "cannot bind to %.*s", vec.len, vec.ptr);
+			ok = FALSE;
+		} else if (listener->is_ssl == TRUE && ctx->ssl_ctx == NULL) {
+			cry(fc(ctx), "cannot add SSL socket, please specify "
+			    "-ssl_cert option BEFORE -ports option");
+			ok = FALSE;
+		} else {
+			/* Take over the old socket, if the port stays */
+			for (i = 0; i < ctx->num_listeners; i++)
+				if (!is_kept[i] &&
+				    is_same_listener(ctx->listeners + i, listener))
+					break;
+
+			if ((is_new[n] = i == ctx->num_listeners) == FALSE) {
+				is_kept[i] = TRUE;
+				listener->sock = ctx->listeners[i].sock;
+				n++;
+			} else if ((listener->sock = open_listening_socket(ctx,
+			    &listener->lsa, INVALID_SOCKET)) ==
+			    INVALID_SOCKET) {
+				cry(fc(ctx), "cannot bind to %.*s",
+				    vec.len, vec.ptr);
+				ok = FALSE;
+			} else {
+				n++;
+			}
+		}
+	}
+
+	if (!ok) {
+		for (i = 0; i < n; i++)
+			if (is_new[i])
+				(void) closesocket(listeners[i].sock);
+		return (FALSE);
+	}
+
+	for (i = 0; i < ctx->num_listeners; i++)
+		if (!is_kept[i])
+			close_listener(ctx, ctx->listeners + i);
+
+	(void) memcpy(ctx->listeners, listeners, n * sizeof(listeners[0]));
+	ctx->num_listeners = n;
+
+	/* Acceptors other than the master thread check it without the lock */
+	(void) ATOMIC_ADD(&ctx->listeners_generation, 1);
+
+	return (TRUE);
+}
+
+static void
+log_header(const struct mg_connection *conn, const char *header, FILE *fp)
+{
+	const char	*header_value;
+
+	if ((header_value = mg_get_header(conn, header)) == NULL) {
+		(void) fprintf(fp, "%s", " -");
+	} else {
+		(void) fprintf(fp, " \"%s\"", header_value);
+	}
+}
+
+static void
+log_access(const struct mg_connection *conn)
+{
+	const struct mg_request_info *ri;
+	char		date[64];
+
+	if (conn->ctx->access_log == NULL)
+		return;
+
+	(void) strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S %z",
+	    localtime(&conn->birth_time));
+
+	ri = &conn->request_info;
+
+	flockfile(conn->ctx->access_log);
+
+	(void) fprintf(conn->ctx->access_log,
+	    "%s - %s [%s] \"%s %s HTTP/%s\" %d %" INT64_FMT,
+	    inet_ntoa(conn->client.rsa.u.sin.sin_addr),
+	    ri->remote_user == NULL ? "-" : ri->remote_user,
+	    date,
+	    ri->request_method ? ri->request_method : "-",
+	    ri->uri ? ri->uri : "-",
+	    ri->http_version,
+	    conn->request_info.status_code, conn->num_bytes_sent);
+	log_header(conn, "Referer", conn->ctx->access_log);
+	log_header(conn, "User-Agent", conn->ctx->access_log);
+	(void) fputc('\n', conn->ctx->access_log);
+	(void) fflush(conn->ctx->access_log);
+
+	funlockfile(conn->ctx->access_log);
+}
+
+static bool_t
+isbyte(int n) {
+	return (n >= 0 && n <= 255);
+}
+
+/*
+ * Verify given socket address against the ACL.
+ * Return -1 if ACL is malformed, 0 if address is disallowed, 1 if allowed.
+ */
+static int
+check_acl(struct mg_context *ctx, const char *list, const struct usa *usa)
+{
+	int		a, b, c, d, n, mask, allowed;
+	char		flag;
+	uint32_t	acl_subnet, acl_mask, remote_ip;
+	struct vec	vec;
+
+	(void) memcpy(&remote_ip, &usa->u.sin.sin_addr, sizeof(remote_ip));
+
+	/* If any ACL is set, deny by default */
+	allowed = '-';
+
+	while ((list = next_option(list, &vec, NULL)) != NULL) {
+
+		mask = 32;
+
+		if (sscanf(vec.ptr, "%c%d.%d.%d.%d%n",
+		    &flag, &a, &b, &c, &d, &n) != 5) {
+			cry(fc(ctx),
+			    "%s: subnet must be [+|-]x.x.x.x[/x]", __func__);
+			return (-1);
+		} else if (flag != '+' && flag != '-') {
+			cry(fc(ctx), "%s: flag must be + or -: [%s]",
+			    __func__, vec.ptr);
+			return (-1);
+		} else if (!isbyte(a)||!isbyte(b)||!isbyte(c)||!isbyte(d)) {
+			cry(fc(ctx),
+			    "%s: bad ip address: [%s]", __func__, vec.ptr);
+			return (-1);
+		} else if (sscanf(vec.ptr + n, "/%d", &mask) == 0) {
+			/* Do nothing, no mask specified */
+		} else if (mask < 0 || mask > 32) {
+			cry(fc(ctx), "%s: bad subnet mask: %d [%s]",
+			    __func__, n, vec.ptr);
+			return (-1);
+		}
+
+		acl_subnet = (a << 24) | (b << 16) | (c << 8) | d;
+		acl_mask = mask ? 0xffffffffU << (32 - mask) : 0;
+
+		if (acl_subnet == (ntohl(remote_ip) & acl_mask))
+			allowed = flag;
+	}
+
+	return (allowed == '+' ? 1 : 0);
+}
+
+#if !defined(USE_EPOLL)
+static void
+add_to_set(SOCKET fd, fd_set *set, int *max_fd)
+{
+	FD_SET(fd, set);
+	if (fd > (SOCKET) *max_fd)
+		*max_fd = (int) fd;
+}
+#endif /* !USE_EPOLL */
+
+/*
+ * Deallocate a connection whose socket is closed. If mg_drain() is
+ * waiting, wake it up when the last one goes.
+ */
+static void
+free_connection(struct mg_connection *conn)
+{
+	struct mg_context	*ctx = conn->ctx;
+
+	free(conn->out);
+	free(conn);
+	if (ATOMIC_ADD(&ctx->num_connections, -1) == 1 &&
+	    ATOMIC_LOAD(&ctx->is_draining))
+		park_wake(&ctx->drained);
+}
+
+/*
+ * Deallocate mongoose context, free up the resources
+ */
+static void
+mg_fini(struct mg_context *ctx)
+{
+	struct mg_connection	*conn;
+	struct ring		*ring;
+#if defined(USE_INOTIFY)
+	struct watch		*w;
+#endif /* USE_INOTIFY */
+	int			i;
+
+	close_all_listening_sockets(ctx);
+
+	/* Wait until all threads finish */
+	(void) pthread_mutex_lock(&ctx->thr_mutex);
+	while (ctx->num_threads > 0 || ctx->num_exiting > 0 ||
+	    ctx->has_manager || ctx->has_watcher)
+		(void) pthread_cond_wait(&ctx->thr_cond, &ctx->thr_mutex);
+	(void) pthread_mutex_unlock(&ctx->thr_mutex);
+
+#if defined(USE_EPOLL)
+	/* Idle connections parked after the master thread has exited */
+	while ((conn = ctx->parked) != NULL) {
+		ctx->parked = conn->next;
+		(void) closesocket(conn->client.sock);
+		free_connection(conn);
+	}
+	if (ctx->parked_fd != -1)
+		(void) close(ctx->parked_fd);
+#endif /* USE_EPOLL */
+
+	/* Drop connections nobody has picked up, and free the queues */
+	while ((conn = dequeue_connection(ctx)) != NULL) {
+		(void) closesocket(conn->client.sock);
+		free_connection(conn);
+	}
+	while ((ring = ctx->queue) != NULL) {
+		ctx->queue = ring->next;
+		free(ring);
+	}
+	while ((ring = ctx->retired) != NULL) {
+		ctx->retired = ring->next;
+		while ((conn = ring_get(ring)) != NULL) {
+			(void) closesocket(conn->client.sock);
+			free_connection(conn);
+		}
+		free(ring);
+	}
+	for (i = 0; i < ctx->num_workers; i++) {
+		while ((conn = ring_get(ctx->workers[i]->queue)) != NULL) {
+			(void) closesocket(conn->client.sock);
+			free_connection(conn);
+		}
+		free(ctx->workers[i]->queue);
+		(void) pthread_mutex_destroy(&ctx->workers[i]->sock_mutex);
+		park_destroy(&ctx->workers[i]->wakeup);
+#if defined(USE_IO_URING)
+		if (ctx->workers[i]->uring != NULL)
+			uring_free(ctx->workers[i]->uring);
+#endif /* USE_IO_URING */
+#if defined(USE_COROUTINES)
+		if (ctx->workers[i]->has_scheduler) {
+			(void) close(ctx->workers[i]->epoll_fd);
+			(void) close(ctx->workers[i]->event_fd);
+		}
+#endif /* USE_COROUTINES */
+		free(ctx->workers[i]);
+	}
+
+	/* Nobody sends from the cache any more */
+	cache_clear(ctx, 0);
+	for (i = 0; i < CACHE_SHARDS; i++)
+		(void) pthread_mutex_destroy(&ctx->cache[i].mutex);
+
+#if !defined(_WIN32)
+	ctx->max_open_files = 0;
+	open_file_flush(ctx);
+	for (i = 0; i < CACHE_SHARDS; i++)
+		(void) pthread_mutex_destroy(&ctx->open_files[i].mutex);
+#endif /* !_WIN32 */
+
+#if defined(USE_INOTIFY)
+	ctx->max_resolved[FALSE] = ctx->max_resolved[TRUE] = 0;
+	resolve_flush(ctx);
+	for (i = 0; i < CACHE_SHARDS; i++)
+		(void) pthread_mutex_destroy(&ctx->resolved[i].mutex);
+	for (i = 0; i < CACHE_BUCKETS; i++)
+		while ((w = ctx->watches[i]) != NULL) {
+			ctx->watches[i] = w->next;
+			free(w);
+		}
+	(void) pthread_mutex_destroy(&ctx->watch_mutex);
+	if (ctx->inotify_fd != -1)
+		(void) close(ctx->inotify_fd);
+#endif /* USE_INOTIFY */
+
+	/* Deallocate all registered callbacks */
+	for (i = 0; i < ctx->num_callbacks; i++)
+		if (ctx->callbacks[i].uri_regex != NULL)
+			free(ctx->callbacks[i].uri_regex);
+
+	/* Deallocate all options */
+	for (i = 0; i < NUM_OPTIONS; i++)
+		if (ctx->options[i] != NULL)
+			free(ctx->options[i]);
+
+	/* Close log files */
+	if (ctx->access_log)
+		(void) fclose(ctx->access_log);
+	if (ctx->error_log)
+		(void) fclose(ctx->error_log);
+
+	/* Deallocate SSL context */
+	if (ctx->ssl_ctx)
+		SSL_CTX_free(ctx->ssl_ctx);
+
+	/* Deallocate mutexes and condvars */
+	for (i = 0; i < NUM_OPTIONS; i++)
+		(void) pthread_mutex_destroy(&ctx->opt_mutex[i]);
+
+	(void) pthread_mutex_destroy(&ctx->bind_mutex);
+	(void) pthread_cond_destroy(&ctx->thr_cond);
+	park_destroy(&ctx->queue_full);
+	park_destroy(&ctx->pool_wanted);
+	park_destroy(&ctx->drained);
+
+	/* Signal mg_stop() that we're done. It frees what is left */
+	(void) pthread_mutex_lock(&ctx->thr_mutex);
+	ATOMIC_STORE(&ctx->stop_flag, 2);
+	(void) pthread_cond_signal(&ctx->stop_cond);
+	(void) pthread_mutex_unlock(&ctx->thr_mutex);
+}
+
+#if !defined(_WIN32)
+static bool_t
+set_uid_option(struct mg_context *ctx, const char *uid)
 {
-	struct callback	*cb;
+	struct passwd	*pw;
+	int		retval = FALSE;
 
-	pthread_mutex_lock(&ctx->bind_mutex);
-	if (func == NULL) {
-		remove_callback(ctx, uri_regex, status_code, is_auth);
-	} else if (ctx->num_callbacks >= (int) ARRAY_SIZE(ctx->callbacks) - 1) {
-		cry(fc(ctx), "Too many callbacks! Increase MAX_CALLBACKS.");
-	} else {
-		cb = &ctx->callbacks[ctx->num_callbacks];
-		cb->uri_regex = uri_regex ? mg_strdup(uri_regex) : NULL;
-		cb->func = func;
-		cb->is_auth = is_auth;
-		cb->status_code = status_code;
-		cb->user_data = user_data;
-		ctx->num_callbacks++;
-		DEBUG_TRACE((DEBUG_MGS_PREFIX "%s: uri %s code %d",
-		    __func__, uri_regex ? uri_regex : "NULL", status_code));
-	}
-	pthread_mutex_unlock(&ctx->bind_mutex);
+	if ((pw = getpwnam(uid)) == NULL)
+		cry(fc(ctx), "%s: unknown user [%s]", __func__, uid);
+	else if (setgid(pw->pw_gid) == -1)
+		cry(fc(ctx), "%s: setgid(%s): %s",
+		    __func__, uid, strerror(errno));
+	else if (setuid(pw->pw_uid) == -1)
+		cry(fc(ctx), "%s: setuid(%s): %s",
+		    __func__, uid, strerror(errno));
+	else
+		retval = TRUE;
+
+	return (retval);
 }
+#endif /* !_WIN32 */
 
+#if !defined(NO_SSL)
 void
-mg_set_uri_callback(struct mg_context *ctx, const char *uri_regex,
-		mg_callback_t func, void *user_data)
+mg_set_ssl_password_callback(struct mg_context *ctx, mg_spcb_t func)
 {
-	assert(uri_regex != NULL);
-	add_callback(ctx, uri_regex, -1, func, FALSE, user_data);
+	ctx->ssl_password_callback = func;
 }
 
-void
-mg_set_error_callback(struct mg_context *ctx, int error_code,
-		mg_callback_t func, void *user_data)
+static pthread_mutex_t *ssl_mutexes;
+
+static void
+ssl_locking_callback(int mode, int mutex_num, const char *file, int line)
 {
-	assert(error_code >= 0 && error_code < 1000);
-	add_callback(ctx, NULL, error_code, func, FALSE, user_data);
+	line = 0;	/* Unused */
+	file = NULL;	/* Unused */
+
+	if (mode & CRYPTO_LOCK)
+		(void) pthread_mutex_lock(&ssl_mutexes[mutex_num]);
+	else
+		(void) pthread_mutex_unlock(&ssl_mutexes[mutex_num]);
 }
 
-void
-mg_set_auth_callback(struct mg_context *ctx, const char *uri_regex,
-		mg_callback_t func, void *user_data)
+static unsigned long
+ssl_id_callback(void)
 {
-	assert(uri_regex != NULL);
-	add_callback(ctx, uri_regex, -1, func, TRUE, user_data);
+	return ((unsigned long) pthread_self());
+}
+
+static bool_t
+load_dll(struct mg_context *ctx, const char *dll_name, struct ssl_func *sw)
+{
+	union {void *p; void (*fp)(void);} u;
+	void		*dll_handle;
+	struct ssl_func	*fp;
+
+	if ((dll_handle = dlopen(dll_name, RTLD_LAZY)) == NULL) {
+		cry(fc(ctx), "%s: cannot load %s", __func__, dll_name);
+		return (FALSE);
+	}
+
+	for (fp = sw; fp->name != NULL; fp++) {
+#ifdef _WIN32
+		/* GetProcAddress() returns pointer to function */
+		u.fp = (void (*)(void)) dlsym(dll_handle, fp->name);
+#else
+		/*
+		 * dlsym() on UNIX returns void *.
+		 * ISO C forbids casts of data pointers to function
+		 * pointers. We need to use a union to make a cast.
+		 */
+		u.p = dlsym(dll_handle, fp->name);
+#endif /* _WIN32 */
+		if (u.fp == NULL) {
+			cry(fc(ctx), "%s: cannot find %s", __func__, fp->name);
+			return (FALSE);
+		} else {
+			fp->ptr = u.fp;
+		}
+	}
+
+	return (TRUE);
 }
 
 /*
- * Return True if we should reply 304 Not Modified.
+ * Dynamically load SSL library. Set up ctx->ssl_ctx pointer.
  */
 static bool_t
-is_not_modified(const struct mg_connection *conn, const struct mgstat *stp)
+set_ssl_option(struct mg_context *ctx, const char *pem)
 {
-	const char *ims = mg_get_header(conn, "If-Modified-Since");
-	return (ims != NULL && stp->mtime < date_to_epoch(ims));
+	SSL_CTX		*CTX;
+	int		i, size, retval = FALSE;
+
+#if !TARGET_OS_IPHONE || TARGET_IPHONE_SIMULATOR
+    if (load_dll(ctx, SSL_LIB, ssl_sw) == FALSE ||
+	    load_dll(ctx, CRYPTO_LIB, crypto_sw) == FALSE)
+		return (FALSE);
+#endif
+    
+	/* Initialize SSL crap */
+	SSL_library_init();
+
+	if ((CTX = SSL_CTX_new(SSLv23_server_method())) == NULL)
+		cry(fc(ctx), "SSL_CTX_new error");
+	else if (ctx->ssl_password_callback != NULL)
+		SSL_CTX_set_default_passwd_cb(CTX, ctx->ssl_password_callback);
+
+	if (CTX != NULL && SSL_CTX_use_certificate_file(
+	    CTX, pem, SSL_FILETYPE_PEM) == 0)
+		cry(fc(ctx), "%s: cannot open %s", __func__, pem);
+	else if (CTX != NULL && SSL_CTX_use_PrivateKey_file(
+	    CTX, pem, SSL_FILETYPE_PEM) == 0)
+		cry(fc(ctx), "%s: cannot open %s", NULL, pem);
+	else
+		retval = TRUE;
+
+	/*
+	 * Initialize locking callbacks, needed for thread safety.
+	 * http://www.openssl.org/support/faq.html#PROG1
+	 */
+	size = sizeof(pthread_mutex_t) * CRYPTO_num_locks();
+	if ((ssl_mutexes = (pthread_mutex_t *) malloc(size)) == NULL) {
+		cry(fc(ctx), "%s: cannot allocate mutexes", __func__);
+		return (FALSE);
+	}
+
+	for (i = 0; i < CRYPTO_num_locks(); i++)
+		pthread_mutex_init(&ssl_mutexes[i], NULL);
+
+	CRYPTO_set_locking_callback(&ssl_locking_callback);
+	CRYPTO_set_id_callback(&ssl_id_callback);
+
+	/* Done with everything. Save the context. */
+	ctx->ssl_ctx = CTX;
+
+	return (retval);
 }
+#endif /* !NO_SSL */
 
 static bool_t
-append_chunk(struct mg_request_info *ri, FILE *fp, const char *buf, int len)
+open_log_file(struct mg_context *ctx, FILE **fpp, const char *path)
 {
-	bool_t	ret_code = TRUE;
+	bool_t	retval = TRUE;
 
-	if (fp == NULL) {
-		/* TODO: check for NULL here */
-		ri->post_data = (char *) realloc(ri->post_data,
-		    ri->post_data_len + len);
-		(void) memcpy(ri->post_data + ri->post_data_len, buf, len);
-		ri->post_data_len += len;
-	} else if (push(fp, INVALID_SOCKET,
-	    NULL, buf, (int64_t) len) != (int64_t) len) {
-		ret_code = FALSE;
+	if (*fpp != NULL)
+		(void) fclose(*fpp);
+
+	if (path == NULL) {
+		*fpp = NULL;
+	} else if ((*fpp = mg_fopen(path, "a")) == NULL) {
+		cry(fc(ctx), "%s(%s): %s", __func__, path, strerror(errno));
+		retval = FALSE;
+	} else {
+		set_close_on_exec(fileno(*fpp));
 	}
 
-	return (ret_code);
+	return (retval);
 }
 
 static bool_t
-handle_request_body(struct mg_connection *conn, FILE *fp)
+set_alog_option(struct mg_context *ctx, const char *path)
 {
-	struct mg_request_info	*ri = &conn->request_info;
-	const char	*expect, *tmp;
-	int64_t		content_len;
-	char		buf[BUFSIZ];
-	int		to_read, nread, already_read;
-	bool_t		success_code = FALSE;
+	return (open_log_file(ctx, &ctx->access_log, path));
+}
 
-	content_len = get_content_length(conn);
-	expect = mg_get_header(conn, "Expect");
+static bool_t
+set_elog_option(struct mg_context *ctx, const char *path)
+{
+	return (open_log_file(ctx, &ctx->error_log, path));
+}
 
-	if (content_len == -1) {
-		send_error(conn, 411, "Length Required", "");
-	} else if (expect != NULL && mg_strcasecmp(expect, "100-continue")) {
-		send_error(conn, 417, "Expectation Failed", "");
-	} else {
-		if (expect != NULL)
-			(void) mg_printf(conn, "HTTP/1.1 100 Continue\r\n\r\n");
+static bool_t
+set_gpass_option(struct mg_context *ctx, const char *path)
+{
+	struct mgstat	mgstat;
+	ctx = NULL;
+	return (mg_stat(path, &mgstat) == 0);
+}
 
-		already_read = ri->post_data_len;
-		assert(already_read >= 0);
+/*
+ * Thread limits can be changed at any time. When the pool is bigger than
+ * the new maximum, idle workers are woken up so the surplus can exit, and
+ * busy ones exit after serving their connection. When the minimum grows,
+ * the pool manager starts the missing workers.
+ */
+static bool_t
+set_max_threads_option(struct mg_context *ctx, const char *str)
+{
+	int	n = atoi(str);
 
-		if (content_len <= (int64_t) already_read) {
-			ri->post_data_len = (int) content_len;
-			/*
-			 * If fp is NULL, this is embedded mode, and we do not
-			 * have to do anything: POST data is already there,
-			 * no need to allocate a buffer and copy it in.
-			 * If fp != NULL, we need to write the data.
-			 */
-			success_code = fp == NULL || (push(fp, INVALID_SOCKET,
-			    NULL, ri->post_data, content_len) == content_len) ?
-			    TRUE : FALSE;
-		} else {
+	if (n < 1 || n > MAX_WORKERS) {
+		cry(fc(ctx), "%s: number of threads must be 1..%d",
+		    __func__, MAX_WORKERS);
+		return (FALSE);
+	}
+
+	(void) pthread_mutex_lock(&ctx->thr_mutex);
+	ATOMIC_STORE(&ctx->max_threads, n);
+	(void) pthread_mutex_unlock(&ctx->thr_mutex);
+	wake_all_workers(ctx);
+
+	return (TRUE);
+}
+
+static bool_t
+set_min_threads_option(struct mg_context *ctx, const char *str)
+{
+	int	n = atoi(str);
+
+	if (n < 0) {
+		cry(fc(ctx), "%s: bad number of threads", __func__);
+		return (FALSE);
+	}
+
+	(void) pthread_mutex_lock(&ctx->thr_mutex);
+	ctx->min_threads = n;
+	(void) pthread_mutex_unlock(&ctx->thr_mutex);
+	park_wake(&ctx->pool_wanted);
+
+	return (TRUE);
+}
+
+/*
+ * Replace the connection queue with a new one of the given capacity.
+ * Connections queued in the old ring are still picked up by the workers,
+ * and the pool manager frees it once it is empty.
+ */
+static bool_t
+set_queue_size_option(struct mg_context *ctx, const char *str)
+{
+	struct ring	*ring;
+	int		size;
+
+	if ((size = atoi(str)) <= 0) {
+		cry(fc(ctx), "%s: invalid queue size: %s", __func__, str);
+		return (FALSE);
+	} else if ((ring = ring_new(size)) == NULL) {
+		cry(fc(ctx), "%s: cannot allocate queue", __func__);
+		return (FALSE);
+	}
 
-			if (fp == NULL) {
-				conn->free_post_data = TRUE;
-				tmp = ri->post_data;
-				/* +1 in case if already_read == 0 */
-				ri->post_data = (char*)malloc(already_read + 1);
-				(void) memcpy(ri->post_data, tmp, already_read);
-			} else {
-				(void) push(fp, INVALID_SOCKET, NULL,
-				    ri->post_data, (int64_t) already_read);
-			}
+	ring->next = ctx->queue;
+	ATOMIC_STORE(&ctx->queue, ring);
 
-			content_len -= already_read;
+	/* Producers waiting on the old ring can use the new one */
+	park_wake(&ctx->queue_full);
 
-			while (content_len > 0) {
-				to_read = sizeof(buf);
-				if ((int64_t) to_read > content_len)
-					to_read = (int) content_len;
-				nread = pull(NULL, conn->client.sock,
-				    conn->ssl, buf, to_read);
-				if (nread <= 0)
-					break;
-				if (!append_chunk(ri, fp, buf, nread))
-					break;
-				content_len -= nread;
-			}
-			success_code = content_len == 0 ? TRUE : FALSE;
-		}
+	return (TRUE);
+}
 
-		/* Each error code path in this function must send an error */
-		if (success_code != TRUE)
-			send_error(conn, 577, http_500_error,
-			    "%s", "Error handling body data");
+#if defined(USE_AFFINITY)
+/*
+ * CPU sets take effect for the threads started afterwards.
+ */
+static bool_t
+set_acceptor_cpus_option(struct mg_context *ctx, const char *str)
+{
+	if (!parse_cpus_option(ctx, str, &ctx->acceptor_cpus)) {
+		CPU_ZERO(&ctx->acceptor_cpus);
+		return (FALSE);
 	}
 
-	return (success_code);
+	return (TRUE);
 }
 
-#if !defined(NO_CGI)
+static bool_t
+set_worker_cpus_option(struct mg_context *ctx, const char *str)
+{
+	cpu_set_t	set;
+
+	ctx->num_worker_nodes = 0;
+	if (!parse_cpus_option(ctx, str, &set))
+		return (FALSE);
+	else if (CPU_COUNT(&set) > 0)
+		ctx->num_worker_nodes = split_by_node(&set, ctx->worker_cpus);
+
+	return (TRUE);
+}
+#endif /* USE_AFFINITY */
+
+static bool_t
+set_shed_queue_depth_option(struct mg_context *ctx, const char *str)
+{
+	ATOMIC_STORE(&ctx->shed_depth, atoi(str));
+	return (TRUE);
+}
+
+static bool_t
+set_shed_queue_wait_option(struct mg_context *ctx, const char *str)
+{
+	ATOMIC_STORE(&ctx->shed_wait, atoi(str));
+	return (TRUE);
+}
 
 /*
- * This structure helps to create an environment for the spawned CGI program.
- * Environment is an array of "VARIABLE=VALUE\0" ASCIIZ strings,
- * last element must be NULL.
- * However, on Windows there is a requirement that all these VARIABLE=VALUE\0
- * strings must reside in a contiguous buffer. The end of the buffer is
- * marked by two '\0' characters.
- * We satisfy both worlds: we create an envp array (which is vars), all
- * entries are actually pointers inside buf.
+ * Render the reply sent to connections shed under overload. Setters run
+ * under the option lock, and shed_connection() takes it too.
  */
-struct cgi_env_block {
-	struct mg_connection *conn;
-	char	buf[CGI_ENVIRONMENT_SIZE];	/* Environment buffer	*/
-	int	len;				/* Space taken		*/
-	char	*vars[MAX_CGI_ENVIR_VARS];	/* char **envp		*/
-	int	nvars;				/* Number of variables	*/
-};
+static bool_t
+set_retry_after_option(struct mg_context *ctx, const char *str)
+{
+	int	n = atoi(str);
+
+	if (n < 0) {
+		cry(fc(ctx), "%s: invalid retry time: %s", __func__, str);
+		return (FALSE);
+	}
+
+	ctx->busy_reply_len = mg_snprintf(fc(ctx), ctx->busy_reply,
+	    sizeof(ctx->busy_reply), "HTTP/1.1 503 Service Unavailable\r\n"
+	    "Retry-After: %d\r\nContent-Length: 0\r\n"
+	    "Connection: close\r\n\r\n", n);
+
+	return (TRUE);
+}
 
 /*
- * Append VARIABLE=VALUE\0 string to the buffer, and add a respective
- * pointer into the vars array.
+ * Listener options apply to the sockets that are open already, too.
+ * Acceptor threads retune their own copies when they see the generation
+ * change.
  */
-static char *
-addenv(struct cgi_env_block *block, const char *fmt, ...)
+static bool_t
+set_listener_param(struct mg_context *ctx, const char *str, int *param,
+		int min_value)
 {
-	int	n, space;
-	char	*added;
-	va_list	ap;
+	int	i, n = atoi(str);
 
-	/* Calculate how much space is left in the buffer */
-	space = sizeof(block->buf) - block->len - 2;
-	assert(space >= 0);
+	if (n < min_value) {
+		cry(fc(ctx), "Invalid value: %s", str);
+		return (FALSE);
+	}
 
-	/* Make a pointer to the free space int the buffer */
-	added = block->buf + block->len;
+	ATOMIC_STORE(param, n);
 
-	/* Copy VARIABLE=VALUE\0 string into the free space */
-	va_start(ap, fmt);
-	n = mg_vsnprintf(block->conn, added, (size_t) space, fmt, ap);
-	va_end(ap);
+	lock_option(ctx, OPT_PORTS);
+	for (i = 0; i < ctx->num_listeners; i++)
+		if (!tune_listening_socket(ctx, ctx->listeners[i].sock))
+			cry(fc(ctx), "%s: listen: %s",
+			    __func__, strerror(ERRNO));
+	(void) ATOMIC_ADD(&ctx->listeners_generation, 1);
+	unlock_option(ctx, OPT_PORTS);
 
-	/* Make sure we do not overflow buffer and the envp array */
-	if (n > 0 && n < space &&
-	    block->nvars < (int) ARRAY_SIZE(block->vars) - 2) {
-		/* Append a pointer to the added string into the envp array */
-		block->vars[block->nvars++] = block->buf + block->len;
-		/* Bump up used length counter. Include \0 terminator */
-		block->len += n + 1;
-	}
+	return (TRUE);
+}
 
-	return (added);
+static bool_t
+set_listen_backlog_option(struct mg_context *ctx, const char *str)
+{
+	return (set_listener_param(ctx, str, &ctx->listen_backlog, 1));
 }
 
-static void
-prepare_cgi_environment(struct mg_connection *conn, const char *prog,
-		struct cgi_env_block *blk)
+#if defined(TCP_DEFER_ACCEPT)
+static bool_t
+set_defer_accept_option(struct mg_context *ctx, const char *str)
 {
-	const char	*s, *script_filename, *root, *slash;
-	struct vec	var_vec;
-	char		*p;
-	int		i;
+	return (set_listener_param(ctx, str, &ctx->defer_accept, 0));
+}
+#endif /* TCP_DEFER_ACCEPT */
 
-	blk->len = blk->nvars = 0;
-	blk->conn = conn;
+#if defined(TCP_FASTOPEN)
+static bool_t
+set_fastopen_option(struct mg_context *ctx, const char *str)
+{
+	return (set_listener_param(ctx, str, &ctx->fastopen, 0));
+}
+#endif /* TCP_FASTOPEN */
 
-	/* SCRIPT_FILENAME */
-	script_filename = prog;
-	if ((s = strrchr(prog, '/')) != NULL)
-		script_filename = s + 1;
+static bool_t
+set_rcvbuf_option(struct mg_context *ctx, const char *str)
+{
+	return (set_listener_param(ctx, str, &ctx->rcvbuf, 0));
+}
 
-	lock_option(conn->ctx, OPT_ROOT);
-	root = conn->ctx->options[OPT_ROOT];
-	addenv(blk, "SERVER_NAME=%s", conn->ctx->options[OPT_AUTH_DOMAIN]);
-	unlock_option(conn->ctx, OPT_ROOT);
+static bool_t
+set_sndbuf_option(struct mg_context *ctx, const char *str)
+{
+	return (set_listener_param(ctx, str, &ctx->sndbuf, 0));
+}
 
-	/* Prepare the environment block */
-	addenv(blk, "%s", "GATEWAY_INTERFACE=CGI/1.1");
-	addenv(blk, "%s", "SERVER_PROTOCOL=HTTP/1.1");
-	addenv(blk, "%s", "REDIRECT_STATUS=200");	/* PHP */
-	addenv(blk, "SERVER_PORT=%d", ntohs(conn->client.lsa.u.sin.sin_port));
-	addenv(blk, "SERVER_ROOT=%s", root);
-	addenv(blk, "DOCUMENT_ROOT=%s", root);
-	addenv(blk, "REQUEST_METHOD=%s", conn->request_info.request_method);
-	addenv(blk, "REMOTE_ADDR=%s",
-	    inet_ntoa(conn->client.rsa.u.sin.sin_addr));
-	addenv(blk, "REMOTE_PORT=%d", conn->request_info.remote_port);
-	addenv(blk, "REQUEST_URI=%s", conn->request_info.uri);
+static bool_t
+set_output_buffer_option(struct mg_context *ctx, const char *str)
+{
+	int	n = atoi(str);
 
-	slash = strrchr(conn->request_info.uri, '/');
-	addenv(blk, "SCRIPT_NAME=%.*s%s",
-	    (slash - conn->request_info.uri) + 1, conn->request_info.uri,
-	    script_filename);
+	if (n < 0) {
+		cry(fc(ctx), "%s: invalid buffer size: %s", __func__, str);
+		return (FALSE);
+	}
 
-	addenv(blk, "SCRIPT_FILENAME=%s", script_filename);	/* PHP */
-	addenv(blk, "PATH_TRANSLATED=%s", prog);
-	addenv(blk, "HTTPS=%s", conn->ssl == NULL ? "off" : "on");
+	ATOMIC_STORE(&ctx->output_limit, n);
 
-	if ((s = mg_get_header(conn, "Content-Type")) != NULL)
-		addenv(blk, "CONTENT_TYPE=%s", s);
+	return (TRUE);
+}
 
-	if (conn->request_info.query_string != NULL)
-		addenv(blk, "QUERY_STRING=%s", conn->request_info.query_string);
+/*
+ * Setting the cache size evicts whatever does not fit any more.
+ */
+static bool_t
+set_cache_size_option(struct mg_context *ctx, const char *str)
+{
+	int64_t	n = strtoll(str, NULL, 10);
 
-	if ((s = mg_get_header(conn, "Content-Length")) != NULL)
-		addenv(blk, "CONTENT_LENGTH=%s", s);
+	if (n < 0) {
+		cry(fc(ctx), "%s: invalid cache size: %s", __func__, str);
+		return (FALSE);
+	}
 
-	if ((s = getenv("PATH")) != NULL)
-		addenv(blk, "PATH=%s", s);
+	ATOMIC_STORE(&ctx->is_caching, n > 0);
+	cache_clear(ctx, n);
 
-#if defined(_WIN32)
-	if ((s = getenv("COMSPEC")) != NULL)
-		addenv(blk, "COMSPEC=%s", s);
-	if ((s = getenv("SYSTEMROOT")) != NULL)
-		addenv(blk, "SYSTEMROOT=%s", s);
-#else
-	if ((s = getenv("LD_LIBRARY_PATH")) != NULL)
-		addenv(blk, "LD_LIBRARY_PATH=%s", s);
-#endif /* _WIN32 */
+	return (TRUE);
+}
 
-	if ((s = getenv("PERLLIB")) != NULL)
-		addenv(blk, "PERLLIB=%s", s);
+static bool_t
+set_cache_small_file_option(struct mg_context *ctx, const char *str)
+{
+	ATOMIC_STORE(&ctx->cache_small_file, atoi(str));
+	return (TRUE);
+}
 
-	if (conn->request_info.remote_user != NULL) {
-		addenv(blk, "REMOTE_USER=%s", conn->request_info.remote_user);
-		addenv(blk, "%s", "AUTH_TYPE=Digest");
+#if !defined(_WIN32)
+static bool_t
+set_open_file_cache_option(struct mg_context *ctx, const char *str)
+{
+	int	n = atoi(str);
+
+	if (n < 0) {
+		cry(fc(ctx), "%s: invalid number of files: %s", __func__, str);
+		return (FALSE);
 	}
 
-	/* Add all headers as HTTP_* variables */
-	for (i = 0; i < conn->request_info.num_headers; i++) {
-		p = addenv(blk, "HTTP_%s=%s",
-		    conn->request_info.http_headers[i].name,
-		    conn->request_info.http_headers[i].value);
+	ATOMIC_STORE(&ctx->max_open_files, (n + CACHE_SHARDS - 1) /
+	    CACHE_SHARDS);
+	open_file_flush(ctx);
 
-		/* Convert variable name into uppercase, and change - to _ */
-		for (; *p != '=' && *p != '\0'; p++) {
-			if (*p == '-')
-				*p = '_';
-			*p = (char) toupper(* (unsigned char *) p);
-		}
+	return (TRUE);
+}
+
+static bool_t
+set_open_file_valid_option(struct mg_context *ctx, const char *str)
+{
+	ATOMIC_STORE(&ctx->open_file_valid, atoi(str));
+	open_file_flush(ctx);
+
+	return (TRUE);
+}
+#endif /* !_WIN32 */
+
+#if defined(USE_INOTIFY)
+static bool_t
+set_resolve_limit(struct mg_context *ctx, const char *str, bool_t is_missing)
+{
+	int	n = atoi(str);
+
+	if (n < 0) {
+		cry(fc(ctx), "%s: invalid number of URIs: %s", __func__, str);
+		return (FALSE);
 	}
 
-	/* Add user-specified variables */
-	lock_option(conn->ctx, OPT_CGI_ENV);
-	s = conn->ctx->options[OPT_CGI_ENV];
-	while ((s = next_option(s, &var_vec, NULL)) != NULL)
-		addenv(blk, "%.*s", var_vec.len, var_vec.ptr);
-	unlock_option(conn->ctx, OPT_CGI_ENV);
+	ATOMIC_STORE(&ctx->max_resolved[is_missing],
+	    (n + CACHE_SHARDS - 1) / CACHE_SHARDS);
+	ATOMIC_STORE(&ctx->is_resolving, ctx->inotify_fd != -1 &&
+	    (ATOMIC_LOAD(&ctx->max_resolved[FALSE]) > 0 ||
+	     ATOMIC_LOAD(&ctx->max_resolved[TRUE]) > 0));
+	resolve_flush(ctx);
 
-	blk->vars[blk->nvars++] = NULL;
-	blk->buf[blk->len++] = '\0';
+	return (TRUE);
+}
 
-	assert(blk->nvars < (int) ARRAY_SIZE(blk->vars));
-	assert(blk->len > 0);
-	assert(blk->len < (int) sizeof(blk->buf));
+static bool_t
+set_resolve_cache_option(struct mg_context *ctx, const char *str)
+{
+	return (set_resolve_limit(ctx, str, FALSE));
+}
+
+static bool_t
+set_missing_cache_option(struct mg_context *ctx, const char *str)
+{
+	return (set_resolve_limit(ctx, str, TRUE));
+}
+#endif /* USE_INOTIFY */
+
+static bool_t
+set_tcp_nodelay_option(struct mg_context *ctx, const char *str)
+{
+	ATOMIC_STORE(&ctx->nodelay, is_true(str));
+	return (TRUE);
 }
 
-static void
-send_cgi(struct mg_connection *conn, const char *prog)
+#if defined(USE_EPOLL)
+static bool_t
+set_acceptor_threads_option(struct mg_context *ctx, const char *str)
 {
-	int			headers_len, data_len, i;
-	const char		*status;
-	char			buf[MAX_REQUEST_SIZE], *pbuf;
-	struct mg_request_info	ri;
-	struct cgi_env_block	blk;
-	char			dir[FILENAME_MAX], *p;
-	int			fd_stdin[2], fd_stdout[2];
-	FILE			*in, *out;
-	pid_t			pid;
+	int	n = atoi(str);
 
-	prepare_cgi_environment(conn, prog, &blk);
+	if (n < 1 || n > MAX_ACCEPTORS) {
+		cry(fc(ctx), "%s: number of acceptors must be 1..%d",
+		    __func__, MAX_ACCEPTORS);
+		return (FALSE);
+	}
 
-	/* CGI must be executed in its own directory */
-	(void) mg_snprintf(conn, dir, sizeof(dir), "%s", prog);
-	if ((p = strrchr(dir, DIRSEP)) != NULL)
-		*p++ = '\0';
+	/* Master thread starts new acceptors, extra ones exit by themselves */
+	(void) pthread_mutex_lock(&ctx->thr_mutex);
+	ATOMIC_STORE(&ctx->num_acceptors, n);
+	(void) pthread_mutex_unlock(&ctx->thr_mutex);
 
-	pid = (pid_t) -1;
-	fd_stdin[0] = fd_stdin[1] = fd_stdout[0] = fd_stdout[1] = -1;
-	in = out = NULL;
+	return (TRUE);
+}
+#endif /* USE_EPOLL */
 
-	if (pipe(fd_stdin) != 0 || pipe(fd_stdout) != 0) {
-		send_error(conn, 500, http_500_error,
-		    "Cannot create CGI pipe: %s", strerror(ERRNO));
-		goto done;
-	} else if ((pid = spawn_process(conn, p, blk.buf, blk.vars,
-	    fd_stdin[0], fd_stdout[1], dir)) == (pid_t) -1) {
-		goto done;
-	} else if ((in = fdopen(fd_stdin[1], "wb")) == NULL ||
-	    (out = fdopen(fd_stdout[0], "rb")) == NULL) {
-		send_error(conn, 500, http_500_error,
-		    "fopen: %s", strerror(ERRNO));
-		goto done;
-	}
+static bool_t
+set_acl_option(struct mg_context *ctx, const char *acl)
+{
+	struct usa	fake;
 
-	setbuf(in, NULL);
-	setbuf(out, NULL);
+	return (check_acl(ctx, acl, &fake) != -1);
+}
 
-	/*
-	 * spawn_process() must close those!
-	 * If we don't mark them as closed, close() attempt before
-	 * return from this function throws an exception on Windows.
-	 * Windows does not like when closed descriptor is closed again.
-	 */
-	fd_stdin[0] = fd_stdout[1] = -1;
+static void admin_page(struct mg_connection *,
+		const struct mg_request_info *, void *);
+static bool_t
+set_admin_uri_option(struct mg_context *ctx, const char *uri)
+{
+	mg_set_uri_callback(ctx, uri, &admin_page, NULL);
+	return (TRUE);
+}
 
-	/* Send POST data to the CGI process if needed */
-	if (!strcmp(conn->request_info.request_method, "POST") &&
-	    !handle_request_body(conn, in)) {
-		goto done;
-	}
+/*
+ * Check if the comma-separated list of options has a format of key-value
+ * pairs: "k1=v1,k2=v2". Return FALSE if any entry has invalid key or value.
+ */
+static bool_t
+set_kv_list_option(struct mg_context *ctx, const char *str)
+{
+	const char	*list;
+	struct vec	key, value;
 
-	/*
-	 * Now read CGI reply into a buffer. We need to set correct
-	 * status code, thus we need to see all HTTP headers first.
-	 * Do not send anything back to client, until we buffer in all
-	 * HTTP headers.
-	 */
-	data_len = 0;
-	headers_len = read_request(out, INVALID_SOCKET, NULL,
-	    buf, sizeof(buf), &data_len);
-	if (headers_len <= 0) {
-		send_error(conn, 500, http_500_error,
-		    "CGI program sent malformed HTTP headers: [%.*s]",
-		    data_len, buf);
-		goto done;
-	}
-	pbuf = buf;
-	buf[headers_len - 1] = '\0';
-	parse_http_headers(&pbuf, &ri);
+	list = str;
+	while ((list = next_option(list, &key, &value)) != NULL)
+		if (key.len == 0 || value.len == 0) {
+			cry(fc(ctx), "Invalid list specified: [%s], "
+			    "expecting key1=value1,key2=value2,...", str);
+			return (FALSE);
+		}
 
-	/* Make up and send the status line */
-	status = get_header(&ri, "Status");
-	conn->request_info.status_code = status == NULL ? 200 : atoi(status);
-	(void) mg_printf(conn, "HTTP/1.1 %d OK\r\n",
-	    conn->request_info.status_code);
+	return (TRUE);
+}
 
-	/* Send headers */
-	for (i = 0; i < ri.num_headers; i++)
-		(void) mg_printf(conn, "%s: %s\r\n",
-		    ri.http_headers[i].name,
-		    ri.http_headers[i].value);
-	(void) mg_write(conn, "\r\n", 2);
+static bool_t
+set_root_option(struct mg_context *ctx, const char *root)
+{
+	struct mgstat buf;
+	if ( mg_stat(root, &buf) != 0) {
+		cry(fc(ctx), "Invalid root directory: \"%s\"", root);
+		return (FALSE);
 
-	/* Send chunk of data that may be read after the headers */
-	conn->num_bytes_sent += mg_write(conn,
-	    buf + headers_len, data_len - headers_len);
+	}
+	return (TRUE);
+}
 
-	/* Read the rest of CGI output and send to the client */
-	send_opened_file_stream(conn, out, INT64_MAX);
+static const struct mg_option known_options[] = {
+	{"root", "\tWeb root directory", ".", OPT_ROOT, set_root_option},
+	{"index_files",	"Index files", "index.html,index.htm,index.cgi",
+		OPT_INDEX_FILES, NULL},
+#if !defined(NO_SSL)
+	{"ssl_cert", "SSL certificate file", NULL,
+		OPT_SSL_CERTIFICATE, &set_ssl_option},
+#endif /* !NO_SSL */
+	{"ports", "Listening ports", NULL,
+		OPT_PORTS, &set_ports_option},
+	{"listen_backlog", "Connections waiting to be accepted, capped by "
+		"the system", "1024", OPT_LISTEN_BACKLOG,
+		&set_listen_backlog_option},
+#if defined(TCP_DEFER_ACCEPT)
+	{"defer_accept", "Seconds to wait for request data before accept, "
+		"0 - off", "0", OPT_DEFER_ACCEPT, &set_defer_accept_option},
+#endif /* TCP_DEFER_ACCEPT */
+#if defined(TCP_FASTOPEN)
+	{"fastopen", "TCP Fast Open queue length, 0 - off", "0",
+		OPT_FASTOPEN, &set_fastopen_option},
+#endif /* TCP_FASTOPEN */
+	{"rcvbuf", "Socket receive buffer size, 0 - system default", "0",
+		OPT_RCVBUF, &set_rcvbuf_option},
+	{"sndbuf", "Socket send buffer size, 0 - system default", "0",
+		OPT_SNDBUF, &set_sndbuf_option},
+	{"tcp_nodelay", "Disable Nagle's algorithm on connections", "yes",
+		OPT_TCP_NODELAY, &set_tcp_nodelay_option},
+	{"dir_list", "Directory listing", "yes",
+		OPT_DIR_LIST, NULL},
+	{"protect", "URI to htpasswd mapping", NULL,
+		OPT_PROTECT, &set_kv_list_option},
+#if !defined(NO_CGI)
+	{"cgi_ext", "CGI extensions", ".cgi,.pl,.php",
+		OPT_CGI_EXTENSIONS, NULL},
+	{"cgi_interp", "CGI interpreter to use with all CGI scripts", NULL,
+		OPT_CGI_INTERPRETER, NULL},
+	{"cgi_env", "Custom CGI enviroment variables", NULL,
+		OPT_CGI_ENV, &set_kv_list_option},
+#endif /* NO_CGI */
+	{"ssi_ext", "SSI extensions", ".shtml,.shtm",
+		OPT_SSI_EXTENSIONS, NULL},
+	{"auth_realm", "Authentication domain name", "mydomain.com",
+		OPT_AUTH_DOMAIN, NULL},
+	{"auth_gpass", "Global passwords file", NULL,
+		OPT_AUTH_GPASSWD, &set_gpass_option},
+	{"auth_PUT", "PUT,DELETE auth file", NULL,
+		OPT_AUTH_PUT, NULL},
+#if !defined(_WIN32)
+	{"uid", "\tRun as user", NULL, OPT_UID, &set_uid_option},
+#endif /* !_WIN32 */
+	{"access_log", "Access log file", NULL,
+		OPT_ACCESS_LOG, &set_alog_option},
+	{"error_log", "Error log file", NULL,
+		OPT_ERROR_LOG, &set_elog_option},
+	{"aliases", "Path=URI mappings", NULL,
+		OPT_ALIASES, &set_kv_list_option},
+	{"admin_uri", "Administration page URI", NULL,
+		OPT_ADMIN_URI, &set_admin_uri_option},
+	{"acl", "\tAllow/deny IP addresses/subnets", NULL,
+		OPT_ACL, &set_acl_option},
+	{"max_threads", "Maximum simultaneous threads to spawn", "100",
+		OPT_MAX_THREADS, &set_max_threads_option},
+	{"min_threads", "Worker threads kept running when idle", "4",
+		OPT_MIN_THREADS, &set_min_threads_option},
+	{"idle_time", "Time in seconds connection stays idle", "10",
+		OPT_IDLE_TIME, NULL},
+	{"mime_types", "Comma separated list of ext=mime_type pairs", NULL,
+		OPT_MIME_TYPES, &set_kv_list_option},
+	{"keep_alive_timeout", "Seconds to wait for the next request, 0 - off",
+		"5", OPT_KEEP_ALIVE_TIMEOUT, NULL},
+	{"keep_alive_requests", "Requests per connection, 0 - unlimited",
+		"100", OPT_KEEP_ALIVE_REQUESTS, NULL},
+	{"header_timeout", "Seconds to read request headers, 0 - no limit",
+		"20", OPT_HEADER_TIMEOUT, NULL},
+	{"body_timeout", "Seconds to read request body, 0 - no limit",
+		"20", OPT_BODY_TIMEOUT, NULL},
+	{"send_timeout", "Seconds to send a response, 0 - no limit",
+		"60", OPT_SEND_TIMEOUT, NULL},
+	{"min_rate", "Bytes per second that extend the timeouts above, "
+		"0 - they apply to inactivity", "500", OPT_MIN_RATE, NULL},
+	{"output_buffer", "Response bytes buffered before sending, 0 - off",
+		"16384", OPT_OUTPUT_BUFFER, &set_output_buffer_option},
+	{"cache_size", "Bytes of static files to cache, 0 - off", "0",
+		OPT_CACHE_SIZE, &set_cache_size_option},
+	{"cache_small_file", "Cached files up to this size are kept in "
+		"memory, bigger ones are mapped", "65536",
+		OPT_CACHE_SMALL_FILE, &set_cache_small_file_option},
+	{"precompressed", "Serve file.br or file.gz instead of file to "
+		"clients accepting it", "no", OPT_PRECOMPRESSED, NULL},
+#if !defined(_WIN32)
+	{"open_file_cache", "Static files kept open for reuse, 0 - off", "0",
+		OPT_OPEN_FILE_CACHE, &set_open_file_cache_option},
+	{"open_file_valid", "Seconds a kept file is used before it is "
+		"opened again", "60",
+		OPT_OPEN_FILE_VALID, &set_open_file_valid_option},
+#endif /* !_WIN32 */
+#if defined(USE_INOTIFY)
+	{"resolve_cache", "Request URIs whose files are remembered until "
+		"they change, 0 - off", "4096",
+		OPT_RESOLVE_CACHE, &set_resolve_cache_option},
+	{"missing_cache", "Request URIs remembered to have no file until "
+		"one appears, 0 - off", "1024",
+		OPT_MISSING_CACHE, &set_missing_cache_option},
+#endif /* USE_INOTIFY */
+	{"queue_size", "Maximum accepted connections waiting for a thread",
+		"1024", OPT_QUEUE_SIZE, &set_queue_size_option},
+	{"shed_queue_depth", "Queued connections past which new ones get "
+		"503, 0 - off", "0", OPT_SHED_QUEUE_DEPTH,
+		&set_shed_queue_depth_option},
+	{"shed_queue_wait", "Milliseconds in queue past which new "
+		"connections get 503, 0 - off", "0", OPT_SHED_QUEUE_WAIT,
+		&set_shed_queue_wait_option},
+	{"retry_after", "Seconds in Retry-After header of the 503 reply",
+		"5", OPT_RETRY_AFTER, &set_retry_after_option},
+#if defined(USE_AFFINITY)
+	{"acceptor_cpus", "CPUs to pin acceptor threads to, one each, "
+		"e.g. 0-3,8", NULL, OPT_ACCEPTOR_CPUS, &set_acceptor_cpus_option},
+	{"worker_cpus", "CPUs to run worker threads on, spread across "
+		"NUMA nodes", NULL, OPT_WORKER_CPUS, &set_worker_cpus_option},
+#endif /* USE_AFFINITY */
+#if defined(USE_EPOLL)
+	{"acceptor_threads", "Threads accepting connections, each on its "
+		"own SO_REUSEPORT sockets", "1",
+		OPT_ACCEPTOR_THREADS, &set_acceptor_threads_option},
+#endif /* USE_EPOLL */
+#if defined(USE_SENDFILE)
+	{"sendfile", "Send static files with sendfile() if possible", "yes",
+		OPT_SENDFILE, NULL},
+#endif /* USE_SENDFILE */
+#if defined(USE_IO_URING)
+	{"io_uring", "Send static files with io_uring if possible", "yes",
+		OPT_IO_URING, NULL},
+#endif /* USE_IO_URING */
+#if defined(USE_COROUTINES)
+	{"coroutines", "Connections served as coroutines per thread, 0 - off",
+		"0", OPT_COROUTINES, NULL},
+#endif /* USE_COROUTINES */
+	{NULL, NULL, NULL, 0, NULL}
+};
 
-done:
-	if (pid != (pid_t) -1)
-		kill(pid, SIGTERM);
-	if (fd_stdin[0] != -1)
-		(void) close(fd_stdin[0]);
-	if (fd_stdout[1] != -1)
-		(void) close(fd_stdout[1]);
+static const struct mg_option *
+find_opt(const char *opt_name)
+{
+	int	i;
 
-	if (in != NULL)
-		(void) fclose(in);
-	else if (fd_stdin[1] != -1)
-		(void) close(fd_stdin[1]);
+	for (i = 0; known_options[i].name != NULL; i++)
+		if (!strcmp(opt_name, known_options[i].name))
+			return (known_options + i);
 
-	if (out != NULL)
-		(void) fclose(out);
-	else if (fd_stdout[0] != -1)
-		(void) close(fd_stdout[0]);
+	return (NULL);
 }
-#endif /* !NO_CGI */
 
-/*
- * For a given PUT path, create all intermediate subdirectories
- * for given path. Return 0 if the path itself is a directory,
- * or -1 on error, 1 if OK.
- */
-static int
-put_dir(const char *path)
+int
+mg_set_option(struct mg_context *ctx, const char *opt, const char *val)
 {
-	char		buf[FILENAME_MAX];
-	const char	*s, *p;
-	struct mgstat	st;
-	size_t		len;
+	const struct mg_option	*option;
+	int			i, retval;
 
-	for (s = p = path + 2; (p = strchr(s, '/')) != NULL; s = ++p) {
-		len = p - path;
-		assert(len < sizeof(buf));
-		(void) memcpy(buf, path, len);
-		buf[len] = '\0';
+	DEBUG_TRACE((DEBUG_MGS_PREFIX "%s: [%s]->[%s]", __func__, opt, val));
+	if (opt != NULL && (option = find_opt(opt)) != NULL) {
+		i = option->index;
+		lock_option(ctx, i);
 
-		/* Try to create intermediate directory */
-		if (mg_stat(buf, &st) == -1 && mg_mkdir(buf, 0755) != 0)
-			return (-1);
+		if (option->setter != NULL)
+			retval = option->setter(ctx, val);
+		else
+			retval = TRUE;
 
-		/* Is path itself a directory ? */
-		if (p[1] == '\0')
-			return (0);
+		/* Free old value if any */
+		if (ctx->options[option->index] != NULL)
+			free(ctx->options[option->index]);
+
+		/* Set new option value */
+		ctx->options[option->index] = val ? mg_strdup(val) : NULL;
+		unlock_option(ctx, i);
+
+		/* URIs may resolve to other files now */
+		resolve_flush(ctx);
+
+		if (retval == FALSE)
+			cry(fc(ctx), "%s(%s): failure", __func__, opt);
+	} else {
+		cry(fc(ctx), "%s: No such option: [%s]", __func__, opt);
+		retval = -1;
 	}
 
-	return (1);
+	return (retval);
 }
 
-static void
-put_file(struct mg_connection *conn, const char *path)
+void
+mg_show_usage_string(FILE *fp)
 {
-	struct mgstat	st;
-	FILE		*fp;
-	int		rc;
+	const struct mg_option	*o;
 
-	conn->request_info.status_code = mg_stat(path, &st) == 0 ? 200 : 201;
+	(void) fprintf(stderr,
+	    "Mongoose version %s (c) Sergey Lyubka\n"
+	    "usage: mongoose [options] [config_file]\n", mg_version());
 
-	if (mg_get_header(conn, "Range")) {
-		send_error(conn, 501, "Not Implemented",
-		    "%s", "Range support for PUT requests is not implemented");
-	} else if ((rc = put_dir(path)) == 0) {
-		(void) mg_printf(conn, "HTTP/1.1 %d OK\r\n\r\n",
-		    conn->request_info.status_code);
-	} else if (rc == -1) {
-		send_error(conn, 500, http_500_error,
-		    "put_dir(%s): %s", path, strerror(ERRNO));
-	} else if ((fp = mg_fopen(path, "wb+")) == NULL) {
-		send_error(conn, 500, http_500_error,
-		    "fopen(%s): %s", path, strerror(ERRNO));
-	} else {
-		set_close_on_exec(fileno(fp));
-		if (handle_request_body(conn, fp))
-			(void) mg_printf(conn, "HTTP/1.1 %d OK\r\n\r\n",
-			    conn->request_info.status_code);
-		(void) fclose(fp);
+	fprintf(fp, "  -A <htpasswd_file> <realm> <user> <passwd>\n");
+
+	for (o = known_options; o->name != NULL; o++) {
+		(void) fprintf(fp, "  -%s\t%s", o->name, o->description);
+		if (o->default_value != NULL)
+			fprintf(fp, " (default: \"%s\")", o->default_value);
+		fputc('\n', fp);
 	}
 }
 
-#if !defined(NO_SSI)
-static void send_ssi_file(struct mg_connection *, const char *, FILE *, int);
+const char *
+mg_get_option(const struct mg_context *ctx, const char *option_name)
+{
+	const struct mg_option	*option;
+
+	if ((option = find_opt(option_name)) != NULL)
+		return (ctx->options[option->index]);
+	else
+		return (NULL);
+}
 
 static void
-do_ssi_include(struct mg_connection *conn, const char *ssi, char *tag,
-		int include_level)
+admin_page(struct mg_connection *conn, const struct mg_request_info *ri,
+			   void *user_data)
 {
-	char	file_name[BUFSIZ], path[FILENAME_MAX], *p;
-	FILE	*fp;
+	const struct mg_option	*option;
+	const char		*option_name, *option_value;
 
-	/*
-	 * sscanf() is safe here, since send_ssi_file() also uses buffer
-	 * of size BUFSIZ to get the tag. So strlen(tag) is always < BUFSIZ.
-	 */
-	if (sscanf(tag, " virtual=\"%[^\"]\"", file_name) == 1) {
-		/* File name is relative to the webserver root */
-		lock_option(conn->ctx, OPT_ROOT);
-		(void) mg_snprintf(conn, path, sizeof(path), "%s%c%s",
-		    conn->ctx->options[OPT_ROOT], DIRSEP, file_name);
-		unlock_option(conn->ctx, OPT_ROOT);
-	} else if (sscanf(tag, " file=\"%[^\"]\"", file_name) == 1) {
-		/*
-		 * File name is relative to the webserver working directory
-		 * or it is absolute system path
-		 */
-		(void) mg_snprintf(conn, path, sizeof(path), "%s", file_name);
-	} else if (sscanf(tag, " \"%[^\"]\"", file_name) == 1) {
-		/* File name is relative to the currect document */
-		(void) mg_snprintf(conn, path, sizeof(path), "%s", ssi);
-		if ((p = strrchr(path, DIRSEP)) != NULL)
-			p[1] = '\0';
-		(void) mg_snprintf(conn, path + strlen(path),
-		    sizeof(path) - strlen(path), "%s", file_name);
-	} else {
-		cry(conn, "Bad SSI #include: [%s]", tag);
-		return;
-	}
+	user_data = NULL; /* Unused */
 
-	if ((fp = mg_fopen(path, "rb")) == NULL) {
-		cry(conn, "Cannot open SSI #include: [%s]: fopen(%s): %s",
-		    tag, path, strerror(ERRNO));
-	} else {
-		set_close_on_exec(fileno(fp));
-		if (match_extension(path,
-		    conn->ctx->options[OPT_SSI_EXTENSIONS])) {
-			send_ssi_file(conn, path, fp, include_level + 1);
+	(void) mg_printf(conn,
+	"HTTP/1.1 200 OK\r\n"
+			"Content-Type: text/html\r\n%s\r\n"
+			"<html><body><h1>Mongoose v. %s</h1>",
+			unknown_length_headers(conn), mg_version());
+
+	if (!strcmp(ri->request_method, "POST")) {
+		option_name = mg_get_var(conn, "o");
+		option_value = mg_get_var(conn, "v");
+		if (mg_set_option(conn->ctx,
+		    option_name, option_value) == -1) {
+			(void) mg_printf(conn,
+			    "<p style=\"background: red\">Error setting "
+			    "option \"%s\"</p>",
+			    option_name ? option_name : "(null)");
 		} else {
-			send_opened_file_stream(conn, fp, INT64_MAX);
+			(void) mg_printf(conn,
+			    "<p style=\"color: green\">Saved: %s=%s</p>",
+			    option_name, option_value ? option_value : "NULL");
 		}
-		(void) fclose(fp);
 	}
+
+	/* Print table with all options */
+	(void) mg_printf(conn, "%s", "<table border=\"1\""
+			"<tr><th>Option</th><th>Description</th>"
+					"<th colspan=2>Value</th></tr>");
+
+	for (option = known_options; option->name != NULL; option++) {
+		option_value = mg_get_option(conn->ctx, option->name);
+		if (option_value == NULL)
+			option_value = "";
+		(void) mg_printf(conn,
+		    "<form method=post><tr><td>%s</td><td>%s</td>"
+		    "<input type=hidden name=o value='%s'>"
+		    "<td><input type=text name=v value='%s'></td>"
+		    "<td><input type=submit value=save></td></form></tr>",
+		    option->name, option->description,
+		    option->name, option_value);
+	}
+
+	(void) mg_printf(conn, "%s", "</table></body></html>");
 }
 
 static void
-do_ssi_exec(struct mg_connection *conn, char *tag)
+reset_per_request_attributes(struct mg_connection *conn)
 {
-	char	cmd[BUFSIZ];
-	FILE	*fp;
-
-	if (sscanf(tag, " \"%[^\"]\"", cmd) != 1) {
-		cry(conn, "Bad SSI #exec: [%s]", tag);
-	} else if ((fp = popen(cmd, "r")) == NULL) {
-		cry(conn, "Cannot SSI #exec: [%s]: %s", cmd, strerror(ERRNO));
-	} else {
-		send_opened_file_stream(conn, fp, INT64_MAX);
-		(void) pclose(fp);
+	if (conn->request_info.remote_user != NULL) {
+		free((void *) conn->request_info.remote_user);
+		conn->request_info.remote_user = NULL;
+	}
+	if (conn->free_post_data && conn->request_info.post_data != NULL) {
+		free((void *) conn->request_info.post_data);
+		conn->request_info.post_data = NULL;
 	}
 }
 
 static void
-send_ssi_file(struct mg_connection *conn, const char *path, FILE *fp,
-		int include_level)
+close_socket_gracefully(struct mg_connection *conn, SOCKET sock)
 {
 	char	buf[BUFSIZ];
-	int	ch, len, in_ssi_tag;
+	int	n;
 
-	if (include_level > 10) {
-		cry(conn, "SSI #include level is too deep (%s)", path);
-		return;
-	}
+	/* Send FIN to the client */
+	(void) shutdown(sock, SHUT_WR);
+	set_non_blocking_mode(conn, sock);
 
-	in_ssi_tag = FALSE;
-	len = 0;
+	/*
+	 * Read and discard pending data. If we do not do that and close the
+	 * socket, the data in the send buffer may be discarded. This
+	 * behaviour is seen on Windows, when client keeps sending data
+	 * when server decide to close the connection; then when client
+	 * does recv() it gets no data back.
+	 */
+	do {
+		n = recv(sock, buf, sizeof(buf), 0);
+	} while (n > 0);
 
-	while ((ch = fgetc(fp)) != EOF) {
-		if (in_ssi_tag && ch == '>') {
-			in_ssi_tag = FALSE;
-			buf[len++] = ch & 0xff;
-			buf[len] = '\0';
-			assert(len <= (int) sizeof(buf));
-			if (len < 6 || memcmp(buf, "<!--#", 5) != 0) {
-				/* Not an SSI tag, pass it */
-				(void) mg_write(conn, buf, len);
-			} else {
-				if (!memcmp(buf + 5, "include", 7)) {
-					do_ssi_include(conn, path, buf + 12,
-					    include_level);
-				} else if (!memcmp(buf + 5, "exec", 4)) {
-					do_ssi_exec(conn, buf + 9);
-				} else {
-					cry(conn, "%s: unknown SSI "
-					    "command: \"%s\"", path, buf);
-				}
-			}
-			len = 0;
-		} else if (in_ssi_tag) {
-			if (len == 5 && memcmp(buf, "<!--#", 5) != 0) {
-				/* Not an SSI tag */
-				in_ssi_tag = FALSE;
-			} else if (len == (int) sizeof(buf) - 2) {
-				cry(conn, "%s: SSI tag is too large", path);
-				len = 0;
-			}
-			buf[len++] = ch & 0xff;
-		} else if (ch == '<') {
-			in_ssi_tag = TRUE;
-			if (len > 0)
-				(void) mg_write(conn, buf, len);
-			len = 0;
-			buf[len++] = ch & 0xff;
-		} else {
-			buf[len++] = ch & 0xff;
-			if (len == (int) sizeof(buf)) {
-				(void) mg_write(conn, buf, len);
-				len = 0;
-			}
-		}
-	}
+	/* Now we know that our FIN is ACK-ed, safe to close */
+	(void) closesocket(sock);
+}
 
-	/* Send the rest of buffered data */
-	if (len > 0)
-		(void) mg_write(conn, buf, len);
+static void
+close_connection(struct mg_connection *conn)
+{
+	reset_per_request_attributes(conn);
+
+	if (conn->ssl)
+		SSL_free(conn->ssl);
 
+	if (conn->client.sock != INVALID_SOCKET)
+		close_socket_gracefully(conn, conn->client.sock);
 }
 
 static void
-send_ssi(struct mg_connection *conn, const char *path)
+reset_connection_attributes(struct mg_connection *conn)
 {
-	FILE	*fp;
+	reset_per_request_attributes(conn);
+	conn->free_post_data = FALSE;
+	conn->request_info.status_code = -1;
+	conn->num_bytes_sent = 0;
+	(void) memset(&conn->request_info, 0, sizeof(conn->request_info));
 
-	if ((fp = mg_fopen(path, "rb")) == NULL) {
-		send_error(conn, 500, http_500_error,
-		    "fopen(%s): %s", path, strerror(ERRNO));
-	} else {
-		set_close_on_exec(fileno(fp));
-		(void) mg_printf(conn, "%s", "HTTP/1.1 200 OK\r\n"
-		    "Content-Type: text/html\r\nConnection: close\r\n\r\n");
-		send_ssi_file(conn, path, fp, 0);
-		(void) fclose(fp);
-	}
+	conn->keep_alive = FALSE;
+	conn->chunked = FALSE;
+	conn->body_read = FALSE;
+	conn->pipelined = FALSE;
+	conn->io_phase = IO_NONE;
+	(void) memset(&conn->resp, 0, sizeof(conn->resp));
+	conn->resp.content_len = -1;
 }
-#endif /* !NO_SSI */
 
-void
-mg_authorize(struct mg_connection *conn)
+/*
+ * Decide, before the request is handled, whether the client wants and
+ * is allowed to send another request over this connection.
+ */
+static bool_t
+should_keep_alive(const struct mg_connection *conn)
+{
+	const struct mg_context	*ctx = conn->ctx;
+	const char	*header = mg_get_header(conn, "Connection");
+	int		max_requests;
+
+	max_requests = atoi(ctx->options[OPT_KEEP_ALIVE_REQUESTS]);
+
+	if (ATOMIC_LOAD(&ctx->stop_flag) != 0 ||
+	    ATOMIC_LOAD(&ctx->is_draining) ||
+	    atoi(ctx->options[OPT_KEEP_ALIVE_TIMEOUT]) <= 0 ||
+	    (max_requests > 0 && conn->num_requests >= max_requests))
+		return (FALSE);
+	else if (header != NULL && !mg_strcasecmp(header, "close"))
+		return (FALSE);
+	else if (!strcmp(conn->request_info.http_version, "1.1"))
+		return (TRUE);
+	else
+		return (header != NULL && !mg_strcasecmp(header, "keep-alive"));
+}
+
+/*
+ * Called when the request handler has returned. Terminate the chunked body
+ * if needed. Return TRUE if the client can tell where the response ended,
+ * and the rest of the request is not stuck in the socket, so that the
+ * connection can serve the next request.
+ */
+static bool_t
+finish_response(struct mg_connection *conn, int request_len)
 {
-	conn->embedded_auth = TRUE;
+	const struct response	*resp = &conn->resp;
+	int64_t			cl;
+
+	add_content_length(conn);
+
+	if (conn->chunked && resp->state == RESP_BODY && !resp->no_body &&
+	    write_to_client(conn, "0\r\n\r\n", 5) != 5)
+		return (FALSE);
+
+	cl = get_content_length(conn);
+	if (!conn->body_read && (cl > (int64_t) (conn->nread - request_len) ||
+	    mg_get_header(conn, "Transfer-Encoding") != NULL))
+		return (FALSE);
+
+	return (conn->keep_alive &&
+	    resp->state == RESP_BODY &&
+	    !resp->conn_close &&
+	    (resp->no_body || resp->is_chunked ||
+	     resp->body_len == resp->content_len) &&
+	    (resp->conn_keep_alive ||
+	     !strcmp(conn->request_info.http_version, "1.1")));
 }
 
+/*
+ * Return TRUE if another complete request follows the current one
+ * in the connection buffer.
+ */
 static bool_t
-check_embedded_authorization(struct mg_connection *conn)
+is_pipelined(const struct mg_connection *conn, int request_len)
 {
-	const struct callback	*cb;
-	bool_t			authorized;
-
-	authorized = TRUE;
-	cb = find_callback(conn->ctx, TRUE, conn->request_info.uri, -1);
+	int64_t	cl = get_content_length(conn);
+	int	next;
 
-	if (cb != NULL) {
-		cb->func(conn, &conn->request_info, cb->user_data);
-		authorized = conn->embedded_auth;
-	}
+	if (cl < 0)
+		cl = 0;
+	if (cl >= (int64_t) (conn->nread - request_len))
+		return (FALSE);
 
-	return (authorized);
+	next = request_len + (int) cl;
+	return (get_request_len(conn->buf + next,
+	    (size_t) (conn->nread - next)) > 0);
 }
 
 /*
- * This is the heart of the Mongoose's logic.
- * This function is called when the request is read, parsed and validated,
- * and Mongoose must decide what action to take: serve a file, or
- * a directory, or call embedded function, etcetera.
+ * Wait until the next request starts arriving on a persistent connection.
+ * Return FALSE if the client stayed silent for the keep-alive timeout,
+ * or the server is stopping or draining.
  */
-static void
-analyze_request(struct mg_connection *conn)
+static bool_t
+wait_for_request(struct mg_connection *conn)
 {
-	struct mg_request_info *ri = &conn->request_info;
-	char			path[FILENAME_MAX], *uri = ri->uri;
-	struct mgstat		st;
-	const struct callback	*cb;
-
-	if ((conn->request_info.query_string = strchr(uri, '?')) != NULL)
-		* conn->request_info.query_string++ = '\0';
+	struct mg_context	*ctx = conn->ctx;
+	SOCKET			sock = conn->client.sock;
+	int			n, timeout;
+#if defined(_WIN32)
+	fd_set			read_set;
+	struct timeval		tv;
+#else
+	struct pollfd		pfd[3];
+#endif /* _WIN32 */
+#if defined(USE_COROUTINES)
+	bool_t			ok;
+#endif /* USE_COROUTINES */
 
-	(void) url_decode(uri, (int) strlen(uri), uri, strlen(uri) + 1, FALSE);
-	remove_double_dots_and_double_slashes(uri);
-	convert_uri_to_file_name(conn, uri, path, sizeof(path));
+	/* Draining closes persistent connections after the response */
+	if (ATOMIC_LOAD(&ctx->is_draining))
+		return (FALSE);
+	else if (conn->nread > 0 ||
+	    (conn->ssl != NULL && SSL_pending(conn->ssl)))
+		return (TRUE);
+
+	timeout = atoi(ctx->options[OPT_KEEP_ALIVE_TIMEOUT]);
+#if defined(USE_COROUTINES)
+	if (current_coroutine != NULL) {
+		/* Scheduler resumes idle coroutines when draining starts */
+		current_coroutine->is_idle = TRUE;
+		ok = timeout > 0 &&
+		    coroutine_wait(sock, EPOLLIN, time(NULL) + timeout);
+		current_coroutine->is_idle = FALSE;
+		return (ok && !ATOMIC_LOAD(&ctx->is_draining));
+	}
+#endif /* USE_COROUTINES */
 
-	if (!check_authorization(conn, path)) {
-		send_authorization_request(conn);
-	} else if (check_embedded_authorization(conn) == FALSE) {
-		/*
-		 * Embedded code failed authorization. Do nothing here, since
-		 * an embedded code must handle this itself by either
-		 * showing proper error message, or redirecting to some
-		 * sort of login page, or something else.
-		 */
-	} else if ((cb = find_callback(conn->ctx, FALSE, uri, -1)) != NULL) {
-		if ((strcmp(ri->request_method, "POST") != 0 &&
-		    strcmp(ri->request_method, "PUT") != 0) ||
-		    handle_request_body(conn, NULL))
-			cb->func(conn, &conn->request_info, cb->user_data);
-	} else if (strstr(path, PASSWORDS_FILE_NAME)) {
-		/* Do not allow to view passwords files */
-		send_error(conn, 403, "Forbidden", "Access Forbidden");
-	} else if ((!strcmp(ri->request_method, "PUT") ||
-	    !strcmp(ri->request_method, "DELETE")) &&
-	    (conn->ctx->options[OPT_AUTH_PUT] == NULL ||
-	     !is_authorized_for_put(conn))) {
-		send_authorization_request(conn);
-	} else if (!strcmp(ri->request_method, "PUT")) {
-		put_file(conn, path);
-	} else if (!strcmp(ri->request_method, "DELETE")) {
-		if (mg_remove(path) == 0)
-			send_error(conn, 200, "OK", "");
-		else
-			send_error(conn, 500, http_500_error,
-			    "remove(%s): %s", path, strerror(ERRNO));
-	} else if (mg_stat(path, &st) != 0) {
-		send_error(conn, 404, "Not Found", "%s", "File not found");
-	} else if (st.is_directory && uri[strlen(uri) - 1] != '/') {
-		(void) mg_printf(conn,
-		    "HTTP/1.1 301 Moved Permanently\r\n"
-		    "Location: %s/\r\n\r\n", uri);
-	} else if (st.is_directory &&
-	    substitute_index_file(conn, path, sizeof(path), &st) == FALSE) {
-		if (is_true(conn->ctx->options[OPT_DIR_LIST])) {
-			send_directory(conn, path);
-		} else {
-			send_error(conn, 403, "Directory Listing Denied",
-			    "Directory listing denied");
-		}
-#if !defined(NO_CGI)
-	} else if (match_extension(path,
-	    conn->ctx->options[OPT_CGI_EXTENSIONS])) {
-		if (strcmp(ri->request_method, "POST") &&
-		    strcmp(ri->request_method, "GET")) {
-			send_error(conn, 501, "Not Implemented",
-			    "Method %s is not implemented", ri->request_method);
-		} else {
-			send_cgi(conn, path);
-		}
-#endif /* NO_CGI */
-#if !defined(NO_SSI)
-	} else if (match_extension(path,
-	    conn->ctx->options[OPT_SSI_EXTENSIONS])) {
-		send_ssi(conn, path);
-#endif /* NO_SSI */
-	} else if (is_not_modified(conn, &st)) {
-		send_error(conn, 304, "Not Modified", "");
-	} else {
-		send_file(conn, path, &st);
+#if defined(_WIN32)
+	/* Wake up every second to notice mg_stop() and mg_drain() */
+	for (; timeout > 0 && ATOMIC_LOAD(&ctx->stop_flag) == 0 &&
+	    !ATOMIC_LOAD(&ctx->is_draining); timeout--) {
+		FD_ZERO(&read_set);
+		FD_SET(sock, &read_set);
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		n = select((int) sock + 1, &read_set, NULL, NULL, &tv);
+		if (n > 0)
+			return (TRUE);
+		else if (n < 0 && ERRNO != EINTR)
+			break;
 	}
-}
 
-static void
-close_all_listening_sockets(struct mg_context *ctx)
-{
-	int	i;
+	return (FALSE);
+#else
+	/* mg_stop() and mg_drain() make their descriptors readable.
+	 * poll() ignores descriptors that are -1 */
+	pfd[0].fd = sock;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = ctx->stop_fd[0];
+	pfd[1].events = POLLIN;
+	pfd[2].fd = ctx->drain_fd[0];
+	pfd[2].events = POLLIN;
+	do {
+		n = timeout > 0 ? poll(pfd, 3, timeout * 1000) : 0;
+	} while (n < 0 && ERRNO == EINTR);
 
-	for (i = 0; i < ctx->num_listeners; i++)
-		(void) closesocket(ctx->listeners[i].sock);
-	ctx->num_listeners = 0;
+	return (n > 0 && pfd[0].revents != 0 &&
+	    ATOMIC_LOAD(&ctx->stop_flag) == 0 &&
+	    !ATOMIC_LOAD(&ctx->is_draining));
+#endif /* _WIN32 */
 }
 
+#if defined(USE_EPOLL)
+/*
+ * Hand an idle persistent connection, with whatever part of the next
+ * request is buffered, back to the master thread's reactor. It will be
+ * dispatched again when the request is in. Return FALSE if the worker
+ * has to keep the connection.
+ */
 static bool_t
-set_ports_option(struct mg_context *ctx, const char *list)
+park_connection(struct mg_connection *conn)
 {
-	SOCKET		sock;
-	int		is_ssl;
-	struct vec	vec;
-	struct socket	*listener;
+	struct mg_context	*ctx = conn->ctx;
+	struct mg_connection	*head;
+	uint64_t		one = 1;
+	int			timeout;
+
+	timeout = atoi(ctx->options[OPT_KEEP_ALIVE_TIMEOUT]);
+	if (ctx->parked_fd == -1 || ATOMIC_LOAD(&ctx->stop_flag) != 0 ||
+	    ATOMIC_LOAD(&ctx->is_draining) || timeout <= 0 ||
+	    conn->ssl != NULL ||
+#if defined(USE_COROUTINES)
+	    current_coroutine != NULL ||	/* Waits in its scheduler */
+#endif /* USE_COROUTINES */
+	    get_request_len(conn->buf, (size_t) conn->nread) != 0 ||
+	    set_non_blocking_mode(conn, conn->client.sock) != 0)
+		return (FALSE);
 
-	close_all_listening_sockets(ctx);
-	assert(ctx->num_listeners == 0);
+	/* Reactor times the next request, and the worker may move on */
+	reset_per_request_attributes(conn);
+	conn->io_phase = IO_NONE;
+	if (conn->worker != NULL)
+		set_worker_socket(conn->worker, INVALID_SOCKET);
+	conn->worker = NULL;
 
-	while ((list = next_option(list, &vec, NULL)) != NULL) {
+	/* Output has been flushed, do not keep the buffer while idle */
+	free(conn->out);
+	conn->out = NULL;
+	conn->out_size = 0;
 
-		is_ssl	= vec.ptr[vec.len - 1] == 's' ? TRUE : FALSE;
-		listener = ctx->listeners + ctx->num_listeners;
+	do {
+		head = ATOMIC_LOAD(&ctx->parked);
+		conn->next = head;
+	} while (!ATOMIC_CAS(&ctx->parked, head, conn));
 
-		if (ctx->num_listeners >=
-		    (int) (ARRAY_SIZE(ctx->listeners) - 1)) {
-			cry(fc(ctx), "%s", "Too many listeninig sockets");
-			return (FALSE);
-		} else if ((sock = mg_open_listening_port(ctx,
-		    vec.ptr, &listener->lsa)) == INVALID_SOCKET) {
-			cry(fc(ctx), "cannot bind to %.*s", vec.len, vec.ptr);
-			return (FALSE);
-		} else if (is_ssl == TRUE && ctx->ssl_ctx == NULL) {
-			(void) closesocket(sock);
-			cry(fc(ctx), "cannot add SSL socket, please specify "
-			    "-ssl_cert option BEFORE -ports option");
-			return (FALSE);
-		} else {
-			listener->sock = sock;
-			listener->is_ssl = is_ssl;
-			ctx->num_listeners++;
-		}
-	}
+	/* Reactor takes the whole list, it needs a wakeup only once */
+	if (head == NULL)
+		(void) write(ctx->parked_fd, &one, sizeof(one));
 
 	return (TRUE);
 }
+#else
+#define	park_connection(conn)	FALSE
+#endif /* USE_EPOLL */
 
 static void
-log_header(const struct mg_connection *conn, const char *header, FILE *fp)
+shift_to_next(struct mg_connection *conn, char *buf, int req_len, int *nread)
 {
-	const char	*header_value;
+	int64_t	cl;
+	int	over_len, body_len;
 
-	if ((header_value = mg_get_header(conn, header)) == NULL) {
-		(void) fprintf(fp, "%s", " -");
+	cl = get_content_length(conn);
+	over_len = *nread - req_len;
+	assert(over_len >= 0);
+
+	if (cl == -1) {
+		body_len = 0;
+	} else if (cl < (int64_t) over_len) {
+		body_len = (int) cl;
 	} else {
-		(void) fprintf(fp, " \"%s\"", header_value);
+		body_len = over_len;
 	}
+
+	*nread -= req_len + body_len;
+	(void) memmove(buf, buf + req_len + body_len, *nread);
 }
 
-static void
-log_access(const struct mg_connection *conn)
+/*
+ * Serve requests on the connection until either side wants to close it,
+ * or the connection goes idle. Return TRUE if it was handed back to the
+ * reactor, and must not be closed.
+ */
+static bool_t
+process_new_connection(struct mg_connection *conn)
 {
-	const struct mg_request_info *ri;
-	char		date[64];
-
-	if (conn->ctx->access_log == NULL)
-		return;
-
-	(void) strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S %z",
-	    localtime(&conn->birth_time));
+	struct mg_request_info *ri = &conn->request_info;
+	char	*buf = conn->buf;
+	int	request_len;
+	bool_t	keep_alive, is_parked = FALSE;
 
-	ri = &conn->request_info;
+	do {
+		reset_connection_attributes(conn);
+		keep_alive = FALSE;
 
-	flockfile(conn->ctx->access_log);
+		/*
+		 * The reactor may have buffered the request already. If it
+		 * did not (SSL connection, no reactor on this platform, or
+		 * a persistent connection), read it in.
+		 */
+		if ((request_len = get_request_len(buf,
+		    (size_t) conn->nread)) == 0)
+			request_len = read_request(conn, NULL,
+			    buf, sizeof(conn->buf), &conn->nread);
+		assert(conn->nread >= request_len);
+
+		if (request_len <= 0)
+			return (FALSE);	/* Remote end closed the connection */
+
+		/* 0-terminate the request: parse_request uses sscanf */
+		buf[request_len - 1] = '\0';
+		conn->num_requests++;
+
+		if (parse_http_request(buf, ri, &conn->client.rsa)) {
+			if (strcmp(ri->http_version, "1.0") != 0 &&
+			    strcmp(ri->http_version, "1.1") != 0) {
+				send_error(conn, 505,
+				    "HTTP version not supported",
+				    "%s", "Weird HTTP version");
+				log_access(conn);
+			} else {
+				conn->keep_alive = should_keep_alive(conn);
+				conn->pipelined = is_pipelined(conn,
+				    request_len);
+				ri->post_data = buf + request_len;
+				ri->post_data_len = conn->nread - request_len;
+				conn->birth_time = time(NULL);
+				analyze_request(conn);
+				keep_alive = finish_response(conn, request_len);
+				log_access(conn);
+				shift_to_next(conn, buf, request_len,
+				    &conn->nread);
+			}
+		} else {
+			/* Do not put garbage in the access log */
+			send_error(conn, 400, "Bad Request",
+			    "Can not parse request: [%.*s]", conn->nread, buf);
+		}
 
-	(void) fprintf(conn->ctx->access_log,
-	    "%s - %s [%s] \"%s %s HTTP/%s\" %d %" INT64_FMT,
-	    inet_ntoa(conn->client.rsa.u.sin.sin_addr),
-	    ri->remote_user == NULL ? "-" : ri->remote_user,
-	    date,
-	    ri->request_method ? ri->request_method : "-",
-	    ri->uri ? ri->uri : "-",
-	    ri->http_version,
-	    conn->request_info.status_code, conn->num_bytes_sent);
-	log_header(conn, "Referer", conn->ctx->access_log);
-	log_header(conn, "User-Agent", conn->ctx->access_log);
-	(void) fputc('\n', conn->ctx->access_log);
-	(void) fflush(conn->ctx->access_log);
+		/* Batch ends when no more complete requests are buffered */
+		if ((!keep_alive ||
+		    get_request_len(buf, (size_t) conn->nread) <= 0) &&
+		    !flush_output(conn, FALSE))
+			keep_alive = FALSE;
+	} while (keep_alive && !(is_parked = park_connection(conn)) &&
+	    wait_for_request(conn));
 
-	funlockfile(conn->ctx->access_log);
+	return (is_parked);
 }
 
-static bool_t
-isbyte(int n) {
-	return (n >= 0 && n <= 255);
-}
+/*
+ * Decide whether the calling worker should exit, and if so, remove it
+ * from the pool. Surplus over max_threads always goes. Idle workers above
+ * min_threads go only if the pool has not grown for idle_time seconds,
+ * so that a bursty load does not make the pool shrink and grow again.
+ */
+static void put_socket(struct mg_context *, struct mg_connection *);
 
 /*
- * Verify given socket address against the ACL.
- * Return -1 if ACL is malformed, 0 if address is disallowed, 1 if allowed.
+ * Hand connections from the local queue of a worker that has left to
+ * the others.
  */
-static int
-check_acl(struct mg_context *ctx, const char *list, const struct usa *usa)
+static void
+reclaim_queue(struct worker *w)
 {
-	int		a, b, c, d, n, mask, allowed;
-	char		flag;
-	uint32_t	acl_subnet, acl_mask, remote_ip;
-	struct vec	vec;
-
-	(void) memcpy(&remote_ip, &usa->u.sin.sin_addr, sizeof(remote_ip));
-
-	/* If any ACL is set, deny by default */
-	allowed = '-';
-
-	while ((list = next_option(list, &vec, NULL)) != NULL) {
-
-		mask = 32;
+	struct mg_connection	*conn;
 
-		if (sscanf(vec.ptr, "%c%d.%d.%d.%d%n",
-		    &flag, &a, &b, &c, &d, &n) != 5) {
-			cry(fc(ctx),
-			    "%s: subnet must be [+|-]x.x.x.x[/x]", __func__);
-			return (-1);
-		} else if (flag != '+' && flag != '-') {
-			cry(fc(ctx), "%s: flag must be + or -: [%s]",
-			    __func__, vec.ptr);
-			return (-1);
-		} else if (!isbyte(a)||!isbyte(b)||!isbyte(c)||!isbyte(d)) {
-			cry(fc(ctx),
-			    "%s: bad ip address: [%s]", __func__, vec.ptr);
-			return (-1);
-		} else if (sscanf(vec.ptr + n, "/%d", &mask) == 0) {
-			/* Do nothing, no mask specified */
-		} else if (mask < 0 || mask > 32) {
-			cry(fc(ctx), "%s: bad subnet mask: %d [%s]",
-			    __func__, n, vec.ptr);
-			return (-1);
-		}
+	while ((conn = ring_get(w->queue)) != NULL)
+		put_socket(w->ctx, conn);
+}
 
-		acl_subnet = (a << 24) | (b << 16) | (c << 8) | d;
-		acl_mask = mask ? 0xffffffffU << (32 - mask) : 0;
+static bool_t
+retire_worker(struct worker *w, bool_t is_idle, int idle_time)
+{
+	struct mg_context	*ctx = w->ctx;
+	bool_t			retire;
 
-		if (acl_subnet == (ntohl(remote_ip) & acl_mask))
-			allowed = flag;
+	(void) pthread_mutex_lock(&ctx->thr_mutex);
+	retire = ATOMIC_LOAD(&ctx->stop_flag) != 0 ||
+	    ctx->num_threads > ctx->max_threads ||
+	    (is_idle && ctx->num_threads > ctx->min_threads &&
+	    time(NULL) - ctx->last_grow >= idle_time);
+	if (retire) {
+		ATOMIC_STORE(&w->is_active, FALSE);
+		(void) ATOMIC_ADD(&ctx->num_threads, -1);
+		assert(ctx->num_threads >= 0);
+		ctx->num_exiting++;
 	}
+	(void) pthread_mutex_unlock(&ctx->thr_mutex);
+
+	/* Acceptor may have queued something for us meanwhile */
+	if (retire) {
+		MEMORY_BARRIER();
+		reclaim_queue(w);
 
-	return (allowed == '+' ? 1 : 0);
-}
+		(void) pthread_mutex_lock(&ctx->thr_mutex);
+		ctx->num_exiting--;
+		(void) pthread_cond_signal(&ctx->thr_cond);
+		(void) pthread_mutex_unlock(&ctx->thr_mutex);
+	}
 
-static void
-add_to_set(SOCKET fd, fd_set *set, int *max_fd)
-{
-	FD_SET(fd, set);
-	if (fd > (SOCKET) *max_fd)
-		*max_fd = (int) fd;
+	return (retire);
 }
 
 /*
- * Deallocate mongoose context, free up the resources
+ * Worker threads take accepted connection from the queues. Return NULL if
+ * the worker has left the pool.
  */
-static void
-mg_fini(struct mg_context *ctx)
+static struct mg_connection *
+get_socket(struct worker *w)
 {
-	int	i;
+	struct mg_context	*ctx = w->ctx;
+	struct mg_connection	*conn;
+	unsigned int		seq;
+	int			idle_time;
+	bool_t			woken;
 
-	close_all_listening_sockets(ctx);
+	idle_time = atoi(ctx->options[OPT_IDLE_TIME]);
 
-	/* Wait until all threads finish */
-	(void) pthread_mutex_lock(&ctx->thr_mutex);
-	while (ctx->num_threads > 0)
-		(void) pthread_cond_wait(&ctx->thr_cond, &ctx->thr_mutex);
-	(void) pthread_mutex_unlock(&ctx->thr_mutex);
+	/* Pool may have been shrunk while we were busy. Counters are only
+	 * changed under thr_mutex, but are published atomically for this. */
+	if (ATOMIC_LOAD(&ctx->num_threads) > ATOMIC_LOAD(&ctx->max_threads) &&
+	    retire_worker(w, FALSE, idle_time))
+		return (NULL);
 
-	/* Deallocate all registered callbacks */
-	for (i = 0; i < ctx->num_callbacks; i++)
-		if (ctx->callbacks[i].uri_regex != NULL)
-			free(ctx->callbacks[i].uri_regex);
+	while ((conn = take_connection(w)) == NULL) {
+		DEBUG_TRACE((DEBUG_MGS_PREFIX "%s: thread %p: going idle",
+		    __func__, (void *) pthread_self()));
 
-	/* Deallocate all options */
-	for (i = 0; i < NUM_OPTIONS; i++)
-		if (ctx->options[i] != NULL)
-			free(ctx->options[i]);
+		/* Queues are empty: park, unless something came meanwhile */
+		(void) ATOMIC_ADD(&ctx->num_idle, 1);
+		seq = park_prepare(&w->wakeup);
+		if ((conn = take_connection(w)) != NULL) {
+			park_cancel(&w->wakeup);
+			(void) ATOMIC_ADD(&ctx->num_idle, -1);
+			break;
+		}
+		if (ATOMIC_LOAD(&ctx->stop_flag) != 0) {
+			/* Master thread may have woken workers before us */
+			park_cancel(&w->wakeup);
+			woken = TRUE;
+		} else {
+			woken = park_wait(&w->wakeup, seq, idle_time + 1);
+		}
+		(void) ATOMIC_ADD(&ctx->num_idle, -1);
 
-	/* Close log files */
-	if (ctx->access_log)
-		(void) fclose(ctx->access_log);
-	if (ctx->error_log)
-		(void) fclose(ctx->error_log);
+		/* Producer may have missed our leaving, look once more */
+		if ((conn = take_connection(w)) != NULL)
+			break;
+		else if (retire_worker(w, !woken, idle_time))
+			return (NULL);
+	}
 
-	/* Deallocate SSL context */
-	if (ctx->ssl_ctx)
-		SSL_CTX_free(ctx->ssl_ctx);
+	DEBUG_TRACE((DEBUG_MGS_PREFIX
+	    "%s: thread %p grabbed socket %d, going busy",
+	    __func__, (void *) pthread_self(), conn->client.sock));
 
-	/* Deallocate mutexes and condvars */
-	for (i = 0; i < NUM_OPTIONS; i++)
-		(void) pthread_mutex_destroy(&ctx->opt_mutex[i]);
+	/* There is room in the queue now */
+	park_wake(&ctx->queue_full);
 
-	(void) pthread_mutex_destroy(&ctx->thr_mutex);
-	(void) pthread_mutex_destroy(&ctx->bind_mutex);
-	(void) pthread_cond_destroy(&ctx->thr_cond);
-	(void) pthread_cond_destroy(&ctx->empty_cond);
-	(void) pthread_cond_destroy(&ctx->full_cond);
+	return (conn);
+}
 
-	/* Signal mg_stop() that we're done */
-	ctx->stop_flag = 2;
+static void
+serve_connection(struct mg_connection *conn)
+{
+	struct worker	*w = conn->worker;
+
+	/* mg_drain() and the pool manager shut it down to unblock the worker */
+	set_worker_socket(w, conn->client.sock);
+
+	/* SSL handshake is timed like reading the request headers */
+	if (conn->client.is_ssl)
+		time_io(conn, IO_HEADERS);
+
+	if (conn->client.is_ssl &&
+	    (conn->ssl = SSL_new(conn->ctx->ssl_ctx)) == NULL) {
+		cry(conn, "%s: SSL_new: %d", __func__, ERRNO);
+	} else if (conn->client.is_ssl &&
+	    SSL_set_fd(conn->ssl, conn->client.sock) != 1) {
+		cry(conn, "%s: SSL_set_fd: %d", __func__, ERRNO);
+	} else if (conn->client.is_ssl && SSL_accept(conn->ssl) != 1) {
+		cry(conn, "%s: SSL handshake error", __func__);
+	} else if (process_new_connection(conn)) {
+		return;	/* Parked in the reactor */
+	}
+
+	set_worker_socket(w, INVALID_SOCKET);
+	close_connection(conn);
+	free_connection(conn);
 }
 
-#if !defined(_WIN32)
+#if defined(USE_COROUTINES)
+/*
+ * Open the epoll and eventfd descriptors of the worker's scheduler.
+ */
 static bool_t
-set_uid_option(struct mg_context *ctx, const char *uid)
+init_scheduler(struct worker *w)
 {
-	struct passwd	*pw;
-	int		retval = FALSE;
+	struct epoll_event	ev;
 
-	if ((pw = getpwnam(uid)) == NULL)
-		cry(fc(ctx), "%s: unknown user [%s]", __func__, uid);
-	else if (setgid(pw->pw_gid) == -1)
-		cry(fc(ctx), "%s: setgid(%s): %s",
-		    __func__, uid, strerror(errno));
-	else if (setuid(pw->pw_uid) == -1)
-		cry(fc(ctx), "%s: setuid(%s): %s",
-		    __func__, uid, strerror(errno));
-	else
-		retval = TRUE;
+	if (w->has_scheduler)
+		return (TRUE);
 
-	return (retval);
-}
-#endif /* !_WIN32 */
+	if ((w->epoll_fd = epoll_create(64)) == -1) {
+		cry(fc(w->ctx), "%s: epoll_create: %d", __func__, ERRNO);
+		return (FALSE);
+	} else if ((w->event_fd = eventfd(0, EFD_NONBLOCK)) == -1) {
+		cry(fc(w->ctx), "%s: eventfd: %d", __func__, ERRNO);
+		(void) close(w->epoll_fd);
+		return (FALSE);
+	}
+	set_close_on_exec(w->epoll_fd);
+	set_close_on_exec(w->event_fd);
+
+	/* Event with NULL pointer means new work for the scheduler */
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	(void) epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->event_fd, &ev);
+
+	/* Becomes readable on mg_stop(), and stays so */
+	ev.data.ptr = &w->ctx->stop_flag;
+	if (w->ctx->stop_fd[0] != -1)
+		(void) epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD,
+		    w->ctx->stop_fd[0], &ev);
+
+	/* Same on mg_drain(), but only the edge is of interest */
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = &w->ctx->is_draining;
+	if (w->ctx->drain_fd[0] != -1)
+		(void) epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD,
+		    w->ctx->drain_fd[0], &ev);
+	wheel_init(&w->wheel, time(NULL));
+	w->has_scheduler = TRUE;
 
-#if !defined(NO_SSL)
-void
-mg_set_ssl_password_callback(struct mg_context *ctx, mg_spcb_t func)
-{
-	ctx->ssl_password_callback = func;
+	return (TRUE);
 }
 
-static pthread_mutex_t *ssl_mutexes;
-
+/*
+ * Wake up the scheduler waiting in epoll_wait(), to take new connections.
+ */
 static void
-ssl_locking_callback(int mode, int mutex_num, const char *file, int line)
+wake_scheduler(struct worker *w)
 {
-	line = 0;	/* Unused */
-	file = NULL;	/* Unused */
+	uint64_t	one = 1;
 
-	if (mode & CRYPTO_LOCK)
-		(void) pthread_mutex_lock(&ssl_mutexes[mutex_num]);
-	else
-		(void) pthread_mutex_unlock(&ssl_mutexes[mutex_num]);
+	(void) write(w->event_fd, &one, sizeof(one));
 }
 
-static unsigned long
-ssl_id_callback(void)
+static void
+coroutine_main(void)
 {
-	return ((unsigned long) pthread_self());
+	struct coroutine	*co = current_coroutine;
+	struct mg_connection	*conn = co->conn;
+
+	(void) process_new_connection(conn);
+
+	/* Socket must leave epoll before close, it may have been dup-ed */
+	if (co->is_registered)
+		(void) epoll_ctl(co->worker->epoll_fd, EPOLL_CTL_DEL,
+		    conn->client.sock, NULL);
+	close_connection(conn);
+	free_connection(conn);
+
+	/* Return to the scheduler through uc_link */
+	co->is_done = TRUE;
 }
 
+/*
+ * Run the connection as a new coroutine. Return FALSE on failure.
+ */
 static bool_t
-load_dll(struct mg_context *ctx, const char *dll_name, struct ssl_func *sw)
+start_coroutine(struct worker *w, struct mg_connection *conn)
 {
-	union {void *p; void (*fp)(void);} u;
-	void		*dll_handle;
-	struct ssl_func	*fp;
+	struct coroutine	*co;
+	char			*stack;
 
-	if ((dll_handle = dlopen(dll_name, RTLD_LAZY)) == NULL) {
-		cry(fc(ctx), "%s: cannot load %s", __func__, dll_name);
+	/* Stack pages are only used on touch. Lowest one is the guard */
+	if ((co = (struct coroutine *) calloc(1, sizeof(*co))) == NULL) {
+		return (FALSE);
+	} else if ((stack = (char *) mmap(NULL, COROUTINE_STACK_SIZE,
+	    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK,
+	    -1, 0)) == MAP_FAILED) {
+		free(co);
 		return (FALSE);
 	}
+	(void) mprotect(stack, getpagesize(), PROT_NONE);
 
-	for (fp = sw; fp->name != NULL; fp++) {
-#ifdef _WIN32
-		/* GetProcAddress() returns pointer to function */
-		u.fp = (void (*)(void)) dlsym(dll_handle, fp->name);
-#else
-		/*
-		 * dlsym() on UNIX returns void *.
-		 * ISO C forbids casts of data pointers to function
-		 * pointers. We need to use a union to make a cast.
-		 */
-		u.p = dlsym(dll_handle, fp->name);
-#endif /* _WIN32 */
-		if (u.fp == NULL) {
-			cry(fc(ctx), "%s: cannot find %s", __func__, fp->name);
-			return (FALSE);
-		} else {
-			fp->ptr = u.fp;
-		}
-	}
+	(void) getcontext(&co->context);
+	co->context.uc_stack.ss_sp = stack;
+	co->context.uc_stack.ss_size = COROUTINE_STACK_SIZE;
+	co->context.uc_link = &w->scheduler;
+	makecontext(&co->context, coroutine_main, 0);
+
+	co->worker = w;
+	co->conn = conn;
+	co->stack = stack;
+	co->next = w->coroutines;
+	w->coroutines = co;
+	w->num_coroutines++;
+
+	/* Coroutines use non-blocking sockets, and wait in epoll */
+	(void) set_non_blocking_mode(conn, conn->client.sock);
 
 	return (TRUE);
 }
 
 /*
- * Dynamically load SSL library. Set up ctx->ssl_ctx pointer.
+ * Switch to the coroutine until it waits or finishes. Free it if done.
  */
-static bool_t
-set_ssl_option(struct mg_context *ctx, const char *pem)
+static void
+resume_coroutine(struct worker *w, struct coroutine *co, bool_t is_ready)
 {
-	SSL_CTX		*CTX;
-	int		i, size, retval = FALSE;
-
-#if !TARGET_OS_IPHONE || TARGET_IPHONE_SIMULATOR
-    if (load_dll(ctx, SSL_LIB, ssl_sw) == FALSE ||
-	    load_dll(ctx, CRYPTO_LIB, crypto_sw) == FALSE)
-		return (FALSE);
-#endif
-    
-	/* Initialize SSL crap */
-	SSL_library_init();
-
-	if ((CTX = SSL_CTX_new(SSLv23_server_method())) == NULL)
-		cry(fc(ctx), "SSL_CTX_new error");
-	else if (ctx->ssl_password_callback != NULL)
-		SSL_CTX_set_default_passwd_cb(CTX, ctx->ssl_password_callback);
+	struct coroutine	**p;
 
-	if (CTX != NULL && SSL_CTX_use_certificate_file(
-	    CTX, pem, SSL_FILETYPE_PEM) == 0)
-		cry(fc(ctx), "%s: cannot open %s", __func__, pem);
-	else if (CTX != NULL && SSL_CTX_use_PrivateKey_file(
-	    CTX, pem, SSL_FILETYPE_PEM) == 0)
-		cry(fc(ctx), "%s: cannot open %s", NULL, pem);
-	else
-		retval = TRUE;
+	timer_cancel(&w->wheel, &co->timer);
+	co->is_waiting = FALSE;
+	co->is_ready = is_ready;
+	current_coroutine = co;
+	(void) swapcontext(&w->scheduler, &co->context);
+	current_coroutine = NULL;
 
-	/*
-	 * Initialize locking callbacks, needed for thread safety.
-	 * http://www.openssl.org/support/faq.html#PROG1
-	 */
-	size = sizeof(pthread_mutex_t) * CRYPTO_num_locks();
-	if ((ssl_mutexes = (pthread_mutex_t *) malloc(size)) == NULL) {
-		cry(fc(ctx), "%s: cannot allocate mutexes", __func__);
-		return (FALSE);
+	if (co->is_done) {
+		for (p = &w->coroutines; *p != co; p = &(*p)->next)
+			continue;
+		*p = co->next;
+		w->num_coroutines--;
+		(void) munmap(co->stack, COROUTINE_STACK_SIZE);
+		free(co);
 	}
+}
 
-	for (i = 0; i < CRYPTO_num_locks(); i++)
-		pthread_mutex_init(&ssl_mutexes[i], NULL);
+/*
+ * Serve the connection, and others that come meanwhile, as coroutines on
+ * the calling worker thread. Return when all of them are served.
+ */
+static void
+run_coroutines(struct worker *w, struct mg_connection *conn, int max)
+{
+	struct mg_context	*ctx = w->ctx;
+	struct epoll_event	events[MAX_EPOLL_EVENTS];
+	struct coroutine	*co, *next;
+	struct timer		*t;
+	int			i, n, timeout;
+	uint64_t		count;
 
-	CRYPTO_set_locking_callback(&ssl_locking_callback);
-	CRYPTO_set_id_callback(&ssl_id_callback);
+	if (!init_scheduler(w) || !start_coroutine(w, conn)) {
+		serve_connection(conn);
+		return;
+	}
+	resume_coroutine(w, w->coroutines, TRUE);
 
-	/* Done with everything. Save the context. */
-	ctx->ssl_ctx = CTX;
+	while (w->coroutines != NULL) {
+		/* Take more connections while there is room */
+		while (w->num_coroutines < max &&
+		    ATOMIC_LOAD(&ctx->stop_flag) == 0 &&
+		    (conn = take_connection(w)) != NULL) {
+			conn->birth_time = time(NULL);
+			conn->worker = w;
+			if (conn->client.is_ssl || !start_coroutine(w, conn))
+				serve_connection(conn);
+			else
+				resume_coroutine(w, w->coroutines, TRUE);
+		}
+		if (w->coroutines == NULL)
+			break;
 
-	return (retval);
+		/* Acceptors write to event_fd if is_polling is set */
+		ATOMIC_STORE(&w->is_polling, TRUE);
+		MEMORY_BARRIER();
+		timeout = w->num_coroutines < max &&
+		    ring_depth(w->queue) > 0 ? 0 : 1000;
+		n = epoll_wait(w->epoll_fd, events, ARRAY_SIZE(events),
+		    timeout);
+		ATOMIC_STORE(&w->is_polling, FALSE);
+
+		for (i = 0; i < n; i++)
+			if ((co = (struct coroutine *) events[i].data.ptr) ==
+			    NULL)
+				(void) read(w->event_fd, &count, sizeof(count));
+			else if (events[i].data.ptr != &ctx->stop_flag &&
+			    events[i].data.ptr != &ctx->is_draining &&
+			    co->is_waiting)
+				resume_coroutine(w, co, TRUE);
+
+		/* Time out coroutines */
+		while ((t = wheel_expire(&w->wheel, time(NULL))) != NULL)
+			resume_coroutine(w,
+			    TIMER_OWNER(t, struct coroutine, timer), FALSE);
+
+		/* Stop them all, or the idle ones when draining */
+		if (ATOMIC_LOAD(&ctx->stop_flag) != 0 ||
+		    ATOMIC_LOAD(&ctx->is_draining))
+			for (co = w->coroutines; co != NULL; co = next) {
+				next = co->next;
+				if (co->is_waiting &&
+				    (ATOMIC_LOAD(&ctx->stop_flag) != 0 ||
+				    co->is_idle))
+					resume_coroutine(w, co, FALSE);
+			}
+	}
 }
-#endif /* !NO_SSL */
+#endif /* USE_COROUTINES */
 
-static bool_t
-open_log_file(struct mg_context *ctx, FILE **fpp, const char *path)
+static void
+worker_thread(struct worker *w)
 {
-	bool_t	retval = TRUE;
+	struct mg_connection	*conn;
+#if defined(USE_COROUTINES)
+	int			max;
+#endif /* USE_COROUTINES */
 
-	if (*fpp != NULL)
-		(void) fclose(*fpp);
+	DEBUG_TRACE((DEBUG_MGS_PREFIX "%s: thread %p starting",
+	    __func__, (void *) pthread_self()));
 
-	if (path == NULL) {
-		*fpp = NULL;
-	} else if ((*fpp = mg_fopen(path, "a")) == NULL) {
-		cry(fc(ctx), "%s(%s): %s", __func__, path, strerror(errno));
-		retval = FALSE;
-	} else {
-		set_close_on_exec(fileno(*fpp));
+	pin_worker(w);
+	while ((conn = get_socket(w)) != NULL) {
+		conn->birth_time = time(NULL);
+		conn->worker = w;
+
+#if defined(USE_COROUTINES)
+		max = atoi(w->ctx->options[OPT_COROUTINES]);
+		if (max > 0 && !conn->client.is_ssl) {
+			run_coroutines(w, conn, max);
+			continue;
+		}
+#endif /* USE_COROUTINES */
+		serve_connection(conn);
 	}
 
-	return (retval);
+	DEBUG_TRACE((DEBUG_MGS_PREFIX "%s: thread %p exiting",
+	    __func__, (void *) pthread_self()));
 }
 
+/*
+ * The workers are overloaded if the pool cannot grow, no worker is idle,
+ * and either too many connections are queued, the last one taken from
+ * the queue waited too long, or the shared queue is full.
+ */
 static bool_t
-set_alog_option(struct mg_context *ctx, const char *path)
+is_overloaded(struct mg_context *ctx)
 {
-	return (open_log_file(ctx, &ctx->access_log, path));
-}
+	struct ring	*ring;
+	int		depth, max_depth, max_wait, phase;
+	bool_t		is_full;
 
-static bool_t
-set_elog_option(struct mg_context *ctx, const char *path)
-{
-	return (open_log_file(ctx, &ctx->error_log, path));
-}
+	max_depth = ATOMIC_LOAD(&ctx->shed_depth);
+	max_wait = ATOMIC_LOAD(&ctx->shed_wait);
+	if ((max_depth <= 0 && max_wait <= 0) ||
+	    ATOMIC_LOAD(&ctx->num_idle) > 0 ||
+	    ATOMIC_LOAD(&ctx->num_threads) < ATOMIC_LOAD(&ctx->max_threads))
+		return (FALSE);
 
-static bool_t
-set_gpass_option(struct mg_context *ctx, const char *path)
-{
-	struct mgstat	mgstat;
-	ctx = NULL;
-	return (mg_stat(path, &mgstat) == 0);
+	phase = enter_queue(ctx);
+	ring = ATOMIC_LOAD(&ctx->queue);
+	is_full = ring_depth(ring) > (int) ring->mask;
+	leave_queue(ctx, phase);
+	depth = queued_connections(ctx);
+
+	return ((max_depth > 0 && depth >= max_depth) ||
+	    (max_wait > 0 && depth > 0 &&
+	    ATOMIC_LOAD(&ctx->queue_wait) >= max_wait) || is_full);
 }
 
+/*
+ * Under overload, reply 503 to the new connection right away and close
+ * it, rather than queue it for a worker, or block until there is room.
+ * Return TRUE if the connection was shed. The reactor calls this when
+ * the request headers are buffered, so that the client sees the reply
+ * before the connection is closed. SSL connections are always queued.
+ */
 static bool_t
-set_max_threads_option(struct mg_context *ctx, const char *str)
+shed_connection(struct mg_context *ctx, struct mg_connection *conn)
 {
-	ctx->max_threads = atoi(str);
+	if (conn->client.is_ssl || !is_overloaded(ctx))
+		return (FALSE);
+
+	lock_option(ctx, OPT_RETRY_AFTER);
+	(void) send(conn->client.sock, ctx->busy_reply,
+	    (size_t) ctx->busy_reply_len, 0);
+	unlock_option(ctx, OPT_RETRY_AFTER);
+
+	close_socket_gracefully(conn, conn->client.sock);
+	free_connection(conn);
+
 	return (TRUE);
 }
 
-static bool_t
-set_acl_option(struct mg_context *ctx, const char *acl)
+/*
+ * Acceptors hand accepted connection to a worker. If no worker has room,
+ * the connection goes to the shared queue.
+ */
+static void
+put_socket(struct mg_context *ctx, struct mg_connection *conn)
 {
-	struct usa	fake;
+	struct worker	*w;
+	unsigned int	seq;
 
-	return (check_acl(ctx, acl, &fake) != -1);
-}
+	conn->queued_at = get_msec();
 
-static void admin_page(struct mg_connection *,
-		const struct mg_request_info *, void *);
-static bool_t
-set_admin_uri_option(struct mg_context *ctx, const char *uri)
-{
-	mg_set_uri_callback(ctx, uri, &admin_page, NULL);
-	return (TRUE);
+	/* If the shared queue is full, wait until a worker takes something */
+	if ((w = assign_connection(ctx, conn)) == NULL)
+		while (!enqueue_connection(ctx, conn)) {
+			seq = park_prepare(&ctx->queue_full);
+			if (enqueue_connection(ctx, conn)) {
+				park_cancel(&ctx->queue_full);
+				break;
+			} else if (ATOMIC_LOAD(&ctx->stop_flag) != 0) {
+				/* Workers are leaving, nobody will take it */
+				park_cancel(&ctx->queue_full);
+				(void) closesocket(conn->client.sock);
+				free_connection(conn);
+				return;
+			}
+			(void) park_wait(&ctx->queue_full, seq, 1);
+		}
+	DEBUG_TRACE((DEBUG_MGS_PREFIX "%s: queued socket %d",
+	    __func__, conn->client.sock));
+
+	/* Wake the chosen worker, or else any idle one to steal the work */
+	MEMORY_BARRIER();
+	if (w != NULL && ATOMIC_LOAD(&w->wakeup.num_waiting) > 0)
+		park_wake(&w->wakeup);
+#if defined(USE_COROUTINES)
+	else if (w != NULL && ATOMIC_LOAD(&w->is_polling))
+		wake_scheduler(w);
+#endif /* USE_COROUTINES */
+	else if (ATOMIC_LOAD(&ctx->num_idle) > 0)
+		wake_idle_worker(ctx);
+	else
+		park_wake(&ctx->pool_wanted);
+
+	/* Chosen worker may have left the pool before seeing it */
+	if (w != NULL && !ATOMIC_LOAD(&w->is_active))
+		reclaim_queue(w);
 }
 
 /*
- * Check if the comma-separated list of options has a format of key-value
- * pairs: "k1=v1,k2=v2". Return FALSE if any entry has invalid key or value.
+ * Start worker threads, so that there are at least min_threads of them,
+ * and enough to take every queued connection. Never more than max_threads.
  */
-static bool_t
-set_kv_list_option(struct mg_context *ctx, const char *str)
+static void
+grow_pool(struct mg_context *ctx)
 {
-	const char	*list;
-	struct vec	key, value;
+	struct worker	*w;
+	int		wanted;
 
-	list = str;
-	while ((list = next_option(list, &key, &value)) != NULL)
-		if (key.len == 0 || value.len == 0) {
-			cry(fc(ctx), "Invalid list specified: [%s], "
-			    "expecting key1=value1,key2=value2,...", str);
-			return (FALSE);
+	(void) pthread_mutex_lock(&ctx->thr_mutex);
+	wanted = ctx->num_threads + queued_connections(ctx) -
+	    ATOMIC_LOAD(&ctx->num_idle);
+	if (wanted < ctx->min_threads)
+		wanted = ctx->min_threads;
+	if (wanted > ctx->max_threads)
+		wanted = ctx->max_threads;
+
+	while (ctx->num_threads < wanted &&
+	    ATOMIC_LOAD(&ctx->stop_flag) == 0) {
+		if ((w = claim_worker(ctx)) == NULL) {
+			cry(fc(ctx), "Cannot allocate worker");
+			break;
+		} else if (start_thread(ctx,
+		    (mg_thread_func_t) worker_thread, w) != 0) {
+			cry(fc(ctx), "Cannot start thread: %d", ERRNO);
+			ATOMIC_STORE(&w->is_active, FALSE);
+			break;
 		}
-
-	return (TRUE);
+		(void) ATOMIC_ADD(&ctx->num_threads, 1);
+		ctx->last_grow = time(NULL);
+	}
+	(void) pthread_mutex_unlock(&ctx->thr_mutex);
 }
 
-static bool_t
-set_root_option(struct mg_context *ctx, const char *root)
+/*
+ * Shut down the sockets of workers blocked in IO past its deadline, see
+ * time_io(). The worker lets go of the socket under sock_mutex before
+ * closing it, so the descriptor cannot be reused while it is looked at.
+ */
+static void
+expire_workers(struct mg_context *ctx)
 {
-	struct mgstat buf;
-	if ( mg_stat(root, &buf) != 0) {
-		cry(fc(ctx), "Invalid root directory: \"%s\"", root);
-		return (FALSE);
+	struct worker	*w;
+	time_t		deadline, now = time(NULL);
+	int		i;
 
+	for (i = 0; i < ATOMIC_LOAD(&ctx->num_workers); i++) {
+		w = ctx->workers[i];
+		(void) pthread_mutex_lock(&w->sock_mutex);
+		deadline = ATOMIC_LOAD(&w->deadline);
+		if (deadline != 0 && now >= deadline &&
+		    w->sock != INVALID_SOCKET) {
+			ATOMIC_STORE(&w->deadline, 0);
+			(void) shutdown(w->sock, SHUT_RDWR);
+		}
+		(void) pthread_mutex_unlock(&w->sock_mutex);
 	}
-	return (TRUE);
 }
 
-static const struct mg_option known_options[] = {
-	{"root", "\tWeb root directory", ".", OPT_ROOT, set_root_option},
-	{"index_files",	"Index files", "index.html,index.htm,index.cgi",
-		OPT_INDEX_FILES, NULL},
-#if !defined(NO_SSL)
-	{"ssl_cert", "SSL certificate file", NULL,
-		OPT_SSL_CERTIFICATE, &set_ssl_option},
-#endif /* !NO_SSL */
-	{"ports", "Listening ports", NULL,
-		OPT_PORTS, &set_ports_option},
-	{"dir_list", "Directory listing", "yes",
-		OPT_DIR_LIST, NULL},
-	{"protect", "URI to htpasswd mapping", NULL,
-		OPT_PROTECT, &set_kv_list_option},
-#if !defined(NO_CGI)
-	{"cgi_ext", "CGI extensions", ".cgi,.pl,.php",
-		OPT_CGI_EXTENSIONS, NULL},
-	{"cgi_interp", "CGI interpreter to use with all CGI scripts", NULL,
-		OPT_CGI_INTERPRETER, NULL},
-	{"cgi_env", "Custom CGI enviroment variables", NULL,
-		OPT_CGI_ENV, &set_kv_list_option},
-#endif /* NO_CGI */
-	{"ssi_ext", "SSI extensions", ".shtml,.shtm",
-		OPT_SSI_EXTENSIONS, NULL},
-	{"auth_realm", "Authentication domain name", "mydomain.com",
-		OPT_AUTH_DOMAIN, NULL},
-	{"auth_gpass", "Global passwords file", NULL,
-		OPT_AUTH_GPASSWD, &set_gpass_option},
-	{"auth_PUT", "PUT,DELETE auth file", NULL,
-		OPT_AUTH_PUT, NULL},
-#if !defined(_WIN32)
-	{"uid", "\tRun as user", NULL, OPT_UID, &set_uid_option},
-#endif /* !_WIN32 */
-	{"access_log", "Access log file", NULL,
-		OPT_ACCESS_LOG, &set_alog_option},
-	{"error_log", "Error log file", NULL,
-		OPT_ERROR_LOG, &set_elog_option},
-	{"aliases", "Path=URI mappings", NULL,
-		OPT_ALIASES, &set_kv_list_option},
-	{"admin_uri", "Administration page URI", NULL,
-		OPT_ADMIN_URI, &set_admin_uri_option},
-	{"acl", "\tAllow/deny IP addresses/subnets", NULL,
-		OPT_ACL, &set_acl_option},
-	{"max_threads", "Maximum simultaneous threads to spawn", "100",
-		OPT_MAX_THREADS, &set_max_threads_option},
-	{"idle_time", "Time in seconds connection stays idle", "10",
-		OPT_IDLE_TIME, NULL},
-	{"mime_types", "Comma separated list of ext=mime_type pairs", NULL,
-		OPT_MIME_TYPES, &set_kv_list_option},
-	{NULL, NULL, NULL, 0, NULL}
-};
+/*
+ * Free the rings retired by resizing the queue. Once they all look empty,
+ * they are unlinked and the phase is flipped. On a later call, when the
+ * threads of the old phase have left, they are freed. A connection put
+ * in one meanwhile puts its ring back at the end of the queue.
+ */
+static void
+free_retired_rings(struct mg_context *ctx)
+{
+	struct ring	*head, *ring, *next, *last;
 
-static const struct mg_option *
-find_opt(const char *opt_name)
+	if ((ring = ctx->retired) != NULL) {
+		if (ATOMIC_LOAD(&ctx->queue_users[ctx->retired_phase]) != 0)
+			return;
+		for (ctx->retired = NULL; ring != NULL; ring = next) {
+			next = ring->next;
+			if (ring_depth(ring) == 0) {
+				free(ring);
+				continue;
+			}
+			ring->next = NULL;
+			for (last = ATOMIC_LOAD(&ctx->queue);
+			    last->next != NULL; last = last->next)
+				continue;
+			ATOMIC_STORE(&last->next, ring);
+		}
+		return;
+	}
+
+	head = ATOMIC_LOAD(&ctx->queue);
+	for (ring = head->next; ring != NULL; ring = ring->next)
+		if (ring_depth(ring) > 0)
+			return;
+
+	/* Threads walking the chain can still follow the unlinked part */
+	if ((ctx->retired = head->next) != NULL) {
+		ATOMIC_STORE(&head->next, NULL);
+		ctx->retired_phase = ATOMIC_ADD(&ctx->queue_phase, 1) & 1;
+	}
+}
+
+/*
+ * Pool manager starts worker threads on behalf of the acceptors, so that
+ * thread creation cost is never paid on the accept path. Once a second,
+ * it also cuts off workers stuck in IO with slow clients, and frees the
+ * rings retired by resizing the queue.
+ */
+static void
+manager_thread(struct mg_context *ctx)
 {
-	int	i;
+	unsigned int	seq;
+	time_t		last_check = 0;
 
-	for (i = 0; known_options[i].name != NULL; i++)
-		if (!strcmp(opt_name, known_options[i].name))
-			return (known_options + i);
+	for (;;) {
+		seq = park_prepare(&ctx->pool_wanted);
+		if (ATOMIC_LOAD(&ctx->stop_flag) != 0) {
+			park_cancel(&ctx->pool_wanted);
+			break;
+		}
+		grow_pool(ctx);
+		if (time(NULL) != last_check) {
+			last_check = time(NULL);
+			expire_workers(ctx);
+			free_retired_rings(ctx);
+		}
+		(void) park_wait(&ctx->pool_wanted, seq, 1);
+	}
 
-	return (NULL);
+	(void) pthread_mutex_lock(&ctx->thr_mutex);
+	ctx->has_manager = FALSE;
+	(void) pthread_cond_signal(&ctx->thr_cond);
+	(void) pthread_mutex_unlock(&ctx->thr_mutex);
 }
 
-int
-mg_set_option(struct mg_context *ctx, const char *opt, const char *val)
+/*
+ * Called by the master thread once it has noticed mg_stop(). Threads
+ * parked with long timeouts are woken up to notice it too.
+ */
+static void
+wake_all_threads(struct mg_context *ctx)
 {
-	const struct mg_option	*option;
-	int			i, retval;
+	wake_all_workers(ctx);
+	park_wake(&ctx->pool_wanted);
+	park_wake_all(&ctx->queue_full);
+}
 
-	DEBUG_TRACE((DEBUG_MGS_PREFIX "%s: [%s]->[%s]", __func__, opt, val));
-	if (opt != NULL && (option = find_opt(opt)) != NULL) {
-		i = (int) (option - known_options);
-		lock_option(ctx, i);
+/*
+ * Accept new connection on the given listening socket. Return FALSE if
+ * there was nothing to accept. Otherwise, store newly allocated connection
+ * in connp, or NULL if the client is not allowed to connect.
+ */
+static bool_t
+accept_new_connection(const struct socket *listener, struct mg_context *ctx,
+		struct mg_connection **connp)
+{
+	struct mg_connection	*conn;
+	struct socket		accepted;
+	int			on = 1;
 
-		if (option->setter != NULL)
-			retval = option->setter(ctx, val);
-		else
-			retval = TRUE;
+	*connp = NULL;
+	accepted.rsa.len = sizeof(accepted.rsa.u.sin);
+	accepted.lsa = listener->lsa;
+#if defined(USE_EPOLL)
+	/* Accepted sockets start in the reactor, in non-blocking mode */
+	if ((accepted.sock = accept4(listener->sock, &accepted.rsa.u.sa,
+	    &accepted.rsa.len, SOCK_NONBLOCK | SOCK_CLOEXEC)) == INVALID_SOCKET)
+		return (FALSE);
+#else
+	if ((accepted.sock = accept(listener->sock,
+	    &accepted.rsa.u.sa, &accepted.rsa.len)) == INVALID_SOCKET)
+		return (FALSE);
+#endif /* USE_EPOLL */
 
-		/* Free old value if any */
-		if (ctx->options[option->index] != NULL)
-			free(ctx->options[option->index]);
+	/*
+	 * A persistent connection carries many small responses, often
+	 * written in several pieces. Do not let Nagle hold them back.
+	 */
+	if (ATOMIC_LOAD(&ctx->nodelay))
+		(void) setsockopt(accepted.sock, IPPROTO_TCP, TCP_NODELAY,
+		    (char *) &on, sizeof(on));
 
-		/* Set new option value */
-		ctx->options[option->index] = val ? mg_strdup(val) : NULL;
-		unlock_option(ctx, i);
+	lock_option(ctx, OPT_ACL);
+	if (ctx->options[OPT_ACL] != NULL &&
+	    !check_acl(ctx, ctx->options[OPT_ACL], &accepted.rsa)) {
+		cry(fc(ctx), "%s: %s is not allowed to connect",
+		    __func__, inet_ntoa(accepted.rsa.u.sin.sin_addr));
+		(void) closesocket(accepted.sock);
+		unlock_option(ctx, OPT_ACL);
+		return (TRUE);
+	}
+	unlock_option(ctx, OPT_ACL);
 
-		if (retval == FALSE)
-			cry(fc(ctx), "%s(%s): failure", __func__, opt);
-	} else {
-		cry(fc(ctx), "%s: No such option: [%s]", __func__, opt);
-		retval = -1;
+	if ((conn = (struct mg_connection *) calloc(1, sizeof(*conn))) == NULL) {
+		cry(fc(ctx), "%s: cannot allocate connection", __func__);
+		(void) closesocket(accepted.sock);
+		return (TRUE);
 	}
 
-	return (retval);
+	(void) ATOMIC_ADD(&ctx->num_connections, 1);
+	DEBUG_TRACE((DEBUG_MGS_PREFIX "%s: accepted socket %d",
+	    __func__, accepted.sock));
+	accepted.is_ssl = listener->is_ssl;
+	conn->client = accepted;
+	conn->ctx = ctx;
+	*connp = conn;
+
+	return (TRUE);
 }
 
-void
-mg_show_usage_string(FILE *fp)
+/*
+ * Close a listening socket that is no longer wanted. Connections already
+ * in its listen queue would be reset by the close, so accept them first
+ * and hand them to the workers.
+ */
+static void
+close_listener(struct mg_context *ctx, const struct socket *listener)
 {
-	const struct mg_option	*o;
-
-	(void) fprintf(stderr,
-	    "Mongoose version %s (c) Sergey Lyubka\n"
-	    "usage: mongoose [options] [config_file]\n", mg_version());
+	struct mg_connection	*conn;
+	int			i;
 
-	fprintf(fp, "  -A <htpasswd_file> <realm> <user> <passwd>\n");
+	(void) set_non_blocking_mode(fc(ctx), listener->sock);
+	for (i = 0; i < SOMAXCONN &&
+	    accept_new_connection(listener, ctx, &conn); i++)
+		if (conn != NULL) {
+			(void) set_blocking_mode(conn, conn->client.sock);
+			put_socket(ctx, conn);
+		}
 
-	for (o = known_options; o->name != NULL; o++) {
-		(void) fprintf(fp, "  -%s\t%s", o->name, o->description);
-		if (o->default_value != NULL)
-			fprintf(fp, " (default: \"%s\")", o->default_value);
-		fputc('\n', fp);
-	}
+	/* The master thread may be in select() on it, which would keep
+	 * the socket listening after close(). Shut it down first */
+	(void) shutdown(listener->sock, SHUT_RDWR);
+	(void) closesocket(listener->sock);
 }
 
-const char *
-mg_get_option(const struct mg_context *ctx, const char *option_name)
+#if defined(USE_EPOLL)
+static void
+unlink_pending(struct reactor *r, struct mg_connection *conn)
 {
-	const struct mg_option	*option;
-
-	if ((option = find_opt(option_name)) != NULL)
-		return (ctx->options[option->index]);
+	timer_cancel(&r->wheel, &conn->timer);
+	if (conn->prev != NULL)
+		conn->prev->next = conn->next;
 	else
-		return (NULL);
+		r->pending = conn->next;
+	if (conn->next != NULL)
+		conn->next->prev = conn->prev;
+	conn->next = conn->prev = NULL;
 }
 
+/*
+ * Hand the connection over to the worker threads, unless they are
+ * overloaded. From now on, the reactor does not own it: workers use
+ * blocking IO on it.
+ */
 static void
-admin_page(struct mg_connection *conn, const struct mg_request_info *ri,
-			   void *user_data)
+dispatch_connection(struct reactor *r, struct mg_connection *conn)
 {
-	const struct mg_option	*option;
-	const char		*option_name, *option_value;
-
-	user_data = NULL; /* Unused */
-
-	(void) mg_printf(conn,
-	"HTTP/1.1 200 OK\r\n"
-			"Content-Type: text/html\r\n\r\n"
-			"<html><body><h1>Mongoose v. %s</h1>", mg_version());
-
-	if (!strcmp(ri->request_method, "POST")) {
-		option_name = mg_get_var(conn, "o");
-		option_value = mg_get_var(conn, "v");
-		if (mg_set_option(conn->ctx,
-		    option_name, option_value) == -1) {
-			(void) mg_printf(conn,
-			    "<p style=\"background: red\">Error setting "
-			    "option \"%s\"</p>",
-			    option_name ? option_name : "(null)");
-		} else {
-			(void) mg_printf(conn,
-			    "<p style=\"color: green\">Saved: %s=%s</p>",
-			    option_name, option_value ? option_value : "NULL");
-		}
+	(void) epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, conn->client.sock, NULL);
+	unlink_pending(r, conn);
+	if (!shed_connection(r->ctx, conn)) {
+		(void) set_blocking_mode(conn, conn->client.sock);
+		put_socket(r->ctx, conn);
 	}
+}
 
-	/* Print table with all options */
-	(void) mg_printf(conn, "%s", "<table border=\"1\""
-			"<tr><th>Option</th><th>Description</th>"
-					"<th colspan=2>Value</th></tr>");
+static void
+discard_pending_connection(struct reactor *r, struct mg_connection *conn)
+{
+	unlink_pending(r, conn);
+	(void) closesocket(conn->client.sock);
+	free_connection(conn);
+}
 
-	for (option = known_options; option->name != NULL; option++) {
-		option_value = mg_get_option(conn->ctx, option->name);
-		if (option_value == NULL)
-			option_value = "";
-		(void) mg_printf(conn,
-		    "<form method=post><tr><td>%s</td><td>%s</td>"
-		    "<input type=hidden name=o value='%s'>"
-		    "<td><input type=text name=v value='%s'></td>"
-		    "<td><input type=submit value=save></td></form></tr>",
-		    option->name, option->description,
-		    option->name, option_value);
-	}
+/*
+ * Idle persistent connections are dropped after the keep-alive timeout.
+ * Once a request starts arriving, it is timed like reading the request
+ * headers in a worker.
+ */
+static void
+set_pending_deadline(struct reactor *r, struct mg_connection *conn)
+{
+	int	timeout;
 
-	(void) mg_printf(conn, "%s", "</table></body></html>");
+	if (conn->num_requests > 0 && conn->nread == 0) {
+		timeout = atoi(r->ctx->options[OPT_KEEP_ALIVE_TIMEOUT]);
+		timer_set(&r->wheel, &conn->timer, time(NULL) + timeout);
+	} else {
+		time_io(conn, IO_HEADERS);
+		if (conn->io_deadline != 0)
+			timer_set(&r->wheel, &conn->timer, conn->io_deadline);
+		else
+			timer_cancel(&r->wheel, &conn->timer);
+	}
 }
 
+/*
+ * Non-SSL connections are kept in the reactor until request headers are
+ * fully buffered. Slow or idle clients do not occupy a worker thread.
+ */
 static void
-reset_per_request_attributes(struct mg_connection *conn)
+add_pending_connection(struct reactor *r, struct mg_connection *conn)
 {
-	if (conn->request_info.remote_user != NULL) {
-		free((void *) conn->request_info.remote_user);
-		conn->request_info.remote_user = NULL;
+	struct epoll_event	ev;
+
+	if (conn->client.is_ssl) {
+		/* SSL handshake is done by the worker thread */
+		(void) set_blocking_mode(conn, conn->client.sock);
+		put_socket(r->ctx, conn);
+		return;
 	}
-	if (conn->free_post_data && conn->request_info.post_data != NULL) {
-		free((void *) conn->request_info.post_data);
-		conn->request_info.post_data = NULL;
+
+	conn->next = r->pending;
+	conn->prev = NULL;
+	if (r->pending != NULL)
+		r->pending->prev = conn;
+	r->pending = conn;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = conn;
+	if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD,
+	    conn->client.sock, &ev) != 0) {
+		cry(conn, "%s: epoll_ctl: %s", __func__, strerror(ERRNO));
+		discard_pending_connection(r, conn);
+	} else {
+		set_pending_deadline(r, conn);
 	}
 }
 
+/*
+ * Read whatever is available on the connection. Once the request headers
+ * are buffered, hand the connection over to the workers. If the request
+ * is malformed or too big, the worker sends the error.
+ */
 static void
-close_socket_gracefully(struct mg_connection *conn, SOCKET sock)
+read_pending_request(struct reactor *r, struct mg_connection *conn)
 {
-	char	buf[BUFSIZ];
 	int	n;
 
-	/* Send FIN to the client */
-	(void) shutdown(sock, SHUT_WR);
-	set_non_blocking_mode(conn, sock);
-
-	/*
-	 * Read and discard pending data. If we do not do that and close the
-	 * socket, the data in the send buffer may be discarded. This
-	 * behaviour is seen on Windows, when client keeps sending data
-	 * when server decide to close the connection; then when client
-	 * does recv() it gets no data back.
-	 */
-	do {
-		n = pull(NULL, sock, NULL, buf, sizeof(buf));
-	} while (n > 0);
+	n = recv(conn->client.sock, conn->buf + conn->nread,
+	    sizeof(conn->buf) - conn->nread, 0);
 
-	/* Now we know that our FIN is ACK-ed, safe to close */
-	(void) closesocket(sock);
+	if (n > 0) {
+		conn->nread += n;
+		conn->io_bytes += n;
+		if (get_request_len(conn->buf, (size_t) conn->nread) != 0 ||
+		    conn->nread == (int) sizeof(conn->buf))
+			dispatch_connection(r, conn);
+		else
+			set_pending_deadline(r, conn);
+	} else if (n == 0 || (ERRNO != EWOULDBLOCK && ERRNO != EINTR)) {
+		/* Remote end closed the connection, or network error */
+		discard_pending_connection(r, conn);
+	}
 }
 
+/*
+ * Take idle persistent connections handed back by the workers.
+ */
 static void
-close_connection(struct mg_connection *conn)
+adopt_parked_connections(struct reactor *r)
 {
-	reset_per_request_attributes(conn);
+	struct mg_context	*ctx = r->ctx;
+	struct mg_connection	*conn, *next;
+	uint64_t		count;
 
-	if (conn->ssl)
-		SSL_free(conn->ssl);
+	/* Read the eventfd before taking the list, not to miss a wakeup */
+	(void) read(ctx->parked_fd, &count, sizeof(count));
+	do {
+		conn = ATOMIC_LOAD(&ctx->parked);
+	} while (!ATOMIC_CAS(&ctx->parked, conn, NULL));
 
-	if (conn->client.sock != INVALID_SOCKET)
-		close_socket_gracefully(conn, conn->client.sock);
+	for (; conn != NULL; conn = next) {
+		next = conn->next;
+		add_pending_connection(r, conn);
+	}
 }
 
+/*
+ * Close connections whose deadline has passed. When draining, close
+ * persistent connections that wait for the next request as well, once
+ * a second.
+ */
 static void
-reset_connection_attributes(struct mg_connection *conn)
+expire_pending_connections(struct reactor *r)
 {
-	reset_per_request_attributes(conn);
-	conn->free_post_data = FALSE;
-	conn->request_info.status_code = -1;
-	conn->num_bytes_sent = 0;
-	(void) memset(&conn->request_info, 0, sizeof(conn->request_info));
-}
+	struct mg_connection	*conn, *next;
+	struct timer		*t;
+	time_t			now = time(NULL);
 
-static void
-shift_to_next(struct mg_connection *conn, char *buf, int req_len, int *nread)
-{
-	int64_t	cl;
-	int	over_len, body_len;
+	while ((t = wheel_expire(&r->wheel, now)) != NULL)
+		discard_pending_connection(r,
+		    TIMER_OWNER(t, struct mg_connection, timer));
 
-	cl = get_content_length(conn);
-	over_len = *nread - req_len;
-	assert(over_len >= 0);
+	if (now == r->last_sweep || !ATOMIC_LOAD(&r->ctx->is_draining))
+		return;
+	r->last_sweep = now;
 
-	if (cl == -1) {
-		body_len = 0;
-	} else if (cl < (int64_t) over_len) {
-		body_len = (int) cl;
-	} else {
-		body_len = over_len;
+	for (conn = r->pending; conn != NULL; conn = next) {
+		next = conn->next;
+		if (conn->num_requests > 0 && conn->nread == 0)
+			discard_pending_connection(r, conn);
 	}
-
-	*nread -= req_len + body_len;
-	(void) memmove(buf, buf + req_len + body_len, *nread);
 }
 
-static void
-process_new_connection(struct mg_connection *conn)
+/*
+ * Acceptor 0 accepts on ctx->listeners, the others on their own copies.
+ */
+static struct socket *
+reactor_listeners(struct reactor *r, int *num_listeners)
 {
-	struct mg_request_info *ri = &conn->request_info;
-	char	buf[MAX_REQUEST_SIZE];
-	int	request_len, nread;
-
-	nread = 0;
-	reset_connection_attributes(conn);
-
-	/* If next request is not pipelined, read it in */
-	if ((request_len = get_request_len(buf, (size_t) nread)) == 0)
-		request_len = read_request(NULL, conn->client.sock,
-		    conn->ssl, buf, sizeof(buf), &nread);
-	assert(nread >= request_len);
-
-	if (request_len <= 0)
-		return;	/* Remote end closed the connection */
-
-	/* 0-terminate the request: parse_request uses sscanf */
-	buf[request_len - 1] = '\0';
-
-	if (parse_http_request(buf, ri, &conn->client.rsa)) {
-		if (strcmp(ri->http_version, "1.0") != 0 &&
-		    strcmp(ri->http_version, "1.1") != 0) {
-			send_error(conn, 505,
-			    "HTTP version not supported",
-			    "%s", "Weird HTTP version");
-			log_access(conn);
-		} else {
-			ri->post_data = buf + request_len;
-			ri->post_data_len = nread - request_len;
-			conn->birth_time = time(NULL);
-			analyze_request(conn);
-			log_access(conn);
-			shift_to_next(conn, buf, request_len, &nread);
-		}
+	if (r->index == 0) {
+		*num_listeners = r->ctx->num_listeners;
+		return (r->ctx->listeners);
 	} else {
-		/* Do not put garbage in the access log */
-		send_error(conn, 400, "Bad Request",
-		    "Can not parse request: [%.*s]", nread, buf);
+		*num_listeners = r->num_listeners;
+		return (r->listeners);
 	}
-
 }
 
-/*
- * Worker threads take accepted socket from the queue
- */
 static bool_t
-get_socket(struct mg_context *ctx, struct socket *sp)
+is_listener(struct reactor *r, const void *ptr)
 {
-	struct timespec	ts;
+	const struct socket	*listeners;
+	int			n;
 
-	(void) pthread_mutex_lock(&ctx->thr_mutex);
-	DEBUG_TRACE((DEBUG_MGS_PREFIX "%s: thread %p: going idle",
-	    __func__, (void *) pthread_self()));
+	listeners = reactor_listeners(r, &n);
+	return ((const char *) ptr >= (const char *) listeners &&
+	    (const char *) ptr < (const char *) (listeners +
+	    MAX_LISTENING_SOCKETS));
+}
 
-	/* If the queue is empty, wait. We're idle at this point. */
-	ctx->num_idle++;
-	while (ctx->sq_head == ctx->sq_tail) {
-		ts.tv_nsec = 0;
-		ts.tv_sec = time(NULL) + atoi(ctx->options[OPT_IDLE_TIME]) + 1;
-		if (pthread_cond_timedwait(&ctx->empty_cond,
-		    &ctx->thr_mutex, &ts) != 0) {
-			/* Timeout! release the mutex and return */
-			(void) pthread_mutex_unlock(&ctx->thr_mutex);
-			return (FALSE);
+/*
+ * Register listening sockets with the epoll set whenever the "ports"
+ * option has changed. Acceptors other than the master thread first sync
+ * their own SO_REUSEPORT copies of the listening sockets. Closed sockets
+ * are removed from the epoll set by the kernel automatically.
+ */
+static void
+sync_listeners(struct reactor *r)
+{
+	struct mg_context	*ctx = r->ctx;
+	struct epoll_event	ev;
+	struct socket		copies[MAX_LISTENING_SOCKETS], *listeners;
+	bool_t			is_kept[MAX_LISTENING_SOCKETS];
+	int			i, j, n;
+
+	lock_option(ctx, OPT_PORTS);
+	if (r->generation != ctx->listeners_generation) {
+		r->generation = ctx->listeners_generation;
+
+		/* Same as set_ports_option(): keep copies of the ports that
+		 * stay, open new ones first, then drain and close the rest */
+		if (r->index > 0) {
+			(void) memset(is_kept, 0, sizeof(is_kept));
+			for (i = n = 0; i < ctx->num_listeners; i++) {
+				for (j = 0; j < r->num_listeners; j++)
+					if (!is_kept[j] && is_same_listener(
+					    r->listeners + j,
+					    ctx->listeners + i))
+						break;
+				copies[n] = ctx->listeners[i];
+				if (j < r->num_listeners) {
+					is_kept[j] = TRUE;
+					copies[n].sock = r->listeners[j].sock;
+					/* Listener options may have changed */
+					(void) tune_listening_socket(ctx,
+					    copies[n++].sock);
+				} else if ((copies[n].sock =
+				    open_listening_socket(ctx,
+				    &ctx->listeners[i].lsa,
+				    ctx->listeners[i].sock)) !=
+				    INVALID_SOCKET) {
+					n++;
+				}
+			}
+			for (j = 0; j < r->num_listeners; j++)
+				if (!is_kept[j])
+					close_listener(ctx, r->listeners + j);
+			(void) memcpy(r->listeners, copies,
+			    n * sizeof(copies[0]));
+			r->num_listeners = n;
 		}
-	}
-	assert(ctx->sq_head > ctx->sq_tail);
-
-	/* We're going busy now: got a socket to process! */
-	ctx->num_idle--;
 
-	/* Copy socket from the queue and increment tail */
-	*sp = ctx->queue[ctx->sq_tail % ARRAY_SIZE(ctx->queue)];
-	ctx->sq_tail++;
-	DEBUG_TRACE((DEBUG_MGS_PREFIX
-	    "%s: thread %p grabbed socket %d, going busy",
-	    __func__, (void *) pthread_self(), sp->sock));
-
-	/* Wrap pointers if needed */
-	while (ctx->sq_tail > (int) ARRAY_SIZE(ctx->queue)) {
-		ctx->sq_tail -= ARRAY_SIZE(ctx->queue);
-		ctx->sq_head -= ARRAY_SIZE(ctx->queue);
+		listeners = reactor_listeners(r, &n);
+		for (i = 0; i < n; i++) {
+			(void) set_non_blocking_mode(fc(ctx),
+			    listeners[i].sock);
+			ev.events = EPOLLIN;
+			ev.data.ptr = &listeners[i];
+
+			/* A kept socket may have moved to another slot */
+			if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD,
+			    listeners[i].sock, &ev) != 0 && (ERRNO != EEXIST ||
+			    epoll_ctl(r->epoll_fd, EPOLL_CTL_MOD,
+			    listeners[i].sock, &ev) != 0))
+				cry(fc(ctx), "%s: epoll_ctl: %s",
+				    __func__, strerror(ERRNO));
+		}
 	}
-
-	pthread_cond_signal(&ctx->full_cond);
-	(void) pthread_mutex_unlock(&ctx->thr_mutex);
-
-	return (TRUE);
+	unlock_option(ctx, OPT_PORTS);
 }
 
+/*
+ * Accept everything waiting on the listening socket.
+ */
 static void
-worker_thread(struct mg_context *ctx)
+accept_connections(struct reactor *r, const struct socket *listener)
 {
-	struct mg_connection	conn;
+	struct mg_context	*ctx = r->ctx;
+	struct mg_connection	*conn;
 
-	DEBUG_TRACE((DEBUG_MGS_PREFIX "%s: thread %p starting",
-	    __func__, (void *) pthread_self()));
+	/*
+	 * ctx->listeners may be changed by set_ports_option() while we were
+	 * waiting. Skip stale events, the socket will be polled again.
+	 * Other acceptors own their sockets and do not need the lock.
+	 */
+	if (r->index == 0)
+		lock_option(ctx, OPT_PORTS);
 
-	(void) memset(&conn, 0, sizeof(conn));
+	if (r->generation == ATOMIC_LOAD(&ctx->listeners_generation))
+		while (ATOMIC_LOAD(&ctx->stop_flag) == 0 &&
+		    accept_new_connection(listener, ctx, &conn))
+			if (conn != NULL)
+				add_pending_connection(r, conn);
 
-	while (get_socket(ctx, &conn.client) == TRUE) {
-		conn.birth_time = time(NULL);
-		conn.ctx = ctx;
+	if (r->index == 0)
+		unlock_option(ctx, OPT_PORTS);
+}
 
-		if (conn.client.is_ssl &&
-		    (conn.ssl = SSL_new(conn.ctx->ssl_ctx)) == NULL) {
-			cry(&conn, "%s: SSL_new: %d", __func__, ERRNO);
-		} else if (conn.client.is_ssl &&
-		    SSL_set_fd(conn.ssl, conn.client.sock) != 1) {
-			cry(&conn, "%s: SSL_set_fd: %d", __func__, ERRNO);
-		} else if (conn.client.is_ssl && SSL_accept(conn.ssl) != 1) {
-			cry(&conn, "%s: SSL handshake error", __func__);
-		} else {
-			process_new_connection(&conn);
-		}
+static struct reactor *
+new_reactor(struct mg_context *ctx, int index)
+{
+	struct reactor	*r;
 
-		close_connection(&conn);
+	if ((r = (struct reactor *) calloc(1, sizeof(*r))) == NULL) {
+		cry(fc(ctx), "%s: cannot allocate reactor", __func__);
+	} else if ((r->epoll_fd = epoll_create(MAX_EPOLL_EVENTS)) == -1) {
+		cry(fc(ctx), "%s: epoll_create: %s", __func__, strerror(ERRNO));
+		free(r);
+		r = NULL;
+	} else {
+		set_close_on_exec(r->epoll_fd);
+		r->ctx = ctx;
+		r->index = index;
+		r->generation = -1;
+		wheel_init(&r->wheel, time(NULL));
 	}
 
-	/* Signal master that we're done with connection and exiting */
-	pthread_mutex_lock(&ctx->thr_mutex);
-	ctx->num_threads--;
-	ctx->num_idle--;
-	pthread_cond_signal(&ctx->thr_cond);
-	assert(ctx->num_threads >= 0);
-	pthread_mutex_unlock(&ctx->thr_mutex);
+	return (r);
+}
 
-	DEBUG_TRACE((DEBUG_MGS_PREFIX "%s: thread %p exiting",
-	    __func__, (void *) pthread_self()));
+static void
+free_reactor(struct reactor *r)
+{
+	int	i;
+
+	/* Close connections that never made it to the worker threads */
+	while (r->pending != NULL)
+		discard_pending_connection(r, r->pending);
+
+	for (i = 0; i < r->num_listeners; i++)
+		(void) closesocket(r->listeners[i].sock);
+	(void) close(r->epoll_fd);
+	free(r);
 }
 
+static void acceptor_thread(struct reactor *);
+
 /*
- * Master thread adds accepted socket to a queue
+ * Start acceptor threads up to the configured number. Extra acceptors
+ * notice that the number went down, and exit by themselves.
  */
 static void
-put_socket(struct mg_context *ctx, const struct socket *sp)
+start_acceptors(struct mg_context *ctx)
 {
+	struct reactor	*r;
+	int		i;
+
 	(void) pthread_mutex_lock(&ctx->thr_mutex);
+	for (i = 1; i < ctx->num_acceptors; i++) {
+		if (ctx->acceptors[i] != NULL)
+			continue;
+		if ((r = new_reactor(ctx, i)) == NULL)
+			break;
+		if (start_thread(ctx, (mg_thread_func_t) acceptor_thread,
+		    r) != 0) {
+			cry(fc(ctx), "Cannot start acceptor: %d", ERRNO);
+			free_reactor(r);
+			break;
+		}
+		ctx->acceptors[i] = r;
+	}
+	(void) pthread_mutex_unlock(&ctx->thr_mutex);
+}
 
-	/* If the queue is full, wait */
-	while (ctx->sq_head - ctx->sq_tail >= (int) ARRAY_SIZE(ctx->queue))
-		(void) pthread_cond_wait(&ctx->full_cond, &ctx->thr_mutex);
-	assert(ctx->sq_head - ctx->sq_tail < (int) ARRAY_SIZE(ctx->queue));
+static void
+run_reactor(struct reactor *r)
+{
+	struct mg_context	*ctx = r->ctx;
+	struct epoll_event	events[MAX_EPOLL_EVENTS], ev;
+	int			i, n;
+
+	/* Master thread's reactor takes idle persistent connections */
+	if (r->index == 0 && ctx->parked_fd != -1) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = &ctx->parked;
+		(void) epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD,
+		    ctx->parked_fd, &ev);
+	}
 
-	/* Copy socket to the queue and increment head */
-	ctx->queue[ctx->sq_head % ARRAY_SIZE(ctx->queue)] = *sp;
-	ctx->sq_head++;
-	DEBUG_TRACE((DEBUG_MGS_PREFIX "%s: queued socket %d",
-	    __func__, sp->sock));
+	/* Every reactor watches stop_fd, it is never drained */
+	if (ctx->stop_fd[0] != -1) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = &ctx->stop_flag;
+		(void) epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD,
+		    ctx->stop_fd[0], &ev);
+	}
+	if (ctx->drain_fd[0] != -1) {
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.ptr = &ctx->is_draining;
+		(void) epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD,
+		    ctx->drain_fd[0], &ev);
+	}
 
-	/* If there are no idle threads, start one */
-	if (ctx->num_idle == 0 && ctx->num_threads < ctx->max_threads) {
-		if (start_thread(ctx,
-		    (mg_thread_func_t) worker_thread, ctx) != 0)
-			cry(fc(ctx), "Cannot start thread: %d", ERRNO);
-		else
-			ctx->num_threads++;
+	while (ATOMIC_LOAD(&ctx->stop_flag) == 0 &&
+	    (r->index == 0 || r->index < ATOMIC_LOAD(&ctx->num_acceptors))) {
+		if (r->index == 0)
+			start_acceptors(ctx);
+		sync_listeners(r);
+
+		n = epoll_wait(r->epoll_fd, events, ARRAY_SIZE(events), 1000);
+
+		for (i = 0; i < n; i++)
+			if (is_listener(r, events[i].data.ptr))
+				accept_connections(r,
+				    (struct socket *) events[i].data.ptr);
+			else if (events[i].data.ptr == (void *) &ctx->parked)
+				adopt_parked_connections(r);
+			else if (events[i].data.ptr ==
+			    (void *) &ctx->is_draining)
+				r->last_sweep = 0;	/* Sweep right now */
+			else if (events[i].data.ptr != (void *) &ctx->stop_flag)
+				read_pending_request(r,
+				    (struct mg_connection *) events[i].data.ptr);
+
+		expire_pending_connections(r);
 	}
+}
+
+static void
+acceptor_thread(struct reactor *r)
+{
+	struct mg_context	*ctx = r->ctx;
+
+	pin_acceptor(ctx, r->index);
+	run_reactor(r);
 
-	pthread_cond_signal(&ctx->empty_cond);
+	/* Tell the master thread that we're gone */
+	(void) pthread_mutex_lock(&ctx->thr_mutex);
+	ctx->acceptors[r->index] = NULL;
+	(void) pthread_cond_signal(&ctx->thr_cond);
 	(void) pthread_mutex_unlock(&ctx->thr_mutex);
+
+	free_reactor(r);
 }
 
 static void
-accept_new_connection(const struct socket *listener, struct mg_context *ctx)
+master_thread(struct mg_context *ctx)
 {
-	struct socket	accepted;
-
-	accepted.rsa.len = sizeof(accepted.rsa.u.sin);
-	accepted.lsa = listener->lsa;
-	if ((accepted.sock = accept(listener->sock,
-	    &accepted.rsa.u.sa, &accepted.rsa.len)) == INVALID_SOCKET)
-		return;
+	struct reactor	*r;
+	int		i;
 
-	lock_option(ctx, OPT_ACL);
-	if (ctx->options[OPT_ACL] != NULL &&
-	    !check_acl(ctx, ctx->options[OPT_ACL], &accepted.rsa)) {
-		cry(fc(ctx), "%s: %s is not allowed to connect",
-		    __func__, inet_ntoa(accepted.rsa.u.sin.sin_addr));
-		(void) closesocket(accepted.sock);
-		unlock_option(ctx, OPT_ACL);
-		return;
+	pin_acceptor(ctx, 0);
+	if ((r = new_reactor(ctx, 0)) != NULL) {
+		ctx->acceptors[0] = r;
+		run_reactor(r);
 	}
-	unlock_option(ctx, OPT_ACL);
+	wake_all_threads(ctx);
 
-	/* Put accepted socket structure into the queue */
-	DEBUG_TRACE((DEBUG_MGS_PREFIX "%s: accepted socket %d",
-	    __func__, accepted.sock));
-	accepted.is_ssl = listener->is_ssl;
-	put_socket(ctx, &accepted);
-}
+	/* Wait until other acceptors exit */
+	(void) pthread_mutex_lock(&ctx->thr_mutex);
+	for (i = 1; i < MAX_ACCEPTORS; i++)
+		while (ctx->acceptors[i] != NULL)
+			(void) pthread_cond_wait(&ctx->thr_cond,
+			    &ctx->thr_mutex);
+	ctx->acceptors[0] = NULL;
+	(void) pthread_mutex_unlock(&ctx->thr_mutex);
+
+	if (r != NULL)
+		free_reactor(r);
 
+	/* Stop signal received: somebody called mg_stop. Quit. */
+	mg_fini(ctx);
+}
+#else
 static void
 master_thread(struct mg_context *ctx)
 {
 	fd_set		read_set;
 	struct timeval	tv;
+	struct mg_connection *conn;
 	int		i, max_fd;
 
-	while (ctx->stop_flag == 0) {
+	pin_acceptor(ctx, 0);
+	while (ATOMIC_LOAD(&ctx->stop_flag) == 0) {
 		FD_ZERO(&read_set);
 		max_fd = -1;
+#if !defined(_WIN32)
+		if (ctx->stop_fd[0] != -1)
+			add_to_set(ctx->stop_fd[0], &read_set, &max_fd);
+#endif /* !_WIN32 */
 
 		/* Add listening sockets to the read set */
 		lock_option(ctx, OPT_PORTS);
@@ -4664,34 +10318,151 @@ master_thread(struct mg_context *ctx)
 		} else {
 			lock_option(ctx, OPT_PORTS);
 			for (i = 0; i < ctx->num_listeners; i++)
-				if (FD_ISSET(ctx->listeners[i].sock, &read_set))
-					accept_new_connection(
-					    ctx->listeners + i, ctx);
+				if (FD_ISSET(ctx->listeners[i].sock, &read_set) &&
+				    accept_new_connection(ctx->listeners + i,
+				    ctx, &conn) && conn != NULL &&
+				    !shed_connection(ctx, conn))
+					put_socket(ctx, conn);
 			unlock_option(ctx, OPT_PORTS);
 		}
 	}
+	wake_all_threads(ctx);
 
 	/* Stop signal received: somebody called mg_stop. Quit. */
 	mg_fini(ctx);
 }
+#endif /* USE_EPOLL */
+
+#if !defined(_WIN32)
+/*
+ * A latch is a pipe that becomes readable once set, and is never read.
+ * Threads add it to their poll() or epoll sets to be woken up.
+ */
+static void
+open_latch(struct mg_context *ctx, int fds[2])
+{
+	if (pipe(fds) != 0) {
+		cry(fc(ctx), "pipe: %s", strerror(ERRNO));
+		fds[0] = fds[1] = -1;
+	} else {
+		set_close_on_exec(fds[0]);
+		set_close_on_exec(fds[1]);
+	}
+}
+
+static void
+set_latch(int fds[2])
+{
+	if (fds[1] != -1)
+		(void) write(fds[1], "", 1);
+}
+
+static void
+close_latch(int fds[2])
+{
+	if (fds[0] != -1) {
+		(void) close(fds[0]);
+		(void) close(fds[1]);
+	}
+}
+#endif /* !_WIN32 */
+
+/*
+ * Free what mg_fini() has left: the things mg_stop() is using while
+ * waiting for it. Then the context itself.
+ */
+static void
+free_context(struct mg_context *ctx)
+{
+#if !defined(_WIN32)
+	close_latch(ctx->stop_fd);
+	close_latch(ctx->drain_fd);
+#endif /* !_WIN32 */
+	(void) pthread_mutex_destroy(&ctx->thr_mutex);
+	(void) pthread_cond_destroy(&ctx->stop_cond);
+	free(ctx);
+}
 
 void
 mg_stop(struct mg_context *ctx)
 {
-	ctx->stop_flag = 1;
+	ATOMIC_STORE(&ctx->stop_flag, 1);
+
+#if !defined(_WIN32)
+	/* Wake up the master thread, and everybody waiting on a descriptor */
+	set_latch(ctx->stop_fd);
+#endif /* !_WIN32 */
 
 	/* Wait until mg_fini() stops */
+	(void) pthread_mutex_lock(&ctx->thr_mutex);
 	while (ctx->stop_flag != 2)
-		(void) sleep(1);
+		(void) pthread_cond_wait(&ctx->stop_cond, &ctx->thr_mutex);
+	(void) pthread_mutex_unlock(&ctx->thr_mutex);
 
 	assert(ctx->num_threads == 0);
-	free(ctx);
+	free_context(ctx);
 
 #if defined(_WIN32)
 	(void) WSACleanup();
 #endif /* _WIN32 */
 }
 
+/*
+ * Shut down the sockets that workers are blocked on, so that they can
+ * notice mg_stop(). The parked connections, the caches and the watcher
+ * still have their descriptors open, so a socket the worker is done with
+ * must not be touched: it is looked at under sock_mutex, the same as in
+ * expire_workers().
+ */
+static void
+abort_connections(struct mg_context *ctx)
+{
+	struct worker	*w;
+	int		i;
+
+	for (i = 0; i < ATOMIC_LOAD(&ctx->num_workers); i++) {
+		w = ctx->workers[i];
+		(void) pthread_mutex_lock(&w->sock_mutex);
+		if (w->sock != INVALID_SOCKET)
+			(void) shutdown(w->sock, SHUT_RDWR);
+		(void) pthread_mutex_unlock(&w->sock_mutex);
+	}
+}
+
+void
+mg_drain(struct mg_context *ctx, int timeout)
+{
+	time_t		deadline = time(NULL) + timeout;
+	unsigned int	seq;
+
+	/* Close the listening sockets, serving what is queued on them */
+	ATOMIC_STORE(&ctx->is_draining, TRUE);
+	(void) mg_set_option(ctx, "ports", "");
+#if !defined(_WIN32)
+	set_latch(ctx->drain_fd);
+#endif /* !_WIN32 */
+
+	/* Wait until the last connection is closed */
+	for (;;) {
+		seq = park_prepare(&ctx->drained);
+		if (ATOMIC_LOAD(&ctx->num_connections) == 0 ||
+		    time(NULL) >= deadline) {
+			park_cancel(&ctx->drained);
+			break;
+		}
+		(void) park_wait(&ctx->drained, seq,
+		    (int) (deadline - time(NULL)));
+	}
+
+	if (ATOMIC_LOAD(&ctx->num_connections) > 0) {
+		cry(fc(ctx), "%s: closing %d connections", __func__,
+		    ATOMIC_LOAD(&ctx->num_connections));
+		abort_connections(ctx);
+	}
+
+	mg_stop(ctx);
+}
+
 struct mg_context *
 mg_start(void)
 {
@@ -4712,6 +10483,52 @@ mg_start(void)
 	ctx->error_log = stderr;
 	mg_set_log_callback(ctx, builtin_error_log);
 
+	/* Option setters below may need these */
+	for (i = 0; i < NUM_OPTIONS; i++)
+		(void) pthread_mutex_init(&ctx->opt_mutex[i], NULL);
+	for (i = 0; i < CACHE_SHARDS; i++)
+		(void) pthread_mutex_init(&ctx->cache[i].mutex, NULL);
+#if !defined(_WIN32)
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		(void) pthread_mutex_init(&ctx->open_files[i].mutex, NULL);
+		ctx->open_files[i].lru.lru_next =
+		    ctx->open_files[i].lru.lru_prev = &ctx->open_files[i].lru;
+	}
+#endif /* !_WIN32 */
+#if defined(USE_INOTIFY)
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		(void) pthread_mutex_init(&ctx->resolved[i].mutex, NULL);
+		ctx->resolved[i].lru[0].lru_next =
+		    ctx->resolved[i].lru[0].lru_prev = ctx->resolved[i].lru;
+		ctx->resolved[i].lru[1].lru_next =
+		    ctx->resolved[i].lru[1].lru_prev = ctx->resolved[i].lru + 1;
+	}
+	(void) pthread_mutex_init(&ctx->watch_mutex, NULL);
+	if ((ctx->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+		cry(fc(ctx), "inotify_init1: %s", strerror(ERRNO));
+#endif /* USE_INOTIFY */
+
+	(void) pthread_mutex_init(&ctx->thr_mutex, NULL);
+	(void) pthread_mutex_init(&ctx->bind_mutex, NULL);
+	(void) pthread_cond_init(&ctx->thr_cond, NULL);
+	(void) pthread_cond_init(&ctx->stop_cond, NULL);
+#if defined(USE_AFFINITY)
+	/* Threads that are not pinned may run where the caller may */
+	if (sched_getaffinity(0, sizeof(ctx->all_cpus), &ctx->all_cpus) != 0)
+		CPU_ZERO(&ctx->all_cpus);
+#endif /* USE_AFFINITY */
+	park_init(&ctx->queue_full);
+	park_init(&ctx->pool_wanted);
+	park_init(&ctx->drained);
+#if !defined(_WIN32)
+	open_latch(ctx, ctx->stop_fd);
+	open_latch(ctx, ctx->drain_fd);
+#endif /* !_WIN32 */
+#if defined(USE_EPOLL)
+	if ((ctx->parked_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+		cry(fc(ctx), "eventfd: %s", strerror(ERRNO));
+#endif /* USE_EPOLL */
+
 	/* Initialize options. First pass: set default option values */
 	for (option = known_options; option->name != NULL; option++)
 		ctx->options[option->index] = option->default_value == NULL ?
@@ -4724,6 +10541,7 @@ mg_start(void)
 			if (option->setter(ctx,
 			    ctx->options[option->index]) == FALSE) {
 				mg_fini(ctx);
+				free_context(ctx);
 				return (NULL);
 			}
 
@@ -4738,15 +10556,26 @@ mg_start(void)
 	(void) signal(SIGPIPE, SIG_IGN);
 #endif /* _WIN32 */
 
-	/* Initialize options mutexes */
-	for (i = 0; i < NUM_OPTIONS; i++)
-		(void) pthread_mutex_init(&ctx->opt_mutex[i], NULL);
+	/* Pre-spawn the worker pool, and start its manager */
+	grow_pool(ctx);
+	ctx->has_manager = TRUE;
+	if (start_thread(ctx, (mg_thread_func_t) manager_thread, ctx) != 0) {
+		cry(fc(ctx), "Cannot start pool manager: %d", ERRNO);
+		ctx->has_manager = FALSE;
+	}
 
-	(void) pthread_mutex_init(&ctx->thr_mutex, NULL);
-	(void) pthread_mutex_init(&ctx->bind_mutex, NULL);
-	(void) pthread_cond_init(&ctx->thr_cond, NULL);
-	(void) pthread_cond_init(&ctx->empty_cond, NULL);
-	(void) pthread_cond_init(&ctx->full_cond, NULL);
+#if defined(USE_INOTIFY)
+	/* Nothing is remembered unless changes are noticed */
+	ctx->has_watcher = ctx->inotify_fd != -1;
+	if (ctx->has_watcher && start_thread(ctx,
+	    (mg_thread_func_t) watcher_thread, ctx) != 0) {
+		cry(fc(ctx), "Cannot start watcher: %d", ERRNO);
+		ctx->has_watcher = FALSE;
+		ATOMIC_STORE(&ctx->is_resolving, FALSE);
+		(void) close(ctx->inotify_fd);
+		ctx->inotify_fd = -1;
+	}
+#endif /* USE_INOTIFY */
 
 	/* Start master (listening) thread */
 	start_thread(ctx, (mg_thread_func_t) master_thread, ctx);
@@ -82,6 +82,19 @@ struct mg_context *mg_start(void);
 void mg_stop(struct mg_context *);
 
 
+/*
+ * Stop the web server gracefully.
+ * Listening sockets are closed first, so that no new connections are
+ * accepted. Requests that are in flight are allowed to finish, and
+ * persistent connections are closed after their current response.
+ * Connections still open after the timeout (in seconds) are closed
+ * forcibly. Then the server is stopped, just like with mg_stop().
+ * This function blocks until all Mongoose threads are stopped. Context
+ * pointer becomes invalid.
+ */
+void mg_drain(struct mg_context *, int timeout);
+
+
 /*
  * Return current value of a particular option.
  */
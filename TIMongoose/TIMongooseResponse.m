@@ -71,11 +71,13 @@
 // Declared as readonly properties in the header
 - (NSString *)headersForOutput
 {
+    // Content-Length lets the client reuse the connection for the next request
     return [NSString stringWithFormat:
-            @"HTTP/1.1 %i%@\r\nContent-Type: %@\r\n\r\n",
+            @"HTTP/1.1 %i%@\r\nContent-Type: %@\r\nContent-Length: %lu\r\n\r\n",
             [self statusCode], 
             [self _statusCodeDescription], 
-            [self contentType]];
+            [self contentType],
+            (unsigned long)[[self responseData] length]];
 }
 
 - (NSData *)dataForOutput